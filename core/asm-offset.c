@@ -55,4 +55,8 @@ void __foo__ (void)
   CONTEXT_SYMBOL(rdi);
   CONTEXT_SYMBOL(rsi);
   CONTEXT_SYMBOL(rbp);     
+  BLANK();
+
+  /* The VT_CPU of a processor is pointed to by the base of its host stack */
+  DEFINE(VT_STACK_MASK, ~(VMM_STACK_SIZE - 1));
 }
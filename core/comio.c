@@ -36,6 +36,10 @@
 #define INTERRUPT_IDENTIFICATION_REGISTER  0x02
 #define LINE_STATUS_REGISTER		   0x05
 
+/* INTERRUPT_IDENTIFICATION_REGISTER bits 7:6 are set when the FIFOs are
+   enabled (16550A and later) */
+#define IIR_FIFO_ENABLED                (3 << 6)
+
 /* Meaning of the various bits in the LINE_STATUS_REGISTER */
 #define LSR_DATA_AVAILABLE              (1 << 0)
 #define LSR_OVERRUN_ERROR               (1 << 1)
@@ -59,19 +63,39 @@
 //static Bit16u  DebugComPort = 0;
 static Bit16u  DebugComPort = 0;
 static Bit32u  ComSpinLock;	/* Spin lock that guards accesses to the COM port */
+static Bit32u  ComFifoSize = 1;	/* Bytes we can write per LSR_THR_EMPTY poll */
+
+/* Software TX queue, used in asynchronous mode. Producers hold ComSpinLock;
+   there is a single consumer, ComDrain(), that never blocks */
+static hvm_bool ComAsync = FALSE;
+static Bit8u    ComTxQueue[COM_TX_QUEUE_SIZE];
+static Bit32u   ComTxHead, ComTxTail;
+
+static void ComEnqueue(Bit8u *buffer, Bit32u n);
 
-void ComInit()
+void ComInit(Bit32u baud)
 {
+  Bit32u divisor;
+
+  /* Baud rates above COM_UART_CLOCK need a faster UART clock */
+  if (baud == 0 || baud > COM_UART_CLOCK)
+    baud = COM_UART_CLOCK;
+  divisor = MIN(COM_UART_CLOCK / baud, 0xffff);
+
 #ifdef GUEST_LINUX
   /* FIXME: check if serial port has already been initialized */
   /* and restore the original guest encoding (port + 3) upon an enter */
   IoWritePortByte(DebugComPort + 1, 0x00);    // Disable all interrupts
   IoWritePortByte(DebugComPort + 3, 0x80);    // Enable DLAB (set baud rate divisor)
-  IoWritePortByte(DebugComPort + 0, 0x03);    // Set divisor to 3 (lo byte) 38400 baud
-  IoWritePortByte(DebugComPort + 1, 0x00);    //                  (hi byte)
+  IoWritePortByte(DebugComPort + 0, divisor & 0xff);        // Set divisor (lo byte)
+  IoWritePortByte(DebugComPort + 1, (divisor >> 8) & 0xff); //             (hi byte)
   IoWritePortByte(DebugComPort + 3, 0x03);    // 8 bits, no parity, one stop bit
   IoWritePortByte(DebugComPort + 2, 0xC7);    // Enable FIFO, clear them, with 14-byte threshold
   IoWritePortByte(DebugComPort + 4, 0x0B);    // IRQs enabled, RTS/DSR set
+
+  /* An 8250 or 16450 has no FIFO: stick to one byte at a time */
+  if ((IoReadPortByte(DebugComPort + INTERRUPT_IDENTIFICATION_REGISTER) & IIR_FIFO_ENABLED) == IIR_FIFO_ENABLED)
+    ComFifoSize = COM_FIFO_SIZE;
 #else
 #warning "Windows serial support is currently not working properly in VmWare Workstation 8"
 #endif
@@ -83,19 +107,77 @@ void ComInit()
 void ComPrint(const char* fmt, ...)
 {
   va_list args;
+
+  va_start(args, fmt);
+  ComVPrint(fmt, args);
+  va_end(args);  
+}
+
+void ComVPrint(const char* fmt, va_list args)
+{
   char str[768] = {0};
-  unsigned int i;
 
   CmAcquireSpinLock(&ComSpinLock);
   
-  va_start(args, fmt);
   vmm_vsnprintf(str, sizeof(str), fmt, args);
-  va_end(args);  
-  for (i = 0; i < vmm_strlen(str); i++)
-    PortSendByte(str[i]);
+  if (ComAsync)
+    ComEnqueue((Bit8u*) str, vmm_strlen(str));
+  else
+    PortSendBurst((Bit8u*) str, vmm_strlen(str));
   CmReleaseSpinLock(&ComSpinLock);
 }
 
+/* In asynchronous mode, ComPrint() only queues data: it is written out by
+   ComDrain() (e.g., on VM exits) and ComFlush() */
+void ComSetAsync(hvm_bool async)
+{
+  if (!async)
+    ComFlush();
+
+  ComAsync = async;
+}
+
+/* Write as much queued data as the UART can take right now, without
+   waiting */
+void ComDrain(void)
+{
+  Bit32u n;
+
+  if (ComTxHead == ComTxTail)
+    return;
+
+  if (!(IoReadPortByte(DebugComPort + LINE_STATUS_REGISTER) & LSR_THR_EMPTY))
+    return;
+
+  for (n = 0; n < ComFifoSize && ComTxTail != ComTxHead; n++) {
+    IoWritePortByte(DebugComPort + TRANSMIT_HOLDING_REGISTER, ComTxQueue[ComTxTail & (COM_TX_QUEUE_SIZE - 1)]);
+    ComTxTail++;
+  }
+}
+
+/* Write all queued data, waiting for the UART */
+void ComFlush(void)
+{
+  while (ComTxHead != ComTxTail)
+    ComDrain();
+}
+
+/* Bytes that don't fit in the queue are dropped */
+static void ComEnqueue(Bit8u *buffer, Bit32u n)
+{
+  Bit32u head;
+
+  head = ComTxHead;
+  while (n-- > 0 && head - ComTxTail < COM_TX_QUEUE_SIZE) {
+    ComTxQueue[head & (COM_TX_QUEUE_SIZE - 1)] = *buffer++;
+    head++;
+  }
+
+  /* Publish the data to ComDrain() */
+  __sync_synchronize();
+  ComTxHead = head;
+}
+
 Bit8u ComIsInitialized()
 {
   /* Ok, we should also check if ComInit() has been invoked.. but we assume it
@@ -110,10 +192,22 @@ void PortInit()
 
 void PortSendByte(Bit8u b)
 {
-  /* Empty input buffer */
-  while (!(IoReadPortByte(DebugComPort + LINE_STATUS_REGISTER) & LSR_THR_EMPTY));
-  
-  IoWritePortByte(DebugComPort + TRANSMIT_HOLDING_REGISTER, b);
+  PortSendBurst(&b, 1);
+}
+
+/* When the FIFO is enabled, LSR_THR_EMPTY means that the whole FIFO is empty:
+   fill it with up to ComFifoSize bytes per poll */
+void PortSendBurst(Bit8u *buffer, Bit32u n)
+{
+  Bit32u i;
+
+  while (n > 0) {
+    /* Empty input buffer */
+    while (!(IoReadPortByte(DebugComPort + LINE_STATUS_REGISTER) & LSR_THR_EMPTY));
+
+    for (i = 0; i < ComFifoSize && n > 0; i++, n--)
+      IoWritePortByte(DebugComPort + TRANSMIT_HOLDING_REGISTER, *buffer++);
+  }
 }
 
 Bit8u PortRecvByte(void)
@@ -28,17 +28,33 @@
 #define COM_PORT_IRQ                    0x004
 #define COM_PORT_ADDRESS                0x3f8
 
+#define COM_BAUD_RATE_DEFAULT           38400
+#define COM_FIFO_SIZE                   16	/* 16550A transmit FIFO */
+#define COM_TX_QUEUE_SIZE               8192	/* Must be a power of 2 */
+
+/* Highest baud rate (divisor 1): the standard 1.8432 MHz crystal gives
+   115200, boards with faster clocks can override it at build time */
+#ifndef COM_UART_CLOCK
+#define COM_UART_CLOCK                  115200
+#endif
+
+#include <stdarg.h>
 #include "common.h"
 #include "types.h"
 
 /* COM level communication */
-void  ComInit(void);
+void  ComInit(Bit32u baud);
 void  ComPrint(const char* fmt, ...) asm("_ComPrint");
+void  ComVPrint(const char* fmt, va_list args);
 Bit8u ComIsInitialized(void);
+void  ComSetAsync(hvm_bool async);
+void  ComDrain(void);
+void  ComFlush(void);
 
 /* Hardware port level communication */
 void  PortInit(void);
 void  PortSendByte(Bit8u b);
+void  PortSendBurst(Bit8u *buffer, Bit32u n);
 Bit8u PortRecvByte(void);
 
 #endif	/* _PILL_COMIO_H */
@@ -65,6 +65,30 @@ int wide2ansi(Bit8u* dst, Bit8u* src, Bit32u n)
   return cnt;
 }
 
+/* 64-by-32 bit unsigned division: the Linux kernel does not provide
+   __udivdi3. Quotients that do not fit in 32 bits are saturated */
+Bit32u CmDiv64(Bit64u n, Bit32u d)
+{
+  Bit64u r;
+  Bit32u q;
+  int i;
+
+  if (d == 0 || (n >> 32) >= d)
+    return 0xffffffff;
+
+  q = 0;
+  r = n >> 32;
+  for (i = 31; i >= 0; i--) {
+    r = (r << 1) | ((n >> i) & 1);
+    if (r >= d) {
+      r -= d;
+      q |= (Bit32u) 1 << i;
+    }
+  }
+
+  return q;
+}
+
 void CmSleep(Bit32u microseconds)
 {
   //  Bit32u v;
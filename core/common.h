@@ -58,6 +58,7 @@ void CmSetBit32(Bit32u* dword, Bit32u bit);
 void CmClearBit32(Bit32u* dword, Bit32u bit);
 void CmClearBit16(Bit16u* word, Bit32u bit); 
 void CmSleep(Bit32u microseconds);
+Bit32u CmDiv64(Bit64u n, Bit32u d);
 
 int wide2ansi(Bit8u* dst, Bit8u* src, Bit32u n);
 
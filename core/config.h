@@ -28,6 +28,10 @@
 /* Comment out the following line to disable debugging */
 #define DEBUG
 
+/* Comment out the following line to run the guest without VPIDs, even if
+   the processor supports them (e.g., to compare exit costs) */
+#define ENABLE_VPID
+
 /* Stack area reserved to the HVM */
 #define VMM_STACK_SIZE      0x8000
 
@@ -26,6 +26,7 @@
 #define _PILL_DEBUG_H
 
 #include "comio.h"
+#include "trace.h"
 #include "config.h"
 
 ///////////
@@ -50,9 +51,11 @@
     }									\
   } while(0)
 
-/* Modify this macro to use a different logging method */
+/* Modify this macro to use a different logging method. Messages are recorded
+   in the trace ring (see trace.h) and printed on the serial port when the
+   guest is idle */
 #ifdef DEBUG
-#define Log(fmt, ...) SerialLog(fmt, ## __VA_ARGS__)
+#define Log(fmt, ...) TraceLog(fmt, ## __VA_ARGS__)
 #elif defined GUEST_LINUX
 #define Log(fmt, ...)
 #else
@@ -26,16 +26,106 @@
 #include "mmu.h"
 #include "debug.h"
 #include "vmmstring.h"
+#include "common.h"
+#include "smp.h"
+
+/* The identity map uses the largest pages allowed by the processor and by
+   the MTRRs. A PD (PT) is allocated for a 1GB (2MB) region only when it has
+   to be split, and is retired when the region is merged back (see
+   EPTReclaimTables()) */
+hvm_address VIRT_PD_BASES[HOST_GB];     /* PD of each PDPTE, 0 if none */
+hvm_address VIRT_PT_BASES[HOST_GB*512]; /* PT of each PDE, 0 if none */
+static Bit32u PHYS_PD_BASES[HOST_GB];
+static Bit32u PHYS_PT_BASES[HOST_GB*512];
+static hvm_address VIRT_PDPT;
+
+/* Memory type of each 2MB and 1GB region, EPT_TYPE_MIXED if the MTRRs
+   assign more than one type to it */
+#define EPT_TYPE_MIXED 0xff
+static Bit8u large_types[HOST_GB*512];
+static Bit8u huge_types[HOST_GB];
+
+static hvm_bool ept_large_pages;	/* 2MB pages supported */
+static hvm_bool ept_huge_pages;		/* 1GB pages supported */
+hvm_bool EPTAccessDirty;
+
+/* Dirty-page logging state. With the EPT dirty flags the bitmap is filled at
+   harvest time, otherwise by EPTHandleWrite(). Snapshots use the
+   same bitmap, for the pages saved in the pool */
+typedef enum {
+  EptDirtyCollect,		/* Move the dirty flags to the bitmap */
+  EptDirtyProtect,		/* Write-protect the pages in the bitmap */
+  EptDirtyProtectAll,		/* Write-protect all the pages */
+  EptDirtyClearFlags,		/* Clear all the dirty flags */
+  EptDirtyRelease,		/* Make all the pages writable again */
+} EPT_DIRTY_LOG_OP;
+
+static Bit32u   dirty_bitmap[EPT_DIRTY_LOG_PAGES / 32];
+static hvm_bool dirty_log_active = FALSE;
+static hvm_bool dirty_log_ad;	/* Using the EPT dirty flags */
+
+/* Copy-on-write snapshot: snapshot_pool[i] holds the original content of
+   guest page snapshot_pages[i], for the first snapshot_count slots */
+static hvm_address snapshot_pool[EPT_SNAPSHOT_POOL];
+static Bit32u      snapshot_pages[EPT_SNAPSHOT_POOL];
+static Bit32u      snapshot_pool_size;
+static Bit32u      snapshot_count;
+static hvm_bool    snapshot_active = FALSE;
+static hvm_bool    snapshot_overflow; /* Pages were written but not saved */
+
+/* Writes to pages not yet in the bitmap cause an EPT violation */
+#define EPT_WRITES_TRAPPED (snapshot_active || (dirty_log_active && !dirty_log_ad))
+
+/* Tables used to split large pages from the VMM, where memory cannot be
+   allocated. Tables detached by a merge are retired first: a processor that
+   has not flushed its EPT TLB yet may still be using them. While a snapshot
+   is active, the last table_reserved tables of the pool are only used by
+   EPTHandleWrite() */
+#define EPT_TABLES (EPT_TABLE_POOL + EPT_SNAPSHOT_TABLES)
+static hvm_address table_pool[EPT_TABLES];
+static Bit32u      table_pool_phys[EPT_TABLES];
+static Bit32u      table_pool_count;
+static Bit32u      table_reserved;
+static hvm_address table_retired[EPT_TABLES];
+static Bit32u      table_retired_phys[EPT_TABLES];
+static Bit32u      table_retired_count;
 
-hvm_address VIRT_PT_BASES[HOST_GB*512]; /* 512 entry for each PDPT to map a full 4GB address space */
 INVEPT_DESCRIPTOR EPTInveptDesc;
 
+/* Incremented at each change of the paging structures: the other processors
+   flush their EPT TLBs when they see a new value */
+volatile Bit32u EPTGeneration = 0;
+
+/* Open EPTBeginBatch() calls, and whether changes are waiting for the
+   INVEPT issued by the last EPTCommitBatch() */
+static Bit32u   ept_batch_depth = 0;
+static hvm_bool ept_batch_dirty = FALSE;
+
 hvm_address     Pml4;
 hvm_phy_address Phys_Pml4; 
 
 
 void   USESTACK EptInvept(Bit32u eptp_high, Bit32u eptp_low, Bit32u rsvd_high, Bit32u rsvd_low);
 
+static hvm_bool    EPTRangeIsUniform(Bit64u base, Bit64u size);
+static hvm_address EPTAllocTable(Bit32u *phys);
+static void        EPTRetireTable(hvm_address va, Bit32u phys);
+static void        EPTReclaimTables(void);
+static void        EPTSetEntry(hvm_address va_of_entry, Bit32u value);
+static hvm_status  EPTSplitHuge(Bit32u pdpte_num);
+static hvm_status  EPTSplitLarge(Bit32u pdpte_num, Bit32u pde_num, Bit32u flags);
+static void        EPTMerge(Bit32u pdpte_num, Bit32u pde_num);
+static hvm_bool    EPTMergeHuge(Bit32u pdpte_num);
+static void        EPTFlush(void);
+static void        EPTAlterPage(hvm_address va, hvm_phy_address phy, void* arg);
+static void        EPTDirtyMark(Bit32u page, Bit32u npages);
+static hvm_bool    EPTDirtyTest(Bit32u page, Bit32u npages);
+static hvm_bool    EPTDirtyLogLeaf(hvm_address entry, Bit32u page, Bit32u npages, EPT_DIRTY_LOG_OP op);
+static hvm_bool    EPTDirtyLogRegion(Bit32u n, EPT_DIRTY_LOG_OP op);
+static hvm_status  EPTSplitAllHuge(void);
+static hvm_bool    EPTMergeAllHuge(void);
+static void        EPTSnapshotSave(Bit32u page, Bit32u npages);
+
 #define IA32_MTRRCAP_VCNT		0x000000ff
 #define IA32_MTRRCAP_FIX		0x00000100
 #define IA32_MTRRCAP_WC			0x00000400
@@ -54,7 +144,7 @@ static uint64_t mtrr_phys_mask;
 ((~((mask) & IA32_MTRR_PHYSBASE_MASK) & mtrr_phys_mask) + 1)
 
 typedef struct _MTRR_FIXED_RANGE {
-  hvm_address types;
+  Bit64u types;			/* 8 types, one per byte */
 } MTRR_FIXED_RANGE, *PMTRR_FIXED_RANGE;
 
 typedef struct _MTRR_RANGE {
@@ -70,6 +160,29 @@ typedef struct _MTRR_RANGE {
 MTRR_RANGE ranges[MAX_SUPPORTED_MTRR_RANGE];
 MTRR_FIXED_RANGE fixed_ranges[MAX_SUPPORTED_MTRR_FIXED_RANGE];
 
+#define IA32_MTRR_DEF_TYPE_TYPE		0xFF
+#define IA32_MTRR_DEF_TYPE_FE		0x00000400
+#define IA32_MTRR_DEF_TYPE_E		0x00000800
+
+/* Effective memory type of the physical address space, as seen through the
+   variable ranges and the default type: interval i spans from
+   intervals[i].base to intervals[i+1].base (4GB for the last one) */
+typedef struct _MTRR_INTERVAL {
+  Bit64u base;
+  Bit8u type;
+} MTRR_INTERVAL, *PMTRR_INTERVAL;
+
+#define MAX_MTRR_INTERVALS (2*MAX_SUPPORTED_MTRR_RANGE + 1)
+#define MTRR_ADDRESS_LIMIT 0x100000000ULL
+
+static MTRR_INTERVAL intervals[MAX_MTRR_INTERVALS];
+static Bit32u interval_count;
+static hvm_bool mtrr_fixed_enabled;
+
+static Bit8u  EPTCombineTypes(Bit8u a, Bit8u b);
+static void   EPTBuildIntervals(Bit8u deftype);
+static Bit32u EPTFindInterval(Bit64u address);
+
 void EPTInit()
 {
   unsigned long long count = 0;
@@ -81,26 +194,17 @@ void EPTInit()
 	/* +------------------------------+-----------------+----------------+ */
 	/* |##############################|VirtualMemoryBits| PhysMemoryBits | */
 	/* +------------------------------+-----------------+----------------+ */
-  __asm__ __volatile__ ("pushl %%eax\n"
-                        "pushl %%ebx\n"
-                        "pushl %%ecx\n"
-                        "pushl %%edx\n"
-                        "movl $0x80000008, %%eax\n"
-                        "cpuid\n"
-                        "movl %%eax, %0\n"
-                        "popl %%edx\n"
-                        "popl %%ecx\n"
-                        "popl %%ebx\n"
-                        "popl %%eax\n"
-                        :"=m"(n)
-                        ::
+  __asm__ __volatile__ ("cpuid\n"
+                        :"=a"(n)
+                        :"a"(0x80000008)
+                        :"ebx", "ecx", "edx"
                         );
 
 	n &= 0xff;
 	mtrr_phys_mask = PHYS_BITS_TO_MASK(n);
 
   vmm_memset(ranges, 0, MAX_SUPPORTED_MTRR_RANGE*sizeof(MTRR_RANGE));
-  vmm_memset(fixed_ranges, 0, MAX_SUPPORTED_MTRR_RANGE*sizeof(MTRR_FIXED_RANGE));
+  vmm_memset(fixed_ranges, 0, MAX_SUPPORTED_MTRR_FIXED_RANGE*sizeof(MTRR_FIXED_RANGE));
 
   ReadMSR(MSR_IA32_MTRRCAP, &base);
   count = ((((unsigned long long) base.Hi) << 32) | base.Lo) & IA32_MTRRCAP_VCNT;
@@ -120,142 +224,982 @@ void EPTInit()
   
   i = 0;
   ReadMSR(MSR_IA32_MTRR_FIX64K_00000, &base);
-  fixed_ranges[i++].types = base.Lo;
+  fixed_ranges[i++].types = ((Bit64u) base.Hi << 32) | base.Lo;
   ReadMSR(MSR_IA32_MTRR_FIX16K_80000, &base);
-  fixed_ranges[i++].types = base.Lo;
+  fixed_ranges[i++].types = ((Bit64u) base.Hi << 32) | base.Lo;
   ReadMSR(MSR_IA32_MTRR_FIX16K_A0000, &base);
-  fixed_ranges[i++].types = base.Lo;
+  fixed_ranges[i++].types = ((Bit64u) base.Hi << 32) | base.Lo;
   ReadMSR(MSR_IA32_MTRR_FIX4K_C0000, &base);
-  fixed_ranges[i++].types = base.Lo;
+  fixed_ranges[i++].types = ((Bit64u) base.Hi << 32) | base.Lo;
   ReadMSR(MSR_IA32_MTRR_FIX4K_C8000, &base);
-  fixed_ranges[i++].types = base.Lo;
+  fixed_ranges[i++].types = ((Bit64u) base.Hi << 32) | base.Lo;
   ReadMSR(MSR_IA32_MTRR_FIX4K_D0000, &base);
-  fixed_ranges[i++].types = base.Lo;
+  fixed_ranges[i++].types = ((Bit64u) base.Hi << 32) | base.Lo;
   ReadMSR(MSR_IA32_MTRR_FIX4K_D8000, &base);
-  fixed_ranges[i++].types = base.Lo;
+  fixed_ranges[i++].types = ((Bit64u) base.Hi << 32) | base.Lo;
   ReadMSR(MSR_IA32_MTRR_FIX4K_E0000, &base);
-  fixed_ranges[i++].types = base.Lo;
+  fixed_ranges[i++].types = ((Bit64u) base.Hi << 32) | base.Lo;
   ReadMSR(MSR_IA32_MTRR_FIX4K_E8000, &base);
-  fixed_ranges[i++].types = base.Lo;
+  fixed_ranges[i++].types = ((Bit64u) base.Hi << 32) | base.Lo;
   ReadMSR(MSR_IA32_MTRR_FIX4K_F0000, &base);
-  fixed_ranges[i++].types = base.Lo;
+  fixed_ranges[i++].types = ((Bit64u) base.Hi << 32) | base.Lo;
   ReadMSR(MSR_IA32_MTRR_FIX4K_F8000, &base);
-  fixed_ranges[i++].types = base.Lo;
+  fixed_ranges[i++].types = ((Bit64u) base.Hi << 32) | base.Lo;
+
+  /* With MTRRs disabled everything is UC; fixed ranges need their own
+     enable bit */
+  ReadMSR(MSR_IA32_MTRR_DEF_TYPE, &base);
+  if (base.Lo & IA32_MTRR_DEF_TYPE_E) {
+    mtrr_fixed_enabled = (base.Lo & IA32_MTRR_DEF_TYPE_FE) != 0;
+    EPTBuildIntervals((Bit8u) (base.Lo & IA32_MTRR_DEF_TYPE_TYPE));
+  } else {
+    mtrr_fixed_enabled = FALSE;
+    interval_count = 1;
+    intervals[0].base = 0;
+    intervals[0].type = MEM_TYPE_UNCACHEABLE;
+  }
+
+  /* Large EPT pages supported by the processor */
+  ReadMSR(IA32_VMX_EPT_VPID_CAP, &base);
+  ept_large_pages = (base.Lo & EPT_CAP_2MB_PAGES) != 0;
+  ept_huge_pages  = (base.Lo & EPT_CAP_1GB_PAGES) != 0;
+  EPTAccessDirty  = (base.Lo & EPT_CAP_ACCESS_DIRTY) != 0;
+}
+
+/* Effective type where variable ranges overlap: UC wins, WT wins over WB,
+   any other combination is undefined and treated as UC */
+static Bit8u EPTCombineTypes(Bit8u a, Bit8u b)
+{
+  if (a == b)
+    return a;
+  if (a == MEM_TYPE_UNCACHEABLE || b == MEM_TYPE_UNCACHEABLE)
+    return MEM_TYPE_UNCACHEABLE;
+  if ((a == MEM_TYPE_WRITETHROUGH && b == MEM_TYPE_WRITEBACK) ||
+      (a == MEM_TYPE_WRITEBACK && b == MEM_TYPE_WRITETHROUGH))
+    return MEM_TYPE_WRITETHROUGH;
+
+  return MEM_TYPE_UNCACHEABLE;
+}
+
+/* Split the address space at every variable range boundary, and assign to
+   each piece the combination of the ranges that cover it. Adjacent pieces
+   with the same type are merged */
+static void EPTBuildIntervals(Bit8u deftype)
+{
+  Bit64u points[MAX_MTRR_INTERVALS], p, end;
+  Bit32u npoints, i, j;
+  hvm_bool covered;
+  Bit8u type;
+
+  npoints = 0;
+  points[npoints++] = 0;
+
+  for (i = 0; i < MAX_SUPPORTED_MTRR_RANGE; i++) {
+    if (ranges[i].size == 0)
+      continue;
+
+    end = (Bit64u) ranges[i].base + ranges[i].size;
+    if (ranges[i].base != 0)
+      points[npoints++] = ranges[i].base;
+    if (end < MTRR_ADDRESS_LIMIT)
+      points[npoints++] = end;
+  }
+
+  /* Insertion sort: there are a few tens of points at most */
+  for (i = 1; i < npoints; i++) {
+    p = points[i];
+    for (j = i; j > 0 && points[j-1] > p; j--)
+      points[j] = points[j-1];
+    points[j] = p;
+  }
+
+  interval_count = 0;
+  for (i = 0; i < npoints; i++) {
+    if (i > 0 && points[i] == points[i-1])
+      continue;
+
+    covered = FALSE;
+    type = deftype;
+    for (j = 0; j < MAX_SUPPORTED_MTRR_RANGE; j++) {
+      if (ranges[j].size == 0 || points[i] < ranges[j].base ||
+	  points[i] >= (Bit64u) ranges[j].base + ranges[j].size)
+	continue;
+
+      type = covered ? EPTCombineTypes(type, ranges[j].type) : ranges[j].type;
+      covered = TRUE;
+    }
+
+    if (interval_count > 0 && intervals[interval_count-1].type == type)
+      continue;
+
+    intervals[interval_count].base = points[i];
+    intervals[interval_count].type = type;
+    interval_count++;
+  }
+}
+
+/* Index of the interval that contains address */
+static Bit32u EPTFindInterval(Bit64u address)
+{
+  Bit32u lo, hi, mid;
+
+  lo = 0;
+  hi = interval_count - 1;
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if (intervals[mid].base <= address)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  return lo;
 }
 
 Bit8u EPTGetMemoryType(hvm_address address)
 {
-  Bit8u type = 0, index;
-  if(address < 0x100000) { /* Check in fixed ranges */
-    if(address < 0x80000) { /* 00000000:00080000 */
-      type = (fixed_ranges[0].types & (0xff << ((address >> 16) * 8))) >> ((address >> 16) * 8);
+  Bit8u index;
+  Bit32u shift;
+
+  if(address >= 0x100000 || !mtrr_fixed_enabled)
+    return intervals[EPTFindInterval(address)].type;
+
+  /* Check in fixed ranges */
+  if(address < 0x80000) { /* 00000000:00080000 */
+    index = 0;
+    shift = (address >> 16) * 8;
+  }
+  else if (address < 0xa0000){
+    index = 1;
+    shift = ((address - 0x80000) >> 14) * 8;
+  }
+  else if (address < 0xc0000) {
+    index = 2;
+    shift = ((address - 0xa0000) >> 14) * 8;
+  }
+  else {
+    index = ((address - 0xc0000) >> 15) + 3;
+    shift = ((address & 0x7fff) >> 12) * 8;
+  }
+
+  return (Bit8u) (fixed_ranges[index].types >> shift);
+}
+
+/* TRUE if the MTRRs assign the same type to the whole range. Below 1MB the
+   fixed ranges are checked page by page; above, the range must lie in a
+   single interval */
+static hvm_bool EPTRangeIsUniform(Bit64u base, Bit64u size)
+{
+  Bit64u addr, end;
+  Bit32u i;
+  Bit8u type;
+
+  end = base + size;
+
+  if (base < 0x100000 && mtrr_fixed_enabled) {
+    type = EPTGetMemoryType((hvm_address) base);
+    for (addr = base; addr < end && addr < 0x100000; addr += 4096) {
+      if (EPTGetMemoryType((hvm_address) addr) != type)
+	return FALSE;
     }
-    else if (address < 0xa0000){
-      address -= 0x80000;
-      type = (fixed_ranges[1].types & (0xff << ((address >> 14) * 8))) >> ((address >> 14) * 8);
+    if (end <= 0x100000)
+      return TRUE;
+    if (EPTGetMemoryType(0x100000) != type)
+      return FALSE;
+    base = 0x100000;
+  }
+
+  i = EPTFindInterval(base);
+
+  return i + 1 >= interval_count || intervals[i+1].base >= end;
+}
+
+/* Allocate a zeroed paging structure. Before the map is built, memory is
+   taken from the guest; afterwards, from the preallocated pool */
+static hvm_address EPTAllocTable(Bit32u *phys)
+{
+  hvm_phy_address p;
+  hvm_address va;
+
+  if (Pml4) {
+    if (table_pool_count <= table_reserved)
+      EPTReclaimTables();
+    if (table_pool_count <= table_reserved)
+      return 0;
+
+    table_pool_count--;
+    *phys = table_pool_phys[table_pool_count];
+    va = table_pool[table_pool_count];
+  } else {
+    va = (hvm_address) GUEST_MALLOC(4096);
+    if (!va)
+      return 0;
+    MmuGetPhysicalAddress(RegGetCr3(), va, &p);
+    *phys = GET32L(p);
+  }
+
+  vmm_memset((void *) va, 0, 4096);
+
+  return va;
+}
+
+/* Only tables from the pool are ever merged: the ones allocated while
+   building the map cover regions with mixed memory types */
+static void EPTRetireTable(hvm_address va, Bit32u phys)
+{
+  table_retired[table_retired_count]      = va;
+  table_retired_phys[table_retired_count] = phys;
+  table_retired_count++;
+}
+
+/* Give the retired tables back to the pool. The other processors are
+   stopped, and flush their EPT TLBs before they run the guest again; this
+   one flushes right now */
+static void EPTReclaimTables(void)
+{
+  if (table_retired_count == 0)
+    return;
+
+  SmpFreezeOthers();
+
+  EPTGeneration++;
+  EPTInvalidate();
+
+  while (table_retired_count > 0) {
+    table_retired_count--;
+    table_pool[table_pool_count]      = table_retired[table_retired_count];
+    table_pool_phys[table_pool_count] = table_retired_phys[table_retired_count];
+    table_pool_count++;
+  }
+
+  SmpThawOthers();
+}
+
+/* Write a 64-bit entry, as two 4 byte writes */
+static void EPTSetEntry(hvm_address va_of_entry, Bit32u value)
+{
+  *((Bit32u *) va_of_entry) = value;
+  *((Bit32u *) (va_of_entry + 4)) = 0;
+}
+
+/* Replace a 1GB page with a PD of 2MB pages (or of PTs, for 2MB regions
+   with mixed memory types) with the same permissions */
+static hvm_status EPTSplitHuge(Bit32u pdpte_num)
+{
+  Bit32u pdpte, pde, phys, i, n;
+  hvm_address pd;
+
+  pdpte = *(Bit32u *) (VIRT_PDPT + pdpte_num*8);
+
+  if (!VIRT_PD_BASES[pdpte_num]) {
+    pd = EPTAllocTable(&phys);
+    if (!pd)
+      return HVM_STATUS_UNSUCCESSFUL;
+    VIRT_PD_BASES[pdpte_num] = pd;
+    PHYS_PD_BASES[pdpte_num] = phys;
+  }
+  pd = VIRT_PD_BASES[pdpte_num];
+
+  for (i = 0; i < 512; i++) {
+    n = pdpte_num*512 + i;
+    if (ept_large_pages && large_types[n] != EPT_TYPE_MIXED) {
+      pde = (n << 21) | (large_types[n] << 3) | EPT_LARGE_PAGE | (pdpte & (EPT_PERMS | EPT_DIRTY));
+    } else {
+      if (!HVM_SUCCESS(EPTSplitLarge(pdpte_num, i, pdpte & (EPT_PERMS | EPT_DIRTY))))
+	return HVM_STATUS_UNSUCCESSFUL;
+      pde = PHYS_PT_BASES[n] | 0x7;
     }
-    else if (address < 0xc0000) {
-      address -= 0xa0000;
-      type = (fixed_ranges[2].types & (0xff << ((address >> 14) * 8))) >> ((address >> 14) * 8);
+    EPTSetEntry(pd + i*8, pde);
+  }
+
+  EPTSetEntry(VIRT_PDPT + pdpte_num*8, PHYS_PD_BASES[pdpte_num] | 0x7);
+
+  return HVM_STATUS_SUCCESS;
+}
+
+/* Fill the PT of a 2MB region with 4KB pages with the given permissions (and
+   dirty flag). The caller links the PT to the PD */
+static hvm_status EPTSplitLarge(Bit32u pdpte_num, Bit32u pde_num, Bit32u flags)
+{
+  Bit32u phys, n, h, map;
+  hvm_address pt;
+
+  n = pdpte_num*512 + pde_num;
+
+  if (!VIRT_PT_BASES[n]) {
+    pt = EPTAllocTable(&phys);
+    if (!pt)
+      return HVM_STATUS_UNSUCCESSFUL;
+    VIRT_PT_BASES[n] = pt;
+    PHYS_PT_BASES[n] = phys;
+  }
+  pt = VIRT_PT_BASES[n];
+
+  /* 1:1 physical memory mapping */
+  map = n << 21;
+  for (h = 0; h < 512; h++) {
+    EPTSetEntry(pt + h*8, map | ((Bit8u) EPTGetMemoryType(map) << 3) | flags);
+    map += 4096;
+  }
+
+  return HVM_STATUS_SUCCESS;
+}
+
+/* Turn a PT (PD) back into a 2MB (1GB) page if all its entries have the same
+   permissions and memory type. The large page is dirty if any entry was. 1GB
+   pages are not rebuilt while dirty logging or a snapshot is active */
+static void EPTMerge(Bit32u pdpte_num, Bit32u pde_num)
+{
+  Bit32u first, dirty, i, n;
+  hvm_address pd, pt;
+
+  n  = pdpte_num*512 + pde_num;
+  pd = VIRT_PD_BASES[pdpte_num];
+  pt = VIRT_PT_BASES[n];
+
+  if (!ept_large_pages || large_types[n] == EPT_TYPE_MIXED)
+    return;
+
+  first = *(Bit32u *) pt & (EPT_PERMS | EPT_TYPE);
+  dirty = 0;
+  for (i = 0; i < 512; i++) {
+    if ((*(Bit32u *) (pt + i*8) & (EPT_PERMS | EPT_TYPE)) != first)
+      return;
+    dirty |= *(Bit32u *) (pt + i*8) & EPT_DIRTY;
+  }
+
+  EPTSetEntry(pd + pde_num*8, (n << 21) | first | dirty | EPT_LARGE_PAGE);
+  EPTRetireTable(pt, PHYS_PT_BASES[n]);
+  VIRT_PT_BASES[n] = 0;
+
+  EPTMergeHuge(pdpte_num);
+}
+
+/* Turn a PD back into a 1GB page if all its entries are 2MB pages with the
+   same permissions and memory type. Returns TRUE if it did */
+static hvm_bool EPTMergeHuge(Bit32u pdpte_num)
+{
+  Bit32u first, dirty, i;
+  hvm_address pd;
+
+  pd = VIRT_PD_BASES[pdpte_num];
+
+  if (!pd || !ept_huge_pages || huge_types[pdpte_num] == EPT_TYPE_MIXED || dirty_log_active || snapshot_active)
+    return FALSE;
+
+  first = *(Bit32u *) pd & (EPT_PERMS | EPT_TYPE | EPT_LARGE_PAGE);
+  if (!(first & EPT_LARGE_PAGE))
+    return FALSE;
+  dirty = 0;
+  for (i = 0; i < 512; i++) {
+    if ((*(Bit32u *) (pd + i*8) & (EPT_PERMS | EPT_TYPE | EPT_LARGE_PAGE)) != first)
+      return FALSE;
+    dirty |= *(Bit32u *) (pd + i*8) & EPT_DIRTY;
+  }
+
+  EPTSetEntry(VIRT_PDPT + pdpte_num*8, (pdpte_num << 30) | first | dirty);
+  EPTRetireTable(pd, PHYS_PD_BASES[pdpte_num]);
+  VIRT_PD_BASES[pdpte_num] = 0;
+
+  return TRUE;
+}
+
+hvm_status EPTBuildIdentityMap(void)
+{
+  hvm_address pml4;
+  Bit32u phys, i, j, n;
+
+  vmm_memset(VIRT_PD_BASES, 0, sizeof(VIRT_PD_BASES));
+  vmm_memset(VIRT_PT_BASES, 0, sizeof(VIRT_PT_BASES));
+
+  /* Memory types of the large regions */
+  for (i = 0; i < HOST_GB; i++) {
+    huge_types[i] = EPTRangeIsUniform((Bit64u) i << 30, 1 << 30) ? EPTGetMemoryType(i << 30) : EPT_TYPE_MIXED;
+    for (j = 0; j < 512; j++) {
+      n = i*512 + j;
+      large_types[n] = EPTRangeIsUniform((Bit64u) n << 21, 1 << 21) ? EPTGetMemoryType(n << 21) : EPT_TYPE_MIXED;
     }
-    else {
-      index = ((address - 0xc0000) >> 15) + 3;
-      address &= 0x7fff;
-      type = (fixed_ranges[index].types & (0xff << ((address >> 12) * 8))) >> ((address >> 12) * 8);
+  }
+
+  /* We need only one entry of EPT PML4 table, and HOST_GB entries of EPT
+     PDPT */
+  Pml4 = 0;
+  VIRT_PDPT = EPTAllocTable(&phys);
+  if (!VIRT_PDPT)
+    return HVM_STATUS_UNSUCCESSFUL;
+
+  pml4 = EPTAllocTable(&i);
+  if (!pml4)
+    return HVM_STATUS_UNSUCCESSFUL;
+  Phys_Pml4 = i;
+
+  /* Fill PML4E with PDPT base address and RWX permissions */
+  EPTSetEntry(pml4, phys | 0x7);
+
+  for (i = 0; i < HOST_GB; i++) {
+    if (ept_huge_pages && huge_types[i] != EPT_TYPE_MIXED) {
+      EPTSetEntry(VIRT_PDPT + i*8, (i << 30) | (huge_types[i] << 3) | EPT_LARGE_PAGE | READ | WRITE | EXEC);
+      continue;
     }
+
+    /* A PD is needed */
+    EPTSetEntry(VIRT_PDPT + i*8, (i << 30) | EPT_LARGE_PAGE | READ | WRITE | EXEC);
+    if (!HVM_SUCCESS(EPTSplitHuge(i)))
+      return HVM_STATUS_UNSUCCESSFUL;
   }
-  else {
-    index = 0;
-    while (index < MAX_SUPPORTED_MTRR_RANGE) {
-      if(ranges[index].base <= address && (ranges[index].base+ranges[index].size) > address) {
-        return ranges[index].type;
-			}
-      index++;
+
+  /* Preallocate the tables for the splits done by the VMM */
+  table_reserved = 0;
+  for (table_pool_count = 0; table_pool_count < EPT_TABLES; table_pool_count++) {
+    table_pool[table_pool_count] = EPTAllocTable(&table_pool_phys[table_pool_count]);
+    if (!table_pool[table_pool_count])
+      return HVM_STATUS_UNSUCCESSFUL;
+  }
+
+  /* Pages for copy-on-write snapshots. Snapshots are only limited in size
+     if some allocation fails */
+  for (snapshot_pool_size = 0; snapshot_pool_size < EPT_SNAPSHOT_POOL; snapshot_pool_size++) {
+    snapshot_pool[snapshot_pool_size] = (hvm_address) GUEST_MALLOC(4096);
+    if (!snapshot_pool[snapshot_pool_size]) {
+      Log("[EPT] Snapshots limited to %d pages", snapshot_pool_size);
+      break;
     }
-    type = MEM_TYPE_WRITEBACK;
   }
-  return type;
+
+  /* From now on, tables come from the pool */
+  Pml4 = pml4;
+
+  return HVM_STATUS_SUCCESS;
 }
 
-void EPTAlterPT(hvm_address guest_phy, Bit8u perms, hvm_bool isRemove)
+hvm_status EPTAlterPT(hvm_address guest_phy, Bit8u perms, hvm_bool isRemove)
 {
-  Bit32u entryNum, offset;
-  Bit32u pdpte_num, pde_num, pte_num;
-  hvm_address pte_low, pte_high = 0, va_of_pte;
+  Bit32u pdpte_num, pde_num, n;
+  Bit32u pte_low;
+  hvm_address va_of_pte;
 
-	/* First level */
-  entryNum = guest_phy & 0xc0000000;
-  entryNum = entryNum >> 30;
-  pdpte_num = entryNum;
+  pdpte_num = guest_phy >> 30;
+  pde_num   = (guest_phy >> 21) & 0x1ff;
+  n         = pdpte_num*512 + pde_num;
 
-	/* Second level */
-  entryNum = guest_phy & 0x3fe00000;
-  entryNum = entryNum >> 21;
-  pde_num = entryNum;
-  
-	/* Third level */
-  entryNum = guest_phy & 0x001ff000;
-  entryNum = entryNum >> 12;
-  pte_num = entryNum;
-  offset   = entryNum*8;
+  /* While writes are trapped, a page becomes writable only after its first
+     write has been recorded */
+  if (!isRemove && EPT_WRITES_TRAPPED && !EPTDirtyTest(guest_phy >> 12, 1))
+    perms &= ~WRITE;
 
-	/* Fourth level */
-  va_of_pte = VIRT_PT_BASES[(pdpte_num*512)+pde_num] + (pte_num * 8);
+  /* Nothing to do if the page already has the requested permissions */
+  va_of_pte = EPTGetEntry(guest_phy);
+  pte_low = *((Bit32u *) va_of_pte);
+  if ((isRemove  && (pte_low & perms) == 0) ||
+      (!isRemove && (pte_low & EPT_PERMS) == perms))
+    return HVM_STATUS_SUCCESS;
+
+  /* Split the large pages the address is mapped by */
+  if (*(Bit32u *) (VIRT_PDPT + pdpte_num*8) & EPT_LARGE_PAGE) {
+    if (!HVM_SUCCESS(EPTSplitHuge(pdpte_num))) {
+      Log("[EPT] Out of tables, cannot split the 1GB page at %.8x", pdpte_num << 30);
+      return HVM_STATUS_UNSUCCESSFUL;
+    }
+  }
+
+  if (*(Bit32u *) (VIRT_PD_BASES[pdpte_num] + pde_num*8) & EPT_LARGE_PAGE) {
+    if (!HVM_SUCCESS(EPTSplitLarge(pdpte_num, pde_num, *(Bit32u *) (VIRT_PD_BASES[pdpte_num] + pde_num*8) & (EPT_PERMS | EPT_DIRTY)))) {
+      Log("[EPT] Out of tables, cannot split the 2MB page at %.8x", n << 21);
+      return HVM_STATUS_UNSUCCESSFUL;
+    }
+    EPTSetEntry(VIRT_PD_BASES[pdpte_num] + pde_num*8, PHYS_PT_BASES[n] | 0x7);
+  }
+
+  va_of_pte = VIRT_PT_BASES[n] + ((guest_phy >> 12) & 0x1ff) * 8;
 
   if(isRemove) {
     pte_low = *((hvm_address *)va_of_pte);
     pte_low = (pte_low | (EPTGetMemoryType(pte_low & 0xfffff000) << 3)) & ~perms;
   }
   else {
-    pte_low = (guest_phy & 0xfffff000) | (EPTGetMemoryType(guest_phy & 0xfffff000) << 3) | perms;
+    pte_low = (guest_phy & 0xfffff000) | (EPTGetMemoryType(guest_phy & 0xfffff000) << 3) | perms |
+      (*((Bit32u *) va_of_pte) & EPT_DIRTY);
   }
 
-	/* Write new entry, two 4 byte writes */
-  *((hvm_address *)va_of_pte) = pte_low;
-  *((hvm_address *)(va_of_pte+4)) = pte_high;
+  EPTSetEntry(va_of_pte, pte_low);
+
+  /* Go back to a large page when the whole region is uniform again */
+  EPTMerge(pdpte_num, pde_num);
 
   /* Invalidate EPT cache */
+  EPTFlush();
+
+  return HVM_STATUS_SUCCESS;
+}
+
+static void EPTFlush(void)
+{
+  if (ept_batch_depth > 0) {
+    ept_batch_dirty = TRUE;
+    return;
+  }
+
+  EPTGeneration++;
+  EPTInvalidate();
+}
+
+void EPTBeginBatch(void)
+{
+  ept_batch_depth++;
+}
+
+void EPTCommitBatch(void)
+{
+  if (ept_batch_depth == 0 || --ept_batch_depth > 0)
+    return;
+
+  if (ept_batch_dirty) {
+    ept_batch_dirty = FALSE;
+    EPTFlush();
+  }
+}
+
+hvm_status EPTAlterPhysicalRange(hvm_address guest_phy, Bit32u size, Bit8u perms, hvm_bool isRemove)
+{
+  Bit32u npages;
+  hvm_status r;
+
+  if (size == 0)
+    return HVM_STATUS_SUCCESS;
+
+  npages = ((((guest_phy + size - 1) & 0xfffff000) - (guest_phy & 0xfffff000)) >> 12) + 1;
+  guest_phy &= 0xfffff000;
+
+  r = HVM_STATUS_SUCCESS;
+  EPTBeginBatch();
+  while (npages-- > 0 && HVM_SUCCESS(r)) {
+    r = EPTAlterPT(guest_phy, perms, isRemove);
+    guest_phy += 4096;
+  }
+  EPTCommitBatch();
+
+  return r;
+}
+
+/* Argument of EPTAlterPage(). r is the first failure */
+typedef struct {
+  Bit8u      perms;
+  hvm_bool   isRemove;
+  hvm_status r;
+} EPT_ALTER_ARGS;
+
+static void EPTAlterPage(hvm_address va, hvm_phy_address phy, void* arg)
+{
+  EPT_ALTER_ARGS *args;
+
+  args = (EPT_ALTER_ARGS *) arg;
+  if (HVM_SUCCESS(args->r))
+    args->r = EPTAlterPT(GET32L(phy), args->perms, args->isRemove);
+}
+
+hvm_status EPTAlterVirtualRange(hvm_address cr3, hvm_address va, Bit32u size, Bit8u perms, hvm_bool isRemove)
+{
+  EPT_ALTER_ARGS args;
+  hvm_status r;
+
+  args.perms    = perms;
+  args.isRemove = isRemove;
+  args.r        = HVM_STATUS_SUCCESS;
+
+  EPTBeginBatch();
+  r = MmuWalkVirtualRange(cr3, va, size, EPTAlterPage, &args);
+  EPTCommitBatch();
+
+  return HVM_SUCCESS(r) ? args.r : r;
+}
+
+void EPTInvalidate(void)
+{
   EptInvept(GET32H(EPTInveptDesc.Eptp), GET32L(EPTInveptDesc.Eptp), GET32H(EPTInveptDesc.Rsvd), GET32L(EPTInveptDesc.Rsvd));
 }
 
+/* Address of the entry that maps guest_phy: a PTE, or the PDE (PDPTE) of a
+   2MB (1GB) page */
 hvm_address EPTGetEntry(hvm_address guest_phy) 
 {
-  Bit32u entryNum, offset;
   Bit32u pdpte_num, pde_num, pte_num;
-  hvm_address va_of_pte;
+  hvm_address va_of_pde;
 
-	/* First level */
-  entryNum = guest_phy & 0xc0000000;
-  entryNum = entryNum >> 30;
-  pdpte_num = entryNum;
+  pdpte_num = guest_phy >> 30;
+  pde_num   = (guest_phy >> 21) & 0x1ff;
+  pte_num   = (guest_phy >> 12) & 0x1ff;
+
+  if (*(Bit32u *) (VIRT_PDPT + pdpte_num*8) & EPT_LARGE_PAGE)
+    return VIRT_PDPT + pdpte_num*8;
+
+  va_of_pde = VIRT_PD_BASES[pdpte_num] + pde_num*8;
+  if (*(Bit32u *) va_of_pde & EPT_LARGE_PAGE)
+    return va_of_pde;
+
+  return VIRT_PT_BASES[pdpte_num*512 + pde_num] + pte_num*8;
+}
 
-	/* Second level */
-  entryNum = guest_phy & 0x3fe00000;
-  entryNum = entryNum >> 21;
-  pde_num = entryNum;
-  
-	/* Third level */
-  entryNum = guest_phy & 0x001ff000;
-  entryNum = entryNum >> 12;
-  pte_num = entryNum;
-  offset   = entryNum*8;
 
-	/* Fourth level */
-  va_of_pte = VIRT_PT_BASES[(pdpte_num*512)+pde_num] + (pte_num * 8);
-	
-	return va_of_pte;
+/* Copy the original content of the pages to the snapshot pool */
+static void EPTSnapshotSave(Bit32u page, Bit32u npages)
+{
+  for (; npages > 0; page++, npages--) {
+    if (snapshot_count >= snapshot_pool_size) {
+      if (!snapshot_overflow)
+	Log("[EPT] Snapshot pool exhausted, the snapshot cannot be restored");
+      snapshot_overflow = TRUE;
+      return;
+    }
+
+    MmuReadPhysicalRegion((hvm_phy_address) page << 12, (void *) snapshot_pool[snapshot_count], 4096);
+    snapshot_pages[snapshot_count++] = page;
+  }
 }
 
+hvm_status EPTSnapshotTake(void)
+{
+  Bit32u i;
+
+  /* The other processors would write to memory while it is restored */
+  if (dirty_log_active || snapshot_active || SmpCpuCount() > 1 || snapshot_pool_size == 0)
+    return HVM_STATUS_UNSUCCESSFUL;
+
+  if (!HVM_SUCCESS(EPTSplitAllHuge()))
+    return HVM_STATUS_UNSUCCESSFUL;
+
+  /* Without a table, the first write to a 2MB page would save all of it */
+  if (table_pool_count < EPT_SNAPSHOT_TABLES)
+    EPTReclaimTables();
+  if (table_pool_count < EPT_SNAPSHOT_TABLES) {
+    Log("[EPT] Cannot reserve %d tables for the snapshot, %d left", EPT_SNAPSHOT_TABLES, table_pool_count);
+    return HVM_STATUS_UNSUCCESSFUL;
+  }
+  table_reserved = EPT_SNAPSHOT_TABLES;
+
+  vmm_memset(dirty_bitmap, 0, sizeof(dirty_bitmap));
+  snapshot_count    = 0;
+  snapshot_overflow = FALSE;
+  snapshot_active   = TRUE;
 
-void EPTProtectPhysicalRange(hvm_address base, Bit32u size, Bit8u permsToRemove) {
+  for (i = 0; i < EPT_DIRTY_LOG_PAGES / 512; i++)
+    EPTDirtyLogRegion(i, EptDirtyProtectAll);
+  EPTFlush();
 
-  hvm_phy_address phyaddr;
-  hvm_address i;
+  return HVM_STATUS_SUCCESS;
+}
+
+/* Only the pages written since the snapshot (or the last restore) are
+   touched: each one is copied back and write-protected again */
+hvm_status EPTSnapshotRestore(Bit32u *npages)
+{
+  Bit32u i, page;
 
-  for(i = base; i < base+size; i=i+4096) {
-    MmuGetPhysicalAddress(RegGetCr3(), i, &phyaddr);
-    EPTRemovePTperms(GET32L(phyaddr), permsToRemove);
+  if (!snapshot_active || snapshot_overflow)
+    return HVM_STATUS_UNSUCCESSFUL;
+
+  for (i = 0; i < snapshot_count; i++) {
+    page = snapshot_pages[i];
+    MmuWritePhysicalRegion((hvm_phy_address) page << 12, (void *) snapshot_pool[i], 4096);
+    *(Bit32u *) EPTGetEntry(page << 12) &= ~WRITE;
+    dirty_bitmap[page >> 5] &= ~(1 << (page & 31));
   }
+
+  *npages = snapshot_count;
+  snapshot_count = 0;
+
+  if (*npages > 0)
+    EPTFlush();
+
+  return HVM_STATUS_SUCCESS;
+}
+
+void EPTSnapshotDrop(void)
+{
+  Bit32u i;
+
+  if (!snapshot_active)
+    return;
+
+  for (i = 0; i < EPT_DIRTY_LOG_PAGES / 512; i++)
+    EPTDirtyLogRegion(i, EptDirtyRelease);
+
+  snapshot_active = FALSE;
+  table_reserved  = 0;
+
+  /* Give back the tables of the 2MB pages split by the snapshot, and of the
+   1GB pages split when it was taken */
+  for (i = 0; i < EPT_DIRTY_LOG_PAGES / 512; i++) {
+    if (VIRT_PT_BASES[i] && !(*(Bit32u *) (VIRT_PD_BASES[i >> 9] + (i & 0x1ff)*8) & EPT_LARGE_PAGE))
+      EPTMerge(i >> 9, i & 0x1ff);
+  }
+  EPTMergeAllHuge();
+
+  EPTFlush();
+}
+
+/* Despite the name, base is a virtual address in the current address space */
+hvm_status EPTProtectPhysicalRange(hvm_address base, Bit32u size, Bit8u permsToRemove)
+{
+  return EPTAlterVirtualRange(RegGetCr3(), base, size, permsToRemove, TRUE);
+}
+
+/* npages is 1, or the pages of a large page */
+static void EPTDirtyMark(Bit32u page, Bit32u npages)
+{
+  if (npages == 1)
+    dirty_bitmap[page >> 5] |= 1 << (page & 31);
+  else
+    vmm_memset(&dirty_bitmap[page >> 5], 0xff, npages / 8);
+}
+
+/* TRUE if any of the pages is marked */
+static hvm_bool EPTDirtyTest(Bit32u page, Bit32u npages)
+{
+  Bit32u i;
+
+  if (npages == 1)
+    return (dirty_bitmap[page >> 5] & (1 << (page & 31))) != 0;
+
+  for (i = page >> 5; i < (page + npages) >> 5; i++) {
+    if (dirty_bitmap[i])
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* Apply op to the leaf entry that maps npages pages from page. Returns TRUE
+   if the entry was changed */
+static hvm_bool EPTDirtyLogLeaf(hvm_address entry, Bit32u page, Bit32u npages, EPT_DIRTY_LOG_OP op)
+{
+  Bit32u old, e;
+
+  old = e = *(Bit32u *) entry;
+
+  switch (op) {
+  case EptDirtyCollect:
+    if (e & EPT_DIRTY) {
+      EPTDirtyMark(page, npages);
+      e &= ~EPT_DIRTY;
+    }
+    break;
+  case EptDirtyProtect:
+    if (EPTDirtyTest(page, npages))
+      e &= ~WRITE;
+    break;
+  case EptDirtyProtectAll:
+    e &= ~WRITE;
+    break;
+  case EptDirtyClearFlags:
+    e &= ~EPT_DIRTY;
+    break;
+  case EptDirtyRelease:
+    /* Write-only entries are not allowed */
+    if (e & READ)
+      e |= WRITE;
+    break;
+  }
+
+  if (e == old)
+    return FALSE;
+
+  *(Bit32u *) entry = e;
+
+  return TRUE;
+}
+
+/* Apply op to the leaves of the 2MB region n. There are no 1GB pages while
+   dirty logging or a snapshot is active */
+static hvm_bool EPTDirtyLogRegion(Bit32u n, EPT_DIRTY_LOG_OP op)
+{
+  hvm_address pde, pt;
+  hvm_bool changed;
+  Bit32u i;
+
+  pde = VIRT_PD_BASES[n >> 9] + (n & 0x1ff)*8;
+  if (*(Bit32u *) pde & EPT_LARGE_PAGE)
+    return EPTDirtyLogLeaf(pde, n << 9, 512, op);
+
+  pt = VIRT_PT_BASES[n];
+  changed = FALSE;
+  for (i = 0; i < 512; i++) {
+    if (EPTDirtyLogLeaf(pt + i*8, (n << 9) + i, 1, op))
+      changed = TRUE;
+  }
+
+  return changed;
+}
+
+/* A write to a 1GB page would mark 256K pages dirty */
+static hvm_status EPTSplitAllHuge(void)
+{
+  Bit32u i;
+
+  for (i = 0; i < HOST_GB; i++) {
+    if ((*(Bit32u *) (VIRT_PDPT + i*8) & EPT_LARGE_PAGE) && !HVM_SUCCESS(EPTSplitHuge(i))) {
+      Log("[EPT] Out of tables, cannot split the 1GB page at %.8x", i << 30);
+      return HVM_STATUS_UNSUCCESSFUL;
+    }
+  }
+
+  return HVM_STATUS_SUCCESS;
+}
+
+/* Rebuild the 1GB pages that are uniform again, once dirty logging or the
+   snapshot is over. Returns TRUE if any was */
+static hvm_bool EPTMergeAllHuge(void)
+{
+  hvm_bool merged;
+  Bit32u i;
+
+  merged = FALSE;
+  for (i = 0; i < HOST_GB; i++) {
+    if (EPTMergeHuge(i))
+      merged = TRUE;
+  }
+
+  return merged;
+}
+
+hvm_status EPTDirtyLogStart(void)
+{
+  Bit32u i;
+
+  if (dirty_log_active || snapshot_active)
+    return HVM_STATUS_UNSUCCESSFUL;
+
+  /* The other processors pick up the new permissions before running the
+     guest again */
+  SmpFreezeOthers();
+
+  if (!HVM_SUCCESS(EPTSplitAllHuge())) {
+    SmpThawOthers();
+    return HVM_STATUS_UNSUCCESSFUL;
+  }
+
+  vmm_memset(dirty_bitmap, 0, sizeof(dirty_bitmap));
+  dirty_log_ad     = EPTAccessDirty;
+  dirty_log_active = TRUE;
+
+  for (i = 0; i < EPT_DIRTY_LOG_PAGES / 512; i++)
+    EPTDirtyLogRegion(i, dirty_log_ad ? EptDirtyClearFlags : EptDirtyProtectAll);
+  EPTFlush();
+
+  SmpThawOthers();
+
+  Log("[EPT] Dirty logging started (%s)", dirty_log_ad ? "dirty flags" : "write protection");
+
+  return HVM_STATUS_SUCCESS;
+}
+
+void EPTDirtyLogStop(void)
+{
+  Bit32u i;
+
+  if (!dirty_log_active)
+    return;
+
+  SmpFreezeOthers();
+
+  if (!dirty_log_ad) {
+    for (i = 0; i < EPT_DIRTY_LOG_PAGES / 512; i++)
+      EPTDirtyLogRegion(i, EptDirtyRelease);
+  }
+
+  dirty_log_active = FALSE;
+
+  if (EPTMergeAllHuge() || !dirty_log_ad)
+    EPTFlush();
+
+  SmpThawOthers();
+}
+
+hvm_status EPTDirtyLogHarvest(Bit8u *bitmap, Bit32u first_page, Bit32u npages)
+{
+  hvm_bool changed;
+  Bit32u n;
+
+  if (!dirty_log_active || first_page % EPT_DIRTY_LOG_GRANULE != 0 || npages % EPT_DIRTY_LOG_GRANULE != 0 ||
+      first_page > EPT_DIRTY_LOG_PAGES || npages > EPT_DIRTY_LOG_PAGES - first_page)
+    return HVM_STATUS_UNSUCCESSFUL;
+
+  /* Nobody writes to guest memory while the flags are collected, and the
+     pages are protected again. A single INVEPT covers the whole range */
+  SmpFreezeOthers();
+
+  changed = FALSE;
+  for (n = first_page / 512; n < (first_page + npages) / 512; n++) {
+    if (EPTDirtyLogRegion(n, dirty_log_ad ? EptDirtyCollect : EptDirtyProtect))
+      changed = TRUE;
+  }
+
+  if (changed)
+    EPTFlush();
+
+  vmm_memcpy(bitmap, &dirty_bitmap[first_page / 32], npages / 8);
+  vmm_memset(&dirty_bitmap[first_page / 32], 0, npages / 8);
+
+  SmpThawOthers();
+
+  return HVM_STATUS_SUCCESS;
+}
+
+hvm_bool EPTHandleWrite(hvm_address guest_phy)
+{
+  hvm_address entry;
+  Bit32u npages, page, n, e;
+
+  if (!EPT_WRITES_TRAPPED)
+    return FALSE;
+
+  /* Not protected by us, or already recorded: someone else's violation */
+  entry = EPTGetEntry(guest_phy);
+  e = *(Bit32u *) entry;
+  if ((e & (READ | WRITE)) != READ || EPTDirtyTest(guest_phy >> 12, 1))
+    return FALSE;
+
+  /* A snapshot saves 4KB pages rather than whole 2MB pages, with one of the
+     tables it has reserved. Once they are over, the snapshot cannot be
+     restored: saving the 512 pages would only exhaust the pool */
+  if (snapshot_active && (e & EPT_LARGE_PAGE) && !(entry >= VIRT_PDPT && entry < VIRT_PDPT + 4096)) {
+    n = guest_phy >> 21;
+    if (table_reserved > 0) {
+      table_reserved--;
+      if (HVM_SUCCESS(EPTSplitLarge(n >> 9, n & 0x1ff, e & (EPT_PERMS | EPT_DIRTY)))) {
+	EPTSetEntry(entry, PHYS_PT_BASES[n] | 0x7);
+	EPTFlush();
+	entry = VIRT_PT_BASES[n] + ((guest_phy >> 12) & 0x1ff)*8;
+	e = *(Bit32u *) entry;
+      }
+    }
+
+    if (e & EPT_LARGE_PAGE) {
+      if (!snapshot_overflow)
+	Log("[EPT] Snapshot tables exhausted, the snapshot cannot be restored");
+      snapshot_overflow = TRUE;
+      EPTDirtyMark((guest_phy >> 12) & ~511, 512);
+      *(Bit32u *) entry = e | WRITE;
+      return TRUE;
+    }
+  }
+
+  if (!(e & EPT_LARGE_PAGE))
+    npages = 1;
+  else if (entry >= VIRT_PDPT && entry < VIRT_PDPT + 4096)
+    npages = 1 << 18;
+  else
+    npages = 512;
+
+  page = (guest_phy >> 12) & ~(npages - 1);
+  if (snapshot_active)
+    EPTSnapshotSave(page, npages);
+  EPTDirtyMark(page, npages);
+
+  /* Adding a permission needs no INVEPT: translations that cause a violation
+     are never cached */
+  *(Bit32u *) entry = e | WRITE;
+
+  return TRUE;
 }
 
 
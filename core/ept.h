@@ -32,12 +32,55 @@
 #define WRITE 0x2
 #define EXEC  0x4
 
+#define EPT_PERMS      (READ | WRITE | EXEC)
+#define EPT_TYPE       0x38	/* Memory type, bits 5:3 */
+#define EPT_LARGE_PAGE 0x80	/* PDE (PDPTE) maps a 2MB (1GB) page */
+#define EPT_ACCESSED   0x100	/* Set by the processor, if EPTP_ACCESS_DIRTY */
+#define EPT_DIRTY      0x200
+
+#define EPTP_ACCESS_DIRTY 0x40	/* Enable the accessed and dirty flags */
+
+/* IA32_VMX_EPT_VPID_CAP bits */
+#define EPT_CAP_2MB_PAGES (1 << 16)
+#define EPT_CAP_1GB_PAGES (1 << 17)
+#define EPT_CAP_ACCESS_DIRTY (1 << 21)
+
+/* Tables preallocated for splitting large pages from the VMM: one PD and a
+   few PTs for each EPT breakpoint page. Tables are given back when their
+   region is merged again */
+#define EPT_TABLE_POOL 64
+
+/* Pages preallocated for copy-on-write snapshots: the most pages the guest
+   can write before a snapshot is restored */
+#define EPT_SNAPSHOT_POOL 1024
+
+/* Tables reserved by a snapshot, to split the 2MB pages the guest writes to
+   and save only the 4KB pages written: the most 2MB regions the guest can
+   write before a snapshot is restored. Preallocated besides EPT_TABLE_POOL */
+#define EPT_SNAPSHOT_TABLES 256
+
+/* Dirty logging covers the whole identity map, and reports pages in groups
+   of EPT_DIRTY_LOG_GRANULE (the pages of a 2MB region) */
+#define EPT_DIRTY_LOG_PAGES   (HOST_GB << 18)
+#define EPT_DIRTY_LOG_GRANULE 512
+
+/* Operations of HYPERCALL_DIRTYLOG, in RBX */
+#define DIRTYLOG_STOP    0
+#define DIRTYLOG_START   1
+#define DIRTYLOG_HARVEST 2
+
+/* Operations of HYPERCALL_SNAPSHOT, in RBX */
+#define SNAPSHOT_TAKE    0
+#define SNAPSHOT_RESTORE 1
+#define SNAPSHOT_DROP    2
+
 #define MEM_TYPE_UNCACHEABLE  0
 #define MEM_TYPE_WRITECOMBINE 1
 #define MEM_TYPE_WRITETHROUGH 4
 #define MEM_TYPE_WRITEPROTECT 5
 #define MEM_TYPE_WRITEBACK    6
 
+extern hvm_address VIRT_PD_BASES[HOST_GB];
 extern hvm_address VIRT_PT_BASES[HOST_GB*512];
 
 #pragma pack (push, 1)
@@ -52,17 +95,63 @@ typedef struct
 #pragma pack (pop)
 
 extern INVEPT_DESCRIPTOR EPTInveptDesc;
+extern volatile Bit32u   EPTGeneration;
+extern hvm_bool          EPTAccessDirty; /* EPTP_ACCESS_DIRTY supported */
 
 extern hvm_address     Pml4;
 extern hvm_phy_address Phys_Pml4; 
 
 void EPTInit(void);
+hvm_status EPTBuildIdentityMap(void);
 Bit8u EPTGetMemoryType(hvm_address address);
-void EPTAlterPT(hvm_address guest_phy, Bit8u perms, hvm_bool isRemove);
+/* Fail if a large page must be split and no table is left */
+hvm_status EPTAlterPT(hvm_address guest_phy, Bit8u perms, hvm_bool isRemove);
 hvm_address EPTGetEntry(hvm_address guest_phy);
-void EPTProtectPhysicalRange(hvm_address base, Bit32u size, Bit8u permsToRemove);
+void EPTInvalidate(void);
+hvm_status EPTProtectPhysicalRange(hvm_address base, Bit32u size, Bit8u permsToRemove);
+
+/* Permission changes made between EPTBeginBatch() and EPTCommitBatch() are
+   made visible to the guest by a single INVEPT, when the outermost batch is
+   committed */
+void EPTBeginBatch(void);
+void EPTCommitBatch(void);
+hvm_status EPTAlterPhysicalRange(hvm_address guest_phy, Bit32u size, Bit8u perms, hvm_bool isRemove);
+hvm_status EPTAlterVirtualRange(hvm_address cr3, hvm_address va, Bit32u size, Bit8u perms, hvm_bool isRemove);
+
+/* Dirty-page logging. While it is active, the pages written by the guest are
+   recorded in a bitmap, one bit per 4KB page: with the EPT dirty flags when
+   the processor has them, otherwise by write-protecting each page until its
+   first write. Pages are tracked with 2MB granularity where the identity map
+   uses 2MB pages. The logging owns the write permission of all the pages
+   until it is stopped.
+
+   EPTDirtyLogHarvest() copies to bitmap, and clears, the bits of npages
+   pages starting at first_page (both multiples of EPT_DIRTY_LOG_GRANULE),
+   and write-protects those pages again. Start, stop and harvest must be
+   called while handling a VM exit */
+hvm_status EPTDirtyLogStart(void);
+void       EPTDirtyLogStop(void);
+hvm_status EPTDirtyLogHarvest(Bit8u *bitmap, Bit32u first_page, Bit32u npages);
+
+/* Copy-on-write snapshot of guest memory, for a single processor. After
+   EPTSnapshotTake() all the pages are write-protected, and the first write
+   to each one saves it to a preallocated pool. EPTSnapshotRestore() copies
+   back the pages written since the snapshot (or since the last restore),
+   and reports their number in npages. The snapshot is kept until
+   EPTSnapshotDrop(). Take fails if EPT_SNAPSHOT_TABLES tables cannot be
+   reserved. Restore fails if more than EPT_SNAPSHOT_POOL pages, or pages in
+   more than EPT_SNAPSHOT_TABLES 2MB pages, were written: the snapshot must
+   then be dropped and taken again */
+hvm_status EPTSnapshotTake(void);
+hvm_status EPTSnapshotRestore(Bit32u *npages);
+void       EPTSnapshotDrop(void);
+
+/* Called on a write EPT violation: returns TRUE if it was the first write to
+   a page write-protected by dirty logging or by a snapshot, which is
+   recorded (and saved) and made writable */
+hvm_bool   EPTHandleWrite(hvm_address guest_phy);
 
-#define EPTRemovePTperms(guest_phy, permsToRemove) EPTAlterPT(guest_phy, permsToRemove, TRUE);
-#define EPTMapPhysicalAddress(guest_phy, perms) EPTAlterPT(guest_phy, perms, FALSE);
+#define EPTRemovePTperms(guest_phy, permsToRemove) EPTAlterPT(guest_phy, permsToRemove, TRUE)
+#define EPTMapPhysicalAddress(guest_phy, perms) EPTAlterPT(guest_phy, perms, FALSE)
 
 #endif /* _EPT_H */
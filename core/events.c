@@ -35,6 +35,29 @@
 
 #define N_EVENTS 512
 
+#define N_EVENT_TYPES       EventMax
+
+#define N_IO_PORTS          65536
+#define IO_BITMAP_PORTS     0x8000	/* Ports covered by each I/O bitmap */
+#define N_EXCEPTIONS        32
+#define N_HYPERCALL_BUCKETS 64
+#define N_CONTROL_REGISTERS 16
+#define N_MSR_BUCKETS       64
+
+/* Fibonacci hashing on the hypercall number */
+#define HYPERCALL_HASH(n) ((Bit32u) ((n) * 0x9e3779b1) >> 26)
+#define MSR_HASH(n)       HYPERCALL_HASH(n)
+
+/* The 4 KB VMX MSR bitmap is made of four 1 KB bitmaps: reads of low MSRs
+   (0x0-0x1fff), reads of high MSRs (0xc0000000-0xc0001fff), then writes of
+   low and high MSRs */
+#define MSR_BITMAP_READ_LOW   0
+#define MSR_BITMAP_READ_HIGH  1024
+#define MSR_BITMAP_WRITE_LOW  2048
+#define MSR_BITMAP_WRITE_HIGH 3072
+#define MSR_BITMAP_RANGE      0x2000
+#define MSR_HIGH_BASE         0xc0000000
+
 /* ############### */
 /* #### TYPES #### */
 /* ############### */
@@ -47,6 +70,7 @@ typedef struct _EVENT {
     EVENT_CONDITION_EXCEPTION exception;
     EVENT_CONDITION_IO io;
     EVENT_CONDITION_CR cr;
+    EVENT_CONDITION_MSR msr;
     EVENT_CONDITION_NONE none;
 #ifdef ENABLE_EPT
     EVENT_CONDITION_EPT_VIOLATION ept_violation;
@@ -54,6 +78,10 @@ typedef struct _EVENT {
   } condition;
 
   EVENT_CALLBACK callback;
+
+  struct _EVENT* next_type;	/* Next subscriber of the same type (or next
+				   free slot, when type == EventNone) */
+  struct _EVENT* next_key;	/* Next subscriber with the same lookup key */
 } EVENT, *PEVENT;
 
 /* ################# */
@@ -62,12 +90,31 @@ typedef struct _EVENT {
 
 static EVENT events[N_EVENTS];
 
+/* Free slots of events[] */
+static PEVENT events_free;
+
+/* Per-type subscriber lists, kept in subscription order */
+static PEVENT events_by_type[N_EVENT_TYPES];
+static Bit32u events_count[N_EVENT_TYPES];
+
+/* Keyed lookup tables, used by EventPublish() on the VM exit path. Each entry
+   is the head of a chain of subscribers that share the same key */
+static PEVENT events_by_port[N_IO_PORTS];
+static PEVENT events_by_port_range;	/* Subscriptions to more than one port */
+static PEVENT events_by_exception[N_EXCEPTIONS];
+static PEVENT events_by_hypercall[N_HYPERCALL_BUCKETS];
+static PEVENT events_by_cr[N_CONTROL_REGISTERS][2];
+static PEVENT events_by_msr[N_MSR_BUCKETS];
+
 /* ########################## */
 /* #### LOCAL PROTOTYPES #### */
 /* ########################## */
 
 static PEVENT   EventFindInternal(HVM_EVENT_TYPE type, void* pcondition, int condition_size);
 static hvm_bool EventCheckCondition(HVM_EVENT_TYPE type, void* c1, void* c2);
+static PEVENT*  EventGetKeyChain(HVM_EVENT_TYPE type, void* pcondition);
+static hvm_bool EventPublishChain(HVM_EVENT_TYPE type, PEVENT p, hvm_bool iskeyed, PEVENT_ARGUMENTS args, void* pcondition, EVENT_PUBLISH_STATUS* ps);
+static void     EventSetBitRange(Bit8u* pbitmap, Bit32u first, Bit32u count);
 
 /* ################ */
 /* #### BODIES #### */
@@ -77,38 +124,74 @@ hvm_status EventInit(void)
 {
   int i;
 
-  for (i=0; i<sizeof(events)/sizeof(EVENT); i++)
-    events[i].type = EventNone;
+  events_free = NULL;
+  for (i=N_EVENTS-1; i>=0; i--) {
+    events[i].type      = EventNone;
+    events[i].next_key  = NULL;
+    events[i].next_type = events_free;
+    events_free = &events[i];
+  }
+
+  vmm_memset(events_by_type, 0, sizeof(events_by_type));
+  vmm_memset(events_count, 0, sizeof(events_count));
+  vmm_memset(events_by_port, 0, sizeof(events_by_port));
+  events_by_port_range = NULL;
+  vmm_memset(events_by_exception, 0, sizeof(events_by_exception));
+  vmm_memset(events_by_hypercall, 0, sizeof(events_by_hypercall));
+  vmm_memset(events_by_cr, 0, sizeof(events_by_cr));
+  vmm_memset(events_by_msr, 0, sizeof(events_by_msr));
 
   return HVM_STATUS_SUCCESS;
 }
 
 hvm_bool EventSubscribe(HVM_EVENT_TYPE type, void* pcondition, int condition_size, EVENT_CALLBACK callback)
 {
-  hvm_bool b;
-  int i;
+  PEVENT p, *pp, *pchain;
 
   if (!pcondition) return FALSE;
 
-  b = FALSE;
-  for (i=0; i<sizeof(events)/sizeof(EVENT); i++) {
-    if (events[i].type != EventNone)
-      continue;
+  if (type <= EventNone || type >= N_EVENT_TYPES) return FALSE;
 
-    events[i].type = type;
-    vmm_memcpy(&(events[i].condition), pcondition, condition_size);
-    events[i].callback = callback;
+  if (!events_free) return FALSE;
 
-    b = TRUE;
-    break;
+  p = events_free;
+  p->type = type;
+  vmm_memcpy(&(p->condition), pcondition, condition_size);
+
+  /* Check that the condition can be indexed, before taking the slot */
+  pchain = EventGetKeyChain(type, &(p->condition));
+  if (!pchain && type != EventHlt && type != EventMonitorTrap
+#ifdef ENABLE_EPT
+      && type != EventEPTViolation
+#endif
+      ) {
+    p->type = EventNone;
+    return FALSE;
   }
 
-  return b;
+  events_free  = p->next_type;
+  p->callback  = callback;
+  p->next_type = NULL;
+  p->next_key  = NULL;
+
+  /* Append to the type list and to the key chain, so that handlers are
+     invoked in subscription order */
+  for (pp=&events_by_type[type]; *pp; pp=&((*pp)->next_type));
+  *pp = p;
+
+  if (pchain) {
+    for (pp=pchain; *pp; pp=&((*pp)->next_key));
+    *pp = p;
+  }
+
+  events_count[type]++;
+
+  return TRUE;
 }
 
 hvm_bool EventUnsubscribe(HVM_EVENT_TYPE type, void* pcondition, int condition_size)
 {
-  PEVENT p;
+  PEVENT p, *pp, *pchain;
   
   if (!pcondition) return FALSE;
 
@@ -117,89 +200,208 @@ hvm_bool EventUnsubscribe(HVM_EVENT_TYPE type, void* pcondition, int condition_s
   if (!p)
     return FALSE;
 
-  p->type = EventNone;
+  /* Unlink from the key chain */
+  pchain = EventGetKeyChain(type, &(p->condition));
+  if (pchain) {
+    for (pp=pchain; *pp != p; pp=&((*pp)->next_key));
+    *pp = p->next_key;
+  }
+
+  /* Unlink from the type list */
+  for (pp=&events_by_type[type]; *pp != p; pp=&((*pp)->next_type));
+  *pp = p->next_type;
+
+  events_count[type]--;
+
+  /* Give the slot back */
+  p->type      = EventNone;
+  p->next_key  = NULL;
+  p->next_type = events_free;
+  events_free  = p;
+
   return TRUE;
 }
 
 EVENT_PUBLISH_STATUS EventPublish(HVM_EVENT_TYPE type, PEVENT_ARGUMENTS args, void* pcondition, int condition_size)
 {
-  int i;
-  hvm_bool b;
+  PEVENT p, *pchain;
+  hvm_bool iskeyed;
   EVENT_PUBLISH_STATUS s;
 
   s = EventPublishNone;
 
   if (!pcondition) return s;
 
-  for (i=0; i<sizeof(events)/sizeof(EVENT); i++) {
-    if (events[i].type != type) {
-      /* Event type mismatch */
-      continue;
-    }
+  if (type <= EventNone || type >= N_EVENT_TYPES) return s;
 
-    /* Check if event conditions match */
-    b = EventCheckCondition(type, pcondition, &(events[i].condition));
+  /* Events with a lookup key only need to walk the subscribers sharing the
+     same key; the others walk the (short) list of their type */
+  pchain  = EventGetKeyChain(type, pcondition);
+  iskeyed = (pchain != NULL);
+  p = iskeyed ? *pchain : events_by_type[type];
 
-    if (!b)
+  if (EventPublishChain(type, p, iskeyed, args, pcondition, &s))
+    return s;
+
+  /* Port range subscribers are not indexed by port */
+  if (type == EventIO)
+    EventPublishChain(type, events_by_port_range, TRUE, args, pcondition, &s);
+
+  return s;
+}
+
+/* Invoke the matching subscribers of a chain. Returns TRUE if one of them
+   handled the event */
+static hvm_bool EventPublishChain(HVM_EVENT_TYPE type, PEVENT p, hvm_bool iskeyed, PEVENT_ARGUMENTS args, void* pcondition, EVENT_PUBLISH_STATUS* ps)
+{
+  for (; p; p = iskeyed ? p->next_key : p->next_type) {
+    /* Check if event conditions match */
+    if (!EventCheckCondition(type, pcondition, &(p->condition)))
       continue;
 
     /* Found a matching event */
-    s = events[i].callback(args);
+    *ps = p->callback(args);
       
-    if (s == EventPublishHandled) {
+    if (*ps == EventPublishHandled) {
       /* No more events to process */
-      break;
+      return TRUE;
     }
   }
 
-  return s;
+  return FALSE;
 }
 
 hvm_bool EventHasType(HVM_EVENT_TYPE type)
 {
-  int i;
-  hvm_bool b;
+  if (type <= EventNone || type >= N_EVENT_TYPES) return FALSE;
 
-  b = FALSE;
-  for (i=0; i<sizeof(events)/sizeof(EVENT); i++) {
-    if (events[i].type == type) {
-      b = TRUE;
-      break;
+  return events_count[type] != 0;
+}
+
+void EventUpdateExceptionBitmap(Bit32u* pbitmap)
+{
+  Bit32u i;
+
+  for (i=0; i<N_EXCEPTIONS; i++) {
+    if (events_by_exception[i])
+      CmSetBit32(pbitmap, i);
+  }
+}
+
+/* Bitmap A covers ports 0x0000-0x7fff, bitmap B ports 0x8000-0xffff. As
+   for the exception bitmap, the caller clears the bitmaps first */
+void EventUpdateIOBitmaps(Bit8u* pIOBitmapA, Bit8u* pIOBitmapB)
+{
+  PEVENT p;
+  Bit32u first, last;
+
+  for (p=events_by_type[EventIO]; p; p=p->next_type) {
+    first = p->condition.io.portnum;
+    last  = first + (p->condition.io.portcount ? p->condition.io.portcount : 1);
+
+    if (first < IO_BITMAP_PORTS)
+      EventSetBitRange(pIOBitmapA, first, MIN(last, IO_BITMAP_PORTS) - first);
+
+    if (last > IO_BITMAP_PORTS) {
+      if (first < IO_BITMAP_PORTS)
+	first = IO_BITMAP_PORTS;
+      EventSetBitRange(pIOBitmapB, first - IO_BITMAP_PORTS, last - first);
     }
   }
+}
+
+/* Set bits first ... first+count-1 of a bitmap, a byte at a time where
+   possible */
+static void EventSetBitRange(Bit8u* pbitmap, Bit32u first, Bit32u count)
+{
+  Bit32u last;
+
+  last = first + count;
+
+  /* Leading bits, up to a byte boundary */
+  for (; first < last && (first & 7) != 0; first++)
+    pbitmap[first / 8] |= 1 << (first & 7);
+
+  /* Whole bytes */
+  if (last - first >= 8) {
+    vmm_memset(&pbitmap[first / 8], 0xff, (last - first) / 8);
+    first += (last - first) & ~7;
+  }
 
-  return b;
+  /* Trailing bits */
+  for (; first < last; first++)
+    pbitmap[first / 8] |= 1 << (first & 7);
 }
 
-void EventUpdateExceptionBitmap(Bit32u* pbitmap)
+/* The caller clears the bitmap first, so that MSRs whose subscribers are
+   gone stop exiting */
+void EventUpdateMSRBitmaps(Bit8u* pMSRBitmap)
 {
-  int i;
+  PEVENT p;
+  Bit32u msr, base;
+
+  for (p=events_by_type[EventMSR]; p; p=p->next_type) {
+    msr = p->condition.msr.msrnum;
 
-  for (i=0; i<sizeof(events)/sizeof(EVENT); i++) {
-    if (events[i].type != EventException)
+    if (msr < MSR_BITMAP_RANGE) {
+      base = 0;
+    } else if (msr - MSR_HIGH_BASE < MSR_BITMAP_RANGE) {
+      msr -= MSR_HIGH_BASE;
+      base = MSR_BITMAP_READ_HIGH;
+    } else {
+      /* Not covered by the bitmap: accesses always exit */
       continue;
+    }
+
+    if (p->condition.msr.access != EventMSRAccessWrite)
+      pMSRBitmap[MSR_BITMAP_READ_LOW + base + msr / 8] |= 1 << (msr & 7);
 
-    CmSetBit32(pbitmap, events[i].condition.exception.exceptionnum);
+    if (p->condition.msr.access != EventMSRAccessRead)
+      pMSRBitmap[MSR_BITMAP_WRITE_LOW + base + msr / 8] |= 1 << (msr & 7);
   }
 }
 
-void EventUpdateIOBitmaps(Bit8u* pIOBitmapA, Bit8u* pIOBitmapB)
+/* Returns the head of the chain that indexes events of the given type and
+   condition, or NULL if this type of event is not indexed by key (or the
+   condition is out of range) */
+static PEVENT* EventGetKeyChain(HVM_EVENT_TYPE type, void* pcondition)
 {
-  int i;
-  Bit16u port;
+  switch (type) {
+  case EventHypercall: {
+    PEVENT_CONDITION_HYPERCALL p = (PEVENT_CONDITION_HYPERCALL) pcondition;
+    return &events_by_hypercall[HYPERCALL_HASH(p->hypernum)];
+  }
 
-  for (i=0; i<sizeof(events)/sizeof(EVENT); i++) {
-    if (events[i].type != EventIO)
-      continue;
+  case EventException: {
+    PEVENT_CONDITION_EXCEPTION p = (PEVENT_CONDITION_EXCEPTION) pcondition;
+    if (p->exceptionnum >= N_EXCEPTIONS) return NULL;
+    return &events_by_exception[p->exceptionnum];
+  }
 
-    port = (Bit16u) events[i].condition.io.portnum;
+  case EventIO: {
+    PEVENT_CONDITION_IO p = (PEVENT_CONDITION_IO) pcondition;
+    if (p->portnum >= N_IO_PORTS) return NULL;
+    if (p->portcount <= 1) return &events_by_port[p->portnum];
+    if (p->portcount > N_IO_PORTS - p->portnum) return NULL;
+    return &events_by_port_range;
+  }
 
-    if (port < 0x8000) {
-      pIOBitmapA[port / 8] |= 1 << (port & 8);
-    } else {
-      pIOBitmapB[(port - 0x8000) / 8] |= 1 << ((port - 0x8000) & 8);
-    }
+  case EventControlRegister: {
+    PEVENT_CONDITION_CR p = (PEVENT_CONDITION_CR) pcondition;
+    if (p->crno >= N_CONTROL_REGISTERS) return NULL;
+    return &events_by_cr[p->crno][p->iswrite ? 1 : 0];
   }
+
+  case EventMSR: {
+    PEVENT_CONDITION_MSR p = (PEVENT_CONDITION_MSR) pcondition;
+    return &events_by_msr[MSR_HASH(p->msrnum)];
+  }
+
+  default:
+    break;
+  }
+
+  return NULL;
 }
 
 static hvm_bool EventCheckCondition(HVM_EVENT_TYPE type, void* c1, void* c2)
@@ -234,9 +436,12 @@ static hvm_bool EventCheckCondition(HVM_EVENT_TYPE type, void* c1, void* c2)
   case EventIO: {
     PEVENT_CONDITION_IO p1, p2;
 
+    /* c1 is the access being published (a single port), c2 the
+       subscription */
     p1 = (PEVENT_CONDITION_IO) c1;
     p2 = (PEVENT_CONDITION_IO) c2;
-    if ((p1->direction == p2->direction) && (p1->portnum == p2->portnum)) {
+    if ((p2->direction == EventIODirectionBoth || p1->direction == p2->direction) &&
+	(p1->portnum - p2->portnum < (p2->portcount ? p2->portcount : 1))) {
       b = TRUE;
     }
     break;
@@ -253,6 +458,20 @@ static hvm_bool EventCheckCondition(HVM_EVENT_TYPE type, void* c1, void* c2)
     break;
   }
 
+  case EventMSR: {
+    PEVENT_CONDITION_MSR p1, p2;
+
+    /* c1 is the access being published (read or write), c2 the
+       subscription, which may cover both directions */
+    p1 = (PEVENT_CONDITION_MSR) c1;
+    p2 = (PEVENT_CONDITION_MSR) c2;
+    if ((p1->msrnum == p2->msrnum) &&
+	(p2->access == EventMSRAccessBoth || p1->access == p2->access)) {
+      b = TRUE;
+    }
+    break;
+  }
+
 #ifdef ENABLE_EPT
   case EventEPTViolation: {
     PEVENT_CONDITION_EPT_VIOLATION p1, p2;
@@ -265,7 +484,8 @@ static hvm_bool EventCheckCondition(HVM_EVENT_TYPE type, void* c1, void* c2)
   }
 #endif
 
-  case EventHlt: {
+  case EventHlt:
+  case EventMonitorTrap: {
     b = TRUE;
     break;
   }
@@ -279,15 +499,13 @@ static hvm_bool EventCheckCondition(HVM_EVENT_TYPE type, void* c1, void* c2)
 
 static PEVENT EventFindInternal(HVM_EVENT_TYPE type, void* pcondition, int condition_size)
 {
-  int i;
+  PEVENT p;
 
-  for (i=0; i<sizeof(events)/sizeof(EVENT); i++)
-    {
-      if (events[i].type != type)
-	continue;
-      
-      if (!vmm_memcmp(&(events[i].condition), pcondition, condition_size))
-	return &(events[i]);
-    }
+  if (type <= EventNone || type >= N_EVENT_TYPES) return NULL;
+
+  for (p=events_by_type[type]; p; p=p->next_type) {
+    if (!vmm_memcmp(&(p->condition), pcondition, condition_size))
+      return p;
+  }
   return NULL;
 }
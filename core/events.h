@@ -58,10 +58,20 @@ typedef struct {
       hvm_bool   iswrite;
       VtRegister gpr;
     } EventCR;
+    struct {
+      Bit32u     qualification; /* #DB: DR6-like B0-B3, BD, BS bits */
+    } EventException;
+    struct {
+      Bit32u     msrnum;
+      hvm_bool   iswrite;	/* The value is in guest EDX:EAX; a handler
+				   that returns EventPublishHandled must
+				   emulate the access itself */
+    } EventMSR;
   };
 } EVENT_ARGUMENTS, *PEVENT_ARGUMENTS;
 
-/* If you add an event type, you must also modify EventCheckCondition() in events.c */
+/* If you add an event type, you must also modify EventCheckCondition() (and,
+   for keyed events, EventGetKeyChain()) in events.c */
 typedef enum {
   EventNone = 0,
   EventHypercall,
@@ -69,9 +79,12 @@ typedef enum {
   EventIO,
   EventControlRegister,
   EventHlt,
+  EventMonitorTrap,		/* Monitor trap flag, see vt_trap_mtf */
+  EventMSR,
 #ifdef ENABLE_EPT
   EventEPTViolation,
 #endif
+  EventMax,			/* Not an event: number of event types */
 } HVM_EVENT_TYPE;
 
 typedef EVENT_PUBLISH_STATUS (*EVENT_CALLBACK)(PEVENT_ARGUMENTS);
@@ -102,11 +115,30 @@ typedef enum {
   EventIODirectionOut,
 } EVENT_IO_DIRECTION;
 
+/* A subscription covers ports portnum ... portnum+portcount-1 (portcount 0
+   is the same as 1). Published events always have a single port and a
+   direction (in or out), while a subscription with EventIODirectionBoth
+   matches both */
 typedef struct _EVENT_CONDITION_IO {
   EVENT_IO_DIRECTION direction;
   Bit32u portnum;
+  Bit32u portcount;
 } EVENT_CONDITION_IO, *PEVENT_CONDITION_IO;
 
+/* RDMSR and WRMSR only exit for MSRs with a subscriber, when the MSR is
+   covered by the VMX MSR bitmaps (0x0-0x1fff and 0xc0000000-0xc0001fff).
+   Accesses to other MSRs always exit */
+typedef enum {
+  EventMSRAccessBoth = 0,
+  EventMSRAccessRead,
+  EventMSRAccessWrite,
+} EVENT_MSR_ACCESS;
+
+typedef struct _EVENT_CONDITION_MSR {
+  EVENT_MSR_ACCESS access;
+  Bit32u msrnum;
+} EVENT_CONDITION_MSR, *PEVENT_CONDITION_MSR;
+
 typedef struct _EVENT_CONDITION_CR {
   Bit8u    crno;
   hvm_bool iswrite;
@@ -122,5 +154,6 @@ EVENT_PUBLISH_STATUS EventPublish(HVM_EVENT_TYPE type, PEVENT_ARGUMENTS args, vo
 
 void EventUpdateExceptionBitmap(Bit32u* pbitmap);
 void EventUpdateIOBitmaps(Bit8u* pIOBitmapA, Bit8u* pIOBitmapB);
+void EventUpdateMSRBitmaps(Bit8u* pMSRBitmap);
 
 #endif	/* _EVENTS_H */
@@ -0,0 +1,207 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+#include "exitstats.h"
+#include "common.h"
+#include "vmmstring.h"
+
+/* ################# */
+/* #### GLOBALS #### */
+/* ################# */
+
+/* Each processor updates its own entry, so that exits handled at the same
+   time do not contend for the same cache lines */
+typedef struct __attribute__((aligned(VT_CACHE_LINE))) {
+  EXIT_STATS stats;
+} EXIT_STATS_CPU;
+
+static EXIT_STATS_CPU exit_stats_cpus[VT_MAX_CPUS];
+static EXIT_STATS     exit_stats_total;	/* Returned by ExitStatsGet() */
+
+#define exit_stats (exit_stats_cpus[VtCurrentCpu()->id].stats)
+
+/* ########################## */
+/* #### LOCAL PROTOTYPES #### */
+/* ########################## */
+
+static Bit32u ExitStatsLog2(Bit64u v);
+static void   ExitStatsAddPort(PEXIT_STATS stats, Bit16u port, Bit32u count);
+
+/* ################ */
+/* #### BODIES #### */
+/* ################ */
+
+void ExitStatsReset(void)
+{
+  vmm_memset(exit_stats_cpus, 0, sizeof(exit_stats_cpus));
+}
+
+void ExitStatsRecordExit(Bit32u reason, Bit64u cycles, Bit64u lock_cycles)
+{
+  PEXIT_REASON_STATS r;
+  Bit32u b;
+
+  /* Bits 31:16 of the exit reason are flags */
+  reason &= 0xffff;
+  if(reason >= EXIT_STATS_REASONS)
+    reason = EXIT_STATS_REASONS - 1;
+
+  b = ExitStatsLog2(cycles);
+  if(b >= EXIT_STATS_BUCKETS)
+    b = EXIT_STATS_BUCKETS - 1;
+
+  r = &exit_stats.reasons[reason];
+  r->count++;
+  r->cycles += cycles;
+  r->buckets[b]++;
+  if(cycles > r->max)
+    r->max = cycles;
+
+  exit_stats.exits++;
+  exit_stats.lock_cycles += lock_cycles;
+  if(lock_cycles > exit_stats.lock_max)
+    exit_stats.lock_max = lock_cycles;
+}
+
+void ExitStatsRecordIO(Bit16u port)
+{
+  ExitStatsAddPort(&exit_stats, port, 1);
+}
+
+void ExitStatsRecordException(Bit32u vector)
+{
+  if(vector < EXIT_STATS_VECTORS)
+    exit_stats.vectors[vector]++;
+}
+
+PEXIT_STATS ExitStatsGet(void)
+{
+  PEXIT_STATS s, t;
+  Bit32u cpu, i, j;
+
+  t = &exit_stats_total;
+  vmm_memset(t, 0, sizeof(*t));
+  t->version = EXIT_STATS_VERSION;
+  t->size    = sizeof(*t);
+
+  for(cpu = 0; cpu < VT_MAX_CPUS; cpu++) {
+    s = &exit_stats_cpus[cpu].stats;
+    if(s->exits == 0)
+      continue;
+
+    t->exits       += s->exits;
+    t->lock_cycles += s->lock_cycles;
+    if(s->lock_max > t->lock_max)
+      t->lock_max = s->lock_max;
+
+    for(i = 0; i < EXIT_STATS_REASONS; i++) {
+      t->reasons[i].count  += s->reasons[i].count;
+      t->reasons[i].cycles += s->reasons[i].cycles;
+      if(s->reasons[i].max > t->reasons[i].max)
+	t->reasons[i].max = s->reasons[i].max;
+      for(j = 0; j < EXIT_STATS_BUCKETS; j++)
+	t->reasons[i].buckets[j] += s->reasons[i].buckets[j];
+    }
+
+    for(i = 0; i < EXIT_STATS_VECTORS; i++)
+      t->vectors[i] += s->vectors[i];
+
+    for(i = 0; i < EXIT_STATS_PORTS; i++) {
+      if(s->ports[i].count != 0)
+	ExitStatsAddPort(t, s->ports[i].port, s->ports[i].count);
+    }
+    t->ports_dropped += s->ports_dropped;
+  }
+
+  return t;
+}
+
+Bit64u ExitStatsPercentile(PEXIT_REASON_STATS stats, Bit32u pct)
+{
+  Bit32u i, n, target;
+  Bit64u bound;
+
+  if(stats->count == 0)
+    return 0;
+
+  /* Number of samples that must fall at or below the percentile */
+  target = CmDiv64((Bit64u) stats->count * pct + 99, 100);
+
+  n = 0;
+  for(i = 0; i < EXIT_STATS_BUCKETS - 1; i++) {
+    n += stats->buckets[i];
+    if(n >= target)
+      break;
+  }
+
+  /* The last bucket is open-ended */
+  bound = (i == EXIT_STATS_BUCKETS - 1) ? stats->max : ((Bit64u) 1 << (i + 1)) - 1;
+
+  return bound < stats->max ? bound : stats->max;
+}
+
+/* Open addressing with linear probing: entries are never removed */
+static void ExitStatsAddPort(PEXIT_STATS stats, Bit16u port, Bit32u count)
+{
+  Bit32u i, h;
+
+  h = port & (EXIT_STATS_PORTS - 1);
+  for(i = 0; i < EXIT_STATS_PORTS; i++) {
+    PEXIT_PORT_STATS p = &stats->ports[(h + i) & (EXIT_STATS_PORTS - 1)];
+
+    if(p->count == 0) {
+      p->port = port;
+    } else if(p->port != port) {
+      continue;
+    }
+
+    p->count += count;
+    return;
+  }
+
+  stats->ports_dropped += count;
+}
+
+/* Index of the most significant bit set (0 for 0 and 1) */
+static Bit32u ExitStatsLog2(Bit64u v)
+{
+  Bit32u r, hi, lo;
+
+  hi = (Bit32u) (v >> 32);
+  lo = (Bit32u) v;
+
+  r = 0;
+  if(hi) {
+    r  = 32;
+    lo = hi;
+  }
+
+  if(lo >= 1 << 16) { r += 16; lo >>= 16; }
+  if(lo >= 1 << 8)  { r += 8;  lo >>= 8;  }
+  if(lo >= 1 << 4)  { r += 4;  lo >>= 4;  }
+  if(lo >= 1 << 2)  { r += 2;  lo >>= 2;  }
+  if(lo >= 1 << 1)  { r += 1; }
+
+  return r;
+}
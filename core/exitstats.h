@@ -0,0 +1,90 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+#ifndef _EXITSTATS_H
+#define _EXITSTATS_H
+
+#include "types.h"
+
+/* ################ */
+/* #### MACROS #### */
+/* ################ */
+
+#define EXIT_STATS_VERSION  2
+
+#define EXIT_STATS_REASONS  64	/* Basic exit reasons tracked one by one */
+#define EXIT_STATS_BUCKETS  32	/* Bucket i: handlers taking [2^i, 2^(i+1)) cycles */
+#define EXIT_STATS_VECTORS  32	/* Exception vectors */
+#define EXIT_STATS_PORTS    64	/* Distinct I/O ports tracked (power of 2) */
+
+/* #################### */
+/* #### TYPES ######### */
+/* #################### */
+
+/* Exits with the same basic reason. Cycles are measured with the TSC from
+   when the VMM lock is taken to VM entry, so they also include time spent in
+   the debugger command loop, but not the wait for the lock */
+typedef struct {
+  Bit32u count;
+  Bit64u cycles;
+  Bit64u max;
+  Bit32u buckets[EXIT_STATS_BUCKETS];
+} EXIT_REASON_STATS, *PEXIT_REASON_STATS;
+
+typedef struct {
+  Bit16u port;
+  Bit32u count;			/* 0 if the entry is free */
+} EXIT_PORT_STATS, *PEXIT_PORT_STATS;
+
+/* This is also the layout copied into guest buffers by
+   HYPERCALL_EXITSTATS */
+typedef struct {
+  Bit32u            version;	/* EXIT_STATS_VERSION */
+  Bit32u            size;	/* sizeof(EXIT_STATS) */
+  Bit64u            exits;
+  Bit64u            lock_cycles; /* Spent waiting for the VMM lock */
+  Bit64u            lock_max;
+  EXIT_REASON_STATS reasons[EXIT_STATS_REASONS];
+  Bit32u            vectors[EXIT_STATS_VECTORS];
+  EXIT_PORT_STATS   ports[EXIT_STATS_PORTS];
+  Bit32u            ports_dropped; /* I/O exits on ports not in 'ports' */
+} EXIT_STATS, *PEXIT_STATS;
+
+/* #################### */
+/* #### PROTOTYPES #### */
+/* #################### */
+
+void        ExitStatsReset(void);
+void        ExitStatsRecordExit(Bit32u reason, Bit64u cycles, Bit64u lock_cycles);
+void        ExitStatsRecordIO(Bit16u port);
+void        ExitStatsRecordException(Bit32u vector);
+
+/* Statistics are kept per processor. ExitStatsGet() sums them up, in a
+   structure that is overwritten at the next call */
+PEXIT_STATS ExitStatsGet(void);
+
+/* Upper bound of the 'pct'-th percentile of handler latency, in cycles */
+Bit64u      ExitStatsPercentile(PEXIT_REASON_STATS stats, Bit32u pct);
+
+#endif	/* _EXITSTATS_H */
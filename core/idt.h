@@ -48,6 +48,10 @@ typedef struct _IDTR {
 
 /* Defined in i386/vmx-asm.S */
 void       NullIDTHandler(void);
+void       SmpNMIHandler(void);
+
+/* Defined in i386/reg-asm.S */
+void       MsrFaultHandler(void);
 
 void       RegisterIDTHandler(Bit16u index, void (*handler) (void));
 PIDT_ENTRY GetIDTEntry(Bit8u num);
@@ -15,6 +15,10 @@
 #include <net/sock.h>
 #include <net/inet_sock.h>
 
+/* Offsets of the list of tasks inside task_struct, and of its forward link */
+#define TASK_LIST_OFFSET offsetof(struct task_struct, tasks)
+#define TASK_NEXT_OFFSET (offsetof(struct task_struct, tasks) + offsetof(struct list_head, next))
+
 /* Declaring global to have some information tracking */
 VMMLinuxStaticMemory linuxMem;
 
@@ -44,23 +48,24 @@ hvm_status LinuxGetNextProcess(hvm_address cr3, PROCESS_DATA* pprev, PROCESS_DAT
 
   if(!pprev) {
 
-    r = MmuReadVirtualRegion(cr3, (hvm_address)&init_task, &ts, sizeof(ts));
+    /* Only the link to the next task is needed here */
+    r = MmuReadVirtualRegion(cr3, (hvm_address)&init_task + TASK_NEXT_OFFSET, &ts.tasks.next, sizeof(ts.tasks.next));
     if(r != HVM_STATUS_SUCCESS) {
       return HVM_STATUS_UNSUCCESSFUL;
     }
 
-    pnext->pobj = (hvm_address)(ts.tasks.next) - ((hvm_address)&ts.tasks - (hvm_address)&ts);
+    pnext->pobj = (hvm_address)(ts.tasks.next) - TASK_LIST_OFFSET;
 
   }
   else {
     if(!pprev->pobj) return HVM_STATUS_UNSUCCESSFUL;
 
-    r = MmuReadVirtualRegion(cr3, pprev->pobj, &ts, sizeof(ts));
+    r = MmuReadVirtualRegion(cr3, pprev->pobj + TASK_NEXT_OFFSET, &ts.tasks.next, sizeof(ts.tasks.next));
     if(r != HVM_STATUS_SUCCESS) {
       return HVM_STATUS_UNSUCCESSFUL;
     }
 
-    pnext->pobj = (hvm_address)(ts.tasks.next) - ((hvm_address)&ts.tasks - (hvm_address)&ts);
+    pnext->pobj = (hvm_address)(ts.tasks.next) - TASK_LIST_OFFSET;
 
     if(pnext->pobj == (hvm_address)(&init_task))
       return HVM_STATUS_END_OF_FILE;
@@ -29,11 +29,13 @@
 #include <linux/mm.h>
 #include <linux/sched.h>
 #include <asm/io.h> // <------- virt_to_phys
+#include <linux/vmalloc.h>
 #endif
 
 #include "common.h"
 #include "debug.h"
 #include "mmu.h"
+#include "smp.h"
 #include "x86.h"
 #include "vmmstring.h"
 
@@ -56,12 +58,75 @@
 
 static void *hostpt = NULL;
 
+/* PTEs reserved by MmuInit() to map physical pages. Each slot remembers the
+   linear address it maps and the address of the PTE that maps it, so that
+   MmuMapPhysicalPage() neither has to search for an unused PTE nor to flush
+   the whole TLB */
+typedef struct {
+  hvm_address va;
+  hvm_address pte;
+  hvm_bool    busy;
+} MMU_MAP_SLOT;
+
+/* Each processor has its own slots, and its own window of
+   MMU_MAP_WINDOW_PAGES consecutive pages to map a run of physically
+   contiguous pages with a single copy. The last set is used outside root
+   mode, i.e., while the VMM is being initialized */
+typedef struct __attribute__((aligned(VT_CACHE_LINE))) {
+  MMU_MAP_SLOT slots[MMU_MAP_SLOTS];
+  hvm_address  window_va;
+  hvm_address  window_pte[MMU_MAP_WINDOW_PAGES]; /* Not always in the same page table */
+  hvm_bool     window_busy;
+} MMU_MAP_SET, *PMMU_MAP_SET;
+
+#define MMU_MAP_SET_PAGES (MMU_MAP_SLOTS + MMU_MAP_WINDOW_PAGES)
+#define MMU_MAP_GUEST_SET VT_MAX_CPUS
+
+static MMU_MAP_SET  mapsets[VT_MAX_CPUS + 1];
+static hvm_bool     mapsets_ready = FALSE;
+static void*        maparea = NULL;	/* Linear addresses of all the sets */
+
+static MMU_STATS    mmustats;
+
+/* Software cache of guest translations, keyed by (cr3, page). Large pages are
+   cached with their large-page aligned address as the tag. The cache is only
+   used while the guest is not running (i.e., while a VM exit is being
+   handled), and it is flushed as soon as the guest is resumed or changes its
+   paging structures */
+#define MMU_GTLB_SETS 64
+#define MMU_GTLB_WAYS 4
+
+#define MMU_GTLB_SET(cr3, tag) ((((tag) >> 12) ^ ((cr3) >> 12)) & (MMU_GTLB_SETS - 1))
+
+typedef struct {
+  Bit32u      generation;	/* Entry is valid iff equal to gtlb_generation */
+  hvm_address cr3;
+  hvm_address tag;
+  hvm_bool    isLarge;
+  PTE         pte;
+} MMU_GTLB_ENTRY, *PMMU_GTLB_ENTRY;
+
+static MMU_GTLB_ENTRY gtlb[MMU_GTLB_SETS][MMU_GTLB_WAYS];
+static Bit8u          gtlb_victim[MMU_GTLB_SETS];
+static Bit32u         gtlb_generation = 1;
+static hvm_bool       gtlb_enabled = FALSE;
+
 /* ########################## */
 /* #### LOCAL PROTOTYPES #### */
 /* ########################## */
 
-static hvm_status MmuFindUnusedPTE(hvm_address* pdwLogical);
+static hvm_status MmuFindUnusedPTE(hvm_address* pdwLogical, Bit32u n);
+static hvm_address MmuGetPTEAddress(hvm_address va);
+static hvm_status MmuReserveMapSlots(void);
+static void       MmuReleaseMapSlots(void);
+static PMMU_MAP_SET MmuCurrentMapSet(void);
+static void       MmuSetMappingPTE(PPTE pentry, hvm_phy_address phy);
+static hvm_status MmuReadWritePhysicalRun(hvm_phy_address phy, Bit8u* buffer, Bit32u size, hvm_bool isWrite);
 static hvm_status MmuGetPageEntry(hvm_address cr3, hvm_address va, PPTE ppte, hvm_bool* pisLargePage);
+static hvm_status MmuWalkPageEntry(hvm_address cr3, hvm_address va, PPTE ppte, hvm_bool* pisLargePage);
+static hvm_status MmuReadPDE(hvm_address cr3, hvm_address va, PPTE ppde);
+static PMMU_GTLB_ENTRY MmuGuestTLBLookup(hvm_address cr3, hvm_address tag, hvm_bool isLarge);
+static void       MmuGuestTLBInsert(hvm_address cr3, hvm_address tag, hvm_bool isLarge, PTE pte);
 static hvm_bool   MmuGetCr0WP(void);
 
 #if 0
@@ -82,6 +147,32 @@ hvm_address MmuGetHostPT(void)
   return (hvm_address)hostpt;
 }
 
+void MmuGetStats(PMMU_STATS pstats)
+{
+  *pstats = mmustats;
+}
+
+/* Enable the guest translation cache when entering the VMM, disable (and
+   flush) it when the guest is resumed */
+void MmuGuestTLBSetEnabled(hvm_bool enabled)
+{
+  if (!enabled)
+    MmuGuestTLBFlush();
+
+  gtlb_enabled = enabled;
+}
+
+void MmuGuestTLBFlush(void)
+{
+  gtlb_generation++;
+
+  /* Generation 0 marks never-used entries: skip it on wrap-around */
+  if (gtlb_generation == 0) {
+    vmm_memset(gtlb, 0, sizeof(gtlb));
+    gtlb_generation = 1;
+  }
+}
+
 hvm_status MmuInit(hvm_address *pcr3)
 {
   hvm_status r;
@@ -91,6 +182,15 @@ hvm_status MmuInit(hvm_address *pcr3)
     
   cr3 = RegGetCr3();
 
+  /* Reserve the mapping slots first, so that the physical accesses below
+     already use them */
+  r = MmuReserveMapSlots();
+
+  if (!HVM_SUCCESS(r)) {
+    GuestLog("[mmu-init] Failed to reserve PTEs for physical mappings");
+    return HVM_STATUS_UNSUCCESSFUL;
+  }
+
 #ifdef GUEST_WINDOWS
   hostpt = ExAllocatePoolWithTag(NonPagedPool, MMU_PAGE_SIZE, 'gbdh');
 #elif defined GUEST_LINUX
@@ -99,7 +199,7 @@ hvm_status MmuInit(hvm_address *pcr3)
   
   if (!hostpt) {
     GuestLog("[mmu-init] Failed to allocate non-paged pool for page table");
-    return HVM_STATUS_UNSUCCESSFUL;
+    goto error;
   }
   
   r = MmuGetPhysicalAddress(cr3, (hvm_address) hostpt, &phy);
@@ -148,6 +248,7 @@ hvm_status MmuInit(hvm_address *pcr3)
 
     hostpt = NULL;
   }
+  MmuReleaseMapSlots();
   return HVM_STATUS_UNSUCCESSFUL;
 }
 
@@ -163,6 +264,8 @@ hvm_status MmuFini(void)
 #endif
     hostpt = NULL;
   }
+
+  MmuReleaseMapSlots();
   
   return HVM_STATUS_SUCCESS;
 }
@@ -225,29 +328,95 @@ hvm_status MmuGetPhysicalAddress(hvm_address cr3, hvm_address va, hvm_phy_addres
   return HVM_STATUS_SUCCESS;
 }
 
+/* Translate all the pages of a virtual range. The page directory entry is
+   read once for each page table (or large page), and its PTEs are read
+   MMU_WALK_CHUNK at a time. Pages that are not present are skipped */
+hvm_status MmuWalkVirtualRange(hvm_address cr3, hvm_address va, Bit32u size, MMU_PAGE_CALLBACK callback, void* arg)
+{
+  hvm_status r;
+  hvm_phy_address addr;
+  PTE pde, ptes[MMU_WALK_CHUNK];
+  Bit32u npages, n, i, done, chunk;
+
+  if (size == 0)
+    return HVM_STATUS_SUCCESS;
+
+  npages = ((MMU_PAGE_ALIGN(va + size - 1) - MMU_PAGE_ALIGN(va)) / MMU_PAGE_SIZE) + 1;
+  va = MMU_PAGE_ALIGN(va);
+
+  while (npages > 0) {
+    /* Pages up to the end of this page table (or large page) */
+    n = (LARGEPAGE_ALIGN(va) + LARGEPAGE_SIZE - va) / MMU_PAGE_SIZE;
+    if (n == 0 || n > npages)
+      n = npages;
+
+    r = MmuReadPDE(CR3_ALIGN(cr3), va, &pde);
+
+    if (r == HVM_STATUS_SUCCESS && pde.LargePage) {
+      for (i = 0; i < n; i++)
+	callback(va + i*MMU_PAGE_SIZE, LARGEFRAME_TO_PHY(pde.PageBaseAddr) + LARGEPAGE_OFFSET(va + i*MMU_PAGE_SIZE), arg);
+    } else if (r == HVM_STATUS_SUCCESS) {
+      for (done = 0; done < n; done += chunk) {
+	chunk = MIN(n - done, MMU_WALK_CHUNK);
+	addr = FRAME_TO_PHY(pde.PageBaseAddr) + (VA_TO_PTE(va + done*MMU_PAGE_SIZE)*sizeof(PTE));
+	r = MmuReadPhysicalRegion(addr, ptes, chunk*sizeof(PTE));
+	if (r != HVM_STATUS_SUCCESS)
+	  return HVM_STATUS_UNSUCCESSFUL;
+
+	for (i = 0; i < chunk; i++) {
+	  if (ptes[i].Present)
+	    callback(va + (done + i)*MMU_PAGE_SIZE, FRAME_TO_PHY(ptes[i].PageBaseAddr), arg);
+	}
+      }
+    }
+
+    va     += n*MMU_PAGE_SIZE;
+    npages -= n;
+  }
+
+  return HVM_STATUS_SUCCESS;
+}
+
 hvm_status MmuMapPhysicalPage(hvm_phy_address phy, hvm_address* pva, PPTE pentryOriginal)
 {
   hvm_status r;
   hvm_address dwEntryAddress, dwLogicalAddress;
   PTE *pentry;
-  
-  /* Get unused PTE address in the current process */
-  MmuPrint("[MMU] MmuMapPhysicalPage() Searching for unused PTE...\n");
-  r = MmuFindUnusedPTE(&dwLogicalAddress);
-  MmuPrint("[MMU] MmuMapPhysicalPage() Unused PTE found at %.8x\n", dwLogicalAddress);
+  PMMU_MAP_SET set;
+  Bit32u i;
+  hvm_bool isSlot;
+
+  isSlot = FALSE;
+  dwEntryAddress = 0;
+  dwLogicalAddress = 0;
+
+  /* Use one of the reserved PTEs, if available */
+  set = MmuCurrentMapSet();
+  if (set) {
+    for (i=0; i<MMU_MAP_SLOTS; i++) {
+      if (set->slots[i].busy)
+	continue;
+
+      set->slots[i].busy = TRUE;
+      dwLogicalAddress = set->slots[i].va;
+      dwEntryAddress   = set->slots[i].pte;
+      isSlot = TRUE;
+      break;
+    }
+  }
 
-  if (r != HVM_STATUS_SUCCESS)
-    return HVM_STATUS_UNSUCCESSFUL;
-  
-#ifdef GUEST_WINDOWS
-  dwEntryAddress = VIRTUAL_PT_BASE + ((( VA_TO_PDE(dwLogicalAddress) ) << 12) |  (VA_TO_PTE(dwLogicalAddress) * sizeof(PTE)));
-  //  dwEntryAddress = VIRTUAL_PT_BASE + (VA_TO_PTE(dwLogicalAddress) * sizeof(PTE));
-#elif defined GUEST_LINUX 
-  /* DIRTY HACK: we call this again to avoid refactoring of FindUnusedPTE */
-  MmuPrint("dwLogicalAddress: %08x", dwLogicalAddress);
-  MmuVirtToPTE(dwLogicalAddress, &dwEntryAddress);
-  MmuPrint("PTE@%08x", dwEntryAddress);
-#endif
+  if (!isSlot) {
+    /* Get unused PTE address in the current process */
+    MmuPrint("[MMU] MmuMapPhysicalPage() Searching for unused PTE...\n");
+    r = MmuFindUnusedPTE(&dwLogicalAddress, 1);
+    MmuPrint("[MMU] MmuMapPhysicalPage() Unused PTE found at %.8x\n", dwLogicalAddress);
+
+    if (r != HVM_STATUS_SUCCESS)
+      return HVM_STATUS_UNSUCCESSFUL;
+
+    dwEntryAddress = MmuGetPTEAddress(dwLogicalAddress);
+    MmuPrint("PTE@%08x", dwEntryAddress);
+  }
 
   pentry = (PPTE) dwEntryAddress;
 
@@ -255,21 +424,13 @@ hvm_status MmuMapPhysicalPage(hvm_phy_address phy, hvm_address* pva, PPTE pentry
   *pentryOriginal = *pentry;
 
   /* Replace PT entry */
-  pentry->Present         = 1;
-  pentry->Writable        = 1;
-  pentry->Owner           = 1;
-  pentry->WriteThrough    = 0;
-  pentry->CacheDisable    = 0;
-  pentry->Accessed        = 0;
-  pentry->Dirty           = 0;
-  pentry->LargePage       = 0;
-  pentry->Global          = 0;
-  pentry->ForUse1         = 0;
-  pentry->ForUse2         = 0;
-  pentry->ForUse3         = 0;
-  pentry->PageBaseAddr    = PHY_TO_FRAME(phy);
+  MmuSetMappingPTE(pentry, phy);
 
-  hvm_x86_ops.mmu_tlb_flush();
+  /* Only this PTE has changed */
+  hvm_x86_ops.mmu_tlb_flush_page(dwLogicalAddress);
+  mmustats.tlb_page_flushes++;
+
+  mmustats.maps++;
 
   *pva = dwLogicalAddress;
 
@@ -279,18 +440,34 @@ hvm_status MmuMapPhysicalPage(hvm_phy_address phy, hvm_address* pva, PPTE pentry
 hvm_status MmuUnmapPhysicalPage(hvm_address va, PTE entryOriginal)
 {
   PPTE pentry;
+  PMMU_MAP_SET set;
+  Bit32u i;
+
+  va = MMU_PAGE_ALIGN(va);
 
   /* Restore original PTE */
-#ifdef GUEST_WINDOWS
-  pentry = (PPTE) (VIRTUAL_PT_BASE + (((VA_TO_PDE(va) ) << 12 ) |  (VA_TO_PTE(va) * sizeof(PTE))));
-  // pentry = (PPTE) (VIRTUAL_PT_BASE + (VA_TO_PTE(va) * sizeof(PTE)));
-#elif defined GUEST_LINUX
-  MmuVirtToPTE(va, (hvm_address*) &pentry);
-#endif
+  set = MmuCurrentMapSet();
+  if (set) {
+    for (i=0; i<MMU_MAP_SLOTS; i++) {
+      if (!set->slots[i].busy || set->slots[i].va != va)
+	continue;
+
+      pentry = (PPTE) set->slots[i].pte;
+      *pentry = entryOriginal;
+      hvm_x86_ops.mmu_tlb_flush_page(va);
+      mmustats.tlb_page_flushes++;
+
+      set->slots[i].busy = FALSE;
+      return HVM_STATUS_SUCCESS;
+    }
+  }
+
+  pentry = (PPTE) MmuGetPTEAddress(va);
 
   *pentry = entryOriginal;
 
-  hvm_x86_ops.mmu_tlb_flush();
+  hvm_x86_ops.mmu_tlb_flush_page(va);
+  mmustats.tlb_page_flushes++;
   
   return HVM_STATUS_SUCCESS;
 }
@@ -330,38 +507,159 @@ hvm_status MmuReadWritePhysicalRegion(hvm_phy_address phy, void* buffer, Bit32u
   return HVM_STATUS_SUCCESS;
 }
 
-hvm_status MmuReadWriteVirtualRegion(hvm_address cr3, hvm_address va, void* buffer, 
-				     Bit32u size, hvm_bool isWrite)
+/* Write a PTE that maps physical address 'phy' (read/write, supervisor) */
+static void MmuSetMappingPTE(PPTE pentry, hvm_phy_address phy)
+{
+  pentry->Present         = 1;
+  pentry->Writable        = 1;
+  pentry->Owner           = 1;
+  pentry->WriteThrough    = 0;
+  pentry->CacheDisable    = 0;
+  pentry->Accessed        = 0;
+  pentry->Dirty           = 0;
+  pentry->LargePage       = 0;
+  pentry->Global          = 0;
+  pentry->ForUse1         = 0;
+  pentry->ForUse2         = 0;
+  pentry->ForUse3         = 0;
+  pentry->PageBaseAddr    = PHY_TO_FRAME(phy);
+}
+
+/* Read or write 'size' bytes of physically contiguous memory starting at
+   'phy'. The whole run is mapped through the window of the current processor
+   and copied at once; if the window is not available, fall back to
+   page-sized copies */
+static hvm_status MmuReadWritePhysicalRun(hvm_phy_address phy, Bit8u* buffer, Bit32u size, hvm_bool isWrite)
 {
   hvm_status r;
-  hvm_phy_address phy;
-  Bit32u i, n;
+  PTE original[MMU_MAP_WINDOW_PAGES];
+  PPTE pentry;
+  PMMU_MAP_SET set;
+  hvm_address va;
+  Bit32u i, n, npages;
+
+  npages = (MMU_PAGE_OFFSET(phy) + size + MMU_PAGE_SIZE - 1) / MMU_PAGE_SIZE;
+  set    = MmuCurrentMapSet();
+
+  if (npages == 1 || npages > MMU_MAP_WINDOW_PAGES || !set || set->window_busy) {
+    while (size > 0) {
+      n = MIN(size, MMU_PAGE_SIZE - MMU_PAGE_OFFSET(phy));
+      r = MmuReadWritePhysicalRegion(phy, buffer, n, isWrite);
+      if (r != HVM_STATUS_SUCCESS)
+	return HVM_STATUS_UNSUCCESSFUL;
+
+      phy += n;
+      buffer += n;
+      size -= n;
+    }
+    return HVM_STATUS_SUCCESS;
+  }
 
-  i = 0;
+  set->window_busy = TRUE;
 
-  MmuPrint("[MMU] MmuReadWriteVirtualRegion() cr3: %.8x va: %.8x size: %.8x isWrite? %d\n", CR3_ALIGN(cr3), va, size, isWrite);
+  for (i=0; i<npages; i++) {
+    pentry = (PPTE) set->window_pte[i];
+    original[i] = *pentry;
+    MmuSetMappingPTE(pentry, FRAME_TO_PHY(PHY_TO_FRAME(phy) + i));
+    hvm_x86_ops.mmu_tlb_flush_page(set->window_va + i*MMU_PAGE_SIZE);
+  }
 
-  while (va+i < va+size) {
-    n = MIN(size-i, MMU_PAGE_SIZE - MMU_PAGE_OFFSET(va+i));
-    r = MmuGetPhysicalAddress(CR3_ALIGN(cr3), va+i, &phy);
-    if (r != HVM_STATUS_SUCCESS)
-      return HVM_STATUS_UNSUCCESSFUL;
+  va = set->window_va + MMU_PAGE_OFFSET(phy);
 
-    MmuPrint("[MMU] MmuReadWriteVirtualRegion() Reading phy %.8x (write? %d)\n", phy, isWrite);
+  if (!isWrite)
+    vmm_memcpy(buffer, (Bit8u*) va, size);
+  else
+    vmm_memcpy((Bit8u*) va, buffer, size);
 
-    r = MmuReadWritePhysicalRegion(phy, (void*) ((hvm_address)buffer+i), n, isWrite);
-    
-    MmuPrint("[MMU] MmuReadWriteVirtualRegion() Read! Success? %d\n", (r == HVM_STATUS_SUCCESS));
+  for (i=0; i<npages; i++) {
+    *(PPTE) set->window_pte[i] = original[i];
+    hvm_x86_ops.mmu_tlb_flush_page(set->window_va + i*MMU_PAGE_SIZE);
+  }
+
+  set->window_busy = FALSE;
+
+  mmustats.maps             += npages;
+  mmustats.tlb_page_flushes += 2*npages;
+  mmustats.runs++;
+  mmustats.run_pages        += npages;
+
+  return HVM_STATUS_SUCCESS;
+}
 
+hvm_status MmuReadWriteVirtualRegion(hvm_address cr3, hvm_address va, void* buffer, 
+				     Bit32u size, hvm_bool isWrite)
+{
+  MMU_IOVEC iov;
+
+  iov.va     = va;
+  iov.buffer = buffer;
+  iov.size   = size;
+
+  return MmuReadWriteVirtualVector(cr3, &iov, 1, isWrite);
+}
+
+/* Read or write a list of virtual memory regions. Pages are translated one
+   after the other, and chunks that are contiguous both in physical memory and
+   in the local buffers (e.g., consecutive pages inside a large page, or
+   adjacent fields read into the same structure) are merged into a single run,
+   which is then mapped and copied at once */
+hvm_status MmuReadWriteVirtualVector(hvm_address cr3, PMMU_IOVEC iov, Bit32u n, hvm_bool isWrite)
+{
+  hvm_status r;
+  hvm_phy_address phy, runphy;
+  hvm_address va;
+  Bit8u *buffer, *runbuffer;
+  Bit32u i, size, chunk, runsize;
+
+  runphy    = 0;
+  runbuffer = NULL;
+  runsize   = 0;
+
+  for (i=0; i<n; i++) {
+    va     = iov[i].va;
+    buffer = (Bit8u*) iov[i].buffer;
+    size   = iov[i].size;
+
+    MmuPrint("[MMU] MmuReadWriteVirtualVector() cr3: %.8x va: %.8x size: %.8x isWrite? %d\n", CR3_ALIGN(cr3), va, size, isWrite);
+
+    while (size > 0) {
+      chunk = MIN(size, MMU_PAGE_SIZE - MMU_PAGE_OFFSET(va));
+
+      r = MmuGetPhysicalAddress(CR3_ALIGN(cr3), va, &phy);
+      if (r != HVM_STATUS_SUCCESS)
+	return HVM_STATUS_UNSUCCESSFUL;
+
+      /* Flush the current run, unless this chunk extends it */
+      if (runsize > 0 && 
+	  (phy != runphy + runsize || buffer != runbuffer + runsize || 
+	   MMU_PAGE_OFFSET(runphy) + runsize + chunk > MMU_MAP_WINDOW_PAGES*MMU_PAGE_SIZE)) {
+	r = MmuReadWritePhysicalRun(runphy, runbuffer, runsize, isWrite);
+	if (r != HVM_STATUS_SUCCESS)
+	  return HVM_STATUS_UNSUCCESSFUL;
+	runsize = 0;
+      }
+
+      if (runsize == 0) {
+	runphy    = phy;
+	runbuffer = buffer;
+      }
+
+      runsize += chunk;
+      va      += chunk;
+      buffer  += chunk;
+      size    -= chunk;
+    }
+  }
+
+  if (runsize > 0) {
+    r = MmuReadWritePhysicalRun(runphy, runbuffer, runsize, isWrite);
     if (r != HVM_STATUS_SUCCESS)
       return HVM_STATUS_UNSUCCESSFUL;
-
-    i += n;
   }
 
-  MmuPrint("[MMU] MmuReadWriteVirtualRegion() done!\n");
+  MmuPrint("[MMU] MmuReadWriteVirtualVector() done!\n");
 
-  return HVM_STATUS_SUCCESS;;
+  return HVM_STATUS_SUCCESS;
 }
 
 /* 
@@ -372,17 +670,101 @@ hvm_status MmuReadWriteVirtualRegion(hvm_address cr3, hvm_address va, void* buff
 static hvm_status MmuGetPageEntry (hvm_address cr3, hvm_address va, PPTE ppte, hvm_bool* pisLargePage)
 {
   hvm_status r;
-  hvm_phy_address addr;
+  PMMU_GTLB_ENTRY e;
   PTE p;
 
-  MmuPrint("[MMU] MmuGetPageEntry() cr3: %.8x va: %.8x\n", CR3_ALIGN(cr3), va);
+  if (gtlb_enabled) {
+    e = MmuGuestTLBLookup(cr3, MMU_PAGE_ALIGN(va), FALSE);
+
+    if (!e) {
+      e = MmuGuestTLBLookup(cr3, LARGEPAGE_ALIGN(va), TRUE);
+      if (e) mmustats.gtlb_large_hits++;
+    }
+
+    if (e) {
+      mmustats.gtlb_hits++;
+      if (ppte) *ppte = e->pte;
+      *pisLargePage = e->isLarge;
+      return HVM_STATUS_SUCCESS;
+    }
+
+    mmustats.gtlb_misses++;
+  }
+
+  r = MmuWalkPageEntry(cr3, va, &p, pisLargePage);
+
+  if (r != HVM_STATUS_SUCCESS)
+    return r;
+
+  if (gtlb_enabled) {
+    MmuGuestTLBInsert(cr3, *pisLargePage ? LARGEPAGE_ALIGN(va) : MMU_PAGE_ALIGN(va), *pisLargePage, p);
+  }
+
+  if (ppte) *ppte = p;
+
+  return HVM_STATUS_SUCCESS;
+}
+
+static PMMU_GTLB_ENTRY MmuGuestTLBLookup(hvm_address cr3, hvm_address tag, hvm_bool isLarge)
+{
+  PMMU_GTLB_ENTRY set;
+  Bit32u i;
+
+  set = gtlb[MMU_GTLB_SET(cr3, tag)];
+
+  for (i=0; i<MMU_GTLB_WAYS; i++) {
+    if (set[i].generation == gtlb_generation && set[i].tag == tag && 
+	set[i].cr3 == cr3 && set[i].isLarge == isLarge)
+      return &set[i];
+  }
+
+  return NULL;
+}
+
+static void MmuGuestTLBInsert(hvm_address cr3, hvm_address tag, hvm_bool isLarge, PTE pte)
+{
+  PMMU_GTLB_ENTRY set, e;
+  Bit32u i, n;
+
+  n = MMU_GTLB_SET(cr3, tag);
+  set = gtlb[n];
+
+  /* Prefer an invalid way, otherwise evict in round-robin order */
+  e = NULL;
+  for (i=0; i<MMU_GTLB_WAYS; i++) {
+    if (set[i].generation != gtlb_generation) {
+      e = &set[i];
+      break;
+    }
+  }
+
+  if (!e) {
+    e = &set[gtlb_victim[n]];
+    gtlb_victim[n] = (gtlb_victim[n] + 1) % MMU_GTLB_WAYS;
+  }
+
+  e->generation = gtlb_generation;
+  e->cr3        = cr3;
+  e->tag        = tag;
+  e->isLarge    = isLarge;
+  e->pte        = pte;
+}
+
+/* Walk the guest page tables. Same interface as MmuGetPageEntry(), but this
+   one never uses the translation cache */
+/* Read the page directory entry for va. Fails if it is not present */
+static hvm_status MmuReadPDE(hvm_address cr3, hvm_address va, PPTE ppde)
+{
+  hvm_status r;
+  hvm_phy_address addr;
+  PTE p;
 
 #ifdef ENABLE_PAE
   /* Read PDPTE */
   addr = CR3_ALIGN(cr3) + (VA_TO_PDPTE(va)*sizeof(PTE));
   r = MmuReadPhysicalRegion(addr, &p, sizeof(PTE));
   if (r != HVM_STATUS_SUCCESS) {
-    MmuPrint("[MMU] MmuGetPageEntry() cannot read PDPTE from %.8x\n", addr);
+    MmuPrint("[MMU] MmuWalkPageEntry() cannot read PDPTE from %.8x\n", addr);
     return HVM_STATUS_UNSUCCESSFUL;
   }
 
@@ -396,18 +778,35 @@ static hvm_status MmuGetPageEntry (hvm_address cr3, hvm_address va, PPTE ppte, h
   addr = CR3_ALIGN(cr3) + (VA_TO_PDE(va)*sizeof(PTE));
 #endif
   
-  MmuPrint("[MMU] MmuGetPageEntry() Reading phy %.8x%.8x (NOT large)\n", GET32H(addr), GET32L(addr));
+  MmuPrint("[MMU] MmuWalkPageEntry() Reading phy %.8x%.8x (NOT large)\n", GET32H(addr), GET32L(addr));
   r = MmuReadPhysicalRegion(addr, &p, sizeof(PTE));
   
   if (r != HVM_STATUS_SUCCESS) {
-    MmuPrint("[MMU] MmuGetPageEntry() cannot read PDE from %.8x\n", addr);
+    MmuPrint("[MMU] MmuWalkPageEntry() cannot read PDE from %.8x\n", addr);
     return HVM_STATUS_UNSUCCESSFUL;
   }
   
-  MmuPrint("[MMU] MmuGetPageEntry() PDE read. Present? %d Large? %d\n", p.Present, p.LargePage);
+  MmuPrint("[MMU] MmuWalkPageEntry() PDE read. Present? %d Large? %d\n", p.Present, p.LargePage);
 
   if (!p.Present)
     return HVM_STATUS_UNSUCCESSFUL;
+
+  *ppde = p;
+
+  return HVM_STATUS_SUCCESS;
+}
+
+static hvm_status MmuWalkPageEntry (hvm_address cr3, hvm_address va, PPTE ppte, hvm_bool* pisLargePage)
+{
+  hvm_status r;
+  hvm_phy_address addr;
+  PTE p;
+
+  MmuPrint("[MMU] MmuWalkPageEntry() cr3: %.8x va: %.8x\n", CR3_ALIGN(cr3), va);
+
+  r = MmuReadPDE(cr3, va, &p);
+  if (r != HVM_STATUS_SUCCESS)
+    return r;
   
   /* If it's present and it's a 4MB page, then this is a hit */
   if(p.LargePage) {
@@ -421,11 +820,11 @@ static hvm_status MmuGetPageEntry (hvm_address cr3, hvm_address va, PPTE ppte, h
   r = MmuReadPhysicalRegion(addr, &p, sizeof(PTE));
 
   if (r != HVM_STATUS_SUCCESS) {
-    MmuPrint("[MMU] MmuGetPageEntry() cannot read PTE from %.8x\n", addr);
+    MmuPrint("[MMU] MmuWalkPageEntry() cannot read PTE from %.8x\n", addr);
     return HVM_STATUS_UNSUCCESSFUL;
   }
 
-  MmuPrint("[MMU] MmuGetPageEntry() PTE read. Present? %d\n", p.Present);
+  MmuPrint("[MMU] MmuWalkPageEntry() PTE read. Present? %d\n", p.Present);
 
   if (!p.Present)
     return HVM_STATUS_UNSUCCESSFUL;
@@ -454,22 +853,41 @@ void MmuVirtToPTE(hvm_address addr, hvm_address *pPTEAddr)
 
 #endif
 
-static hvm_status MmuFindUnusedPTE(hvm_address* pdwLogical)
+/* Find 'n' consecutive unused PTEs, all in the same page table, and return
+   the linear address mapped by the first one */
+static hvm_status MmuFindUnusedPTE(hvm_address* pdwLogical, Bit32u n)
 {
   hvm_address dwCurrentAddress, dwPTEAddr;
+  Bit32u run;
   
 #ifdef GUEST_LINUX
   Bit32u dwPTE;
 
+  run = 0;
+
   for (dwCurrentAddress=PAGE_OFFSET; dwCurrentAddress < 0xfffff000; dwCurrentAddress += MMU_PAGE_SIZE) {
+    mmustats.search_iterations++;
+
+    /* Runs cannot cross page tables */
+    if (VA_TO_PTE(dwCurrentAddress) == 0)
+      run = 0;
+
     MmuVirtToPTE(dwCurrentAddress, &dwPTEAddr);
-    if (dwPTEAddr == 0)
+    if (dwPTEAddr == 0) {
+      run = 0;
       continue;
+    }
 
     dwPTE = READ_PTE(dwPTEAddr);
-    if (PDE_TO_VALID(dwPTE))
+    if (PDE_TO_VALID(dwPTE)) {
+      run = 0;
       continue;    
-    *pdwLogical= dwCurrentAddress;
+    }
+
+    if (++run < n)
+      continue;
+
+    *pdwLogical= dwCurrentAddress - (n-1)*MMU_PAGE_SIZE;
     return HVM_STATUS_SUCCESS;
   }
   return HVM_STATUS_UNSUCCESSFUL;
@@ -477,7 +895,10 @@ static hvm_status MmuFindUnusedPTE(hvm_address* pdwLogical)
 #elif defined GUEST_WINDOWS
   hvm_address dwPDEAddr;
   
+  run = 0;
+
   for (dwCurrentAddress=MMU_PAGE_SIZE; dwCurrentAddress < 0x80000000; dwCurrentAddress += MMU_PAGE_SIZE) {
+    mmustats.search_iterations++;
     /* Check if memory page at logical address 'dwCurrentAddress' is free */
 #ifdef ENABLE_PAE
     Bit64u dwPDE, dwPTE;
@@ -488,9 +909,15 @@ static hvm_status MmuFindUnusedPTE(hvm_address* pdwLogical)
     dwPDEAddr = VIRTUAL_PD_BASE + (VA_TO_PDE(dwCurrentAddress) * sizeof(PTE));
 #endif
     
+    /* Runs cannot cross page tables */
+    if (VA_TO_PTE(dwCurrentAddress) == 0)
+      run = 0;
+
     dwPDE = READ_PTE(dwPDEAddr);
-    if (!PDE_TO_VALID(dwPDE))
+    if (!PDE_TO_VALID(dwPDE)) {
+      run = 0;
       continue;
+    }
     
     //    dwPTEAddr = VIRTUAL_PT_BASE + (VA_TO_PTE(dwCurrentAddress) * sizeof(PTE));
     dwPTEAddr = (VIRTUAL_PT_BASE + ((( VA_TO_PDE(dwCurrentAddress) ) << 12 ) | (VA_TO_PTE(dwCurrentAddress) * sizeof(PTE))));
@@ -498,11 +925,15 @@ static hvm_status MmuFindUnusedPTE(hvm_address* pdwLogical)
 
     if (PDE_TO_VALID(dwPTE)) {
       /* Skip *valid* PTEs */
+      run = 0;
       continue;
     }
+
+    if (++run < n)
+      continue;
     
     /* All done!*/
-    *pdwLogical = dwCurrentAddress;
+    *pdwLogical = dwCurrentAddress - (n-1)*MMU_PAGE_SIZE;
     return HVM_STATUS_SUCCESS;
   }
 
@@ -511,6 +942,109 @@ static hvm_status MmuFindUnusedPTE(hvm_address* pdwLogical)
 
 }
 
+/* Get the linear address of the PTE that maps 'va' */
+static hvm_address MmuGetPTEAddress(hvm_address va)
+{
+  hvm_address dwEntryAddress;
+
+#ifdef GUEST_WINDOWS
+  dwEntryAddress = VIRTUAL_PT_BASE + ((( VA_TO_PDE(va) ) << 12) |  (VA_TO_PTE(va) * sizeof(PTE)));
+#elif defined GUEST_LINUX 
+  MmuVirtToPTE(va, &dwEntryAddress);
+#endif
+
+  return dwEntryAddress;
+}
+
+/* Reserve the linear addresses of the mapping slots and windows, for each
+   processor and for the guest set. They are taken from memory owned by the
+   VMM, which the guest never reuses: vmalloc() pages on Linux (their PTEs are
+   patched and then restored), system PTEs on Windows */
+static hvm_status MmuReserveMapSlots(void)
+{
+  PMMU_MAP_SET set;
+  hvm_address va;
+  Bit32u i, j, n, size;
+
+  mapsets_ready = FALSE;
+
+  n    = SmpCpuCount() + 1;
+  size = n * MMU_MAP_SET_PAGES * MMU_PAGE_SIZE;
+
+#ifdef GUEST_WINDOWS
+  maparea = MmAllocateMappingAddress(size, 'gbdh');
+#elif defined GUEST_LINUX
+  maparea = vmalloc(size);
+#endif
+
+  if (!maparea)
+    return HVM_STATUS_UNSUCCESSFUL;
+
+#ifdef GUEST_LINUX
+  /* Fault the vmalloc() area into the page directory of the current process,
+     which MmuInit() copies into the host one */
+  vmm_memset(maparea, 0, size);
+#endif
+
+  va = (hvm_address) maparea;
+  for (i=0; i<n; i++) {
+    set = &mapsets[i == n-1 ? MMU_MAP_GUEST_SET : i];
+
+    for (j=0; j<MMU_MAP_SLOTS; j++, va += MMU_PAGE_SIZE) {
+      set->slots[j].va   = va;
+      set->slots[j].pte  = MmuGetPTEAddress(va);
+      set->slots[j].busy = FALSE;
+      if (!set->slots[j].pte)
+	goto error;
+    }
+
+    set->window_va   = va;
+    set->window_busy = FALSE;
+    for (j=0; j<MMU_MAP_WINDOW_PAGES; j++, va += MMU_PAGE_SIZE) {
+      set->window_pte[j] = MmuGetPTEAddress(va);
+      if (!set->window_pte[j])
+	goto error;
+    }
+  }
+
+  mapsets_ready = TRUE;
+
+  return HVM_STATUS_SUCCESS;
+
+ error:
+  MmuReleaseMapSlots();
+  return HVM_STATUS_UNSUCCESSFUL;
+}
+
+static void MmuReleaseMapSlots(void)
+{
+  mapsets_ready = FALSE;
+
+  if (!maparea)
+    return;
+
+#ifdef GUEST_WINDOWS
+  MmFreeMappingAddress(maparea, 'gbdh');
+#elif defined GUEST_LINUX
+  vfree(maparea);
+#endif
+
+  maparea = NULL;
+}
+
+/* The set of the processor in root mode, or the guest one */
+static PMMU_MAP_SET MmuCurrentMapSet(void)
+{
+  PVT_CPU cpu;
+
+  if (!mapsets_ready)
+    return NULL;
+
+  cpu = VtCurrentRootCpu();
+
+  return &mapsets[cpu ? cpu->id : MMU_MAP_GUEST_SET];
+}
+
 static hvm_bool MmuGetCr0WP(void)
 {
   CR0_REG cr0_reg;
@@ -85,6 +85,40 @@
 
 #endif	/* ENABLE_PAE */
 
+/* Number of PTEs reserved at initialization time, for each processor, to
+   temporarily map physical pages */
+#define MMU_MAP_SLOTS        4
+
+/* Number of consecutive PTEs reserved at initialization time, for each
+   processor, to map runs of physically contiguous pages at once */
+#define MMU_MAP_WINDOW_PAGES 16
+
+/* PTEs read at once by MmuWalkVirtualRange() */
+#define MMU_WALK_CHUNK       64
+
+/* Invoked by MmuWalkVirtualRange() for each present page */
+typedef void (*MMU_PAGE_CALLBACK)(hvm_address va, hvm_phy_address phy, void* arg);
+
+/* A single (va, buffer, size) element of a vectored virtual memory access */
+typedef struct {
+  hvm_address va;
+  void*       buffer;
+  Bit32u      size;
+} MMU_IOVEC, *PMMU_IOVEC;
+
+/* MMU counters */
+typedef struct {
+  Bit32u maps;			/* Physical pages mapped */
+  Bit32u tlb_flushes;		/* Full TLB flushes */
+  Bit32u tlb_page_flushes;	/* Single-page TLB invalidations */
+  Bit32u search_iterations;	/* Pages examined looking for unused PTEs */
+  Bit32u gtlb_hits;		/* Guest translations served by the cache... */
+  Bit32u gtlb_large_hits;	/* ...of which for large pages */
+  Bit32u gtlb_misses;		/* Guest translations that walked the page tables */
+  Bit32u runs;			/* Physically contiguous runs copied at once */
+  Bit32u run_pages;		/* Pages copied as part of a run */
+} MMU_STATS, *PMMU_STATS;
+
 hvm_status MmuInit(hvm_address *pcr3);
 hvm_status MmuFini(void);
 
@@ -92,9 +126,11 @@ hvm_status MmuMapPhysicalPage(hvm_phy_address phy, hvm_address* pva, PPTE porigi
 hvm_status MmuUnmapPhysicalPage(hvm_address va, PTE original);
 
 hvm_status MmuReadWriteVirtualRegion(hvm_address cr3, hvm_address va, void* buffer, Bit32u size, hvm_bool isWrite);
+hvm_status MmuReadWriteVirtualVector(hvm_address cr3, PMMU_IOVEC iov, Bit32u n, hvm_bool isWrite);
 hvm_status MmuReadWritePhysicalRegion(hvm_phy_address phy, void* buffer, Bit32u size, hvm_bool isWrite);
 
 hvm_status MmuGetPhysicalAddress(hvm_address cr3, hvm_address va, hvm_phy_address* pphy);
+hvm_status MmuWalkVirtualRange(hvm_address cr3, hvm_address va, Bit32u size, MMU_PAGE_CALLBACK callback, void* arg);
 hvm_bool   MmuIsAddressValid(hvm_address cr3, hvm_address va);
 hvm_bool   MmuIsAddressWritable(hvm_address cr3, hvm_address va);
 
@@ -102,9 +138,17 @@ void       MmuVirtToPTE( hvm_address, hvm_address *);
 
 hvm_address MmuGetHostPT(void);
 
+void       MmuGetStats(PMMU_STATS pstats);
+
+void       MmuGuestTLBSetEnabled(hvm_bool enabled);
+void       MmuGuestTLBFlush(void);
+
 #define    MmuWriteVirtualRegion(cr3, va, buffer, size) MmuReadWriteVirtualRegion(cr3, va, buffer, size, TRUE)
 #define    MmuReadVirtualRegion(cr3, va, buffer, size)  MmuReadWriteVirtualRegion(cr3, va, buffer, size, FALSE)
 
+#define    MmuWriteVirtualVector(cr3, iov, n) MmuReadWriteVirtualVector(cr3, iov, n, TRUE)
+#define    MmuReadVirtualVector(cr3, iov, n)  MmuReadWriteVirtualVector(cr3, iov, n, FALSE)
+
 #define    MmuWritePhysicalRegion(phy, buffer, size) MmuReadWritePhysicalRegion(phy, buffer, size, TRUE)
 #define    MmuReadPhysicalRegion(phy, buffer, size)  MmuReadWritePhysicalRegion(phy, buffer, size, FALSE)
  
@@ -45,6 +45,8 @@
 #define IA32_VMX_CR0_FIXED1                     0x487
 #define IA32_VMX_CR4_FIXED0                     0x488
 #define IA32_VMX_CR4_FIXED1                     0x489
+#define IA32_VMX_PROCBASED_CTLS2                0x48B
+#define IA32_VMX_EPT_VPID_CAP                   0x48C
 #define	IA32_FS_BASE    		   0xc0000100
 #define	IA32_GS_BASE	                   0xc0000101
 
@@ -111,4 +113,10 @@ typedef struct _IA32_FEATURE_CONTROL_MSR
 void USESTACK ReadMSR (Bit32u reg, PMSR msr);
 void USESTACK WriteMSR(Bit32u reg, Bit32u highpart, Bit32u lowpart);
 
+/* Same as above, but return FALSE instead of faulting if the MSR does not
+   exist or the value is not valid. Root mode only: the #GP is caught by
+   MsrFaultHandler in the VMM IDT */
+hvm_bool USESTACK ReadMSRSafe (Bit32u reg, PMSR msr);
+hvm_bool USESTACK WriteMSRSafe(Bit32u reg, Bit32u highpart, Bit32u lowpart);
+
 #endif /* _PILL_MSR_H */
@@ -70,6 +70,10 @@ hvm_status FiniPlugin(void);
 /* ################ */
 
 #define HYPERCALL_SWITCHOFF 0xcafebabe
+#define HYPERCALL_EXITSTATS 0xcafebabf
+#define HYPERCALL_TRACEREAD 0xcafebac0
+#define HYPERCALL_DIRTYLOG  0xcafebac1
+#define HYPERCALL_SNAPSHOT  0xcafebac2
 
 /* #################### */
 /* #### PROTOTYPES #### */
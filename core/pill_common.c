@@ -25,6 +25,7 @@
 /* Inspired to Shawn Embleton's Virtual Machine Monitor */
 
 #include "pill.h"
+#include "vmmstring.h"
 
 /* ################# */
 /* #### GLOBALS #### */
@@ -49,6 +50,9 @@ hvm_address GuestStack;
 hvm_status RegisterEvents(void)
 {
   EVENT_CONDITION_HYPERCALL hypercall;
+#ifdef ENABLE_EPT
+  EVENT_CONDITION_EPT_VIOLATION ept;
+#endif
 
   /* Initialize the event handler */
   EventInit();
@@ -61,6 +65,50 @@ hvm_status RegisterEvents(void)
     return HVM_STATUS_UNSUCCESSFUL;
   }
 
+  /* Register a hypercall to retrieve VM exit statistics */
+  hypercall.hypernum = HYPERCALL_EXITSTATS;
+
+  if(!EventSubscribe(EventHypercall, &hypercall, sizeof(hypercall), HypercallExitStats)) {
+    GuestLog("ERROR: Unable to register exit statistics hypercall handler");
+    return HVM_STATUS_UNSUCCESSFUL;
+  }
+
+  /* Register a hypercall to read the trace ring */
+  hypercall.hypernum = HYPERCALL_TRACEREAD;
+
+  if(!EventSubscribe(EventHypercall, &hypercall, sizeof(hypercall), HypercallTraceRead)) {
+    GuestLog("ERROR: Unable to register trace hypercall handler");
+    return HVM_STATUS_UNSUCCESSFUL;
+  }
+
+#ifdef ENABLE_EPT
+  /* Register a hypercall to control dirty-page logging */
+  hypercall.hypernum = HYPERCALL_DIRTYLOG;
+
+  if(!EventSubscribe(EventHypercall, &hypercall, sizeof(hypercall), HypercallDirtyLog)) {
+    GuestLog("ERROR: Unable to register dirty logging hypercall handler");
+    return HVM_STATUS_UNSUCCESSFUL;
+  }
+
+  /* Register a hypercall to take and restore memory snapshots */
+  hypercall.hypernum = HYPERCALL_SNAPSHOT;
+
+  if(!EventSubscribe(EventHypercall, &hypercall, sizeof(hypercall), HypercallSnapshot)) {
+    GuestLog("ERROR: Unable to register snapshot hypercall handler");
+    return HVM_STATUS_UNSUCCESSFUL;
+  }
+
+  /* First write to a page while dirty logging or after a snapshot.
+     Subscribed before any plugin, so that they never see these violations */
+  vmm_memset(&ept, 0, sizeof(ept));
+  ept.write = TRUE;
+
+  if(!EventSubscribe(EventEPTViolation, &ept, sizeof(ept), EptWriteHandler)) {
+    GuestLog("ERROR: Unable to register EPT write handler");
+    return HVM_STATUS_UNSUCCESSFUL;
+  }
+#endif
+
   return HVM_STATUS_SUCCESS;
 }
 
@@ -80,6 +128,14 @@ void InitVMMIDT(PIDT_ENTRY pidt)
   for (i=0; i<256; i++) {
     pidt[i] = idte_null;
   }
+
+  /* Recover from #GP on guest MSR accesses (see ReadMSRSafe()) */
+  pidt[TRAP_GP_FAULT].LowOffset  = (Bit32u) MsrFaultHandler & 0xffff;
+  pidt[TRAP_GP_FAULT].HighOffset = (Bit32u) MsrFaultHandler >> 16;
+
+  /* Processors sent an NMI in root mode stop there (see SmpHostNMI()) */
+  pidt[TRAP_NMI].LowOffset  = (Bit32u) SmpNMIHandler & 0xffff;
+  pidt[TRAP_NMI].HighOffset = (Bit32u) SmpNMIHandler >> 16;
 }
 
 hvm_status FiniPlugin(void)
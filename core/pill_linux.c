@@ -26,6 +26,19 @@
 #include "linux.h"
 #include <linux/module.h>
 #include <linux/kobject.h>
+#include <linux/moduleparam.h>
+#include <linux/fs.h>
+#include <linux/err.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
+#include <asm/uaccess.h>
+#include <asm/apic.h>
+#include "smp.h"
+
+#ifdef ENABLE_HYPERDBG
+#include "symsearch.h"
+#endif
+
 module_init(DriverEntry);
 module_exit(DriverUnload);
 
@@ -33,6 +46,27 @@ static hvm_bool    ScrubTheLaunch = FALSE;
 static hvm_address GuestReturn;
 static hvm_address HostCR3;
 
+/* Processors that have been launched */
+static hvm_bool    Launched[VT_MAX_CPUS];
+
+#ifdef DEBUG
+/* Serial port used for logging */
+static int serial_baud = COM_BAUD_RATE_DEFAULT;
+module_param(serial_baud, int, 0);
+MODULE_PARM_DESC(serial_baud, "Baud rate of the debug serial port");
+
+static int serial_async = 1;
+module_param(serial_async, int, 0);
+MODULE_PARM_DESC(serial_async, "Queue serial output and write it out on VM exits (0 to write it synchronously)");
+#endif
+
+#ifdef ENABLE_HYPERDBG
+/* Path of a symbol pack to use instead of the compiled-in symbols */
+static char* symbols = NULL;
+module_param(symbols, charp, 0);
+MODULE_PARM_DESC(symbols, "Path of the HyperDbg symbol pack to load");
+#endif
+
 /* #################### */
 /* #### PROTOTYPES #### */
 /* #################### */
@@ -41,12 +75,23 @@ static hvm_status InitGuest(void);
 static hvm_status FiniGuest(void);
 static hvm_status InitPlugin(void);
 
+/* Processor launch & switch off, run on the target processor */
+static long       LaunchCpu(void* arg);
+static long       SwitchOffCpu(void* arg);
+
+#ifdef ENABLE_HYPERDBG
+static void       LoadSymbols(void);
+static hvm_status ReadSymbolPack(void* handle, void* buffer, Bit32u size);
+#endif
+
 /* ################ */
 /* #### BODIES #### */
 /* ################ */
 
 void StartVT()
 {
+  Bit32u cpu;
+
   //	Get the Guest Return RIP.
   //
   //	Hi	|	    |
@@ -60,16 +105,12 @@ void StartVT()
   GuestLog("Guest Return EIP: %.8x", GuestReturn);
   GuestLog("Enabling VT mode");
 
-  /* FIXME: set thread affinity */
-  /* const struct cpumask m; */
-  /* pid_t p= sys_gettid(); */
-  /* if( !sched_setaffinity(p,&m) ) */
-  /*   goto Abort; */
-
-  /* GuestLog("Running on Processor #%d", KeGetCurrentProcessorNumber()); */
+  /* LaunchCpu() runs bound to the processor being launched */
+  cpu = smp_processor_id();
+  GuestLog("Running on Processor #%d", cpu);
   
   /* Enable VT support */
-  if (!HVM_SUCCESS(hvm_x86_ops.vt_hardware_enable())) {
+  if (!HVM_SUCCESS(hvm_x86_ops.vt_hardware_enable(cpu))) {
     goto Abort;
   }
   
@@ -79,7 +120,7 @@ void StartVT()
   /* ************************************************* */
   
   /* Initialize the VMCS */
-  if (!HVM_SUCCESS(hvm_x86_ops.vt_vmcs_initialize(GuestStack, GuestReturn, HostCR3)))
+  if (!HVM_SUCCESS(hvm_x86_ops.vt_vmcs_initialize(cpu, GuestStack, GuestReturn, HostCR3)))
     goto Abort;
   
   /* Update the events that must be handled by the HVM */
@@ -101,24 +142,49 @@ void StartVT()
 			);
 }
 
+static long LaunchCpu(void* arg)
+{
+  DoStartVT();
+
+  if (ScrubTheLaunch)
+    return -1;
+
+  SmpCpuOnline(smp_processor_id());
+
+  return 0;
+}
+
+static long SwitchOffCpu(void* arg)
+{
+  hvm_x86_ops.vt_hypercall(HYPERCALL_SWITCHOFF);
+
+  return 0;
+}
+
 /* Driver unload procedure */
 void __exit DriverUnload(void)
 {
+  int cpu;
+
   ScrubTheLaunch = FALSE;
- /* GuestLog("[vmm-unload] Active processor bitmap: %.8x", (ULONG) KeQueryActiveProcessors()); */
   GuestLog("[vmm-unload] Disabling VT mode");
 
-  /* FIXME: set thread affinity */
-  /* const struct cpumask m; */
-  /* pid_t p= sys_gettid(); */
-  /* sched_setaffinity(p,&m); */
-  
+  /* Leave VMX operation on every processor before the plugins go away, as
+     their handlers may still be invoked by the other processors */
+  for (cpu = 0; cpu < VT_MAX_CPUS; cpu++) {
+    if (!Launched[cpu])
+      continue;
+
+    work_on_cpu(cpu, SwitchOffCpu, NULL);
+    Launched[cpu] = FALSE;
+  }
+
   FiniPlugin();			/* Finalize plugins */
   FiniGuest();			/* Finalize guest-specific structures */
-    
-  if(hvm_x86_ops.vt_enabled()) {
-    hvm_x86_ops.vt_hypercall(HYPERCALL_SWITCHOFF);
-  }
+
+  /* Print what is left in the trace ring */
+  TraceFlush(TRACE_RECORDS);
+  ComFlush();
   
   GuestLog("[vmm-unload] Freeing memory regions");
   
@@ -131,11 +197,14 @@ void __exit DriverUnload(void)
 int __init DriverEntry(void)
 { 
   CR4_REG cr4;
+  Bit32u  ncpus;
+  int     cpu;
 
   /* Initialize debugging port (COM_PORT_ADDRESS, see comio.h) */
 #ifdef DEBUG
     PortInit();
-    ComInit();
+    ComInit(serial_baud);
+    ComSetAsync(serial_async);
 #endif
 
   GuestLog("Driver Routines");
@@ -159,13 +228,25 @@ int __init DriverEntry(void)
     goto error;
   }
 
+  /* Processors with an id above VT_MAX_CPUS are left alone */
+  ncpus = MIN(nr_cpu_ids, VT_MAX_CPUS);
+  if (!HVM_SUCCESS(SmpInit(ncpus, (hvm_address) APIC_BASE))) {
+    GuestLog("Failed to initialize SMP support");
+    goto error;
+  }
+
   /* Initialize VT */
-  if (!HVM_SUCCESS(hvm_x86_ops.vt_initialize(InitVMMIDT))) {
+  if (!HVM_SUCCESS(hvm_x86_ops.vt_initialize(InitVMMIDT, ncpus))) {
     GuestLog("Failed to initialize VT");
     goto error;
   }
 
 #ifdef ENABLE_HYPERDBG
+  /* Load symbols, if requested (must be done before HyperDbgGuestInit()) */
+  if (symbols) {
+    LoadSymbols();
+  }
+
   /* Initialize the guest module of HyperDbg */
   if(HyperDbgGuestInit() != HVM_STATUS_SUCCESS) {
     GuestLog("ERROR: HyperDbg GUEST initialization error");
@@ -197,27 +278,88 @@ int __init DriverEntry(void)
 	goto error;
   }
 
-  DoStartVT();
-  
-  if(ScrubTheLaunch == TRUE){
-    GuestLog("ERROR: Launch aborted");
-    goto error;
+  /* Launch the processors one at a time: StartVT() uses a single GuestStack
+     and GuestReturn */
+  for_each_online_cpu(cpu) {
+    if (cpu >= ncpus) {
+      GuestLog("Processor #%d is not virtualized", cpu);
+      continue;
+    }
+
+    if (work_on_cpu(cpu, LaunchCpu, NULL) != 0 || ScrubTheLaunch == TRUE) {
+      GuestLog("ERROR: Launch aborted on processor #%d", cpu);
+      goto error;
+    }
+    Launched[cpu] = TRUE;
   }
   
-  GuestLog("VM is now executing");
+  GuestLog("VM is now executing on %d processor(s)", SmpCpuCount());
   
   return STATUS_SUCCESS;
   
  error:
   
   /* Cleanup & return an error code */
+  for (cpu = 0; cpu < VT_MAX_CPUS; cpu++) {
+    if (Launched[cpu]) {
+      work_on_cpu(cpu, SwitchOffCpu, NULL);
+      Launched[cpu] = FALSE;
+    }
+  }
+
   FiniPlugin();
   
   hvm_x86_ops.vt_finalize();
+
+  TraceFlush(TRACE_RECORDS);
+  ComFlush();
   
   return STATUS_UNSUCCESSFUL;
 }
 
+#ifdef ENABLE_HYPERDBG
+static void LoadSymbols(void)
+{
+  struct file* f;
+
+  f = filp_open(symbols, O_RDONLY, 0);
+  if (IS_ERR(f)) {
+    GuestLog("Cannot open symbol pack %s", symbols);
+    return;
+  }
+
+  if (!HVM_SUCCESS(SymbolLoadPack(ReadSymbolPack, f))) {
+    GuestLog("Cannot load symbol pack %s, using compiled-in symbols", symbols);
+  }
+
+  filp_close(f, NULL);
+}
+
+static hvm_status ReadSymbolPack(void* handle, void* buffer, Bit32u size)
+{
+  struct file* f;
+  mm_segment_t fs;
+  ssize_t n;
+
+  f = (struct file*) handle;
+
+  fs = get_fs();
+  set_fs(KERNEL_DS);
+
+  while (size > 0) {
+    n = vfs_read(f, buffer, size, &f->f_pos);
+    if (n <= 0)
+      break;
+    buffer = (Bit8u*) buffer + n;
+    size -= n;
+  }
+
+  set_fs(fs);
+
+  return (size == 0) ? HVM_STATUS_SUCCESS : HVM_STATUS_UNSUCCESSFUL;
+}
+#endif
+
 static hvm_status InitPlugin(void)
 {
 #ifdef ENABLE_HYPERDBG
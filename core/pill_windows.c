@@ -24,6 +24,7 @@
 
 #include "pill.h"
 #include "winxp.h"
+#include "smp.h"
 
 static hvm_bool    ScrubTheLaunch = FALSE;
 static hvm_address GuestReturn;
@@ -70,7 +71,7 @@ void StartVT()
   KeSetSystemAffinityThread((KAFFINITY) 0x00000001);
   
   /* Enable VT support */
-  if (!HVM_SUCCESS(hvm_x86_ops.vt_hardware_enable())) {
+  if (!HVM_SUCCESS(hvm_x86_ops.vt_hardware_enable(0))) {
     goto Abort;
   }
 
@@ -80,7 +81,7 @@ void StartVT()
   /* ************************************************* */
 
   /* Initialize the VMCS */
-  if (!HVM_SUCCESS(hvm_x86_ops.vt_vmcs_initialize(GuestStack, GuestReturn, HostCR3)))
+  if (!HVM_SUCCESS(hvm_x86_ops.vt_vmcs_initialize(0, GuestStack, GuestReturn, HostCR3)))
     goto Abort;
   
   /* Update the events that must be handled by the HVM */
@@ -118,6 +119,9 @@ VOID DDKAPI DriverUnload(PDRIVER_OBJECT DriverObject)
     hvm_x86_ops.vt_hypercall(HYPERCALL_SWITCHOFF);
   }
 
+  /* Print what is left in the trace ring */
+  TraceFlush(TRACE_RECORDS);
+
   GuestLog("[vmm-unload] Freeing memory regions");
 
   hvm_x86_ops.vt_finalize();
@@ -148,7 +152,7 @@ NTSTATUS DDKAPI DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING Registr
   
   /* Initialize debugging port (COM_PORT_ADDRESS, see comio.h) */
   PortInit();
-  ComInit();
+  ComInit(COM_BAUD_RATE_DEFAULT);
 
   GuestLog("Driver Routines");
   GuestLog("---------------");
@@ -180,8 +184,15 @@ NTSTATUS DDKAPI DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING Registr
     goto error;
   }
  
+  /* Only the first processor is virtualized: there is no way to send IPIs
+     from the VMM yet */
+  if (!HVM_SUCCESS(SmpInit(1, 0))) {
+    GuestLog("Failed to initialize SMP support");
+    goto error;
+  }
+
   /* Initialize VT */
-  if (!HVM_SUCCESS(hvm_x86_ops.vt_initialize(InitVMMIDT))) {
+  if (!HVM_SUCCESS(hvm_x86_ops.vt_initialize(InitVMMIDT, 1))) {
     GuestLog("Failed to initialize VT");
     goto error;
   }
@@ -212,6 +223,7 @@ NTSTATUS DDKAPI DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING Registr
     GuestLog("ERROR: Launch aborted");
     goto error;
   }
+  SmpCpuOnline(0);
 	
   GuestLog("VM is now executing");
   	
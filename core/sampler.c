@@ -0,0 +1,106 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+#include "sampler.h"
+#include "vt.h"
+#include "common.h"
+
+/* ################ */
+/* #### TYPES ##### */
+/* ################ */
+
+/* 'head' counts the samples taken: the next one goes to
+   samples[head % SAMPLER_SAMPLES] */
+typedef struct __attribute__((aligned(VT_CACHE_LINE))) {
+  Bit32u         head;
+  SAMPLER_SAMPLE samples[SAMPLER_SAMPLES];
+} SAMPLER_RING, *PSAMPLER_RING;
+
+/* ################# */
+/* #### GLOBALS #### */
+/* ################# */
+
+static SAMPLER_RING sampler_rings[VT_MAX_CPUS];
+static Bit64u       sampler_period = 0;
+
+/* ################ */
+/* #### BODIES #### */
+/* ################ */
+
+hvm_status SamplerStart(Bit64u period)
+{
+  hvm_status r;
+  Bit32u i;
+
+  if(period == 0)
+    return HVM_STATUS_INVALID_PARAMETER;
+
+  for(i = 0; i < VT_MAX_CPUS; i++)
+    sampler_rings[i].head = 0;
+
+  r = hvm_x86_ops.vt_set_sample_timer(period);
+  if(HVM_SUCCESS(r))
+    sampler_period = period;
+
+  return r;
+}
+
+void SamplerStop(void)
+{
+  if(sampler_period == 0)
+    return;
+
+  hvm_x86_ops.vt_set_sample_timer(0);
+  sampler_period = 0;
+}
+
+Bit64u SamplerGetPeriod(void)
+{
+  return sampler_period;
+}
+
+void SamplerRecord(Bit32u cpu, hvm_address rip, hvm_address cr3)
+{
+  PSAMPLER_RING ring;
+  PSAMPLER_SAMPLE s;
+
+  ring = &sampler_rings[cpu];
+  s = &ring->samples[ring->head & (SAMPLER_SAMPLES - 1)];
+
+  s->rip = rip;
+  s->cr3 = cr3;
+  ring->head++;
+}
+
+Bit32u SamplerGetSamples(Bit32u cpu, PSAMPLER_SAMPLE *psamples, Bit32u *ptotal)
+{
+  PSAMPLER_RING ring;
+
+  ring = &sampler_rings[cpu];
+
+  *psamples = ring->samples;
+  *ptotal   = ring->head;
+
+  return MIN(ring->head, SAMPLER_SAMPLES);
+}
@@ -0,0 +1,66 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+#ifndef _PILL_SAMPLER_H
+#define _PILL_SAMPLER_H
+
+#include "types.h"
+
+/* ################ */
+/* #### MACROS #### */
+/* ################ */
+
+#define SAMPLER_SAMPLES        1024	/* Per processor, must be a power of 2 */
+#define SAMPLER_DEFAULT_PERIOD 2000000	/* TSC cycles: about 1 kHz at 2 GHz */
+
+/* ################ */
+/* #### TYPES ##### */
+/* ################ */
+
+/* Where the guest was when the sampling timer expired */
+typedef struct {
+  hvm_address rip;
+  hvm_address cr3;
+} SAMPLER_SAMPLE, *PSAMPLER_SAMPLE;
+
+/* #################### */
+/* #### PROTOTYPES #### */
+/* #################### */
+
+/* Start sampling every 'period' TSC cycles, discarding the samples taken so
+   far, or stop it. Samples are kept after stopping */
+hvm_status SamplerStart(Bit64u period);
+void       SamplerStop(void);
+Bit64u     SamplerGetPeriod(void);	/* 0 if stopped */
+
+/* Called on the exit path of processor 'cpu', which is the only writer of its
+   ring: no locks */
+void       SamplerRecord(Bit32u cpu, hvm_address rip, hvm_address cr3);
+
+/* The last samples taken by processor 'cpu', in no particular order. Returns
+   their number, and sets 'ptotal' to the number of samples it has taken
+   since the start */
+Bit32u     SamplerGetSamples(Bit32u cpu, PSAMPLER_SAMPLE *psamples, Bit32u *ptotal);
+
+#endif	/* _PILL_SAMPLER_H */
@@ -0,0 +1,312 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+/* Multi-processor support: serialization of VM exit handling and the
+   rendezvous that stops all the processors while one of them is in the
+   debugger */
+
+#include "smp.h"
+#include "vt.h"
+#include "debug.h"
+#include "vmmstring.h"
+
+/* ################ */
+/* #### MACROS #### */
+/* ################ */
+
+/* Local APIC registers */
+#define LAPIC_ICR_LOW   0x300
+#define LAPIC_ICR_HIGH  0x310
+
+#define LAPIC_ICR_BUSY  (1 << 12)	/* Delivery status: send pending */
+#define LAPIC_ICR_NMI   0x4400		/* NMI, assert, physical destination */
+
+#define LAPIC_REG(r) (*(volatile Bit32u*) (smp_lapic + (r)))
+
+#define SmpPause() __asm__ __volatile__ ("pause\n" ::: "memory")
+
+/* ################# */
+/* #### GLOBALS #### */
+/* ################# */
+
+static Bit32u      smp_ncpus;
+static hvm_address smp_lapic;
+
+static volatile hvm_bool smp_online[VT_MAX_CPUS];
+static volatile Bit32u   smp_online_count;
+
+/* Serializes VM exit handling */
+static volatile Bit32u   smp_vmm_lock;
+static volatile Bit32u   smp_vmm_owner;	/* Valid while the lock is taken */
+
+/* Rendezvous state. Freezes nest (e.g., the debugger shell freezes the
+   other processors, then a command reclaims EPT tables): only the outermost
+   SmpThawOthers() resumes them. The depth is only touched by the owner of
+   the VMM lock */
+static volatile hvm_bool smp_frozen;
+static Bit32u            smp_freeze_depth;
+static volatile hvm_bool smp_nmi_pending[VT_MAX_CPUS];
+
+/* Each freeze has its own epoch: smp_parked[i] is the epoch of the last
+   freeze processor i has stopped for, so that a processor still leaving
+   the previous freeze is not taken as stopped */
+static volatile Bit32u   smp_freeze_epoch;
+static volatile Bit32u   smp_parked[VT_MAX_CPUS];
+static volatile hvm_bool smp_parking[VT_MAX_CPUS];
+
+/* ########################## */
+/* #### LOCAL PROTOTYPES #### */
+/* ########################## */
+
+static hvm_bool SmpPark(void);
+static hvm_bool SmpOthersParked(Bit32u me);
+static void SmpSendNMI(Bit32u apicid);
+
+/* ################ */
+/* #### BODIES #### */
+/* ################ */
+
+hvm_status SmpInit(Bit32u ncpus, hvm_address lapic)
+{
+  if (ncpus == 0 || ncpus > VT_MAX_CPUS)
+    return HVM_STATUS_UNSUCCESSFUL;
+
+  smp_ncpus  = ncpus;
+  smp_lapic  = lapic;
+
+  vmm_memset((void*) smp_online, 0, sizeof(smp_online));
+  vmm_memset((void*) smp_nmi_pending, 0, sizeof(smp_nmi_pending));
+  smp_online_count = 0;
+  smp_vmm_lock     = 0;
+  smp_frozen       = FALSE;
+  smp_freeze_depth = 0;
+  smp_freeze_epoch = 0;
+  vmm_memset((void*) smp_parked, 0, sizeof(smp_parked));
+  vmm_memset((void*) smp_parking, 0, sizeof(smp_parking));
+
+  return HVM_STATUS_SUCCESS;
+}
+
+void SmpCpuOnline(Bit32u cpu)
+{
+  Bit32u eax, ebx, ecx, edx;
+
+  if (cpu >= smp_ncpus || smp_online[cpu])
+    return;
+
+  /* Initial local APIC ID: CPUID.1:EBX[31:24] */
+  __asm__ __volatile__ ("cpuid\n"
+			:"=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+			:"a"(1)
+			);
+
+  vt_cpus[cpu].apicid = ebx >> 24;
+  smp_online[cpu] = TRUE;
+  __sync_fetch_and_add(&smp_online_count, 1);
+}
+
+void SmpCpuOffline(Bit32u cpu)
+{
+  if (cpu >= smp_ncpus || !smp_online[cpu])
+    return;
+
+  smp_online[cpu] = FALSE;
+  __sync_fetch_and_sub(&smp_online_count, 1);
+}
+
+Bit32u SmpCpuCount(void)
+{
+  return smp_ncpus;
+}
+
+void SmpEnterVMM(void)
+{
+  if (smp_ncpus <= 1)
+    return;
+
+  while (__sync_lock_test_and_set(&smp_vmm_lock, 1)) {
+    /* The owner may be in the debugger, waiting for us to stop */
+    while (smp_vmm_lock) {
+      SmpPark();
+      SmpPause();
+    }
+  }
+
+  smp_vmm_owner = VtCurrentCpu()->id;
+}
+
+void SmpLeaveVMM(void)
+{
+  if (smp_ncpus <= 1)
+    return;
+
+  /* If this processor stopped while it was already in root mode, the NMI
+     sent by SmpFreezeOthers() was taken by SmpHostNMI() and did not cause a
+     VM exit */
+  smp_nmi_pending[VtCurrentCpu()->id] = FALSE;
+
+  __sync_lock_release(&smp_vmm_lock);
+}
+
+void SmpFreezeOthers(void)
+{
+  Bit32u i, me, spins;
+
+  if (smp_ncpus <= 1 || !smp_lapic)
+    return;
+
+  if (smp_freeze_depth++ > 0)
+    return;
+
+  me = VtCurrentCpu()->id;
+  smp_freeze_epoch++;
+  smp_frozen = TRUE;
+
+  /* Processors running the guest are stopped by an NMI; those that are
+     already in root mode park when they find the VMM lock taken, or in
+     SmpHostNMI(). An NMI can still be held pending for a while (e.g., while
+     the processor is in SmpHostNMI() for an earlier one): keep sending it
+     to the processors that have not stopped yet */
+  for (;;) {
+    for (i=0; i<smp_ncpus; i++) {
+      if (i == me || !smp_online[i] || smp_parked[i] == smp_freeze_epoch)
+	continue;
+
+      smp_nmi_pending[i] = TRUE;
+      SmpSendNMI(vt_cpus[i].apicid);
+    }
+
+    for (spins=0; !SmpOthersParked(me) && spins < SMP_FREEZE_SPINS; spins++)
+      SmpPause();
+
+    if (SmpOthersParked(me))
+      break;
+
+    Log("[smp] Processors still running after %d spins, sending NMIs again", spins);
+  }
+}
+
+void SmpThawOthers(void)
+{
+  if (smp_ncpus <= 1 || !smp_lapic || smp_freeze_depth == 0)
+    return;
+
+  if (--smp_freeze_depth > 0)
+    return;
+
+  smp_frozen = FALSE;
+}
+
+hvm_bool SmpHandleNMI(void)
+{
+  Bit32u me;
+
+  me = VtCurrentCpu()->id;
+
+  if (!smp_nmi_pending[me])
+    return FALSE;
+
+  smp_nmi_pending[me] = FALSE;
+
+  return TRUE;
+}
+
+void SmpHostNMI(void)
+{
+  Bit32u me;
+
+  if (smp_ncpus <= 1)
+    return;
+
+  /* The owner of the VMM lock is never sent an NMI, and must not stop */
+  me = VtCurrentCpu()->id;
+  if (smp_vmm_lock && smp_vmm_owner == me)
+    return;
+
+  smp_nmi_pending[me] = FALSE;
+
+  /* The processor may be on its way back to the guest, past the point where
+     VM exits pick up the changes made while it was stopped */
+  if (SmpPark())
+    hvm_x86_ops.vt_sync_cpu();
+}
+
+/* Stop while the other processors are frozen. An NMI that arrives while
+   this processor is already stopped returns at once. Returns TRUE if the
+   processor stopped */
+static hvm_bool SmpPark(void)
+{
+  Bit32u me, epoch;
+
+  me = VtCurrentCpu()->id;
+  if (!smp_frozen || smp_parking[me])
+    return FALSE;
+
+  smp_parking[me] = TRUE;
+
+  /* A new freeze may begin before this processor sees the end of the
+     previous one: stop again for the new epoch */
+  while (smp_frozen) {
+    epoch = smp_freeze_epoch;
+    smp_parked[me] = epoch;
+    while (smp_frozen && smp_freeze_epoch == epoch)
+      SmpPause();
+  }
+
+  smp_parking[me] = FALSE;
+
+  return TRUE;
+}
+
+static hvm_bool SmpOthersParked(Bit32u me)
+{
+  Bit32u i;
+
+  for (i=0; i<smp_ncpus; i++) {
+    if (i != me && smp_online[i] && smp_parked[i] != smp_freeze_epoch)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void SmpSendNMI(Bit32u apicid)
+{
+  Bit32u icrhigh;
+
+  /* The guest may have been interrupted between the writes of the two
+     halves of the ICR: preserve the destination it set */
+  while (LAPIC_REG(LAPIC_ICR_LOW) & LAPIC_ICR_BUSY)
+    SmpPause();
+
+  icrhigh = LAPIC_REG(LAPIC_ICR_HIGH);
+
+  LAPIC_REG(LAPIC_ICR_HIGH) = apicid << 24;
+  LAPIC_REG(LAPIC_ICR_LOW)  = LAPIC_ICR_NMI;
+
+  while (LAPIC_REG(LAPIC_ICR_LOW) & LAPIC_ICR_BUSY)
+    SmpPause();
+
+  LAPIC_REG(LAPIC_ICR_HIGH) = icrhigh;
+}
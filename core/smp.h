@@ -0,0 +1,76 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+#ifndef _PILL_SMP_H
+#define _PILL_SMP_H
+
+#include "types.h"
+
+/* ################ */
+/* #### MACROS #### */
+/* ################ */
+
+/* Iterations SmpFreezeOthers() waits for the other processors to stop,
+   before sending them NMIs again */
+#define SMP_FREEZE_SPINS 10000000
+
+/* #################### */
+/* #### PROTOTYPES #### */
+/* #################### */
+
+/* Called before any processor is launched. 'lapic' is the virtual address of
+   the local APIC registers, which must be mapped in the host address space
+   too (0 if there is no way to send IPIs: the other processors are then
+   never frozen) */
+hvm_status SmpInit(Bit32u ncpus, hvm_address lapic);
+
+/* Called by each processor, in non-root mode, once it has been launched,
+   and in root mode when it leaves VMX operation */
+void       SmpCpuOnline(Bit32u cpu);
+void       SmpCpuOffline(Bit32u cpu);
+Bit32u     SmpCpuCount(void);
+
+/* VM exits are handled by one processor at a time. A processor waiting for
+   its turn stops here while the others are frozen */
+void       SmpEnterVMM(void);
+void       SmpLeaveVMM(void);
+
+/* Stop (with an NMI) all the other processors in the VMM, and resume them.
+   Must be called by the processor that is handling a VM exit. Calls nest:
+   the processors are resumed by the SmpThawOthers() that matches the first
+   SmpFreezeOthers(). They stay stopped if this processor goes back to the
+   guest (e.g., to step over an instruction), until one of its next VM exits
+   thaws them */
+void       SmpFreezeOthers(void);
+void       SmpThawOthers(void);
+
+/* Returns TRUE if the NMI that caused the current VM exit was sent by
+   SmpFreezeOthers(), and must not be delivered to the guest */
+hvm_bool   SmpHandleNMI(void);
+
+/* NMI handler of the VMM IDT (see SmpNMIHandler in i386/vmx-asm.S). A
+   processor that is sent an NMI while it is in root mode stops here */
+void       SmpHostNMI(void) asm("_SmpHostNMI");
+
+#endif	/* _PILL_SMP_H */
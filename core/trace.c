@@ -0,0 +1,209 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+#include <stdarg.h>
+#include "trace.h"
+#include "comio.h"
+#include "vmmstring.h"
+#include "x86.h"
+
+/* ################# */
+/* #### GLOBALS #### */
+/* ################# */
+
+static TRACE_RECORD trace_ring[TRACE_RECORDS];
+static Bit32u       trace_head;	/* Next ring index to be reserved */
+static Bit32u       trace_serial_cursor;
+
+/* ########################## */
+/* #### LOCAL PROTOTYPES #### */
+/* ########################## */
+
+static void TraceParseSite(PTRACE_SITE site);
+
+/* ################ */
+/* #### BODIES #### */
+/* ################ */
+
+/* Called on the exit path: no locks and no formatting. Writers reserve a
+   slot with an atomic increment and publish it by writing 'seq' last */
+void TraceRecord(PTRACE_SITE site, ...)
+{
+  va_list args;
+  PTRACE_RECORD r;
+  Bit32u i, idx;
+
+  if(!(site->flags & TRACE_SITE_PARSED))
+    TraceParseSite(site);
+
+  if(site->flags & TRACE_SITE_SYNC) {
+    /* String arguments may not outlive this call */
+    if(ComIsInitialized()) {
+      va_start(args, site);
+      ComVPrint(site->fmt, args);
+      va_end(args);
+    }
+    return;
+  }
+
+  idx = __sync_fetch_and_add(&trace_head, 1);
+  r = &trace_ring[idx & (TRACE_RECORDS - 1)];
+
+  r->seq = 0;
+  __sync_synchronize();
+
+  r->site = site;
+  RegRdtsc(&r->tsc);
+
+  va_start(args, site);
+  for(i = 0; i < site->nargs; i++)
+    r->args[i] = va_arg(args, Bit32u);
+  va_end(args);
+
+  __sync_synchronize();
+  r->seq = idx + 1;
+}
+
+Bit32u TraceGetCursor(void)
+{
+  return trace_head;
+}
+
+hvm_bool TraceRead(Bit32u *pcursor, PTRACE_RECORD record, Bit32u *plost)
+{
+  PTRACE_RECORD r;
+  Bit32u head, seq;
+
+  for(;;) {
+    head = trace_head;
+
+    if(*pcursor == head)
+      return FALSE;
+
+    /* The writers lapped us */
+    if(head - *pcursor > TRACE_RECORDS) {
+      *plost += head - *pcursor - TRACE_RECORDS;
+      *pcursor = head - TRACE_RECORDS;
+    }
+
+    r = &trace_ring[*pcursor & (TRACE_RECORDS - 1)];
+
+    seq = r->seq;
+    __sync_synchronize();
+    vmm_memcpy(record, r, sizeof(TRACE_RECORD));
+    __sync_synchronize();
+
+    if(seq == *pcursor + 1 && r->seq == seq) {
+      (*pcursor)++;
+      return TRUE;
+    }
+
+    /* Still being written */
+    if(seq == 0 || seq == *pcursor + 1 - TRACE_RECORDS)
+      return FALSE;
+
+    /* Overwritten while we were reading it */
+    (*plost)++;
+    (*pcursor)++;
+  }
+}
+
+Bit32u TraceFormat(PTRACE_RECORD record, char *buffer, Bit32u size)
+{
+  Bit32u *a;
+
+  a = record->args;
+
+  /* Arguments the format string doesn't use are ignored */
+  vmm_snprintf(buffer, size, record->site->fmt, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+
+  return vmm_strlen((Bit8u*) buffer);
+}
+
+void TraceFlush(Bit32u max)
+{
+  TRACE_RECORD record;
+  char line[TRACE_LINE_SIZE];
+  Bit32u lost;
+
+  if(!ComIsInitialized())
+    return;
+
+  lost = 0;
+  while(max-- > 0 && TraceRead(&trace_serial_cursor, &record, &lost)) {
+    TraceFormat(&record, line, sizeof(line));
+    ComPrint("%s", line);
+  }
+
+  if(lost != 0)
+    ComPrint("[vmm] %d trace records lost\n", lost);
+}
+
+/* Count the 32-bit words taken by the arguments of a format string. Sites
+   with string arguments, or too many of them, are printed synchronously */
+static void TraceParseSite(PTRACE_SITE site)
+{
+  const char *p;
+  Bit32u n, flags;
+
+  n = 0;
+  flags = TRACE_SITE_PARSED;
+
+  for(p = site->fmt; *p; p++) {
+    if(*p != '%')
+      continue;
+
+    p++;
+    if(*p == '%')
+      continue;
+
+    /* Flags, width and precision */
+    while((*p >= '0' && *p <= '9') || *p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '.' || *p == '*') {
+      if(*p == '*') n++;
+      p++;
+    }
+
+    /* Length modifiers */
+    while(*p == 'h' || *p == 'l' || *p == 'L' || *p == 'q') {
+      if(*p == 'L' || *p == 'q' || (*p == 'l' && p[1] == 'l')) {
+	n++;
+	if(*p == 'l') p++;
+      }
+      p++;
+    }
+
+    if(*p == 's')
+      flags |= TRACE_SITE_SYNC;
+    else if(*p == 0)
+      break;
+
+    n++;
+  }
+
+  if(n > TRACE_MAX_ARGS)
+    flags |= TRACE_SITE_SYNC;
+
+  site->nargs = n;
+  site->flags = flags;
+}
@@ -0,0 +1,85 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+#ifndef _PILL_TRACE_H
+#define _PILL_TRACE_H
+
+#include "types.h"
+
+/* ################ */
+/* #### MACROS #### */
+/* ################ */
+
+#define TRACE_RECORDS    1024	/* Ring size, must be a power of 2 */
+#define TRACE_MAX_ARGS   8	/* 32-bit argument words per record */
+#define TRACE_LINE_SIZE  256	/* Maximum length of a formatted record */
+#define TRACE_FLUSH_IDLE 16	/* Records printed each time the guest halts */
+
+/* TRACE_SITE flags */
+#define TRACE_SITE_PARSED  (1 << 0) /* nargs is valid */
+#define TRACE_SITE_SYNC    (1 << 1) /* Print immediately, don't record */
+
+/* Record a message in the trace ring. Formatting is deferred until the record
+   is drained, so the format string must be a literal */
+#define TraceLog(fmt, ...)						\
+  do {									\
+    static TRACE_SITE __trace_site = { "[vmm] " fmt "\n", 0, 0 };	\
+    TraceRecord(&__trace_site, ## __VA_ARGS__);				\
+  } while(0)
+
+/* ################ */
+/* #### TYPES ##### */
+/* ################ */
+
+/* A call site of TraceLog(): its address identifies the format string */
+typedef struct {
+  const char *fmt;
+  Bit32u      flags;
+  Bit32u      nargs;
+} TRACE_SITE, *PTRACE_SITE;
+
+typedef struct {
+  Bit32u      seq;		/* Ring index + 1, once the record is complete */
+  PTRACE_SITE site;
+  Bit64u      tsc;
+  Bit32u      args[TRACE_MAX_ARGS];
+} TRACE_RECORD, *PTRACE_RECORD;
+
+/* #################### */
+/* #### PROTOTYPES #### */
+/* #################### */
+
+void     TraceRecord(PTRACE_SITE site, ...);
+
+/* Drain side. Each reader keeps its own cursor, starting from
+   TraceGetCursor(): TraceRead() returns FALSE when there is nothing new and
+   adds to 'plost' the records overwritten before they could be read */
+Bit32u   TraceGetCursor(void);
+hvm_bool TraceRead(Bit32u *pcursor, PTRACE_RECORD record, Bit32u *plost);
+Bit32u   TraceFormat(PTRACE_RECORD record, char *buffer, Bit32u size);
+
+/* Print at most 'max' pending records on the serial port */
+void     TraceFlush(Bit32u max);
+
+#endif	/* _PILL_TRACE_H */
@@ -30,16 +30,24 @@
 #include "common.h"
 #include "msr.h"
 #include "x86.h"
+#include "mmu.h"
+#include "exitstats.h"
 
 #ifdef ENABLE_EPT
 #include "ept.h"
 #endif
 
-/* When this variable is TRUE, we are single stepping over an I/O
-   instruction */
-static hvm_bool isIOStepping = FALSE;
-static hvm_bool TF_on;
-static hvm_bool IF_on;
+/* Single-stepping state of each processor. When isIOStepping is TRUE, we are
+   single stepping over an I/O instruction */
+static struct __attribute__((aligned(VT_CACHE_LINE))) {
+  hvm_bool isIOStepping;
+  hvm_bool TF_on;
+  hvm_bool IF_on;
+} iostep[VT_MAX_CPUS];
+
+#define isIOStepping (iostep[VtCurrentCpu()->id].isIOStepping)
+#define TF_on        (iostep[VtCurrentCpu()->id].TF_on)
+#define IF_on        (iostep[VtCurrentCpu()->id].IF_on)
 
 EVENT_PUBLISH_STATUS HypercallSwitchOff(PEVENT_ARGUMENTS args)
 {
@@ -47,6 +55,210 @@ EVENT_PUBLISH_STATUS HypercallSwitchOff(PEVENT_ARGUMENTS args)
     EventPublishHandled : EventPublishPass;
 }
 
+/* Copy the exit statistics to the guest buffer at RBX, of RCX bytes. RCX
+   is set to the size of the snapshot, RAX to HVM_STATUS_SUCCESS or, if the
+   buffer is too small or not writable, HVM_STATUS_UNSUCCESSFUL. If RDX is
+   not zero, statistics are reset after copying them */
+EVENT_PUBLISH_STATUS HypercallExitStats(PEVENT_ARGUMENTS args)
+{
+  PEXIT_STATS stats;
+  hvm_status r;
+
+  stats = ExitStatsGet();
+
+  if(context.GuestContext.rcx < sizeof(EXIT_STATS)) {
+    r = HVM_STATUS_UNSUCCESSFUL;
+  } else {
+    r = MmuWriteVirtualRegion(context.GuestContext.cr3, context.GuestContext.rbx, stats, sizeof(EXIT_STATS));
+  }
+
+  if(HVM_SUCCESS(r) && context.GuestContext.rdx != 0) {
+    ExitStatsReset();
+  }
+
+  context.GuestContext.rax = r;
+  context.GuestContext.rcx = sizeof(EXIT_STATS);
+
+  return EventPublishHandled;
+}
+
+/* Copy formatted trace records, not read by the guest yet, to the buffer at
+   RBX of RCX bytes (at least TRACE_LINE_SIZE). Only whole lines are copied:
+   RAX is set to the number of bytes written, RCX to the number of records
+   lost since the last call */
+EVENT_PUBLISH_STATUS HypercallTraceRead(PEVENT_ARGUMENTS args)
+{
+  static Bit32u cursor;
+  static char   buffer[4096];
+  TRACE_RECORD  record;
+  Bit32u        n, len, lost, size;
+
+  size = MIN(context.GuestContext.rcx, sizeof(buffer));
+
+  n = lost = 0;
+  while(n + 1 < size && TraceRead(&cursor, &record, &lost)) {
+    len = TraceFormat(&record, buffer + n, size - n);
+    if(n + len + 1 >= size) {
+      /* Doesn't fit (or truncated): leave it for the next call */
+      cursor--;
+      break;
+    }
+    n += len;
+  }
+
+  if(n > 0 && !HVM_SUCCESS(MmuWriteVirtualRegion(context.GuestContext.cr3, context.GuestContext.rbx, buffer, n)))
+    n = 0;
+
+  context.GuestContext.rax = n;
+  context.GuestContext.rcx = lost;
+
+  return EventPublishHandled;
+}
+
+#ifdef ENABLE_EPT
+/* Control dirty-page logging: RBX is one of DIRTYLOG_STOP, DIRTYLOG_START or
+   DIRTYLOG_HARVEST. A harvest copies to the buffer at RCX the dirty bitmap
+   of RSI pages starting at page RDX (both multiples of
+   EPT_DIRTY_LOG_GRANULE), one bit per page, and clears it. RAX is set to
+   HVM_STATUS_SUCCESS or HVM_STATUS_UNSUCCESSFUL: if a harvest fails after
+   the copy has started, the dirty state of the range is lost and the next
+   snapshot must copy it whole */
+EVENT_PUBLISH_STATUS HypercallDirtyLog(PEVENT_ARGUMENTS args)
+{
+  static Bit8u buffer[4096];
+  hvm_address  va;
+  Bit32u       page, npages, n;
+  hvm_status   r;
+
+  switch(context.GuestContext.rbx) {
+  case DIRTYLOG_STOP:
+    EPTDirtyLogStop();
+    r = HVM_STATUS_SUCCESS;
+    break;
+
+  case DIRTYLOG_START:
+    r = EPTDirtyLogStart();
+    break;
+
+  case DIRTYLOG_HARVEST:
+    va     = context.GuestContext.rcx;
+    page   = context.GuestContext.rdx;
+    npages = context.GuestContext.rsi;
+
+    r = HVM_STATUS_SUCCESS;
+    while(HVM_SUCCESS(r) && npages > 0) {
+      n = MIN(npages, sizeof(buffer) * 8);
+      r = EPTDirtyLogHarvest(buffer, page, n);
+      if(HVM_SUCCESS(r))
+	r = MmuWriteVirtualRegion(context.GuestContext.cr3, va, buffer, n / 8);
+      va     += n / 8;
+      page   += n;
+      npages -= n;
+    }
+    break;
+
+  default:
+    r = HVM_STATUS_UNSUCCESSFUL;
+    break;
+  }
+
+  context.GuestContext.rax = r;
+
+  return EventPublishHandled;
+}
+
+/* Take, restore or drop a copy-on-write snapshot of the guest: RBX is one of
+   SNAPSHOT_TAKE, SNAPSHOT_RESTORE or SNAPSHOT_DROP. RAX is set to
+   HVM_STATUS_SUCCESS or HVM_STATUS_UNSUCCESSFUL.
+
+   A restore returns a second time from the hypercall that took the
+   snapshot, with all the general purpose registers, RSP, RFLAGS, CR0, CR3
+   and CR4 as that hypercall returned them, except RBX set to 1 (it is 0
+   after the take), RCX to the number of pages restored and RDX to the
+   cycles the restore took. Segment registers, descriptor tables, MSRs, debug
+   and FPU state are not saved: the guest must restore from the same
+   execution context (same thread, privilege level and segments) that took
+   the snapshot */
+EVENT_PUBLISH_STATUS HypercallSnapshot(PEVENT_ARGUMENTS args)
+{
+  static struct CPU_CONTEXT snapshot;
+  Bit64u     t0, t1;
+  Bit32u     npages;
+  hvm_status r;
+
+  switch(context.GuestContext.rbx) {
+  case SNAPSHOT_TAKE:
+    r = EPTSnapshotTake();
+    if(HVM_SUCCESS(r)) {
+      /* As the hypercall returns */
+      context.GuestContext.rax = r;
+      hvm_x86_ops.vt_read_guest_state();
+      snapshot = context;
+    }
+    break;
+
+  case SNAPSHOT_RESTORE:
+    RegRdtsc(&t0);
+    r = EPTSnapshotRestore(&npages);
+    if(!HVM_SUCCESS(r))
+      break;
+
+    context.GuestContext.resumerip = snapshot.GuestContext.resumerip;
+    context.GuestContext.rsp       = snapshot.GuestContext.rsp;
+    context.GuestContext.rflags    = snapshot.GuestContext.rflags;
+    context.GuestContext.rax       = snapshot.GuestContext.rax;
+    context.GuestContext.rbx       = snapshot.GuestContext.rbx;
+    context.GuestContext.rcx       = snapshot.GuestContext.rcx;
+    context.GuestContext.rdx       = snapshot.GuestContext.rdx;
+    context.GuestContext.rdi       = snapshot.GuestContext.rdi;
+    context.GuestContext.rsi       = snapshot.GuestContext.rsi;
+    context.GuestContext.rbp       = snapshot.GuestContext.rbp;
+
+    if(context.GuestContext.cr3 != snapshot.GuestContext.cr3)
+      hvm_x86_ops.vt_set_cr3(snapshot.GuestContext.cr3);
+    hvm_x86_ops.vt_read_guest_state();
+    if(context.GuestContext.cr0 != snapshot.GuestContext.cr0)
+      hvm_x86_ops.vt_set_cr0(snapshot.GuestContext.cr0);
+    if(context.GuestContext.cr4 != snapshot.GuestContext.cr4)
+      hvm_x86_ops.vt_set_cr4(snapshot.GuestContext.cr4);
+
+    RegRdtsc(&t1);
+    context.GuestContext.rbx = 1;
+    context.GuestContext.rcx = npages;
+    context.GuestContext.rdx = (hvm_address) (t1 - t0);
+    break;
+
+  case SNAPSHOT_DROP:
+    EPTSnapshotDrop();
+    r = HVM_STATUS_SUCCESS;
+    break;
+
+  default:
+    r = HVM_STATUS_UNSUCCESSFUL;
+    break;
+  }
+
+  context.GuestContext.rax = r;
+
+  return EventPublishHandled;
+}
+
+/* Record the first write to a page protected by dirty logging or by a
+   snapshot, and resume the guest. Any other violation goes to the next
+   subscriber */
+EVENT_PUBLISH_STATUS EptWriteHandler(PEVENT_ARGUMENTS args)
+{
+  if(!(args->EventEPTViolation.attemptType & WRITE) ||
+     !EPTHandleWrite(args->EventEPTViolation.guestPhysicalAddress))
+    return EventPublishPass;
+
+  /* Re-execute the faulty instruction */
+  context.GuestContext.resumerip = context.GuestContext.rip;
+
+  return EventPublishHandled;
+}
+#endif
+
 void HandleCR(Bit8u crno, VtCrAccessType accesstype, hvm_bool ismemory, VtRegister gpr)
 {
   EVENT_CONDITION_CR cr;
@@ -78,6 +290,9 @@ void HandleCR(Bit8u crno, VtCrAccessType accesstype, hvm_bool ismemory, VtRegist
       else
 	f = hvm_x86_ops.vt_set_cr4;
 
+      /* Guest paging configuration is changing */
+      MmuGuestTLBFlush();
+
       switch(gpr) {
       case VT_REGISTER_RAX:  f(context.GuestContext.rax); break;
       case VT_REGISTER_RCX:  f(context.GuestContext.rcx); break;
@@ -95,6 +310,8 @@ void HandleCR(Bit8u crno, VtCrAccessType accesstype, hvm_bool ismemory, VtRegist
       /* reg32 <-- CRx */
       hvm_address x;
 
+      hvm_x86_ops.vt_read_guest_state();
+
       if (crno == 0)
 	x = context.GuestContext.cr0;
       else if (crno == 3)
@@ -124,6 +341,47 @@ void HandleHLT(void)
   EVENT_CONDITION_NONE none;
 
   EventPublish(EventHlt, NULL, &none, sizeof(none));
+
+  /* The guest has nothing to do: good time to drain the trace ring */
+  TraceFlush(TRACE_FLUSH_IDLE);
+}
+
+void HandleMTF(void)
+{
+  EVENT_CONDITION_NONE none;
+  EVENT_PUBLISH_STATUS s;
+
+  s = EventPublish(EventMonitorTrap, NULL, &none, sizeof(none));
+
+  if (s != EventPublishHandled) {
+    /* Nobody asked for this step: stop trapping */
+    hvm_x86_ops.vt_trap_mtf(FALSE);
+  }
+}
+
+/* Execute a non-string IN/OUT on behalf of the guest. IN of a byte or a word
+   leaves the upper bits of EAX untouched */
+static void HandleIOEmulate(Bit16u port, hvm_bool isoutput, Bit8u size)
+{
+  Bit32u eax;
+
+  eax = (Bit32u) context.GuestContext.rax;
+
+  if (isoutput) {
+    switch (size) {
+    case 1: IoWritePortByte(port, (Bit8u) eax); break;
+    case 2: IoWritePortWord(port, (Bit16u) eax); break;
+    default: IoWritePortDword(port, eax); break;
+    }
+  } else {
+    switch (size) {
+    case 1: eax = (eax & 0xffffff00) | IoReadPortByte(port); break;
+    case 2: eax = (eax & 0xffff0000) | IoReadPortWord(port); break;
+    default: eax = IoReadPortDword(port); break;
+    }
+
+    context.GuestContext.rax = eax;
+  }
 }
 
 void HandleIO(Bit16u port, hvm_bool isoutput, Bit8u size, hvm_bool isstring, hvm_bool isrep)
@@ -133,10 +391,13 @@ void HandleIO(Bit16u port, hvm_bool isoutput, Bit8u size, hvm_bool isstring, hvm
   EVENT_PUBLISH_STATUS s;
   EVENT_ARGUMENTS args;
 
+  ExitStatsRecordIO(port);
+
   /* Initialize event condition */
   dir  = isoutput ? EventIODirectionOut : EventIODirectionIn;
   io.direction = dir;
   io.portnum   = port;
+  io.portcount = 1;
 
   /* Initialize event arguments */
   args.EventIO.size = size;
@@ -146,26 +407,77 @@ void HandleIO(Bit16u port, hvm_bool isoutput, Bit8u size, hvm_bool isstring, hvm
   /* Publish the I/O event (with arguments) */
   s = EventPublish(EventIO, &args, &io, sizeof(io));
 
-  if (s != EventPublishHandled) {
-    /* We would have to emulate the I/O instruction. However, this is quite
-       hard, especially one of the arguments is a memory address. For this
-       reason, we fall back on a simpler (and more effective) solution: we
-       disable I/O traps, let the guest do a single step, and then enable I/O
-       traps again */
+  if (s == EventPublishHandled) {
+    return;
+  }
 
-    isIOStepping = TRUE;
-    
-    /* Disable I/O bitmaps */
-    hvm_x86_ops.vt_trap_io(FALSE);
+  /* Plain IN/OUT only touch the port and EAX, so we perform the access here
+     and skip the instruction (resumerip already points past it). If the
+     guest is single-stepping itself, we take the slow path below so that
+     it still gets its #DB after the instruction */
+  if (!isstring && !isrep && (size == 1 || size == 2 || size == 4) &&
+      (context.GuestContext.rflags & FLAGS_TF_MASK) == 0) {
+    HandleIOEmulate(port, isoutput, size);
+    return;
+  }
 
-    /* Re-exec faulty instruction */
-    context.GuestContext.resumerip = context.GuestContext.rip;
+  /* INS/OUTS and REP prefixes take a memory operand, which is hard to
+     emulate. For these we fall back on a simpler (and more effective)
+     solution: we disable I/O traps, let the guest do a single step, and then
+     enable I/O traps again */
+  isIOStepping = TRUE;
+
+  /* Disable I/O bitmaps */
+  hvm_x86_ops.vt_trap_io(FALSE);
+
+  /* Re-exec faulty instruction */
+  context.GuestContext.resumerip = context.GuestContext.rip;
+
+  TF_on = (context.GuestContext.rflags & FLAGS_TF_MASK) != 0 ? TRUE : FALSE;
+  IF_on = (context.GuestContext.rflags & FLAGS_IF_MASK) != 0 ? TRUE : FALSE;
+
+  /* Enable single-step, but don't trap current instruction */
+  context.GuestContext.rflags = context.GuestContext.rflags | FLAGS_TF_MASK | FLAGS_RF_MASK;
+}
 
-    TF_on = (context.GuestContext.rflags & FLAGS_TF_MASK) != 0 ? TRUE : FALSE;
-    IF_on = (context.GuestContext.rflags & FLAGS_IF_MASK) != 0 ? TRUE : FALSE;
+void HandleMSR(Bit32u msrnum, hvm_bool iswrite)
+{
+  EVENT_CONDITION_MSR msr;
+  EVENT_PUBLISH_STATUS s;
+  EVENT_ARGUMENTS args;
+  MSR value;
+  hvm_bool ok;
 
-    /* Enable single-step, but don't trap current instruction */
-    context.GuestContext.rflags = context.GuestContext.rflags | FLAGS_TF_MASK | FLAGS_RF_MASK;
+  msr.access = iswrite ? EventMSRAccessWrite : EventMSRAccessRead;
+  msr.msrnum = msrnum;
+
+  args.EventMSR.msrnum  = msrnum;
+  args.EventMSR.iswrite = iswrite;
+
+  s = EventPublish(EventMSR, &args, &msr, sizeof(msr));
+
+  if (s == EventPublishHandled) {
+    /* The plugin emulated the access */
+    return;
+  }
+
+  /* Perform the access on behalf of the guest: on its copy of the MSR if
+     the VMCS has one, otherwise on the real one */
+  if (iswrite) {
+    ok = hvm_x86_ops.vt_write_guest_msr(msrnum, (Bit32u) context.GuestContext.rdx, (Bit32u) context.GuestContext.rax) ||
+      WriteMSRSafe(msrnum, (Bit32u) context.GuestContext.rdx, (Bit32u) context.GuestContext.rax);
+  } else {
+    ok = hvm_x86_ops.vt_read_guest_msr(msrnum, &value) || ReadMSRSafe(msrnum, &value);
+    if (ok) {
+      context.GuestContext.rax = value.Lo;
+      context.GuestContext.rdx = value.Hi;
+    }
+  }
+
+  if (!ok) {
+    /* The guest would have faulted on its own */
+    hvm_x86_ops.hvm_inject_hw_exception(TRAP_GP_FAULT, 0);
+    context.GuestContext.resumerip = context.GuestContext.rip;
   }
 }
 
@@ -204,9 +516,12 @@ void HandleNMI(Bit32u trap, Bit32u error_code, Bit32u qualification)
 {
   EVENT_PUBLISH_STATUS s;
   EVENT_CONDITION_EXCEPTION e;
+  EVENT_ARGUMENTS args;
   hvm_bool isSynteticDebug;
 
   isSynteticDebug = FALSE;
+
+  ExitStatsRecordException(trap);
   
   switch (trap) {
   case TRAP_PAGE_FAULT:
@@ -231,8 +546,9 @@ void HandleNMI(Bit32u trap, Bit32u error_code, Bit32u qualification)
 
   /* Publish this exception */
   e.exceptionnum = trap;
+  args.EventException.qualification = qualification;
 
-  s = EventPublish(EventException, NULL, &e, sizeof(e));
+  s = EventPublish(EventException, &args, &e, sizeof(e));
   
   if (s == EventPublishNone || s == EventPublishPass) {
     if (isSynteticDebug) {
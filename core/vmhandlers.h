@@ -32,13 +32,23 @@ void HandleVMCALL(void);
 void HandleVMLAUNCH(void);
 void HandleNMI(Bit32u trap, Bit32u error_code, Bit32u qualification);
 void HandleIO(Bit16u port, hvm_bool isoutput, Bit8u size, hvm_bool isstring, hvm_bool isrep);
+void HandleMSR(Bit32u msrnum, hvm_bool iswrite);
 void HandleCR(Bit8u crno, VtCrAccessType accesstype, hvm_bool ismemory, VtRegister gpr);
 void HandleHLT(void);
+void HandleMTF(void);
 
 #ifdef ENABLE_EPT
 void HandleEPTViolation(hvm_address guest_linear, hvm_address guest_phy, hvm_bool is_linear_valid, Bit8u attempt_type, hvm_bool in_page_walk, hvm_bool fill_an_entry);
 #endif
 
 EVENT_PUBLISH_STATUS HypercallSwitchOff(PEVENT_ARGUMENTS args);
+EVENT_PUBLISH_STATUS HypercallExitStats(PEVENT_ARGUMENTS args);
+EVENT_PUBLISH_STATUS HypercallTraceRead(PEVENT_ARGUMENTS args);
+
+#ifdef ENABLE_EPT
+EVENT_PUBLISH_STATUS HypercallDirtyLog(PEVENT_ARGUMENTS args);
+EVENT_PUBLISH_STATUS HypercallSnapshot(PEVENT_ARGUMENTS args);
+EVENT_PUBLISH_STATUS EptWriteHandler(PEVENT_ARGUMENTS args);
+#endif
 
 #endif	/*  _VMHANDLERS_H */
@@ -27,7 +27,6 @@
 #elif defined GUEST_LINUX
 #include <linux/kernel.h>
 #include <linux/slab.h>
-#include <linux/mempool.h>
 #endif
 
 #include "types.h"
@@ -36,6 +35,7 @@
 #include "x86.h"
 #include "msr.h"
 #include "mmu.h"
+#include "exitstats.h"
 #include "vmx.h"
 #include "config.h"
 #include "common.h"
@@ -43,6 +43,8 @@
 #include "events.h"
 #include "debug.h"
 #include "vmmstring.h"
+#include "smp.h"
+#include "sampler.h"
 
 #ifdef ENABLE_EPT
 #include "ept.h"
@@ -52,39 +54,92 @@
 #define VMX_MEMTYPE_UNCACHEABLE 0
 #define VMX_MEMTYPE_WRITEBACK   6
 
-static struct {
+/* VPID of each processor. VPID 0 tags the translations of the VMM itself */
+#define VMX_VPID(cpu) ((cpu) + 1)
+
+/* VMCS fields that are read on first use after each VM exit, through
+   VmxLazyRead() */
+typedef enum {
+  VMX_LAZY_EXIT_QUALIFICATION = 0,
+  VMX_LAZY_EXIT_INTR_INFO,
+  VMX_LAZY_EXIT_INTR_ERROR_CODE,
+  VMX_LAZY_IDT_VECTORING_INFO,
+  VMX_LAZY_IDT_VECTORING_ERROR_CODE,
+  VMX_LAZY_INSTRUCTION_INFO,
+  VMX_LAZY_GUEST_LINEAR_ADDRESS,
+  VMX_LAZY_GUEST_PHYSICAL_ADDRESS,
+  VMX_LAZY_GUEST_CS,
+  VMX_LAZY_GUEST_CR0,
+  VMX_LAZY_GUEST_CR4,
+  VMX_LAZY_FIELDS,
+} VMX_LAZY_FIELD;
+
+static const Bit32u vmxLazyEncoding[VMX_LAZY_FIELDS] = {
+  EXIT_QUALIFICATION,
+  VM_EXIT_INTR_INFO,
+  VM_EXIT_INTR_ERROR_CODE,
+  IDT_VECTORING_INFO_FIELD,
+  IDT_VECTORING_ERROR_CODE,
+  VMX_INSTRUCTION_INFO,
+  GUEST_LINEAR_ADDRESS,
+  GUEST_PHYSICAL_ADDRESS,
+  GUEST_CS_SELECTOR,
+  GUEST_CR0,
+  GUEST_CR4,
+};
+
+/* Guest fields changed by the handlers, written back to the VMCS before VM
+   entry */
+#define VMX_DIRTY_CR0 (1 << 0)
+#define VMX_DIRTY_CR3 (1 << 1)
+#define VMX_DIRTY_CR4 (1 << 2)
+
+/* With TF clear, and RSP and RFLAGS left alone by the handlers, an I/O exit
+   takes 9 VMREADs and 1 VMWRITE, and a #DB exit 10 and 1. Reading and
+   writing back the whole state took 19 and 8 */
+typedef struct {
+  /* Read on every exit */
   Bit32u ExitReason;
-  Bit32u ExitQualification;
-  Bit32u ExitInterruptionInformation;
-  Bit32u ExitInterruptionErrorCode;
   Bit32u ExitInstructionLength;
-  Bit32u ExitInstructionInformation;
+  hvm_address GuestRsp;		/* As read from the VMCS */
+  hvm_address GuestRflags;
 
-  Bit32u IDTVectoringInformationField;
-  Bit32u IDTVectoringErrorCode;
+  Bit32u Valid;			/* Bit n set if Lazy[n] has been read */
+  Bit32u Lazy[VMX_LAZY_FIELDS];
+  Bit32u Dirty;
+} VMX_EXIT_STATE;
 
-#ifdef ENABLE_EPT
-  hvm_address     GuestLinearAddress;
-  hvm_phy_address GuestPhysicalAddress;
-#endif
-	
-} vmxcontext;
+/* Exit state of the processor that is handling the current VM exit */
+#define vmxcpu     (vmxCpus[VtCurrentCpu()->id])
+#define vmxcontext (vmxcpu.Exit)
 
 /* VMX operations */
 static hvm_bool   VmxHasCPUSupport(void);
 static hvm_bool   VmxIsEnabled(void);
-static hvm_status VmxInitialize(void (*idt_initializer)(PIDT_ENTRY pidt));
+static hvm_status VmxInitialize(void (*idt_initializer)(PIDT_ENTRY pidt), Bit32u ncpus);
 static hvm_status VmxFinalize(void);
-static hvm_status VmxHardwareEnable(void);
+static hvm_status VmxHardwareEnable(Bit32u cpu);
 static hvm_status VmxHardwareDisable(void);
 static void       VmxInvalidateTLB(void);
+static void       VmxInvalidateTLBPage(hvm_address va);
 static void       VmxSetCr0(hvm_address cr0);
 static void       VmxSetCr3(hvm_address cr3);
 static void       VmxSetCr4(hvm_address cr4);
+static void       VmxSetDr(Bit8u drno, hvm_address value);
+static hvm_address VmxGetDr(Bit8u drno);
 static void       VmxTrapIO(hvm_bool enabled);
+static hvm_status VmxTrapMTF(hvm_bool enabled);
 static Bit32u     VmxGetExitInstructionLength(void);
+static void       VmxReadGuestState(void);
+static hvm_bool   VmxReadGuestMSR(Bit32u msr, PMSR value);
+static hvm_bool   VmxWriteGuestMSR(Bit32u msr, Bit32u highpart, Bit32u lowpart);
+static hvm_status VmxSetSampleTimer(Bit64u period);
+static void       VmxSyncCpu(void);
 
-static hvm_status          VmxVmcsInitialize(hvm_address guest_stack, hvm_address guest_return, hvm_address host_cr3);
+#ifdef ENABLE_EPT
+static hvm_status          VmxEptInitialize(void);
+#endif
+static hvm_status          VmxVmcsInitialize(Bit32u cpu, hvm_address guest_stack, hvm_address guest_return, hvm_address host_cr3);
 static Bit32u     USESTACK VmxVmcsRead(Bit32u encoding);
        void       USESTACK VmxVmcsWrite(Bit32u encoding, Bit32u value) asm("_VmxVmcsWrite");
 
@@ -108,6 +163,7 @@ void            VmxResume(void);
 Bit32u USESTACK VmxRead(Bit32u encoding);
 void   USESTACK VmxWrite(Bit32u encoding, Bit32u value);
 void   USESTACK VmxVmCall(Bit32u num);
+void   USESTACK VmxInvvpid(Bit32u type, Bit32u vpid, hvm_address va);
 void            VmxHvmHandleExit(void);
 #ifdef ENABLE_EPT
 void   USESTACK EptInvept(Bit32u eptp_high, Bit32u eptp_low, Bit32u rsvd_high, Bit32u rsvd_low);
@@ -130,11 +186,20 @@ struct HVM_X86_OPS hvm_x86_ops = {
   &VmxSetCr0,			/* vt_set_cr0 */
   &VmxSetCr3,			/* vt_set_cr3 */
   &VmxSetCr4,			/* vt_set_cr4 */
+  &VmxSetDr,			/* vt_set_dr */
+  &VmxGetDr,			/* vt_get_dr */
   &VmxTrapIO,			/* vt_trap_io */
+  &VmxTrapMTF,			/* vt_trap_mtf */
   &VmxGetExitInstructionLength,	/* vt_get_exit_instr_len */
+  &VmxReadGuestState,		/* vt_read_guest_state */
+  &VmxReadGuestMSR,		/* vt_read_guest_msr */
+  &VmxWriteGuestMSR,		/* vt_write_guest_msr */
+  &VmxSetSampleTimer,		/* vt_set_sample_timer */
+  &VmxSyncCpu,			/* vt_sync_cpu */
 
   /* Memory management */
   &VmxInvalidateTLB,     	/* mmu_tlb_flush */
+  &VmxInvalidateTLBPage,	/* mmu_tlb_flush_page */
 
   /* HVM-related */
   &VmxHvmHandleExit,     	/* hvm_handle_exit */
@@ -146,17 +211,40 @@ struct HVM_X86_OPS hvm_x86_ops = {
 /* Utility functions */
 static Bit32u VmxAdjustControls(Bit32u Ctl, Bit32u Msr);
 static void   VmxReadGuestContext(void);
-
-/* This global structure represents the initial VMX state. All these variables
-   are wrapped together in order to be exposed to the plugins. */
-typedef struct {
+static Bit32u VmxLazyRead(VMX_LAZY_FIELD field);
+static void   VmxLazySet(VMX_LAZY_FIELD field, Bit32u value);
+static hvm_status VmxCpuInitialize(Bit32u cpu, hvm_address cr3);
+static void   VmxSetHardwareDr(Bit8u drno, hvm_address value);
+static void   VmxArmSampleTimer(void);
+static void   VmxDetectVpid(void);
+static void   VmxDetectPreemptionTimer(void);
+static void   VmxFlushGuestTLB(Bit32u type, hvm_address va);
+
+/* State of each processor */
+typedef struct __attribute__((aligned(VT_CACHE_LINE))) {
   Bit32u*           pVMXONRegion;	    /* VMA of VMXON region */
   hvm_phy_address   PhysicalVMXONRegionPtr; /* PMA of VMXON region */
 
   Bit32u*           pVMCSRegion;	    /* VMA of VMCS region */
   hvm_phy_address   PhysicalVMCSRegionPtr;  /* PMA of VMCS region */
 
-  void*             VMMStack;               /* VMM stack area */
+  void*             VMMStackArea;           /* VMM stack area, as allocated */
+  void*             VMMStack;               /* VMM stack, aligned to its size */
+
+  hvm_bool          Active;                 /* In VMX operation */
+  Bit32u            DrGeneration;           /* Last vmxDrGeneration loaded */
+  Bit32u            DrSlots;                /* vmxDrSlots when it was loaded */
+  Bit32u            SampleGeneration;       /* Last vmxSampleGeneration armed */
+#ifdef ENABLE_EPT
+  Bit32u            EptGeneration;          /* Last EPTGeneration flushed */
+#endif
+
+  VMX_EXIT_STATE    Exit;
+} VMX_CPU_STATE, *PVMX_CPU_STATE;
+
+/* State shared by all the processors */
+typedef struct {
+  Bit32u            NumCpus;
 
   Bit32u*           pIOBitmapA;	            /* VMA of I/O bitmap A */
   hvm_phy_address   PhysicalIOBitmapA;      /* PMA of I/O bitmap A */
@@ -164,13 +252,41 @@ typedef struct {
   Bit32u*           pIOBitmapB;	            /* VMA of I/O bitmap B */
   hvm_phy_address   PhysicalIOBitmapB;      /* PMA of I/O bitmap B */
 
+  Bit32u*           pMSRBitmap;	            /* VMA of MSR bitmaps */
+  hvm_phy_address   PhysicalMSRBitmap;      /* PMA of MSR bitmaps */
+
   PIDT_ENTRY        VMMIDT;                 /* VMM interrupt descriptor table */
+
+  Bit32u            VpidCaps;               /* IA32_VMX_EPT_VPID_CAP[63:32], 0
+					       if VPIDs are not used */
+
+  hvm_bool          PreemptionTimer;        /* Usable for sampling */
+  Bit32u            PreemptionTimerRate;    /* log2 of TSC cycles per tick */
 } VMX_INIT_STATE, *PVMX_INIT_STATE;
 
-static hvm_bool       vmxIsActive = FALSE;
+static Bit32u         vmxActiveCpus = 0;
 static VMX_INIT_STATE vmxInitState;
+static VMX_CPU_STATE  vmxCpus[VT_MAX_CPUS];
+
+/* Debug registers set through vt_set_dr(). They are loaded by each processor
+   on its first VM exit after a change (see VmxSyncCpu()). Only the slots
+   in use by the VMM (bit n for DRn, set while DRn is not 0) are copied: the
+   guest keeps its own breakpoints, and its DR7 fields for the other slots */
+static hvm_address    vmxDr[4];
+static hvm_address    vmxDr7 = 0x400;
+static Bit32u         vmxDrSlots = 0;
+static volatile Bit32u vmxDrGeneration = 0;
+
+/* DR7 fields of debug register n: L, G, R/W and LEN */
+#define VMX_DR7_FIELDS(n) ((3 << ((n)*2)) | (0xf << (16 + (n)*4)))
+#define VMX_DR7_GE        (1 << 9)
 static hvm_bool	      HandlerLogging = FALSE;
 
+/* Preemption timer value set by vt_set_sample_timer() (0 if sampling is
+   off), armed by each processor on its first VM exit after a change */
+static Bit32u          vmxSampleTicks = 0;
+static volatile Bit32u vmxSampleGeneration = 0;
+
 static Bit32u USESTACK VmxVmcsRead(Bit32u encoding)
 {
   return VmxRead(encoding);
@@ -186,6 +302,9 @@ void USESTACK VmxVmcsWrite(Bit32u encoding, Bit32u value)
   case PIN_BASED_VM_EXEC_CONTROL:
     value = VmxAdjustControls(value, IA32_VMX_PINBASED_CTLS);
     break;
+  case SECONDARY_VM_EXEC_CONTROL:
+    value = VmxAdjustControls(value, IA32_VMX_PROCBASED_CTLS2);
+    break;
   case VM_ENTRY_CONTROLS:
     value = VmxAdjustControls(value, IA32_VMX_ENTRY_CTLS);
     break;
@@ -201,26 +320,39 @@ void USESTACK VmxVmcsWrite(Bit32u encoding, Bit32u value)
 
 static hvm_bool VmxIsEnabled(void)
 {
-  return vmxIsActive;
+  return vmxActiveCpus != 0;
+}
+
+#ifdef ENABLE_EPT
+/* Build the 1:1 EPT paging structures */
+static hvm_status VmxEptInitialize(void)
+{
+  EPTInit();
+
+  return EPTBuildIdentityMap();
 }
+#endif
 
-static hvm_status VmxVmcsInitialize(hvm_address guest_stack, hvm_address guest_return, hvm_address host_cr3)
+static hvm_status VmxVmcsInitialize(Bit32u cpu, hvm_address guest_stack, hvm_address guest_return, hvm_address host_cr3)
 {
+  PVMX_CPU_STATE pcpu;
   IA32_VMX_BASIC_MSR vmxBasicMsr;
   RFLAGS rflags;
   MSR msr;
   GDTR gdt_reg;
   IDTR idt_reg;
   Bit16u seg_selector = 0;
-  Bit32u temp32, gdt_base, idt_base;
+  Bit32u temp32, secondary, gdt_base, idt_base;
 
 #ifdef ENABLE_EPT
-  hvm_phy_address phys_pdpt, phys_pd, phys_pt;
-  hvm_address pdpt, pd, pt;
-  Bit32u i, j, h, map;
   Bit64u temp64;
 #endif
 
+  if (cpu >= vmxInitState.NumCpus)
+    return HVM_STATUS_UNSUCCESSFUL;
+
+  pcpu = &vmxCpus[cpu];
+
 	// GDT Info
   __asm__ __volatile__ (
 			"sgdt %0\n"
@@ -264,7 +396,7 @@ static hvm_status VmxVmcsInitialize(hvm_address guest_stack, hvm_address guest_r
   // (2) Initialize the version identifier in the VMCS (first 32 bits)
   //	 with the VMCS revision identifier reported by the VMX
   //	 capability MSR IA32_VMX_BASIC.
-  *(vmxInitState.pVMCSRegion) = vmxBasicMsr.RevId;
+  *(pcpu->pVMCSRegion) = vmxBasicMsr.RevId;
 
   // (3) Execute the VMCLEAR instruction by supplying the guest-VMCS address.
   //	 This will initialize the new VMCS region in memory and set the launch
@@ -272,7 +404,7 @@ static hvm_status VmxVmcsInitialize(hvm_address guest_stack, hvm_address guest_r
   //	 working-VMCS pointer register to FFFFFFFF_FFFFFFFFH. Software should
   //	 verify successful execution of VMCLEAR by checking if RFLAGS.CF = 0
   //	 and RFLAGS.ZF = 0.
-  FLAGS_TO_ULONG(rflags) = VmxClear(GET32H(vmxInitState.PhysicalVMCSRegionPtr), GET32L(vmxInitState.PhysicalVMCSRegionPtr));
+  FLAGS_TO_ULONG(rflags) = VmxClear(GET32H(pcpu->PhysicalVMCSRegionPtr), GET32L(pcpu->PhysicalVMCSRegionPtr));
 
   if(rflags.CF != 0 || rflags.ZF != 0) {
     Log("ERROR: VMCLEAR operation failed");
@@ -284,7 +416,7 @@ static hvm_status VmxVmcsInitialize(hvm_address guest_stack, hvm_address guest_r
   // (4) Execute the VMPTRLD instruction by supplying the guest-VMCS address.
   //	 This initializes the working-VMCS pointer with the new VMCS region's
   //	 physical address.
-  VmxPtrld(GET32H(vmxInitState.PhysicalVMCSRegionPtr), GET32L(vmxInitState.PhysicalVMCSRegionPtr));
+  VmxPtrld(GET32H(pcpu->PhysicalVMCSRegionPtr), GET32L(pcpu->PhysicalVMCSRegionPtr));
 
   //
   //  ***********************************
@@ -336,8 +468,12 @@ static hvm_status VmxVmcsInitialize(hvm_address guest_stack, hvm_address guest_r
   //	* H.3.1 32-Bit Control Fields *
   //	*******************************
 
-  /* Pin-based VM-execution controls */
-  VmxVmcsWrite(PIN_BASED_VM_EXEC_CONTROL, 0);
+  /* Pin-based VM-execution controls. With more than one processor, NMIs exit
+     as they are used to stop the processors (see SmpFreezeOthers()) */
+  temp32 = 0;
+  if (SmpCpuCount() > 1)
+    CmSetBit32(&temp32, PIN_BASED_NMI_EXITING);
+  VmxVmcsWrite(PIN_BASED_VM_EXEC_CONTROL, temp32);
 
   /* Primary processor-based VM-execution controls */
   temp32 = 0;
@@ -352,6 +488,10 @@ static hvm_status VmxVmcsInitialize(hvm_address guest_stack, hvm_address guest_r
   VmxVmcsWrite(IO_BITMAP_B_HIGH, GET32H(vmxInitState.PhysicalIOBitmapB));  
   VmxVmcsWrite(IO_BITMAP_B,      GET32L(vmxInitState.PhysicalIOBitmapB)); 
 
+  /* MSR bitmaps */
+  VmxVmcsWrite(MSR_BITMAP_HIGH, GET32H(vmxInitState.PhysicalMSRBitmap));
+  VmxVmcsWrite(MSR_BITMAP,      GET32L(vmxInitState.PhysicalMSRBitmap));
+
   /* Time-stamp counter offset */
   VmxVmcsWrite(TSC_OFFSET, 0);
   VmxVmcsWrite(TSC_OFFSET_HIGH, 0);
@@ -513,8 +653,8 @@ static hvm_status VmxVmcsInitialize(hvm_address guest_stack, hvm_address guest_r
   //	 virtual-8086 guest execution.
 
   /* Clear the VMX Abort Error Code prior to VMLAUNCH */
-  vmm_memset((vmxInitState.pVMCSRegion + 4), 0, 4);
-  Log("Clearing VMX abort error code: %.8x", *(vmxInitState.pVMCSRegion + 4));
+  vmm_memset((pcpu->pVMCSRegion + 4), 0, 4);
+  Log("Clearing VMX abort error code: %.8x", *(pcpu->pVMCSRegion + 4));
 
   /* Set RIP, RSP for the Guest right before calling VMLAUNCH */
   Log("Setting Guest RSP to %.8x", guest_stack);
@@ -523,86 +663,34 @@ static hvm_status VmxVmcsInitialize(hvm_address guest_stack, hvm_address guest_r
   Log("Setting Guest RIP to %.8x", guest_return);
   VmxVmcsWrite(GUEST_RIP, (hvm_address) guest_return);
 
-  /* Set RIP, RSP for the Host right before calling VMLAUNCH */
-  Log("Setting Host RSP to %.8x", ((hvm_address) vmxInitState.VMMStack + VMM_STACK_SIZE - 1));
-  VmxVmcsWrite(HOST_RSP, ((hvm_address) vmxInitState.VMMStack + VMM_STACK_SIZE - 1));
+  /* Set RIP, RSP for the Host right before calling VMLAUNCH. The base of the
+     stack holds the processor descriptor, found by VtCurrentCpu() masking the
+     stack pointer */
+  *(PVT_CPU*) pcpu->VMMStack = &vt_cpus[cpu];
+  Log("Setting Host RSP to %.8x", ((hvm_address) pcpu->VMMStack + VMM_STACK_SIZE - 16));
+  VmxVmcsWrite(HOST_RSP, ((hvm_address) pcpu->VMMStack + VMM_STACK_SIZE - 16));
 
   Log("Setting Host RIP to %.8x", hvm_x86_ops.hvm_handle_exit);
   VmxVmcsWrite(HOST_RIP, (hvm_address) hvm_x86_ops.hvm_handle_exit);
 
-#ifdef ENABLE_EPT
-
-  EPTInit();
-
-  /* Init Virtual PT Bases */
-  vmm_memset(VIRT_PT_BASES, 0, HOST_GB*512*sizeof(hvm_address));
-  /* Allocate memory for EPT paging structures */
-
-  /* We need only one entry of EPT PML4 table */
-  Pml4 = (hvm_address)GUEST_MALLOC(4096);	/* Alloc 4K to be sure of 4K alignment :-( */
-  MmuGetPhysicalAddress(RegGetCr3(), Pml4, &Phys_Pml4);
-  vmm_memset((void *)Pml4, 0, 4096);
-
-  /* We need only HOST_GB entries of EPT PDPT */
-  pdpt = (hvm_address)GUEST_MALLOC(4096);	/* Alloc 4K to be sure of 4K alignment :-( */
-  MmuGetPhysicalAddress(RegGetCr3(), pdpt, &phys_pdpt);
-  vmm_memset((void *)pdpt, 0, 4096);
+  /* Secondary processor-based VM-execution controls */
+  secondary = 0;
 
-  /* Fill PML4E with PDPT base address and RWX permissions */
-  *(hvm_address *)Pml4 = (GET32L(phys_pdpt) & 0xfffff000) | 0x7;
-
-  map = 0;
-
-  for(i = 0; i < HOST_GB; i++) {
-
-    /* Allocate memory for PD */
-    pd = (hvm_address)GUEST_MALLOC(4096);
-    if(!pd) {
-      return HVM_STATUS_UNSUCCESSFUL;
-    }
-    MmuGetPhysicalAddress(RegGetCr3(), pd, &phys_pd);
-    vmm_memset((void *)pd, 0, 4096);
-
-    /* Fill i-th PDPTE with i-th PD baseaddr and RWX permissions */
-    *(hvm_address *)(pdpt+i*8) = (GET32L(phys_pd) & 0xfffff000) | 0x7;
-
-    for(j = 0; j < 4096; j=j+8) {
-
-      /* Allocate memory for PT */
-      pt = (hvm_address)GUEST_MALLOC(4096);
-      if(!pt) {
-				return HVM_STATUS_UNSUCCESSFUL;
-      }
-      /* Store Virtual PT base in ad-hoc array */
-      VIRT_PT_BASES[(i*512) + (j/8)] = pt;
-      /* Get Phys Addr */
-      MmuGetPhysicalAddress(RegGetCr3(), pt, &phys_pt);
-      vmm_memset((void *)pt, 0, 4096);
-
-      /* Fill j-th PDE with PT baseaddr and RWX permissions */
-      *(hvm_address *)(pd+j) = (GET32L(phys_pt) & 0xfffff000) | 0x7;
-
-      /* 1:1 physical memory mapping */
-      for(h = 0; h < 4096; h=h+8) {
-      	/* Log("Fill PDPT[%d] PD[%d] PT[%d] with 0x%08hx", i, j/8, h/8, ((map << 12) | 0x37)); */
-				*(hvm_address *)(pt+h) = (map << 12) | ((Bit8u) EPTGetMemoryType((map << 12)) << 3) | READ | WRITE | EXEC;
-      	map++;
-      }
-    }
-  }
+#ifdef ENABLE_EPT
 
-  temp32 = VmxVmcsRead(CPU_BASED_VM_EXEC_CONTROL);
-  CmSetBit32(&temp32, CPU_BASED_PRIMARY_ACTIVATE_SEC); /* Activate secondary controls */
-  VmxVmcsWrite(CPU_BASED_VM_EXEC_CONTROL, temp32);
+  /* EPT paging structures are shared by all the processors */
+  if (!Pml4 && !HVM_SUCCESS(VmxEptInitialize()))
+    return HVM_STATUS_UNSUCCESSFUL;
 
-  /* Write EPTP (Memory Type WB, Page Walk 4 ---> 3 = 0x1e) */
+  /* Write EPTP (Memory Type WB, Page Walk 4 ---> 3 = 0x1e), with the
+     accessed and dirty flags if available (used by dirty logging) */
   temp64 = 0;
   temp64 = (Phys_Pml4 & 0xfffff000) | 0x1e;
+  if (EPTAccessDirty)
+    temp64 |= EPTP_ACCESS_DIRTY;
   VmxVmcsWrite(EPTP_ADDR, temp64);
 
-  temp32 = 0;
-  CmSetBit32(&temp32, 1); /* Enable EPT */
-  VmxVmcsWrite(SECONDARY_VM_EXEC_CONTROL, temp32);
+  CmSetBit32(&secondary, SECONDARY_ENABLE_EPT);
 
   vmm_memset(&EPTInveptDesc, 0, sizeof(EPTInveptDesc));
   EPTInveptDesc.Eptp = VmxVmcsRead(EPTP_ADDR);
@@ -610,65 +698,107 @@ static hvm_status VmxVmcsInitialize(hvm_address guest_stack, hvm_address guest_r
   Log("SUCCESS: EPT enabled.");
 
 #endif
+
+  /* Tag the guest translations, so that they are not flushed on each VM exit
+     and entry. Translations left by a previous VMM instance with the same
+     VPID are dropped */
+  if (vmxInitState.VpidCaps) {
+    VmxVmcsWrite(VIRTUAL_PROCESSOR_ID, VMX_VPID(cpu));
+    CmSetBit32(&secondary, SECONDARY_ENABLE_VPID);
+    VmxInvvpid((vmxInitState.VpidCaps & VPID_CAP_INVVPID_SINGLE) ? INVVPID_SINGLE : INVVPID_ALL, VMX_VPID(cpu), 0);
+    Log("VPID %d assigned to processor #%d", VMX_VPID(cpu), cpu);
+  }
+
+  if (secondary) {
+    temp32 = VmxVmcsRead(CPU_BASED_VM_EXEC_CONTROL);
+    CmSetBit32(&temp32, CPU_BASED_PRIMARY_ACTIVATE_SEC); /* Activate secondary controls */
+    VmxVmcsWrite(CPU_BASED_VM_EXEC_CONTROL, temp32);
+
+    VmxVmcsWrite(SECONDARY_VM_EXEC_CONTROL, secondary);
+  }
   
   return HVM_STATUS_SUCCESS;
 }
 
-static hvm_status VmxInitialize(void (*idt_initializer)(PIDT_ENTRY pidt))
+static hvm_status VmxCpuInitialize(Bit32u cpu, hvm_address cr3)
 {
+  PVMX_CPU_STATE pcpu;
   hvm_status r;
-  hvm_address cr3;
-#ifdef GUEST_LINUX
-  mempool_t* pool;
-#endif
 
-  cr3 = RegGetCr3();
-  
+  pcpu = &vmxCpus[cpu];
+
   /* Allocate the VMXON region memory */
-  vmxInitState.pVMXONRegion = (Bit32u*) GUEST_MALLOC(4096);
+  pcpu->pVMXONRegion = (Bit32u*) GUEST_MALLOC(4096);
   
-  if(vmxInitState.pVMXONRegion == NULL) {
+  if(pcpu->pVMXONRegion == NULL) {
     GuestLog("ERROR: Allocating VMXON region memory");
     return HVM_STATUS_UNSUCCESSFUL;
   }
-  vmm_memset(vmxInitState.pVMXONRegion, 0, 4096);
+  vmm_memset(pcpu->pVMXONRegion, 0, 4096);
   
-  r = MmuGetPhysicalAddress(cr3, (hvm_address) vmxInitState.pVMXONRegion, &vmxInitState.PhysicalVMXONRegionPtr);
+  r = MmuGetPhysicalAddress(cr3, (hvm_address) pcpu->pVMXONRegion, &pcpu->PhysicalVMXONRegionPtr);
   if (r != HVM_STATUS_SUCCESS) {
     GuestLog("ERROR: Can't determine physical address for VMXON region");
     return HVM_STATUS_UNSUCCESSFUL;
   }
 
   /* Allocate the VMCS region memory */
-  vmxInitState.pVMCSRegion = (Bit32u*) GUEST_MALLOC(4096);    
+  pcpu->pVMCSRegion = (Bit32u*) GUEST_MALLOC(4096);    
     
-  if(vmxInitState.pVMCSRegion == NULL) {
+  if(pcpu->pVMCSRegion == NULL) {
     GuestLog("ERROR: Allocating VMCS region memory");
     return HVM_STATUS_UNSUCCESSFUL;
   }
-  vmm_memset(vmxInitState.pVMCSRegion, 0, 4096);
+  vmm_memset(pcpu->pVMCSRegion, 0, 4096);
   
-  r = MmuGetPhysicalAddress(cr3, (hvm_address) vmxInitState.pVMCSRegion, &vmxInitState.PhysicalVMCSRegionPtr);
+  r = MmuGetPhysicalAddress(cr3, (hvm_address) pcpu->pVMCSRegion, &pcpu->PhysicalVMCSRegionPtr);
   if (r != HVM_STATUS_SUCCESS) {
     GuestLog("ERROR: Can't determine physical address for VMCS region");
     return HVM_STATUS_UNSUCCESSFUL;
   }
   
-  /* Allocate stack for the VM exit handler */
+  /* Allocate stack for the VM exit handler. Twice the size is allocated, so
+     that a VMM_STACK_SIZE-aligned stack fits in it */
 #ifdef GUEST_WINDOWS
-  vmxInitState.VMMStack = ExAllocatePoolWithTag(NonPagedPool, VMM_STACK_SIZE, 'gbdh');
+  pcpu->VMMStackArea = ExAllocatePoolWithTag(NonPagedPool, 2*VMM_STACK_SIZE, 'gbdh');
 #elif defined GUEST_LINUX
-  pool = mempool_create_kmalloc_pool(1,VMM_STACK_SIZE);
-  vmxInitState.VMMStack = mempool_alloc(pool,GFP_KERNEL);
+  pcpu->VMMStackArea = kmalloc(2*VMM_STACK_SIZE, GFP_KERNEL);
 #endif
   
-  if(vmxInitState.VMMStack == NULL) {
+  if(pcpu->VMMStackArea == NULL) {
     GuestLog("ERROR: Allocating VM exit handler stack memory");
     return HVM_STATUS_UNSUCCESSFUL;
   }
-  vmm_memset(vmxInitState.VMMStack, 0, VMM_STACK_SIZE);
+  pcpu->VMMStack = (void*) (((hvm_address) pcpu->VMMStackArea + VMM_STACK_SIZE - 1) & ~(VMM_STACK_SIZE - 1));
+  vmm_memset(pcpu->VMMStack, 0, VMM_STACK_SIZE);
+
+  vt_cpus[cpu].id        = cpu;
+  vt_cpus[cpu].hoststack = (hvm_address) pcpu->VMMStack;
+
+  return HVM_STATUS_SUCCESS;
+}
+
+static hvm_status VmxInitialize(void (*idt_initializer)(PIDT_ENTRY pidt), Bit32u ncpus)
+{
+  hvm_status r;
+  hvm_address cr3;
+  Bit32u i;
+
+  if (ncpus == 0 || ncpus > VT_MAX_CPUS) {
+    GuestLog("ERROR: Unsupported number of processors: %d (max %d)", ncpus, VT_MAX_CPUS);
+    return HVM_STATUS_UNSUCCESSFUL;
+  }
+  vmxInitState.NumCpus = ncpus;
+
+  cr3 = RegGetCr3();
+
+  /* Allocate the per-processor VMXON and VMCS regions and VMM stacks */
+  for (i = 0; i < ncpus; i++) {
+    r = VmxCpuInitialize(i, cr3);
+    if (r != HVM_STATUS_SUCCESS)
+      return r;
+  }
 
- 
   /* Allocate a memory page for the I/O bitmap A */
   vmxInitState.pIOBitmapA = GUEST_MALLOC(4096);
   
@@ -702,6 +832,23 @@ static hvm_status VmxInitialize(void (*idt_initializer)(PIDT_ENTRY pidt))
       return HVM_STATUS_UNSUCCESSFUL;
     }
 
+  /* Allocate a memory page for the MSR bitmaps (read low, read high, write
+     low, write high) */
+  vmxInitState.pMSRBitmap = GUEST_MALLOC(4096);
+
+  if(vmxInitState.pMSRBitmap == NULL) {
+    GuestLog("ERROR: Allocating MSR bitmap memory");
+    return HVM_STATUS_UNSUCCESSFUL;
+  }
+  vmm_memset(vmxInitState.pMSRBitmap, 0, 4096);
+
+  r = MmuGetPhysicalAddress(cr3, (hvm_address) vmxInitState.pMSRBitmap, &vmxInitState.PhysicalMSRBitmap);
+  if (r != HVM_STATUS_SUCCESS)
+    {
+      GuestLog("ERROR: Can't determine physical address for MSR bitmap");
+      return HVM_STATUS_UNSUCCESSFUL;
+    }
+
   /* Allocate & initialize the IDT for the VMM */
   vmxInitState.VMMIDT = GUEST_MALLOC(sizeof(IDT_ENTRY)*256);
  
@@ -711,29 +858,115 @@ static hvm_status VmxInitialize(void (*idt_initializer)(PIDT_ENTRY pidt))
   }
   idt_initializer(vmxInitState.VMMIDT);
 
+  VmxDetectVpid();
+  VmxDetectPreemptionTimer();
+
   return HVM_STATUS_SUCCESS;
 }
 
+/* VPIDs are used only if INVVPID can flush at least a whole context: guest
+   CR3 writes must be emulated with a flush */
+static void VmxDetectVpid(void)
+{
+  MSR msr;
+
+  vmxInitState.VpidCaps = 0;
+
+#ifndef ENABLE_VPID
+  return;
+#endif
+
+  ReadMSR(IA32_VMX_PROCBASED_CTLS, &msr);
+  if (!(msr.Hi & (1 << CPU_BASED_PRIMARY_ACTIVATE_SEC)))
+    return;
+
+  ReadMSR(IA32_VMX_PROCBASED_CTLS2, &msr);
+  if (!(msr.Hi & (1 << SECONDARY_ENABLE_VPID)))
+    return;
+
+  ReadMSR(IA32_VMX_EPT_VPID_CAP, &msr);
+  if (!(msr.Hi & VPID_CAP_INVVPID) ||
+      !(msr.Hi & (VPID_CAP_INVVPID_SINGLE | VPID_CAP_INVVPID_ALL)))
+    return;
+
+  vmxInitState.VpidCaps = msr.Hi;
+  GuestLog("Using VPIDs (INVVPID capabilities: %.8x)", vmxInitState.VpidCaps);
+}
+
+/* The preemption timer is used only if its value can be saved on VM exits:
+   otherwise it would restart from the full period on each VM entry, and
+   never expire in a guest that exits more often than that */
+static void VmxDetectPreemptionTimer(void)
+{
+  MSR msr, misc;
+
+  vmxInitState.PreemptionTimer = FALSE;
+
+  ReadMSR(IA32_VMX_PINBASED_CTLS, &msr);
+  if (!(msr.Hi & (1 << PIN_BASED_PREEMPTION_TIMER)))
+    return;
+
+  ReadMSR(IA32_VMX_EXIT_CTLS, &msr);
+  if (!(msr.Hi & (1 << VM_EXIT_SAVE_PREEMPTION_TIMER)))
+    return;
+
+  ReadMSR(IA32_VMX_MISC, &misc);
+  vmxInitState.PreemptionTimer     = TRUE;
+  vmxInitState.PreemptionTimerRate = misc.Lo & VMX_MISC_PREEMPTION_TIMER_RATE;
+}
+
+/* Flush the guest translations of the current processor. With VPIDs, they
+   survive VM exits and entries, so they must be flushed when the guest
+   changes its paging configuration through a trapped instruction. The
+   narrowest INVVPID type supported by the processor is used */
+static void VmxFlushGuestTLB(Bit32u type, hvm_address va)
+{
+  Bit32u caps;
+
+  caps = vmxInitState.VpidCaps;
+  if (!caps)
+    return;
+
+  if (type == INVVPID_ADDRESS && !(caps & VPID_CAP_INVVPID_ADDRESS))
+    type = INVVPID_SINGLE;
+  if (type == INVVPID_SINGLE_GLOBALS && !(caps & VPID_CAP_INVVPID_SINGLE_GLOBALS))
+    type = INVVPID_SINGLE;
+  if (type == INVVPID_SINGLE && !(caps & VPID_CAP_INVVPID_SINGLE))
+    type = INVVPID_ALL;
+
+  VmxInvvpid(type, VMX_VPID(VtCurrentCpu()->id), va);
+}
+
 static hvm_status VmxFinalize(void)
 {
+  PVMX_CPU_STATE pcpu;
+  Bit32u i;
+
   /* Deallocate memory regions allocated during the initialization phase */
-  if (vmxInitState.pVMXONRegion)
-    GUEST_FREE(vmxInitState.pVMXONRegion, 4096);
-  if (vmxInitState.pVMCSRegion)
-    GUEST_FREE(vmxInitState.pVMCSRegion, 4096);
+  for (i = 0; i < vmxInitState.NumCpus; i++) {
+    pcpu = &vmxCpus[i];
 
-  if (vmxInitState.VMMStack) {
+    if (pcpu->pVMXONRegion)
+      GUEST_FREE(pcpu->pVMXONRegion, 4096);
+    if (pcpu->pVMCSRegion)
+      GUEST_FREE(pcpu->pVMCSRegion, 4096);
+
+    if (pcpu->VMMStackArea) {
 #ifdef GUEST_LINUX
-    mempool_destroy(vmxInitState.VMMStack);
+      kfree(pcpu->VMMStackArea);
 #elif defined GUEST_WINDOWS
-    ExFreePoolWithTag(vmxInitState.VMMStack, 'gbdh');
+      ExFreePoolWithTag(pcpu->VMMStackArea, 'gbdh');
 #endif  
+    }
+    vt_cpus[i].hoststack = 0;
   }
 
   if (vmxInitState.pIOBitmapA)
     GUEST_FREE(vmxInitState.pIOBitmapA , 4096);
   if (vmxInitState.pIOBitmapB)
     GUEST_FREE(vmxInitState.pIOBitmapB , 4096);
+  if (vmxInitState.pMSRBitmap)
+    GUEST_FREE(vmxInitState.pMSRBitmap , 4096);
   if (vmxInitState.VMMIDT)
     GUEST_FREE(vmxInitState.VMMIDT , sizeof(IDT_ENTRY)*256);
 
@@ -758,14 +991,21 @@ static hvm_bool VmxHasCPUSupport(void)
   return (vmxFeatures.VMX != 0);
 }
 
-static hvm_status VmxHardwareEnable(void)
+static hvm_status VmxHardwareEnable(Bit32u cpu)
 {
   IA32_FEATURE_CONTROL_MSR vmxFeatureControl;
   IA32_VMX_BASIC_MSR vmxBasicMsr;
+  PVMX_CPU_STATE pcpu;
   RFLAGS  rflags;
   CR0_REG cr0_reg;
   CR4_REG cr4_reg;
 
+  if (cpu >= vmxInitState.NumCpus) {
+    GuestLog("ERROR: Processor #%d has not been initialized", cpu);
+    return HVM_STATUS_UNSUCCESSFUL;
+  }
+  pcpu = &vmxCpus[cpu];
+
   // (1) Check VMX support in processor using CPUID.
   if (!VmxHasCPUSupport()) {
     GuestLog("VMX support not present");
@@ -807,7 +1047,7 @@ static hvm_status VmxHardwareEnable(void)
 
   // (4) Initialize the version identifier in the VMXON region (first 32 bits)
   //	 with the VMCS revision identifier reported by capability MSRs.
-  *(vmxInitState.pVMXONRegion) = vmxBasicMsr.RevId;
+  *(pcpu->pVMXONRegion) = vmxBasicMsr.RevId;
 	
   GuestLog("vmxBasicMsr.RevId: %.8x", vmxBasicMsr.RevId);
   
@@ -875,7 +1115,7 @@ static hvm_status VmxHardwareEnable(void)
   //	 operand. Check successful execution of VMXON by checking if
   //	 RFLAGS.CF=0.
 
-  FLAGS_TO_ULONG(rflags) = VmxTurnOn(GET32H(vmxInitState.PhysicalVMXONRegionPtr), GET32L(vmxInitState.PhysicalVMXONRegionPtr));
+  FLAGS_TO_ULONG(rflags) = VmxTurnOn(GET32H(pcpu->PhysicalVMXONRegionPtr), GET32L(pcpu->PhysicalVMXONRegionPtr));
 
   if(rflags.CF == 1) {
     GuestLog("ERROR: VMXON operation failed");
@@ -883,7 +1123,8 @@ static hvm_status VmxHardwareEnable(void)
   }
   
   /* VMXON was successful, so we cannot use GuestLog() anymore */
-  vmxIsActive = TRUE;
+  pcpu->Active = TRUE;
+  vmxActiveCpus++;
 
   Log("SUCCESS: VMXON operation completed");
   Log("VMM is now running");
@@ -897,22 +1138,163 @@ static hvm_status VmxHardwareDisable(void)
   return HVM_STATUS_SUCCESS;
 }
 
+/* The VMCS is updated before VM entry */
 static void VmxSetCr0(hvm_address cr0)
 {
 	context.GuestContext.cr0 = cr0;
-  VmxVmcsWrite(GUEST_CR0, cr0);	/* This is redundant but whatever */
+  VmxLazySet(VMX_LAZY_GUEST_CR0, cr0);
+  vmxcontext.Dirty |= VMX_DIRTY_CR0;
+  VmxFlushGuestTLB(INVVPID_SINGLE, 0);
 }
 
+/* As a MOV to CR3, global translations are kept */
 static void VmxSetCr3(hvm_address cr3)
 {
 	context.GuestContext.cr3 = cr3;
-  VmxVmcsWrite(GUEST_CR3, cr3); /* This is redundant but whatever */
+  vmxcontext.Dirty |= VMX_DIRTY_CR3;
+  VmxFlushGuestTLB(INVVPID_SINGLE_GLOBALS, 0);
 }
 
 static void VmxSetCr4(hvm_address cr4)
 {
 	context.GuestContext.cr4 = cr4;
-  VmxVmcsWrite(GUEST_CR4, cr4); /* This is redundant but whatever */
+  VmxLazySet(VMX_LAZY_GUEST_CR4, cr4);
+  vmxcontext.Dirty |= VMX_DIRTY_CR4;
+  VmxFlushGuestTLB(INVVPID_SINGLE, 0);
+}
+
+/* DR0-DR3 are not switched on VM entries and exits, so the guest sees the
+   values we load here. DR7 is loaded from the VMCS */
+static void VmxSetDr(Bit8u drno, hvm_address value)
+{
+  /* Remember the value for the other processors */
+  switch (drno) {
+  case 0: case 1: case 2: case 3:
+    vmxDr[drno] = value;
+    if (value != 0)
+      vmxDrSlots |= 1 << drno;
+    else
+      vmxDrSlots &= ~(1 << drno);
+    break;
+  case 7: vmxDr7 = value; break;
+  default: return;
+  }
+  vmxDrGeneration++;
+  vmxcpu.DrGeneration = vmxDrGeneration;
+  vmxcpu.DrSlots      = vmxDrSlots;
+
+  if (drno == 7)
+    VmxVmcsWrite(GUEST_DR7, value);
+  else
+    VmxSetHardwareDr(drno, value);
+}
+
+static void VmxSetHardwareDr(Bit8u drno, hvm_address value)
+{
+  switch (drno) {
+  case 0: __asm__ __volatile__ ("movl %0,%%dr0\n" ::"r"(value)); break;
+  case 1: __asm__ __volatile__ ("movl %0,%%dr1\n" ::"r"(value)); break;
+  case 2: __asm__ __volatile__ ("movl %0,%%dr2\n" ::"r"(value)); break;
+  case 3: __asm__ __volatile__ ("movl %0,%%dr3\n" ::"r"(value)); break;
+  default: break;
+  }
+}
+
+/* Bring the current processor up to date with the changes made by the others
+   while handling their VM exits */
+static void VmxSyncCpu(void)
+{
+  Bit32u n, dr7, fields;
+
+  if (vmxcpu.DrGeneration != vmxDrGeneration) {
+    vmxcpu.DrGeneration = vmxDrGeneration;
+
+    /* Slots released since the last sync only have their DR7 fields
+       cleared */
+    dr7 = VmxVmcsRead(GUEST_DR7);
+    for (n = 0; n < 4; n++) {
+      if (!((vmxDrSlots | vmxcpu.DrSlots) & (1 << n)))
+	continue;
+
+      fields = VMX_DR7_FIELDS(n);
+      dr7 = (dr7 & ~fields) | ((vmxDrSlots & (1 << n)) ? (vmxDr7 & fields) : 0);
+      if (vmxDrSlots & (1 << n))
+	VmxSetHardwareDr(n, vmxDr[n]);
+    }
+    if (vmxDrSlots)
+      dr7 |= vmxDr7 & VMX_DR7_GE;
+
+    vmxcpu.DrSlots = vmxDrSlots;
+    VmxVmcsWrite(GUEST_DR7, dr7);
+  }
+
+#ifdef ENABLE_EPT
+  if (vmxcpu.EptGeneration != EPTGeneration) {
+    vmxcpu.EptGeneration = EPTGeneration;
+    EPTInvalidate();
+  }
+#endif
+
+  if (vmxcpu.SampleGeneration != vmxSampleGeneration) {
+    vmxcpu.SampleGeneration = vmxSampleGeneration;
+    VmxArmSampleTimer();
+  }
+}
+
+/* Enable (or disable) the preemption timer of the current processor */
+static void VmxArmSampleTimer(void)
+{
+  Bit32u pin, exit;
+
+  pin  = VmxVmcsRead(PIN_BASED_VM_EXEC_CONTROL);
+  exit = VmxVmcsRead(VM_EXIT_CONTROLS);
+
+  if (vmxSampleTicks) {
+    CmSetBit32(&pin,    PIN_BASED_PREEMPTION_TIMER);
+    CmSetBit32(&exit,   VM_EXIT_SAVE_PREEMPTION_TIMER);
+    VmxVmcsWrite(VMX_PREEMPTION_TIMER_VALUE, vmxSampleTicks);
+  } else {
+    CmClearBit32(&pin,  PIN_BASED_PREEMPTION_TIMER);
+    CmClearBit32(&exit, VM_EXIT_SAVE_PREEMPTION_TIMER);
+  }
+
+  VmxVmcsWrite(PIN_BASED_VM_EXEC_CONTROL, pin);
+  VmxVmcsWrite(VM_EXIT_CONTROLS, exit);
+}
+
+static hvm_status VmxSetSampleTimer(Bit64u period)
+{
+  Bit64u ticks;
+
+  if (period != 0 && !vmxInitState.PreemptionTimer)
+    return HVM_STATUS_UNSUCCESSFUL;
+
+  ticks = period >> vmxInitState.PreemptionTimerRate;
+  if (period != 0 && ticks == 0)
+    ticks = 1;
+  if (ticks > 0xffffffffULL)
+    ticks = 0xffffffff;
+
+  vmxSampleTicks = (Bit32u) ticks;
+  vmxSampleGeneration++;
+
+  return HVM_STATUS_SUCCESS;
+}
+
+static hvm_address VmxGetDr(Bit8u drno)
+{
+  hvm_address value;
+
+  switch (drno) {
+  case 0: __asm__ __volatile__ ("movl %%dr0,%0\n" :"=r"(value)); break;
+  case 1: __asm__ __volatile__ ("movl %%dr1,%0\n" :"=r"(value)); break;
+  case 2: __asm__ __volatile__ ("movl %%dr2,%0\n" :"=r"(value)); break;
+  case 3: __asm__ __volatile__ ("movl %%dr3,%0\n" :"=r"(value)); break;
+  case 7: value = VmxVmcsRead(GUEST_DR7); break;
+  default: value = 0; break;
+  }
+
+  return value;
 }
 
 static void VmxTrapIO(hvm_bool enabled)
@@ -932,6 +1314,28 @@ static void VmxTrapIO(hvm_bool enabled)
   VmxVmcsWrite(CPU_BASED_VM_EXEC_CONTROL, v);
 }
 
+static hvm_status VmxTrapMTF(hvm_bool enabled)
+{
+  Bit32u v;
+
+  v = VmxVmcsRead(CPU_BASED_VM_EXEC_CONTROL);
+
+  if (enabled) {
+    /* Exit right after the next guest instruction */
+    CmSetBit32(&v,   CPU_BASED_MONITOR_TRAP_FLAG);
+  } else {
+    CmClearBit32(&v, CPU_BASED_MONITOR_TRAP_FLAG);
+  }
+
+  VmxVmcsWrite(CPU_BASED_VM_EXEC_CONTROL, v);
+
+  /* VmxVmcsWrite() silently drops the controls the CPU does not support */
+  if (enabled && (VmxVmcsRead(CPU_BASED_VM_EXEC_CONTROL) & (1 << CPU_BASED_MONITOR_TRAP_FLAG)) == 0)
+    return HVM_STATUS_UNSUCCESSFUL;
+
+  return HVM_STATUS_SUCCESS;
+}
+
 static Bit32u VmxGetExitInstructionLength(void)
 {
   return vmxcontext.ExitInstructionLength;
@@ -945,6 +1349,15 @@ static void VmxInvalidateTLB(void)
 			 );
 }
 
+static void VmxInvalidateTLBPage(hvm_address va)
+{
+  __asm__ __volatile__ (
+			"invlpg (%0)\n"
+			::"r"(va)
+			:"memory"
+			);
+}
+
 Bit32u VmxAdjustControls(Bit32u c, Bit32u n)
 {
   MSR msr;
@@ -966,44 +1379,106 @@ Bit32u VmxAdjustControls(Bit32u c, Bit32u n)
 
    NOTE: general purpose registers are not stored into the VMCS, so they are
    saved at the very beginning of the VmxEntryPoint() procedure */
+/* Only the fields needed by (almost) every exit are read here, the others
+   are read by VmxLazyRead() */
 static void VmxReadGuestContext(void)
 {
   /* Exit state */
-  vmxcontext.ExitReason                   = VmxRead(VM_EXIT_REASON);
-  vmxcontext.ExitQualification            = VmxRead(EXIT_QUALIFICATION);
-  vmxcontext.ExitInterruptionInformation  = VmxRead(VM_EXIT_INTR_INFO);
-  vmxcontext.ExitInterruptionErrorCode    = VmxRead(VM_EXIT_INTR_ERROR_CODE);
-  vmxcontext.IDTVectoringInformationField = VmxRead(IDT_VECTORING_INFO_FIELD);
-  vmxcontext.IDTVectoringErrorCode        = VmxRead(IDT_VECTORING_ERROR_CODE);
-  vmxcontext.ExitInstructionLength        = VmxRead(VM_EXIT_INSTRUCTION_LEN);
-  vmxcontext.ExitInstructionInformation   = VmxRead(VMX_INSTRUCTION_INFO);
-
-#ifdef ENABLE_EPT
-  vmxcontext.GuestLinearAddress           = VmxRead(GUEST_LINEAR_ADDRESS);
-  vmxcontext.GuestPhysicalAddress         = VmxRead(GUEST_PHYSICAL_ADDRESS);
-#endif
+  vmxcontext.ExitReason            = VmxRead(VM_EXIT_REASON);
+  vmxcontext.ExitInstructionLength = VmxRead(VM_EXIT_INSTRUCTION_LEN);
+  vmxcontext.Valid = 0;
+  vmxcontext.Dirty = 0;
 
-  /* Read guest state */
+  /* Read guest state. cr3 is used by most handlers to access guest memory */
   context.GuestContext.rip    = VmxRead(GUEST_RIP);
   context.GuestContext.rsp    = VmxRead(GUEST_RSP);
-  context.GuestContext.cs     = VmxRead(GUEST_CS_SELECTOR);
-  context.GuestContext.cr0    = VmxRead(GUEST_CR0);
   context.GuestContext.cr3    = VmxRead(GUEST_CR3);
-  context.GuestContext.cr4    = VmxRead(GUEST_CR4);
   context.GuestContext.rflags = VmxRead(GUEST_RFLAGS);
 
+  vmxcontext.GuestRsp    = context.GuestContext.rsp;
+  vmxcontext.GuestRflags = context.GuestContext.rflags;
+
   /* Writing the Guest VMCS RIP uses general registers. Must complete this
      before setting general registers for guest return state */
   context.GuestContext.resumerip = context.GuestContext.rip + vmxcontext.ExitInstructionLength;
 }
 
+static Bit32u VmxLazyRead(VMX_LAZY_FIELD field)
+{
+  if (!(vmxcontext.Valid & (1 << field))) {
+    vmxcontext.Lazy[field] = VmxRead(vmxLazyEncoding[field]);
+    vmxcontext.Valid |= (1 << field);
+  }
+
+  return vmxcontext.Lazy[field];
+}
+
+static void VmxLazySet(VMX_LAZY_FIELD field, Bit32u value)
+{
+  vmxcontext.Lazy[field] = value;
+  vmxcontext.Valid |= (1 << field);
+}
+
+static void VmxReadGuestState(void)
+{
+  context.GuestContext.cs  = VmxLazyRead(VMX_LAZY_GUEST_CS);
+  context.GuestContext.cr0 = VmxLazyRead(VMX_LAZY_GUEST_CR0);
+  context.GuestContext.cr4 = VmxLazyRead(VMX_LAZY_GUEST_CR4);
+}
+
+/* The guest SYSENTER MSRs are loaded from the VMCS on every VM entry: the
+   host ones are not the guest's */
+static Bit32u VmxGuestMSRField(Bit32u msr)
+{
+  switch(msr) {
+  case IA32_SYSENTER_CS:  return GUEST_SYSENTER_CS;
+  case IA32_SYSENTER_ESP: return GUEST_SYSENTER_ESP;
+  case IA32_SYSENTER_EIP: return GUEST_SYSENTER_EIP;
+  default:                return 0;
+  }
+}
+
+static hvm_bool VmxReadGuestMSR(Bit32u msr, PMSR value)
+{
+  Bit32u field;
+
+  field = VmxGuestMSRField(msr);
+  if(field == 0)
+    return FALSE;
+
+  value->Lo = VmxRead(field);
+  value->Hi = 0;
+
+  return TRUE;
+}
+
+static hvm_bool VmxWriteGuestMSR(Bit32u msr, Bit32u highpart, Bit32u lowpart)
+{
+  Bit32u field;
+
+  field = VmxGuestMSRField(msr);
+  if(field == 0)
+    return FALSE;
+
+  VmxVmcsWrite(field, lowpart);
+
+  return TRUE;
+}
+
 static hvm_status VmxHvmUpdateEvents(void)
 {
   Bit32u temp32;
 
-  /* I/O bitmap */
+  /* I/O bitmaps: rebuilt from scratch, so that unsubscribed ports stop
+     exiting */
+  vmm_memset(vmxInitState.pIOBitmapA, 0, 4096);
+  vmm_memset(vmxInitState.pIOBitmapB, 0, 4096);
   EventUpdateIOBitmaps((Bit8u*) vmxInitState.pIOBitmapA, (Bit8u*) vmxInitState.pIOBitmapB);
 
+  /* MSR bitmaps, likewise */
+  vmm_memset(vmxInitState.pMSRBitmap, 0, 4096);
+  EventUpdateMSRBitmaps((Bit8u*) vmxInitState.pMSRBitmap);
+
   /* Exception bitmap */
   temp32 = 0;
   EventUpdateExceptionBitmap(&temp32);
@@ -1043,6 +1518,7 @@ static hvm_status VmxHvmSwitchOff(void)
 
   /* TODO: We should restore the whole original guest state here -- se Joanna's
      source code */
+  VmxReadGuestState();
   RegSetIdtr((void*) VmxRead(GUEST_IDTR_BASE), VmxRead(GUEST_IDTR_LIMIT));
   
   __asm__ __volatile__ (
@@ -1068,7 +1544,10 @@ static hvm_status VmxHvmSwitchOff(void)
   			);
   /* Turn off VMX */
   VmxTurnOff();
-  vmxIsActive = FALSE;
+  vmxcpu.Active = FALSE;
+  vmxActiveCpus--;
+  SmpCpuOffline(VtCurrentCpu()->id);
+  SmpLeaveVMM();
 
   __asm__ __volatile__(
 		       /* Restore general-purpose registers */
@@ -1108,12 +1587,14 @@ static void VmxInternalHandleCR(void)
   Bit32u movcrAccessType, movcrOperandType, movcrGeneralPurposeRegister;
   VtCrAccessType accesstype;
   VtRegister gpr;
+  Bit32u qualification;
 
+  qualification = VmxLazyRead(VMX_LAZY_EXIT_QUALIFICATION);
 
-  movcrControlRegister = (Bit8u) (vmxcontext.ExitQualification & 0x0000000F);
-  movcrAccessType      = ((vmxcontext.ExitQualification & 0x00000030) >> 4);
-  movcrOperandType     = ((vmxcontext.ExitQualification & 0x00000040) >> 6);
-  movcrGeneralPurposeRegister = ((vmxcontext.ExitQualification & 0x00000F00) >> 8);
+  movcrControlRegister = (Bit8u) (qualification & 0x0000000F);
+  movcrAccessType      = ((qualification & 0x00000030) >> 4);
+  movcrOperandType     = ((qualification & 0x00000040) >> 6);
+  movcrGeneralPurposeRegister = ((qualification & 0x00000F00) >> 8);
 
   /* Read access type */
   switch (movcrAccessType) {
@@ -1171,12 +1652,15 @@ static void VmxInternalHandleIO(void)
   Bit8u    size;
   Bit16u   port;
   hvm_bool isoutput, isstring, isrep;
+  Bit32u   qualification;
 
-  port     = (Bit16u) ((vmxcontext.ExitQualification & 0xffff0000) >> 16);
-  size     = (vmxcontext.ExitQualification & 7) + 1;
-  isoutput = !(vmxcontext.ExitQualification & (1 << 3));
-  isstring = (vmxcontext.ExitQualification & (1 << 4)) != 0;
-  isrep    = (vmxcontext.ExitQualification & (1 << 5)) != 0;
+  qualification = VmxLazyRead(VMX_LAZY_EXIT_QUALIFICATION);
+
+  port     = (Bit16u) ((qualification & 0xffff0000) >> 16);
+  size     = (qualification & 7) + 1;
+  isoutput = !(qualification & (1 << 3));
+  isstring = (qualification & (1 << 4)) != 0;
+  isrep    = (qualification & (1 << 5)) != 0;
 
   HandleIO(port,		/* I/O port */
 	   isoutput,		/* Direction */
@@ -1188,22 +1672,30 @@ static void VmxInternalHandleIO(void)
 
 static void VmxInternalHandleNMI(void)
 {
-  Bit32u trap, error_code;
+  Bit32u trap, error_code, info;
+
+  info = VmxLazyRead(VMX_LAZY_EXIT_INTR_INFO);
+  trap = info & INTR_INFO_VECTOR_MASK;
 
-  trap = vmxcontext.ExitInterruptionInformation & INTR_INFO_VECTOR_MASK;
+  /* An NMI that does not come from SmpFreezeOthers() belongs to the guest */
+  if ((info & INTR_INFO_INTR_TYPE_MASK) == INTR_TYPE_NMI) {
+    if (!SmpHandleNMI())
+      VmxInternalHvmInjectException(INTR_TYPE_NMI, TRAP_NMI, HVM_DELIVER_NO_ERROR_CODE);
+    return;
+  }
 
   /* Check if bits 11 (deliver code) and 31 (valid) are set. In this
      case, error code has to be delivered to guest OS */
-  if ((vmxcontext.ExitInterruptionInformation & INTR_INFO_DELIVER_CODE_MASK) &&
-      (vmxcontext.ExitInterruptionInformation & INTR_INFO_VALID_MASK)) {
-    error_code = vmxcontext.ExitInterruptionErrorCode;
+  if ((info & INTR_INFO_DELIVER_CODE_MASK) &&
+      (info & INTR_INFO_VALID_MASK)) {
+    error_code = VmxLazyRead(VMX_LAZY_EXIT_INTR_ERROR_CODE);
   } else {
     error_code = HVM_DELIVER_NO_ERROR_CODE;
   }
 
   HandleNMI(trap, 		         /* Trap number */
 	    error_code,			 /* Exception error code */
-	    vmxcontext.ExitQualification /* Exit qualification 
+	    VmxLazyRead(VMX_LAZY_EXIT_QUALIFICATION) /* Exit qualification 
 					    (should be meaningful only for #PF and #DB) */
 	    );
 }
@@ -1214,9 +1706,21 @@ static void VmxInternalHandleNMI(void)
 
 void VmxHvmInternalHandleExit(void)
 {
-  Bit32u interruptibility, activitystate, pending_debug, vectoring_error_code, vectoring_information;
+  Bit32u interruptibility, activitystate, pending_debug, qualification, vectoring_information;
+  Bit64u t0, t1, t2;
+
+  RegRdtsc(&t0);
   VmxReadGuestContext();
 
+  /* From here on, we are the only processor in the VMM. The time spent
+     waiting for the lock is accounted apart from the handler */
+  SmpEnterVMM();
+  RegRdtsc(&t1);
+  VmxSyncCpu();
+
+  /* Guest paging structures cannot change until we resume it */
+  MmuGuestTLBSetEnabled(TRUE);
+
   /* Restore host IDT -- Not sure if this is really needed. I'm pretty sure we */
   /* have to fix the LIMIT fields of host's IDTR. */
 
@@ -1229,7 +1733,8 @@ void VmxHvmInternalHandleExit(void)
   }
 
   if (HandlerLogging) {
-    Log("----- VMM Handler CPU0 -----");
+    VmxReadGuestState();
+    Log("----- VMM Handler CPU%d -----", VtCurrentCpu()->id);
     Log("Guest RAX: %.8x", context.GuestContext.rax);
     Log("Guest RBX: %.8x", context.GuestContext.rbx);
     Log("Guest RCX: %.8x", context.GuestContext.rcx);
@@ -1238,13 +1743,13 @@ void VmxHvmInternalHandleExit(void)
     Log("Guest RSI: %.8x", context.GuestContext.rsi);
     Log("Guest RBP: %.8x", context.GuestContext.rbp);
     Log("Exit Reason:        %d", vmxcontext.ExitReason);
-    Log("Exit Qualification: %.8x", vmxcontext.ExitQualification);
-    Log("Exit Interruption Information:   %.8x", vmxcontext.ExitInterruptionInformation);
-    Log("Exit Interruption Error Code:    %.8x", vmxcontext.ExitInterruptionErrorCode);
-    Log("IDT-Vectoring Information Field: %.8x", vmxcontext.IDTVectoringInformationField);
-    Log("IDT-Vectoring Error Code:        %.8x", vmxcontext.IDTVectoringErrorCode);
+    Log("Exit Qualification: %.8x", VmxLazyRead(VMX_LAZY_EXIT_QUALIFICATION));
+    Log("Exit Interruption Information:   %.8x", VmxLazyRead(VMX_LAZY_EXIT_INTR_INFO));
+    Log("Exit Interruption Error Code:    %.8x", VmxLazyRead(VMX_LAZY_EXIT_INTR_ERROR_CODE));
+    Log("IDT-Vectoring Information Field: %.8x", VmxLazyRead(VMX_LAZY_IDT_VECTORING_INFO));
+    Log("IDT-Vectoring Error Code:        %.8x", VmxLazyRead(VMX_LAZY_IDT_VECTORING_ERROR_CODE));
     Log("VM-Exit Instruction Length:      %.8x", vmxcontext.ExitInstructionLength);
-    Log("VM-Exit Instruction Information: %.8x", vmxcontext.ExitInstructionInformation);
+    Log("VM-Exit Instruction Information: %.8x", VmxLazyRead(VMX_LAZY_INSTRUCTION_INFO));
     Log("VM Exit RIP: %.8x", context.GuestContext.rip);
     Log("VM Exit RSP: %.8x", context.GuestContext.rsp);
     Log("VM Exit CS:  %.4x", context.GuestContext.cs);
@@ -1315,13 +1820,13 @@ void VmxHvmInternalHandleExit(void)
     //  RDMSR  //
     /////////////
   case EXIT_REASON_MSR_READ:
-		/* This gets triggered only for MSRs configured in the MSR bitmap. By default, it just re-execute the faulty instruction. */
-    Log("Read MSR #%.8x", context.GuestContext.rcx);
-    __asm__ __volatile__ (
-			  "movl	%0,%%ecx\n"
-			  "rdmsr\n"
-			  ::"m"(context.GuestContext.rcx)
-			  );
+    /* This gets triggered only for MSRs with a subscriber in the MSR bitmap
+       (or outside the ranges it covers) */
+    if(HandlerLogging) {
+      Log("Read MSR #%.8x", context.GuestContext.rcx);
+    }
+
+    HandleMSR((Bit32u) context.GuestContext.rcx, FALSE);
     goto Resume;
     /* Unreachable */
     break;
@@ -1330,9 +1835,11 @@ void VmxHvmInternalHandleExit(void)
     //  WRMSR  //
     /////////////
   case EXIT_REASON_MSR_WRITE:
-    Log("Write MSR #%.8x", context.GuestContext.rcx);
+    if(HandlerLogging) {
+      Log("Write MSR #%.8x", context.GuestContext.rcx);
+    }
 
-    WriteMSR(context.GuestContext.rcx, context.GuestContext.rdx, context.GuestContext.rax);
+    HandleMSR((Bit32u) context.GuestContext.rcx, TRUE);
     goto Resume;
 
     /* Unreachable */
@@ -1398,8 +1905,8 @@ void VmxHvmInternalHandleExit(void)
 
 #ifdef ENABLE_EPT
   case EXIT_REASON_EPT_VIOLATION:
-    vectoring_information = VmxRead(IDT_VECTORING_INFO_FIELD);
-    vectoring_error_code  = VmxRead(IDT_VECTORING_ERROR_CODE);
+    vectoring_information = VmxLazyRead(VMX_LAZY_IDT_VECTORING_INFO);
+    qualification         = VmxLazyRead(VMX_LAZY_EXIT_QUALIFICATION);
 
     if((vectoring_information & (1 << 31)) == 0) {
       /* If the VM exit stored 0 for bit 31 for IDT-vectoring information field
@@ -1409,12 +1916,12 @@ void VmxHvmInternalHandleExit(void)
       context.GuestContext.rflags &= ~FLAGS_RF_MASK;
     }
     
-    HandleEPTViolation( vmxcontext.GuestLinearAddress,
-			GET32L(vmxcontext.GuestPhysicalAddress),
-			(vmxcontext.ExitQualification & 0x80) != 0,     /* GuestLinear is valid? */
-			 vmxcontext.ExitQualification & 0x7,            /* Attempt type */
-			(vmxcontext.ExitQualification & 0x100) == 0,    /* Violation in guest page walk? */
-			(vmxcontext.ExitQualification & 0x38) == 0      /* Fill an entry? */
+    HandleEPTViolation( VmxLazyRead(VMX_LAZY_GUEST_LINEAR_ADDRESS),
+			VmxLazyRead(VMX_LAZY_GUEST_PHYSICAL_ADDRESS),
+			(qualification & 0x80) != 0,     /* GuestLinear is valid? */
+			 qualification & 0x7,            /* Attempt type */
+			(qualification & 0x100) == 0,    /* Violation in guest page walk? */
+			(qualification & 0x38) == 0      /* Fill an entry? */
 			);
 
     goto Resume;
@@ -1422,6 +1929,22 @@ void VmxHvmInternalHandleExit(void)
     /* Unreachable */
     break;
 #endif
+
+    /////////////////////////
+    //  Monitor trap flag  //
+    /////////////////////////
+  case EXIT_REASON_MONITOR_TRAP_FLAG:
+    /* No instruction caused this exit: guest RIP already points to the next
+       one */
+    context.GuestContext.resumerip = context.GuestContext.rip;
+
+    HandleMTF();
+
+    goto Resume;
+
+    /* Unreachable */
+    break;
+
   case EXIT_REASON_HLT:
     HandleHLT();
 
@@ -1429,6 +1952,18 @@ void VmxHvmInternalHandleExit(void)
     
     /* Unreachable */
     break;
+
+  case EXIT_REASON_PREEMPTION_TIMER:
+    /* Sampling tick: no guest instruction was executed. The timer expired,
+       so it is reloaded with the full period */
+    SamplerRecord(VtCurrentCpu()->id, context.GuestContext.rip, context.GuestContext.cr3);
+    VmxVmcsWrite(VMX_PREEMPTION_TIMER_VALUE, vmxSampleTicks);
+    context.GuestContext.resumerip = context.GuestContext.rip;
+
+    goto Resume;
+
+    /* Unreachable */
+    break;
     
   default:
     /* Unknown exit condition */
@@ -1457,19 +1992,45 @@ void VmxHvmInternalHandleExit(void)
   else {
     /* We must set GUEST_PENDING_DBG_EXCEPTIONS.BS = 0 because RFLAGS.TF == 0*/
     pending_debug = VmxVmcsRead(GUEST_PENDING_DBG_EXCEPTIONS);
-    pending_debug &= ~0x4000; /* bit 14 */
-    VmxVmcsWrite(GUEST_PENDING_DBG_EXCEPTIONS, pending_debug);
+    if ((pending_debug & 0x4000) != 0) { /* bit 14 */
+      pending_debug &= ~0x4000;
+      VmxVmcsWrite(GUEST_PENDING_DBG_EXCEPTIONS, pending_debug);
+    }
   }
 
   /* Mirror context.GuestContext fields into VMCS Guest Fields as update guest context doesn't do it. */
   /* NB: we can do it here because there will be no more updates to context.GuestContext */
+  /* Only fields that actually changed during this exit are written back:
+     CS is never modified by the handlers, RSP and RFLAGS are compared with
+     the values read at exit time, and control registers carry a dirty bit
+     set by vt_set_cr*(). */
   VmxVmcsWrite(GUEST_RIP, context.GuestContext.resumerip);
-  VmxVmcsWrite(GUEST_RSP, context.GuestContext.rsp);
-  VmxVmcsWrite(GUEST_CS_SELECTOR, context.GuestContext.cs);
-  VmxVmcsWrite(GUEST_CR0, context.GuestContext.cr0);
-  VmxVmcsWrite(GUEST_CR3, context.GuestContext.cr3);
-  VmxVmcsWrite(GUEST_CR4, context.GuestContext.cr4);
-  VmxVmcsWrite(GUEST_RFLAGS, context.GuestContext.rflags);
+
+  if (context.GuestContext.rsp != vmxcontext.GuestRsp)
+    VmxVmcsWrite(GUEST_RSP, context.GuestContext.rsp);
+
+  if (context.GuestContext.rflags != vmxcontext.GuestRflags)
+    VmxVmcsWrite(GUEST_RFLAGS, context.GuestContext.rflags);
+
+  if (vmxcontext.Dirty & VMX_DIRTY_CR0)
+    VmxVmcsWrite(GUEST_CR0, context.GuestContext.cr0);
+
+  if (vmxcontext.Dirty & VMX_DIRTY_CR3)
+    VmxVmcsWrite(GUEST_CR3, context.GuestContext.cr3);
+
+  if (vmxcontext.Dirty & VMX_DIRTY_CR4)
+    VmxVmcsWrite(GUEST_CR4, context.GuestContext.cr4);
+
+  /* The guest is about to run again: cached translations become stale */
+  MmuGuestTLBSetEnabled(FALSE);
+
+  /* Push out some queued serial output, if the UART is ready */
+  ComDrain();
+
+  RegRdtsc(&t2);
+  ExitStatsRecordExit(vmxcontext.ExitReason, t2 - t1, t1 - t0);
+
+  SmpLeaveVMM();
 
   return;
   // Exit reason handled. Need to execute the VMRESUME without having
@@ -105,23 +105,47 @@ typedef struct _MISC_DATA
 #define EXIT_REASON_INVALID_GUEST_STATE  33
 #define EXIT_REASON_MSR_LOADING          34
 #define EXIT_REASON_MWAIT_INSTRUCTION    36
+#define EXIT_REASON_MONITOR_TRAP_FLAG    37
 #define EXIT_REASON_MONITOR_INSTRUCTION  39
 #define EXIT_REASON_PAUSE_INSTRUCTION    40
 #define EXIT_REASON_MACHINE_CHECK        41
 #define EXIT_REASON_TPR_BELOW_THRESHOLD  43
 #define EXIT_REASON_EPT_VIOLATION        48
 #define EXIT_REASON_EPT_MISCONFIGURATION 49
+#define EXIT_REASON_PREEMPTION_TIMER     52
 
 /* VM-execution control bits */
+#define PIN_BASED_NMI_EXITING            3
+#define PIN_BASED_PREEMPTION_TIMER       6
 #define CPU_BASED_PRIMARY_HLT            7
 #define CPU_BASED_CR3_WRITE_EXIT        15
 #define CPU_BASED_CR3_READ_EXIT         16        
 #define CPU_BASED_PRIMARY_IO            25
+#define CPU_BASED_MONITOR_TRAP_FLAG     27
 #define CPU_BASED_USE_MSR_BITMAPS       28
 #define CPU_BASED_PRIMARY_ACTIVATE_SEC  31
+#define SECONDARY_ENABLE_EPT             1
+#define SECONDARY_ENABLE_VPID            5
+
+/* IA32_VMX_EPT_VPID_CAP bits, in the high 32 bits of the MSR */
+#define VPID_CAP_INVVPID                 (1 << 0)
+#define VPID_CAP_INVVPID_ADDRESS         (1 << 8)
+#define VPID_CAP_INVVPID_SINGLE          (1 << 9)
+#define VPID_CAP_INVVPID_ALL             (1 << 10)
+#define VPID_CAP_INVVPID_SINGLE_GLOBALS  (1 << 11)
+
+/* INVVPID types */
+#define INVVPID_ADDRESS                  0
+#define INVVPID_SINGLE                   1
+#define INVVPID_ALL                      2
+#define INVVPID_SINGLE_GLOBALS           3
 
 /* VM-exit control bits */
 #define VM_EXIT_ACK_INTERRUPT_ON_EXIT   15
+#define VM_EXIT_SAVE_PREEMPTION_TIMER   22
+
+/* IA32_VMX_MISC: the preemption timer counts down every 2^rate TSC cycles */
+#define VMX_MISC_PREEMPTION_TIMER_RATE  0x1f
 
 /* Exception/NMI-related information */
 #define INTR_INFO_VECTOR_MASK           0xff            /* bits 0:7 */
@@ -135,6 +159,7 @@ typedef struct _MISC_DATA
 
 /* VMCS Encodings */
 enum {
+  VIRTUAL_PROCESSOR_ID = 0x00000000,
   GUEST_ES_SELECTOR = 0x00000800,
   GUEST_CS_SELECTOR = 0x00000802,
   GUEST_SS_SELECTOR = 0x00000804,
@@ -218,6 +243,7 @@ enum {
   GUEST_ACTIVITY_STATE = 0x00004826,
   GUEST_SM_BASE = 0x00004828,
   GUEST_SYSENTER_CS = 0x0000482A,
+  VMX_PREEMPTION_TIMER_VALUE = 0x0000482E,
   HOST_IA32_SYSENTER_CS = 0x00004c00,
   CR0_GUEST_HOST_MASK = 0x00006000,
   CR4_GUEST_HOST_MASK = 0x00006002,
@@ -24,4 +24,30 @@
 
 #include "vt.h"
 
-struct CPU_CONTEXT context;
+VT_CPU vt_cpus[VT_MAX_CPUS];
+
+PVT_CPU VtCurrentCpu(void)
+{
+  hvm_address sp;
+
+  /* Any local variable lives on the host stack */
+  sp = (hvm_address) &sp;
+
+  return *(PVT_CPU*) (sp & ~(VMM_STACK_SIZE - 1));
+}
+
+PVT_CPU VtCurrentRootCpu(void)
+{
+  hvm_address sp;
+  Bit32u i;
+
+  /* Unlike VtCurrentCpu(), never dereference the (guest) stack */
+  sp = (hvm_address) &sp & ~(VMM_STACK_SIZE - 1);
+
+  for (i=0; i<VT_MAX_CPUS; i++) {
+    if (vt_cpus[i].hoststack == sp)
+      return &vt_cpus[i];
+  }
+
+  return NULL;
+}
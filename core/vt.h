@@ -28,9 +28,13 @@
 #include "types.h"
 #include "msr.h"
 #include "idt.h"
+#include "config.h"
 
 #define HVM_DELIVER_NO_ERROR_CODE (-1)
 
+#define VT_MAX_CPUS   32
+#define VT_CACHE_LINE 64
+
 /* CR access types */
 typedef enum {
   VT_CR_ACCESS_WRITE,
@@ -58,6 +62,8 @@ typedef enum {
   VT_REGISTER_R15,
 } VtRegister;
 
+/* On VM exits only rip, rsp, cr3, rflags and general purpose registers are
+   read. cs, cr0 and cr4 are valid only after hvm_x86_ops.vt_read_guest_state() */
 struct __attribute__((__packed__)) CPU_CONTEXT {
   struct __attribute__((__packed__)) {
     hvm_address rip;
@@ -79,32 +85,64 @@ struct __attribute__((__packed__)) CPU_CONTEXT {
   } GuestContext;
 };
 
+/* Per-CPU state. Entries are cache-line aligned, as processors handle their
+   VM exits in parallel. The host stack of each processor is aligned to
+   VMM_STACK_SIZE and starts with a pointer to its VT_CPU, so that root-mode
+   code finds its own entry from the stack pointer (see VtCurrentCpu()) */
+typedef struct __attribute__((aligned(VT_CACHE_LINE))) _VT_CPU {
+  struct CPU_CONTEXT context;	/* Must be the first field (see vmx-asm.S) */
+  Bit32u             id;	/* Index in vt_cpus[] */
+  Bit32u             apicid;	/* Local APIC ID, used to send IPIs */
+  hvm_address        hoststack;	/* Base of the host stack */
+} VT_CPU, *PVT_CPU;
+
+struct _MSR;			/* msr.h, which includes us through common.h */
+
 struct HVM_X86_OPS {
   /* VT-related */
   hvm_bool      (*vt_cpu_has_support)(void);
   hvm_bool      (*vt_disabled_by_bios)(void);
   hvm_bool      (*vt_enabled)(void);
-  hvm_status    (*vt_initialize)(void (*idt_initializer)(PIDT_ENTRY));
+  hvm_status    (*vt_initialize)(void (*idt_initializer)(PIDT_ENTRY), Bit32u ncpus);
   hvm_status    (*vt_finalize)(void);
   void          (*vt_launch)(void);
-  hvm_status    (*vt_hardware_enable)(void);
+  hvm_status    (*vt_hardware_enable)(Bit32u cpu);
   hvm_status    (*vt_hardware_disable)(void);
   void          (*vt_hypercall)(Bit32u num) USESTACK;
 
   /* These will be removed in a near future... */
-  hvm_status    (*vt_vmcs_initialize)(hvm_address guest_stack, hvm_address guest_return, hvm_address host_cr3);
+  hvm_status    (*vt_vmcs_initialize)(Bit32u cpu, hvm_address guest_stack, hvm_address guest_return, hvm_address host_cr3);
   Bit32u        (*vt_vmcs_read)(Bit32u encoding) USESTACK;
   void          (*vt_vmcs_write)(Bit32u encoding, Bit32u value) USESTACK;
   
   void          (*vt_set_cr0)(hvm_address cr0);
   void          (*vt_set_cr3)(hvm_address cr3);
   void          (*vt_set_cr4)(hvm_address cr4);
+  void          (*vt_set_dr)(Bit8u drno, hvm_address value);
+  hvm_address   (*vt_get_dr)(Bit8u drno);
 
   void          (*vt_trap_io)(hvm_bool enabled);
+  hvm_status    (*vt_trap_mtf)(hvm_bool enabled);
   Bit32u        (*vt_get_exit_instr_len)(void);
+  void          (*vt_read_guest_state)(void);
+
+  /* Access the guest copy of an MSR that VM entries load from the VMCS.
+     Return FALSE for any other MSR, which the guest shares with the host */
+  hvm_bool      (*vt_read_guest_msr)(Bit32u msr, struct _MSR *value);
+  hvm_bool      (*vt_write_guest_msr)(Bit32u msr, Bit32u highpart, Bit32u lowpart);
+
+  /* Sample the guest every 'period' TSC cycles, on all the processors (0
+     stops sampling). Each processor picks up the change at its next VM
+     exit. Fails if the processor has no suitable timer */
+  hvm_status    (*vt_set_sample_timer)(Bit64u period);
+
+  /* Apply the changes made by the other processors (EPT, debug registers,
+     sampling) to the current one, before it resumes the guest */
+  void          (*vt_sync_cpu)(void);
 
   /* Memory management */
   void          (*mmu_tlb_flush)(void);
+  void          (*mmu_tlb_flush_page)(hvm_address va);
 
   /* HVM-related */
   void          (*hvm_handle_exit)(void);
@@ -113,7 +151,16 @@ struct HVM_X86_OPS {
   void          (*hvm_inject_hw_exception)(Bit32u type, Bit32u error_code);
 };
 
-extern struct CPU_CONTEXT context asm("_context");
+extern VT_CPU vt_cpus[VT_MAX_CPUS];
 extern struct HVM_X86_OPS hvm_x86_ops;
 
+/* Only valid in root mode, on the host stack */
+PVT_CPU VtCurrentCpu(void);
+
+/* Safe in both modes: NULL unless running on one of the host stacks */
+PVT_CPU VtCurrentRootCpu(void);
+
+/* Guest state of the processor that is handling the current VM exit */
+#define context (VtCurrentCpu()->context)
+
 #endif	/* _VT_H */
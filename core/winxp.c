@@ -439,6 +439,7 @@ hvm_status WindowsFindProcessTid(hvm_address cr3, hvm_address* ptid)
 hvm_status WindowsGetNextProcess(hvm_address cr3, PPROCESS_DATA pprev, PPROCESS_DATA pnext)
 {
   hvm_status r;
+  MMU_IOVEC iov[3];
   
   if (!pnext) return HVM_STATUS_UNSUCCESSFUL;
 
@@ -463,16 +464,20 @@ hvm_status WindowsGetNextProcess(hvm_address cr3, PPROCESS_DATA pprev, PPROCESS_
       return HVM_STATUS_END_OF_FILE;
   }
 
-  /* Read the CR3 of the current process */
-  r = MmuReadVirtualRegion(cr3, pnext->pobj + FIELD_OFFSET(KPROCESS, DirectoryTableBase), &(pnext->cr3), sizeof(pnext->cr3));
-  if (r != HVM_STATUS_SUCCESS) return HVM_STATUS_UNSUCCESSFUL;
+  /* Read the CR3, the PID and the name of the process */
+  iov[0].va = pnext->pobj + FIELD_OFFSET(KPROCESS, DirectoryTableBase);
+  iov[0].buffer = &(pnext->cr3);
+  iov[0].size = sizeof(pnext->cr3);
 
-  /* Read the PID of the process */
-  r = MmuReadVirtualRegion(cr3, pnext->pobj + OFFSET_EPROCESS_UNIQUEPID, &(pnext->pid), sizeof(pnext->pid));
-  if (r != HVM_STATUS_SUCCESS) return HVM_STATUS_UNSUCCESSFUL;
+  iov[1].va = pnext->pobj + OFFSET_EPROCESS_UNIQUEPID;
+  iov[1].buffer = &(pnext->pid);
+  iov[1].size = sizeof(pnext->pid);
+
+  iov[2].va = pnext->pobj + OFFSET_EPROCESS_IMAGEFILENAME;
+  iov[2].buffer = pnext->name;
+  iov[2].size = 16;
 
-  /* Read the name of the process */
-  r = MmuReadVirtualRegion(cr3, pnext->pobj + OFFSET_EPROCESS_IMAGEFILENAME, pnext->name, 16);
+  r = MmuReadVirtualVector(cr3, iov, 3);
   if (r != HVM_STATUS_SUCCESS) return HVM_STATUS_UNSUCCESSFUL;
 
   return HVM_STATUS_SUCCESS;
@@ -534,6 +539,7 @@ hvm_status Windows7FindTargetInfo(hvm_address cr3, hvm_address *target_pep, hvm_
   char process_name[32];
   LIST_ENTRY le;
   Bit8u thread_state;
+  MMU_IOVEC iov[2];
 
   WindowsFindProcess(cr3, target_pep);
     
@@ -550,8 +556,15 @@ hvm_status Windows7FindTargetInfo(hvm_address cr3, hvm_address *target_pep, hvm_
   
   do {
 
-    MmuReadVirtualRegion(cr3, kthread_current + OFFSET_KTHREAD_PROCESS, &thread_pep, sizeof(hvm_address));
-    MmuReadVirtualRegion(cr3, kthread_current + OFFSET_KTHREAD_THREADLISTENTRY, &le, sizeof(le));
+    iov[0].va = kthread_current + OFFSET_KTHREAD_PROCESS;
+    iov[0].buffer = &thread_pep;
+    iov[0].size = sizeof(hvm_address);
+
+    iov[1].va = kthread_current + OFFSET_KTHREAD_THREADLISTENTRY;
+    iov[1].buffer = &le;
+    iov[1].size = sizeof(le);
+
+    MmuReadVirtualVector(cr3, iov, 2);
 
     if(thread_pep == (*target_pep)) {
 
@@ -734,10 +747,11 @@ hvm_status Windows7FindNetworkConnections(hvm_address cr3, SOCKET* buf, Bit32u m
   hvm_status r;
   hvm_address partition_table, partition_entry_array, partition_entry, tmp;
   hvm_address phash, pipinfo, peprocess, pipaddresses;
-  Bit32u i, j, k, h, npart, nmaxhash, hash_index, tcp_conn_found = 0;
+  Bit32u i, j, k, npart, nmaxhash, hash_index, tcp_conn_found = 0;
   Bit32u local_ip, remote_ip, pid, ports, ipv6;
   Bit16u local_port, remote_port, local_ipv6[8], remote_ipv6[8];
   MODULE_DATA tcp_module;
+  MMU_IOVEC iov[4];
 
   r = WindowsFindModuleByName(cr3, "tcpip.sys", &tcp_module);
   if (r != HVM_STATUS_SUCCESS) return HVM_STATUS_UNSUCCESSFUL;
@@ -774,39 +788,44 @@ hvm_status Windows7FindNetworkConnections(hvm_address cr3, SOCKET* buf, Bit32u m
 
 	/* found a valid IPInfo structure */
 
-	r = MmuReadVirtualRegion(cr3, pipinfo + OFFSET_IPINFO_PEPROCESS, &peprocess, sizeof(hvm_address));
-	if (r != HVM_STATUS_SUCCESS) return HVM_STATUS_UNSUCCESSFUL;
+	/* Read all the fields we need from the IPInfo structure at once */
+	iov[0].va = pipinfo + OFFSET_IPINFO_PEPROCESS;
+	iov[0].buffer = &peprocess;
+	iov[0].size = sizeof(hvm_address);
 
-	r = MmuReadVirtualRegion(cr3, peprocess + OFFSET_EPROCESS_UNIQUEPID, &pid, sizeof(pid));
+	iov[1].va = pipinfo + OFFSET_IPINFO_PORTS;
+	iov[1].buffer = &ports;
+	iov[1].size = sizeof(ports);
+
+	iov[2].va = pipinfo + OFFSET_IPv6_1;
+	iov[2].buffer = &tmp;
+	iov[2].size = sizeof(hvm_address);
+
+	iov[3].va = pipinfo + OFFSET_IPINFO_IPADDRESSES;
+	iov[3].buffer = &pipaddresses;
+	iov[3].size = sizeof(hvm_address);
+
+	r = MmuReadVirtualVector(cr3, iov, 4);
 	if (r != HVM_STATUS_SUCCESS) return HVM_STATUS_UNSUCCESSFUL;
 
-	r = MmuReadVirtualRegion(cr3, pipinfo + OFFSET_IPINFO_PORTS, &ports, sizeof(ports));
+	r = MmuReadVirtualRegion(cr3, peprocess + OFFSET_EPROCESS_UNIQUEPID, &pid, sizeof(pid));
 	if (r != HVM_STATUS_SUCCESS) return HVM_STATUS_UNSUCCESSFUL;
 
 	remote_port = (ports & 0xffff0000) >> 16;
 	local_port = ports & 0x0000ffff;
 
-	r = MmuReadVirtualRegion(cr3, pipinfo + OFFSET_IPv6_1, &tmp, sizeof(hvm_address));
-	if (r != HVM_STATUS_SUCCESS) return HVM_STATUS_UNSUCCESSFUL;
-
 	r = MmuReadVirtualRegion(cr3, tmp + OFFSET_IPv6_2, &ipv6, sizeof(ipv6));
 	if (r != HVM_STATUS_SUCCESS) return HVM_STATUS_UNSUCCESSFUL;
 
 	if(ipv6 != 0x17) ipv6 = 0;
 	else Log("[HyperDbg] Ipv6 connection at pipinfo 0x%08hx!!!", pipinfo); 
 
-	r = MmuReadVirtualRegion(cr3, pipinfo + OFFSET_IPINFO_IPADDRESSES, &pipaddresses, sizeof(hvm_address));
-	if (r != HVM_STATUS_SUCCESS) return HVM_STATUS_UNSUCCESSFUL;
-
 	r = MmuReadVirtualRegion(cr3, pipaddresses + OFFSET_REMOTE_IP, &tmp, sizeof(hvm_address));
 	if (r != HVM_STATUS_SUCCESS) return HVM_STATUS_UNSUCCESSFUL;
 
 	if(ipv6) {
-
-	  for(k = 0, h = 0; k < 0xe; k+=2, h++) {
-	    r = MmuReadVirtualRegion(cr3, tmp + k, &remote_ipv6[h], sizeof(remote_ipv6[0]));
-	    if(r != HVM_STATUS_SUCCESS) return HVM_STATUS_UNSUCCESSFUL;
-	  }
+	  r = MmuReadVirtualRegion(cr3, tmp, remote_ipv6, 7*sizeof(remote_ipv6[0]));
+	  if(r != HVM_STATUS_SUCCESS) return HVM_STATUS_UNSUCCESSFUL;
 	}
 	else {
 
@@ -818,11 +837,8 @@ hvm_status Windows7FindNetworkConnections(hvm_address cr3, SOCKET* buf, Bit32u m
 	if (r != HVM_STATUS_SUCCESS) return HVM_STATUS_UNSUCCESSFUL;
 
 	if(ipv6) {
-
-	  for(k = 0, h = 0; k < 0xe; k+=2, h++) {
-	    r = MmuReadVirtualRegion(cr3, pipaddresses + OFFSET_LOCAL_IP + k, &local_ipv6[h], sizeof(remote_ipv6[0]));
-	    if(r != HVM_STATUS_SUCCESS) return HVM_STATUS_UNSUCCESSFUL;
-	  }
+	  r = MmuReadVirtualRegion(cr3, pipaddresses + OFFSET_LOCAL_IP, local_ipv6, 7*sizeof(local_ipv6[0]));
+	  if(r != HVM_STATUS_SUCCESS) return HVM_STATUS_UNSUCCESSFUL;
 	}
 	else {
 	  r = MmuReadVirtualRegion(cr3, pipaddresses + OFFSET_LOCAL_IP, &local_ip, sizeof(local_ip));
@@ -0,0 +1,161 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+#include "debug.h"
+#include "mmu.h"
+#include "vt.h"
+#include "ept_bp.h"
+
+#ifdef ENABLE_EPT
+
+typedef struct _EPT_BP {
+  hvm_address Addr;		/* 0 if the entry is free */
+  hvm_address cr3;
+  hvm_address phy;		/* Guest-physical page holding Addr */
+  hvm_bool isCr3Dipendent;
+} EPT_BP, *PEPT_BP;
+
+/* ################# */
+/* #### GLOBALS #### */
+/* ################# */
+
+/* A handful of entries: a linear scan is cheaper than any index here */
+static EPT_BP ept_bps[MAXEPTBPS];
+
+/* ################ */
+/* #### BODIES #### */
+/* ################ */
+
+/* If it returns MAXEPTBPS, we have a full-error (or no MTF support, or no
+   EPT table left to split the page) */
+Bit32u EptBreakpointSet(hvm_address cr3, hvm_address address, hvm_bool isCr3Dipendent)
+{
+  Bit32u i, index;
+  hvm_phy_address phy;
+
+  index = MAXEPTBPS;
+  for(i = 0; i < MAXEPTBPS; i++) {
+    if(ept_bps[i].Addr == address && ept_bps[i].cr3 == cr3)
+      return -1;
+    if(ept_bps[i].Addr == 0 && index == MAXEPTBPS)
+      index = i;
+  }
+
+  if(index == MAXEPTBPS) return MAXEPTBPS;
+
+  /* Without the monitor trap flag we could not re-protect the page after
+     stepping over a faulting instruction */
+  if(!HVM_SUCCESS(hvm_x86_ops.vt_trap_mtf(TRUE))) {
+    Log("[HyperDbg] Monitor trap flag not supported, no EPT breakpoints");
+    return MAXEPTBPS;
+  }
+  hvm_x86_ops.vt_trap_mtf(FALSE);
+
+  if(MmuGetPhysicalAddress(cr3, address, &phy) != HVM_STATUS_SUCCESS)
+    return MAXEPTBPS;
+
+  ept_bps[index].Addr = address;
+  ept_bps[index].cr3 = cr3;
+  ept_bps[index].phy = GET32L(phy) & 0xfffff000;
+  ept_bps[index].isCr3Dipendent = isCr3Dipendent;
+
+  if(!HVM_SUCCESS(EptBreakpointProtectPage(ept_bps[index].phy, TRUE))) {
+    ept_bps[index].Addr = 0;
+    return MAXEPTBPS;
+  }
+
+  return index;
+}
+
+/* Check if the instruction fetch at linear 'address' hits one of our
+   breakpoints */
+hvm_bool EptBreakpointIsHit(hvm_address cr3, hvm_address address)
+{
+  Bit32u i;
+
+  for(i = 0; i < MAXEPTBPS; i++) {
+    if(ept_bps[i].Addr == address && (!ept_bps[i].isCr3Dipendent || ept_bps[i].cr3 == cr3))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+hvm_bool EptBreakpointIsPageProtected(hvm_address phy)
+{
+  Bit32u i;
+
+  phy &= 0xfffff000;
+
+  for(i = 0; i < MAXEPTBPS; i++) {
+    if(ept_bps[i].Addr != 0 && ept_bps[i].phy == phy)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+hvm_status EptBreakpointProtectPage(hvm_address phy, hvm_bool protect)
+{
+  phy &= 0xfffff000;
+
+  if(protect)
+    return EPTRemovePTperms(phy, EXEC);
+  else
+    return EPTMapPhysicalAddress(phy, READ|WRITE|EXEC);
+}
+
+hvm_bool EptBreakpointDeleteById(Bit32u id)
+{
+  PEPT_BP ptr;
+
+  if(id >= MAXEPTBPS) return FALSE;
+  ptr = &ept_bps[id];
+  if(ptr->Addr == 0) return FALSE;
+
+  ptr->Addr = 0;
+
+  /* Give the execute permission back, unless other breakpoints share the
+     page. If we are stepping over this page, the step completes anyway */
+  if(!EptBreakpointIsPageProtected(ptr->phy))
+    EptBreakpointProtectPage(ptr->phy, FALSE);
+
+  return TRUE;
+}
+
+void EptBreakpointGetBPList(PCMD_RESULT result)
+{
+  int i;
+
+  for(i = 0; i < MAXEPTBPS; i++) {
+
+    (*result).bplist[MAXSWBPS+i].Addr = ept_bps[i].Addr;
+    (*result).bplist[MAXSWBPS+i].cr3 = ept_bps[i].cr3;
+    (*result).bplist[MAXSWBPS+i].isPerm = TRUE;
+    (*result).bplist[MAXSWBPS+i].isCr3Dipendent = ept_bps[i].isCr3Dipendent;
+    (*result).bplist[MAXSWBPS+i].kind = BreakpointEpt;
+  }
+}
+
+#endif	/* ENABLE_EPT */
@@ -0,0 +1,49 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+#ifndef _EPT_BP_H
+#define _EPT_BP_H
+
+#include "hyperdbg.h"
+#include "hyperdbg_print.h"
+#include "hyperdbg_common.h"
+
+/* EPT ("hidden") breakpoints leave guest code untouched: they take away the
+   execute permission from the guest-physical page that holds the target
+   address, and filter the resulting EPT violations on the exact linear
+   address. Requires monitor trap flag support, to step over the faulting
+   instruction */
+
+#ifdef ENABLE_EPT
+#include "ept.h"
+
+Bit32u      EptBreakpointSet(hvm_address cr3, hvm_address address, hvm_bool isCr3Dipendent);
+hvm_bool    EptBreakpointIsHit(hvm_address cr3, hvm_address address);
+hvm_bool    EptBreakpointIsPageProtected(hvm_address phy);
+hvm_status  EptBreakpointProtectPage(hvm_address phy, hvm_bool protect);
+hvm_bool    EptBreakpointDeleteById(Bit32u id);
+void        EptBreakpointGetBPList(PCMD_RESULT result);
+#endif
+
+#endif
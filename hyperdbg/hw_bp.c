@@ -0,0 +1,158 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+#include "debug.h"
+#include "vt.h"
+#include "hw_bp.h"
+
+/* DR7 fields for debug register n */
+#define DR7_L(n)        (1 << ((n)*2))
+#define DR7_G(n)        (1 << ((n)*2 + 1))
+#define DR7_RW(n, rw)   ((rw) << (16 + (n)*4))
+#define DR7_LEN(n, len) ((len) << (18 + (n)*4))
+#define DR7_MASK(n)     (DR7_L(n) | DR7_G(n) | DR7_RW(n, 3) | DR7_LEN(n, 3))
+#define DR7_GE          (1 << 9)
+
+/* DR6 (and #DB exit qualification) hit bit for debug register n */
+#define DR6_B(n)        (1 << (n))
+
+typedef struct _HW_BP {
+  hvm_address Addr;		/* 0 if the entry is free */
+  hvm_address cr3;
+  HW_BP_TYPE type;
+  Bit32u len;
+  hvm_bool isCr3Dipendent;
+} HW_BP, *PHW_BP;
+
+/* ################# */
+/* #### GLOBALS #### */
+/* ################# */
+
+/* Entry n uses debug register n */
+static HW_BP hw_bps[MAXHWBPS];
+
+/* ################ */
+/* #### BODIES #### */
+/* ################ */
+
+/* If it returns MAXHWBPS, we have a full-error (or invalid address/length) */
+Bit32u HwBreakpointSet(hvm_address cr3, hvm_address address, HW_BP_TYPE type, Bit32u len, hvm_bool isCr3Dipendent)
+{
+  Bit32u i, dr7, lenbits;
+
+  /* Instruction breakpoints must be 1 byte long, data ones naturally
+     aligned */
+  switch(len) {
+  case 1: lenbits = 0; break;
+  case 2: lenbits = 1; break;
+  case 4: lenbits = 3; break;
+  default: return MAXHWBPS;
+  }
+  if(address == 0 || (type == HwBreakpointExec && len != 1) || (address & (len - 1)) != 0)
+    return MAXHWBPS;
+
+  for(i = 0; i < MAXHWBPS; i++) {
+    if(hw_bps[i].Addr == address && hw_bps[i].type == type && hw_bps[i].cr3 == cr3)
+      return -1;
+  }
+
+  dr7 = hvm_x86_ops.vt_get_dr(7);
+
+  /* Pick a debug register that neither we nor the guest are using */
+  for(i = 0; i < MAXHWBPS; i++) {
+    if(hw_bps[i].Addr == 0 && (dr7 & (DR7_L(i) | DR7_G(i))) == 0)
+      break;
+  }
+  if(i == MAXHWBPS) return MAXHWBPS;
+
+  hw_bps[i].Addr = address;
+  hw_bps[i].cr3 = cr3;
+  hw_bps[i].type = type;
+  hw_bps[i].len = len;
+  hw_bps[i].isCr3Dipendent = isCr3Dipendent;
+
+  hvm_x86_ops.vt_set_dr(i, address);
+
+  dr7 &= ~DR7_MASK(i);
+  dr7 |= DR7_G(i) | DR7_RW(i, type) | DR7_LEN(i, lenbits) | DR7_GE;
+  hvm_x86_ops.vt_set_dr(7, dr7);
+
+  return i;
+}
+
+/* Check if a #DB has been triggered by our breakpoints. If so, 'isHit' tells
+   if the address space is the right one, and 'isExec' if at least one of
+   them is an instruction breakpoint */
+hvm_bool HwBreakpointCheck(Bit32u qualification, hvm_address cr3, hvm_bool *isHit, hvm_bool *isExec)
+{
+  Bit32u i;
+  hvm_bool isOurs;
+
+  isOurs = *isHit = *isExec = FALSE;
+
+  for(i = 0; i < MAXHWBPS; i++) {
+    if(hw_bps[i].Addr == 0 || (qualification & DR6_B(i)) == 0)
+      continue;
+
+    isOurs = TRUE;
+    if(!hw_bps[i].isCr3Dipendent || hw_bps[i].cr3 == cr3)
+      *isHit = TRUE;
+    if(hw_bps[i].type == HwBreakpointExec)
+      *isExec = TRUE;
+  }
+
+  return isOurs;
+}
+
+hvm_bool HwBreakpointDeleteById(Bit32u id)
+{
+  Bit32u dr7;
+
+  if(id >= MAXHWBPS || hw_bps[id].Addr == 0) return FALSE;
+
+  dr7 = hvm_x86_ops.vt_get_dr(7);
+  dr7 &= ~DR7_MASK(id);
+  hvm_x86_ops.vt_set_dr(7, dr7);
+  hvm_x86_ops.vt_set_dr(id, 0);
+
+  hw_bps[id].Addr = 0;
+
+  return TRUE;
+}
+
+void HwBreakpointGetBPList(PCMD_RESULT result)
+{
+  int i;
+
+  for(i = 0; i < MAXHWBPS; i++) {
+
+    (*result).bplist[MAXSWBPS+MAXEPTBPS+i].Addr = hw_bps[i].Addr;
+    (*result).bplist[MAXSWBPS+MAXEPTBPS+i].cr3 = hw_bps[i].cr3;
+    (*result).bplist[MAXSWBPS+MAXEPTBPS+i].isPerm = TRUE;
+    (*result).bplist[MAXSWBPS+MAXEPTBPS+i].isCr3Dipendent = hw_bps[i].isCr3Dipendent;
+    (*result).bplist[MAXSWBPS+MAXEPTBPS+i].kind = BreakpointHardware;
+    (*result).bplist[MAXSWBPS+MAXEPTBPS+i].hwtype = hw_bps[i].type;
+    (*result).bplist[MAXSWBPS+MAXEPTBPS+i].hwlen = hw_bps[i].len;
+  }
+}
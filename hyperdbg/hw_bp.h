@@ -0,0 +1,49 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+#ifndef _HW_BP_H
+#define _HW_BP_H
+
+#include "hyperdbg.h"
+#include "hyperdbg_print.h"
+#include "hyperdbg_common.h"
+
+/* Hardware breakpoints and watchpoints use the debug registers DR0-DR3 (one
+   each), leaving alone the ones the guest has enabled in DR7. They match
+   linear addresses in any address space: cr3-dependent ones are filtered by
+   HwBreakpointCheck() */
+
+/* Values for the R/W fields of DR7 */
+typedef enum {
+  HwBreakpointExec      = 0,
+  HwBreakpointWrite     = 1,
+  HwBreakpointReadWrite = 3,
+} HW_BP_TYPE;
+
+Bit32u      HwBreakpointSet(hvm_address cr3, hvm_address address, HW_BP_TYPE type, Bit32u len, hvm_bool isCr3Dipendent);
+hvm_bool    HwBreakpointCheck(Bit32u qualification, hvm_address cr3, hvm_bool *isHit, hvm_bool *isExec);
+hvm_bool    HwBreakpointDeleteById(Bit32u id);
+void        HwBreakpointGetBPList(PCMD_RESULT result);
+
+#endif
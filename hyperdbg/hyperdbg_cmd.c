@@ -31,6 +31,9 @@
 #include "gui.h"
 #include "mmu.h"
 #include "sw_bp.h"
+#include "ept_bp.h"
+#include "hw_bp.h"
+#include "exitstats.h"
 #include "x86.h"       /* Needed for the FLAGS_TF_MASK macro */
 #include "vt.h"
 #include "extern.h"    /* From libudis */
@@ -41,6 +44,8 @@
 #include "network.h"
 #include "pager.h"
 #include "hyperdbg_print.h"
+#include "sampler.h"
+#include "profile.h"
 
 #ifdef GUEST_WINDOWS
 #include "winxp.h"
@@ -61,6 +66,10 @@ typedef enum {
   HYPERDBG_CMD_SW_BP,
   HYPERDBG_CMD_SW_PERM_BP,
   HYPERDBG_CMD_DELETE_SW_BP,
+  HYPERDBG_CMD_EPT_BP,
+  HYPERDBG_CMD_DELETE_EPT_BP,
+  HYPERDBG_CMD_HW_BP,
+  HYPERDBG_CMD_DELETE_HW_BP,
   HYPERDBG_CMD_LIST_BP,
   HYPERDBG_CMD_SINGLESTEP,
   HYPERDBG_CMD_BACKTRACE,
@@ -69,6 +78,9 @@ typedef enum {
   HYPERDBG_CMD_SYMBOL,
   HYPERDBG_CMD_SYMBOL_NEAREST,
   HYPERDBG_CMD_INFO,
+  HYPERDBG_CMD_EXITSTATS,
+  HYPERDBG_CMD_TRACE,
+  HYPERDBG_CMD_PROFILE,
   HYPERDBG_CMD_UNLINK_PROC,
   HYPERDBG_CMD_RELINK_PROC,
 } HYPERDBG_OPCODE;
@@ -88,12 +100,21 @@ static void CmdRetrieveProcesses(PHYPERDBG_CMD pcmd, PCMD_RESULT result, Bit32s
 static void CmdRetrieveModules(PHYPERDBG_CMD pcmd, PCMD_RESULT result, Bit32s *size);
 static void CmdRetrieveSockets(PHYPERDBG_CMD pcmd, PCMD_RESULT result, Bit32s *size);
 static void CmdDumpMemory(PHYPERDBG_CMD pcmd, PCMD_RESULT result, Bit32s *size);
+static hvm_bool CmdParseBreakpoint(PHYPERDBG_CMD pcmd, PCMD_RESULT result, int cr3arg, hvm_address *pcr3, hvm_bool *pisCr3Dipendent);
 static void CmdSwBreakpoint(PHYPERDBG_CMD pcmd, PCMD_RESULT result, hvm_bool isPerm);
 static void CmdDeleteSwBreakpoint(PHYPERDBG_CMD pcmd, PCMD_RESULT result);
+#ifdef ENABLE_EPT
+static void CmdEptBreakpoint(PHYPERDBG_CMD pcmd, PCMD_RESULT result);
+static void CmdDeleteEptBreakpoint(PHYPERDBG_CMD pcmd, PCMD_RESULT result);
+#endif
+static void CmdHwBreakpoint(PHYPERDBG_CMD pcmd, PCMD_RESULT result);
+static void CmdDeleteHwBreakpoint(PHYPERDBG_CMD pcmd, PCMD_RESULT result);
 static void CmdSetSingleStep(PHYPERDBG_CMD pcmd);
 static void CmdDisassemble(PHYPERDBG_CMD pcmd, PCMD_RESULT result, Bit32s *size);
 static void CmdBacktrace(PHYPERDBG_CMD pcmd);
 static void CmdLookupSymbol(PHYPERDBG_CMD pcmd, hvm_bool bExactMatch);
+static void CmdExitStats(PHYPERDBG_CMD pcmd);
+static void CmdProfile(PHYPERDBG_CMD pcmd);
 static void CmdUnlinkProc(PHYPERDBG_CMD pcmd, Bit32s *result);
 static void CmdRelinkProc(PHYPERDBG_CMD pcmd, Bit32s *result);
 
@@ -160,12 +181,34 @@ hvm_bool HyperDbgProcessCommand(Bit8u *bufcmd)
     break;
   case HYPERDBG_CMD_LIST_BP:
     SwBreakpointGetBPList(&result);
+#ifdef ENABLE_EPT
+    EptBreakpointGetBPList(&result);
+#endif
+    HwBreakpointGetBPList(&result);
     PrintBPList(&result);
     break;
   case HYPERDBG_CMD_DELETE_SW_BP:
     CmdDeleteSwBreakpoint(&cmd, &result);
     PrintDeleteSwBreakpoint(&result);
     break;
+#ifdef ENABLE_EPT
+  case HYPERDBG_CMD_EPT_BP:
+    CmdEptBreakpoint(&cmd, &result);
+    PrintSwBreakpoint(&result);
+    break;
+  case HYPERDBG_CMD_DELETE_EPT_BP:
+    CmdDeleteEptBreakpoint(&cmd, &result);
+    PrintDeleteSwBreakpoint(&result);
+    break;
+#endif
+  case HYPERDBG_CMD_HW_BP:
+    CmdHwBreakpoint(&cmd, &result);
+    PrintSwBreakpoint(&result);
+    break;
+  case HYPERDBG_CMD_DELETE_HW_BP:
+    CmdDeleteHwBreakpoint(&cmd, &result);
+    PrintDeleteSwBreakpoint(&result);
+    break;
   case HYPERDBG_CMD_SINGLESTEP:
     CmdSetSingleStep(&cmd);
     /* After this command we have to return control to the guest */
@@ -198,6 +241,17 @@ hvm_bool HyperDbgProcessCommand(Bit8u *bufcmd)
   case HYPERDBG_CMD_INFO:
     PrintInfo();
     break;
+  case HYPERDBG_CMD_EXITSTATS:
+    PrintExitStats();
+    /* Reset after showing them, if requested */
+    CmdExitStats(&cmd);
+    break;
+  case HYPERDBG_CMD_TRACE:
+    PrintTrace(cmd.nargs >= 1 ? vmm_atoi(cmd.args[0]) : TRACE_RECORDS);
+    break;
+  case HYPERDBG_CMD_PROFILE:
+    CmdProfile(&cmd);
+    break;
   default:
     PrintUnknown();
     break;
@@ -286,6 +340,40 @@ static void CmdRetrieveSockets(PHYPERDBG_CMD pcmd, PCMD_RESULT result, Bit32s *s
   *size = n;
 }
 
+static void CmdExitStats(PHYPERDBG_CMD pcmd)
+{
+  if(pcmd->nargs >= 1 && vmm_strlen(pcmd->args[0]) == 5 && vmm_strncmpi(pcmd->args[0], (Bit8u*) "reset", 5) == 0)
+    ExitStatsReset();
+}
+
+#define CMD_ARG_IS(pcmd, n, s) (vmm_strlen((pcmd)->args[n]) == sizeof(s) - 1 && vmm_strncmpi((pcmd)->args[n], (Bit8u*) s, sizeof(s) - 1) == 0)
+
+static void CmdProfile(PHYPERDBG_CMD pcmd)
+{
+  Bit64u period;
+  int n;
+
+  if(pcmd->nargs == 0) {
+    PrintProfile(ProfileByFunction);
+  } else if(CMD_ARG_IS(pcmd, 0, "proc")) {
+    PrintProfile(ProfileByProcess);
+  } else if(CMD_ARG_IS(pcmd, 0, "start")) {
+    period = SAMPLER_DEFAULT_PERIOD;
+    if(pcmd->nargs >= 2) {
+      n = vmm_atoi((char *) pcmd->args[1]);
+      period = (n > 0) ? (Bit64u) n : 0;
+    }
+    PrintProfileStatus(SamplerStart(period));
+  } else if(CMD_ARG_IS(pcmd, 0, "stop")) {
+    SamplerStop();
+    PrintProfileStatus(HVM_STATUS_SUCCESS);
+  } else {
+    PrintUnknown();
+  }
+}
+
+#undef CMD_ARG_IS
+
 static void CmdUnlinkProc(PHYPERDBG_CMD pcmd, Bit32s *result)
 {
 #ifdef GUEST_WIN_7
@@ -428,17 +516,17 @@ static void CmdDumpMemory(PHYPERDBG_CMD pcmd, PCMD_RESULT result, Bit32s *size)
     *size = ERROR_COMMAND_SPECIFIC;
 }
 
-static void CmdSwBreakpoint(PHYPERDBG_CMD pcmd, PCMD_RESULT result, hvm_bool isPerm)
+/* Parse "addr|$symbol ... [cr3]" into result->bpinfo.addr and the target
+   cr3, which is taken from argument #cr3arg. On failure,
+   result->bpinfo.error_code is set */
+static hvm_bool CmdParseBreakpoint(PHYPERDBG_CMD pcmd, PCMD_RESULT result, int cr3arg, hvm_address *pcr3, hvm_bool *pisCr3Dipendent)
 {
-  hvm_address cr3;
-  hvm_bool isCr3Dipendent;
-
   result->bpinfo.addr = 0;
-  isCr3Dipendent = FALSE;
+  *pisCr3Dipendent = FALSE;
 
   if(pcmd->nargs == 0) {
     result->bpinfo.error_code = ERROR_MISSING_PARAM;
-    return;
+    return FALSE;
   }
 
   /* Check if the param is a symbol name */
@@ -450,35 +538,46 @@ static void CmdSwBreakpoint(PHYPERDBG_CMD pcmd, PCMD_RESULT result, hvm_bool isP
     else {
       Log("[HyperDbg] Invalid symbol %s!", &pcmd->args[0][1]);
       result->bpinfo.error_code = ERROR_INVALID_SYMBOL;
-      return;
+      return FALSE;
     }
   }
   else {
     /* Translate the addr param */
     if(!vmm_strtoul(pcmd->args[0], &(result->bpinfo.addr))) {
       result->bpinfo.error_code = ERROR_INVALID_ADDR;
-      return;
+      return FALSE;
     }
   }
 
-  if(pcmd->nargs >= 2) {
+  if(pcmd->nargs > cr3arg) {
 
     /* Translate the target cr3 */
-    if(!vmm_strtoul(pcmd->args[1], &cr3)) {
+    if(!vmm_strtoul(pcmd->args[cr3arg], pcr3)) {
       result->bpinfo.error_code = ERROR_INVALID_MEMORY;
-      return;
+      return FALSE;
     }
-    isCr3Dipendent = TRUE;
+    *pisCr3Dipendent = TRUE;
   }
-  else cr3 = context.GuestContext.cr3;
+  else *pcr3 = context.GuestContext.cr3;
 
   /* Check if the address is ok */
-  if(!MmuIsAddressValid(cr3, result->bpinfo.addr)) {
+  if(!MmuIsAddressValid(*pcr3, result->bpinfo.addr)) {
     Log("[HyperDbg] Invalid memory address!");
     result->bpinfo.error_code = ERROR_INVALID_MEMORY;
-    return;
+    return FALSE;
   }
 
+  return TRUE;
+}
+
+static void CmdSwBreakpoint(PHYPERDBG_CMD pcmd, PCMD_RESULT result, hvm_bool isPerm)
+{
+  hvm_address cr3;
+  hvm_bool isCr3Dipendent;
+
+  if(!CmdParseBreakpoint(pcmd, result, 1, &cr3, &isCr3Dipendent))
+    return;
+
   result->bpinfo.bp_index = SwBreakpointSet(cr3, result->bpinfo.addr, isPerm, isCr3Dipendent);
 
   if(result->bpinfo.bp_index == MAXSWBPS) {
@@ -518,6 +617,124 @@ static void CmdDeleteSwBreakpoint(PHYPERDBG_CMD pcmd, PCMD_RESULT result)
   }
 }
 
+#ifdef ENABLE_EPT
+static void CmdEptBreakpoint(PHYPERDBG_CMD pcmd, PCMD_RESULT result)
+{
+  hvm_address cr3;
+  hvm_bool isCr3Dipendent;
+
+  result->bpinfo.kind = BreakpointEpt;
+
+  if(!CmdParseBreakpoint(pcmd, result, 1, &cr3, &isCr3Dipendent))
+    return;
+
+  result->bpinfo.bp_index = EptBreakpointSet(cr3, result->bpinfo.addr, isCr3Dipendent);
+
+  if(result->bpinfo.bp_index == MAXEPTBPS) {
+    result->bpinfo.error_code = ERROR_COMMAND_SPECIFIC;
+    return;
+  }
+  if(result->bpinfo.bp_index == -1) {
+    result->bpinfo.error_code = ERROR_DOUBLED_BP;
+    return;
+  }
+
+  result->bpinfo.error_code = 0;
+}
+
+static void CmdDeleteEptBreakpoint(PHYPERDBG_CMD pcmd, PCMD_RESULT result)
+{
+  Bit32s index = 0;
+
+  result->bpinfo.kind = BreakpointEpt;
+
+  if(pcmd->nargs == 0) {
+    result->bpinfo.error_code = ERROR_MISSING_PARAM;
+    return;
+  }
+
+  index = vmm_atoi(pcmd->args[0]);
+  if(index < 0 || index >= MAXEPTBPS) {
+    (result->bpinfo).error_code = ERROR_NOSUCH_BP;
+    return;
+  }
+  (result->bpinfo).bp_index = index;
+  if(!EptBreakpointDeleteById((result->bpinfo).bp_index)) {
+    result->bpinfo.error_code = ERROR_NOSUCH_BP;
+  }
+}
+#endif
+
+/* "H addr|$symbol [x|w|rw] [1|2|4] [cr3]" */
+static void CmdHwBreakpoint(PHYPERDBG_CMD pcmd, PCMD_RESULT result)
+{
+  hvm_address cr3;
+  hvm_bool isCr3Dipendent;
+  HW_BP_TYPE type;
+  Bit32u len;
+
+  result->bpinfo.kind = BreakpointHardware;
+
+  if(!CmdParseBreakpoint(pcmd, result, 3, &cr3, &isCr3Dipendent))
+    return;
+
+  /* Breakpoint type: instruction fetch by default */
+  type = HwBreakpointExec;
+  if(pcmd->nargs >= 2) {
+    if(vmm_strlen(pcmd->args[1]) == 1 && vmm_strncmpi(pcmd->args[1], (Bit8u*) "x", 1) == 0)
+      type = HwBreakpointExec;
+    else if(vmm_strlen(pcmd->args[1]) == 1 && vmm_strncmpi(pcmd->args[1], (Bit8u*) "w", 1) == 0)
+      type = HwBreakpointWrite;
+    else if(vmm_strlen(pcmd->args[1]) == 2 && vmm_strncmpi(pcmd->args[1], (Bit8u*) "rw", 2) == 0)
+      type = HwBreakpointReadWrite;
+    else {
+      result->bpinfo.error_code = ERROR_COMMAND_SPECIFIC;
+      return;
+    }
+  }
+
+  /* Watched length: 1 byte by default */
+  len = 1;
+  if(pcmd->nargs >= 3) {
+    len = vmm_atoi(pcmd->args[2]);
+  }
+
+  result->bpinfo.bp_index = HwBreakpointSet(cr3, result->bpinfo.addr, type, len, isCr3Dipendent);
+
+  if(result->bpinfo.bp_index == MAXHWBPS) {
+    result->bpinfo.error_code = ERROR_COMMAND_SPECIFIC;
+    return;
+  }
+  if(result->bpinfo.bp_index == -1) {
+    result->bpinfo.error_code = ERROR_DOUBLED_BP;
+    return;
+  }
+
+  result->bpinfo.error_code = 0;
+}
+
+static void CmdDeleteHwBreakpoint(PHYPERDBG_CMD pcmd, PCMD_RESULT result)
+{
+  Bit32s index = 0;
+
+  result->bpinfo.kind = BreakpointHardware;
+
+  if(pcmd->nargs == 0) {
+    result->bpinfo.error_code = ERROR_MISSING_PARAM;
+    return;
+  }
+
+  index = vmm_atoi(pcmd->args[0]);
+  if(index < 0 || index >= MAXHWBPS) {
+    (result->bpinfo).error_code = ERROR_NOSUCH_BP;
+    return;
+  }
+  (result->bpinfo).bp_index = index;
+  if(!HwBreakpointDeleteById((result->bpinfo).bp_index)) {
+    result->bpinfo.error_code = ERROR_NOSUCH_BP;
+  }
+}
+
 static void CmdSetSingleStep(PHYPERDBG_CMD pcmd)
 {
   hvm_address flags;
@@ -531,14 +748,14 @@ static void CmdSetSingleStep(PHYPERDBG_CMD pcmd)
   /* Temporarly disable interrupts in the guest so that the single-stepping instruction isn't interrupted */
   flags &= ~FLAGS_IF_MASK;
   /* Store info on old flags */
-  hyperdbg_state.TF_on = (context.GuestContext.rflags & FLAGS_TF_MASK) != 0 ? TRUE : FALSE;
-  hyperdbg_state.IF_on = (context.GuestContext.rflags & FLAGS_IF_MASK) != 0 ? TRUE : FALSE;
+  hyperdbg_cpu.TF_on = (context.GuestContext.rflags & FLAGS_TF_MASK) != 0 ? TRUE : FALSE;
+  hyperdbg_cpu.IF_on = (context.GuestContext.rflags & FLAGS_IF_MASK) != 0 ? TRUE : FALSE;
 
   /* These will be written @ vmentry */
   context.GuestContext.rflags = flags; 
 
   /* Update HyperDbg state structure */
-  hyperdbg_state.singlestepping = TRUE;
+  hyperdbg_cpu.singlestepping = TRUE;
 }
 
 static void CmdDisassemble(PHYPERDBG_CMD pcmd, PCMD_RESULT result, Bit32s *size)
@@ -548,10 +765,13 @@ static void CmdDisassemble(PHYPERDBG_CMD pcmd, PCMD_RESULT result, Bit32s *size)
   ud_t ud_obj;
   Bit8u* disasinst;
   Bit8u disasbuf[128];
-  PSYMBOL sym;
+  hvm_address operands[OUT_SIZE_Y];
+  Bit32u nops, opindex[OUT_SIZE_Y];
+  PSYMBOL opsyms[OUT_SIZE_Y];
   
   y = 0;
   addr = 0;
+  nops = 0;
 
   /* Check if we have to use RIP and if it's valid */
   if(pcmd->nargs == 0) {
@@ -601,7 +821,6 @@ static void CmdDisassemble(PHYPERDBG_CMD pcmd, PCMD_RESULT result, Bit32s *size)
   while(ud_disassemble(&ud_obj)) {
     /* check if we can resolv a symbol */
     /* FIXME: reengineer better */
-    sym = 0;
     i = 0;
     disasinst = (Bit8u*) ud_insn_asm(&ud_obj);
     while(disasinst[i] != (Bit8u)'\0' && disasinst[i] != (Bit8u)' ') i++; /* reach the end or the first operand */
@@ -609,7 +828,10 @@ static void CmdDisassemble(PHYPERDBG_CMD pcmd, PCMD_RESULT result, Bit32s *size)
       /* check if it's likely to be an address */
       if(disasinst[i+1] == (Bit8u)'0' && disasinst[i+2] == 'x') {
 	if(vmm_strtoul(&disasinst[i+1], &operand)) { /* if it can be converted to a hvm_address */
-	  sym = SymbolGetFromAddress(operand);
+	  /* Symbols are resolved all together at the end */
+	  operands[nops] = operand;
+	  opindex[nops] = y;
+	  nops++;
 	}
       }
     }
@@ -617,10 +839,7 @@ static void CmdDisassemble(PHYPERDBG_CMD pcmd, PCMD_RESULT result, Bit32s *size)
     result->instructions[y].addr = tmpaddr;
     vmm_strncpy(result->instructions[y].hexcode, ud_insn_hex(&ud_obj), 32);
     vmm_strncpy(result->instructions[y].asmcode, ud_insn_asm(&ud_obj), 64);
-    if(sym) {
-      vmm_strncpy(result->instructions[y].sym_name, (sym->name), 64);
-      result->instructions[y].sym_exists = TRUE;
-    } else result->instructions[y].sym_exists = FALSE;
+    result->instructions[y].sym_exists = FALSE;
 
     tmpaddr += ud_insn_len(&ud_obj);
     y++;
@@ -628,17 +847,29 @@ static void CmdDisassemble(PHYPERDBG_CMD pcmd, PCMD_RESULT result, Bit32s *size)
     if(y >= OUT_SIZE_Y) break;
   }
 
+  SymbolResolveMany(operands, opsyms, nops, TRUE);
+
+  for(i = 0; i < nops; i++) {
+    if(opsyms[i]) {
+      vmm_strncpy(result->instructions[opindex[i]].sym_name, (opsyms[i]->name), 64);
+      result->instructions[opindex[i]].sym_exists = TRUE;
+    }
+  }
+
   *size = y-1;
 }
 
 static void CmdBacktrace(PHYPERDBG_CMD pcmd)
 {
-  Bit32u current_frame, nframes, n;
+  Bit32u current_frame, nframes, n, i;
   hvm_address current_rip;
   hvm_status r;
   Bit8u  namec[64];
   Bit8u  sym[96];
   Bit8u  module[96];
+  Bit32u frames[OUT_SIZE_Y];
+  hvm_address rips[OUT_SIZE_Y];
+  PSYMBOL nearsyms[OUT_SIZE_Y];
   
   VideoResetOutMatrix();
   /* Parse (optional) command argument */
@@ -652,7 +883,7 @@ static void CmdBacktrace(PHYPERDBG_CMD pcmd)
     }
   }
 
-  /* Print backtrace */
+  /* Walk the stack frames */
   current_frame = context.GuestContext.rbp;
   nframes = 0;
 
@@ -661,6 +892,27 @@ static void CmdBacktrace(PHYPERDBG_CMD pcmd)
 
     if(r != HVM_STATUS_SUCCESS) break;
 
+    frames[nframes] = current_frame;
+    rips[nframes] = current_rip;
+
+    nframes += 1;
+    if ((n != 0 && nframes > n) || nframes >= OUT_SIZE_Y) {
+      break;
+    }
+
+    /* Go on with the next frame */
+    r = MmuReadVirtualRegion(context.GuestContext.cr3, current_frame, &current_frame, sizeof(current_frame));
+    if (r != HVM_STATUS_SUCCESS) break;
+  }
+
+  /* Resolve all return addresses at once */
+  SymbolResolveMany(rips, nearsyms, nframes, FALSE);
+
+  /* Print backtrace */
+  for(i = 0; i < nframes; i++) {
+    current_frame = frames[i];
+    current_rip = rips[i];
+
     vmm_memset(namec, 0, sizeof(namec));
     vmm_memset(sym, 0, sizeof(sym));
     vmm_memset(module, 0, sizeof(module));
@@ -676,7 +928,7 @@ static void CmdBacktrace(PHYPERDBG_CMD pcmd)
 	if(vmm_strlen(namec) > 0)
 	  vmm_snprintf(module, 96, "[%s]", namec);
       }
-      nearsym = SymbolGetNearest((hvm_address) current_rip);
+      nearsym = nearsyms[i];
       if(nearsym) {
 	if(current_rip-(nearsym->addr + hyperdbg_state.win_state.kernel_base) < 100000) /* FIXME: tune this param */
 	  vmm_snprintf(sym, 96, "(%s+%d)", nearsym->name, (current_rip-(nearsym->addr + hyperdbg_state.win_state.kernel_base)));
@@ -686,16 +938,7 @@ static void CmdBacktrace(PHYPERDBG_CMD pcmd)
      
 #endif
 
-    vmm_snprintf(out_matrix[nframes], OUT_SIZE_X, "[%02d] @%.8hx %.8hx %-40s %s\n", nframes, current_frame, current_rip, sym, module);
-
-    nframes += 1;
-    if ((n != 0 && nframes > n) || nframes >= OUT_SIZE_Y) {
-      break;
-    }
-
-    /* Go on with the next frame */
-    r = MmuReadVirtualRegion(context.GuestContext.cr3, current_frame, &current_frame, sizeof(current_frame));
-    if (r != HVM_STATUS_SUCCESS) break;
+    vmm_snprintf(out_matrix[i], OUT_SIZE_X, "[%02d] @%.8hx %.8hx %-40s %s\n", i, current_frame, current_rip, sym, module);
   }
   VideoRefreshOutArea(LIGHT_GREEN);
 }
@@ -783,6 +1026,12 @@ static void ParseCommand(Bit8u *buffer, PHYPERDBG_CMD pcmd)
     PARSE_COMMAND(SW_BP);
     PARSE_COMMAND(SW_PERM_BP);
     PARSE_COMMAND(DELETE_SW_BP);
+#ifdef ENABLE_EPT
+    PARSE_COMMAND(EPT_BP);
+    PARSE_COMMAND(DELETE_EPT_BP);
+#endif
+    PARSE_COMMAND(HW_BP);
+    PARSE_COMMAND(DELETE_HW_BP);
     PARSE_COMMAND(LIST_BP);
     PARSE_COMMAND(SINGLESTEP);
     PARSE_COMMAND(DISAS);
@@ -791,6 +1040,9 @@ static void ParseCommand(Bit8u *buffer, PHYPERDBG_CMD pcmd)
     PARSE_COMMAND(SYMBOL);
     PARSE_COMMAND(SYMBOL_NEAREST);
     PARSE_COMMAND(INFO);
+    PARSE_COMMAND(EXITSTATS);
+    PARSE_COMMAND(TRACE);
+    PARSE_COMMAND(PROFILE);
     PARSE_COMMAND(UNLINK_PROC);
     PARSE_COMMAND(RELINK_PROC);
   default:
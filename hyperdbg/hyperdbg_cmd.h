@@ -36,9 +36,16 @@
 #define HYPERDBG_CMD_CHAR_CONTINUE       'c'
 #define HYPERDBG_CMD_CHAR_DISAS          'd'
 #define HYPERDBG_CMD_CHAR_DELETE_SW_BP   'D'
+#define HYPERDBG_CMD_CHAR_EPT_BP         'e'
+#define HYPERDBG_CMD_CHAR_DELETE_EPT_BP  'E'
+#define HYPERDBG_CMD_CHAR_HW_BP          'H'
+#define HYPERDBG_CMD_CHAR_DELETE_HW_BP   'K'
 #define HYPERDBG_CMD_CHAR_LIST_BP        'L'
 #define HYPERDBG_CMD_CHAR_HELP           'h'
 #define HYPERDBG_CMD_CHAR_INFO           'i'
+#define HYPERDBG_CMD_CHAR_EXITSTATS      'I'
+#define HYPERDBG_CMD_CHAR_TRACE          'l'
+#define HYPERDBG_CMD_CHAR_PROFILE        'P'
 #define HYPERDBG_CMD_CHAR_SYMBOL_NEAREST 'n'
 #define HYPERDBG_CMD_CHAR_SHOWMODULES    'm'
 #define HYPERDBG_CMD_CHAR_SHOWPROCESSES  'p'
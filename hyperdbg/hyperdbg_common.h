@@ -26,10 +26,22 @@
 #define _HYPERDBG_COMMON_H
 
 #include "hyperdbg.h"
+#include "vt.h"
 
 #define HYPERDBG_MAGIC_SCANCODE     88	/* F12 */
 
-#define MAXSWBPS 100
+#define MAXSWBPS 4096
+#define MAXEPTBPS 64
+#define MAXHWBPS 4		/* DR0-DR3 */
+
+/* Cost of a breakpoint mode. Cycles are the ones spent in the exit handlers
+   (time spent in the command loop excluded), for all the exits caused by the
+   breakpoints, including the ones that did not hit */
+typedef struct {
+  Bit32u hits;
+  Bit32u exits;
+  Bit64u cycles;
+} BP_STATS, *PBP_STATS;
 
 /* Information related to the state of the internal Linux guest */
 typedef struct {
@@ -42,14 +54,9 @@ typedef struct {
   hvm_address kernel_base;
 } WIN_STATE;
 
-typedef struct {
-  /* This variable is set to 1 when HyperDbg has been initialized */
-  hvm_bool initialized;
-
-  /* This variable is set to TRUE when user has requested to enter
-     HyperDbg-mode, otherwise, it is set to FALSE */
-  hvm_bool enabled;
-
+/* Stepping state, which belongs to the processor that is stepping: another
+   processor can hit a breakpoint, or step, in the meanwhile */
+typedef struct __attribute__((aligned(VT_CACHE_LINE))) {
   /* This variable is TRUE when guest single-stepping is enabled */
   hvm_bool singlestepping;
 
@@ -63,6 +70,25 @@ typedef struct {
   hvm_bool TF_on;
   hvm_bool IF_on;
 
+  /* These variables are used while stepping over an instruction on a page
+     protected by EPT breakpoints (two pages, if the instruction straddles
+     them) */
+  Bit32u ept_step_npages;
+  hvm_address ept_step_phy[2];
+  hvm_bool ept_IF_on;
+} HYPERDBG_CPU_STATE;
+
+typedef struct {
+  /* This variable is set to 1 when HyperDbg has been initialized */
+  hvm_bool initialized;
+
+  /* This variable is set to TRUE when user has requested to enter
+     HyperDbg-mode, otherwise, it is set to FALSE */
+  hvm_bool enabled;
+
+  /* Indexed by processor ID (see hyperdbg_cpu) */
+  HYPERDBG_CPU_STATE cpus[VT_MAX_CPUS];
+
   /* This variable is TRUE when HyperDbg running in console mode */
   hvm_bool console_mode;
 
@@ -71,6 +97,9 @@ typedef struct {
 
   /* Accounting variables */
   Bit32u ntraps;
+  BP_STATS int3_stats;
+  BP_STATS ept_stats;
+  BP_STATS hw_stats;
 
   union {
     WIN_STATE   win_state;
@@ -94,4 +123,7 @@ typedef struct {
 
 extern HYPERDBG_STATE hyperdbg_state;
 
+/* Stepping state of the current processor */
+#define hyperdbg_cpu (hyperdbg_state.cpus[VtCurrentCpu()->id])
+
 #endif	/* _HYPERDBG_COMMON_H */
@@ -36,8 +36,10 @@
 #include "keyboard.h"
 #include "debug.h"
 #include "vt.h"
+#include "vmmstring.h"
 #include "video.h"
 #include "mmu.h"
+#include "symsearch.h"
 
 /* ################# */
 /* #### GLOBALS #### */
@@ -71,11 +73,8 @@ hvm_status HyperDbgGuestInit(void)
   /* Initialize global hyperdbg_state structure fields */
   hyperdbg_state.initialized = TRUE;
   hyperdbg_state.enabled = FALSE;
-  hyperdbg_state.singlestepping = FALSE;
-  hyperdbg_state.TF_on = FALSE;
-  hyperdbg_state.IF_on = FALSE;
+  vmm_memset(hyperdbg_state.cpus, 0, sizeof(hyperdbg_state.cpus));
   hyperdbg_state.console_mode = TRUE;
-  hyperdbg_state.hasPermBP = FALSE;
   hyperdbg_state.ntraps = 0;
   
   /* Init guest-specific fields */
@@ -91,6 +90,11 @@ hvm_status HyperDbgGuestInit(void)
 #error Invalid HyperDBG guest!
 #endif
 
+  /* Build symbol indexes. Not fatal: lookups by name will just be slower */
+  if (SymbolInit() != HVM_STATUS_SUCCESS) {
+    GuestLog("[HyperDbg] Cannot build symbol indexes");
+  }
+
   GuestLog("[HyperDbg] Guest initialization ok!");
 
   return HVM_STATUS_SUCCESS;
@@ -108,6 +112,9 @@ hvm_status HyperDbgGuestFini(void)
   /* Deallocate video buffer */
   VideoDealloc();
 
+  /* Deallocate symbol indexes */
+  SymbolFini();
+
   hyperdbg_state.initialized = FALSE;
 
   return HVM_STATUS_SUCCESS;
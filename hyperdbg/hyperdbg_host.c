@@ -34,9 +34,14 @@
 #include "gui.h"
 #include "events.h"
 #include "sw_bp.h"
+#include "ept_bp.h"
+#include "hw_bp.h"
 #include "vt.h"
+#include "smp.h"
 #include "symsearch.h"
 #include "mmu.h"
+#include "sampler.h"
+#include "profile.h"
 
 #ifdef GUEST_WINDOWS
 #include "winxp.h"
@@ -48,6 +53,7 @@
 
 #define HYPERDBG_HYPERCALL_SETRES    0xdead0001
 #define HYPERDBG_HYPERCALL_USER      0xdead0002
+#define HYPERDBG_HYPERCALL_PROFILE   0xdead0003
 
 /* ########################## */
 /* #### LOCAL PROTOTYPES #### */
@@ -56,6 +62,11 @@
 static EVENT_PUBLISH_STATUS HyperDbgSwBpHandler(PEVENT_ARGUMENTS args);
 static EVENT_PUBLISH_STATUS HyperDbgDebugHandler(PEVENT_ARGUMENTS args);
 static EVENT_PUBLISH_STATUS HyperDbgIOHandler(PEVENT_ARGUMENTS args);
+#ifdef ENABLE_EPT
+static EVENT_PUBLISH_STATUS HyperDbgEptBpHandler(PEVENT_ARGUMENTS args);
+static EVENT_PUBLISH_STATUS HyperDbgMTFHandler(PEVENT_ARGUMENTS args);
+#endif
+static hvm_bool HyperDbgCompleteSymbol(Bit8u* buffer, Bit32s* plen, Bit32u size);
 
 // static EVENT_PUBLISH_STATUS HyperDbgVMCallHandler(PEVENT_ARGUMENTS args);
 
@@ -66,9 +77,12 @@ static EVENT_PUBLISH_STATUS HyperDbgHypercallSetResolution(PEVENT_ARGUMENTS args
 #endif
 
 static EVENT_PUBLISH_STATUS HyperDbgHypercallUser(PEVENT_ARGUMENTS args);
+static EVENT_PUBLISH_STATUS HyperDbgHypercallProfile(PEVENT_ARGUMENTS args);
 
 static void HyperDbgEnter(void);
 static void HyperDbgCommandLoop(void);
+static void HyperDbgAccount(PBP_STATS stats, Bit64u start);
+static void HyperDbgBreakpointHit(PBP_STATS stats, Bit64u *pstart);
 
 /* ##################### */
 /* #### GLOBAL VARS #### */
@@ -93,6 +107,64 @@ static EVENT_PUBLISH_STATUS HyperDbgHypercallUser(PEVENT_ARGUMENTS args)
   return EventPublishPass;
 }
 
+/* Drive the sampling profiler from the guest: RBX is one of PROFILE_STOP,
+   PROFILE_START (RCX is the period in TSC cycles, 0 for the default),
+   PROFILE_READ_FUNCTIONS or PROFILE_READ_PROCESSES. A read writes the
+   histogram as text lines, the same as the 'P' command shows, to the guest
+   buffer at RCX of RDX bytes, and sets RDX to the bytes written: lines that
+   do not fit are dropped. RAX is set to the hvm_status of the operation */
+static EVENT_PUBLISH_STATUS HyperDbgHypercallProfile(PEVENT_ARGUMENTS args)
+{
+  PPROFILE_ENTRY entries;
+  hvm_address va;
+  Bit32u i, n, total, size, len, written;
+  char line[PROFILE_NAME_SIZE + 32];
+  hvm_status r;
+
+  switch(context.GuestContext.rbx) {
+  case PROFILE_STOP:
+    SamplerStop();
+    r = HVM_STATUS_SUCCESS;
+    break;
+
+  case PROFILE_START:
+    r = SamplerStart(context.GuestContext.rcx ? context.GuestContext.rcx : SAMPLER_DEFAULT_PERIOD);
+    break;
+
+  case PROFILE_READ_FUNCTIONS:
+  case PROFILE_READ_PROCESSES:
+    va   = context.GuestContext.rcx;
+    size = context.GuestContext.rdx;
+
+    n = ProfileBuild(context.GuestContext.rbx == PROFILE_READ_FUNCTIONS ? ProfileByFunction : ProfileByProcess,
+		     &entries, &total);
+
+    r = HVM_STATUS_SUCCESS;
+    written = 0;
+    for(i = 0; i < n && HVM_SUCCESS(r); i++) {
+      ProfileFormatEntry(&entries[i], total, line, sizeof(line) - 1);
+      len = vmm_strlen((Bit8u *) line);
+      line[len++] = '\n';
+      if(written + len > size)
+	break;
+
+      r = MmuWriteVirtualRegion(context.GuestContext.cr3, va + written, line, len);
+      written += len;
+    }
+
+    context.GuestContext.rdx = written;
+    break;
+
+  default:
+    r = HVM_STATUS_UNSUCCESSFUL;
+    break;
+  }
+
+  context.GuestContext.rax = r;
+
+  return EventPublishHandled;
+}
+
 /* Not used right now */
 #if 0
 static EVENT_PUBLISH_STATUS HyperDbgHypercallSetResolution(PEVENT_ARGUMENTS args)
@@ -107,6 +179,12 @@ static void HyperDbgEnter(void)
 {
   hvm_status r;
 
+  /* Stop the other processors while the user is in the shell */
+  SmpFreezeOthers();
+
+  /* The shell shows (and evaluates) cs, cr0 and cr4 */
+  hvm_x86_ops.vt_read_guest_state();
+
   /* Update HyperDbg state structure */
   hyperdbg_state.enabled = TRUE;
 
@@ -123,6 +201,29 @@ static void HyperDbgEnter(void)
   Log("[HyperDbg] Leaving HyperDbg command loop");
 
   hyperdbg_state.enabled = FALSE;
+
+  SmpThawOthers();
+}
+
+/* Charge the cycles elapsed since 'start' to a breakpoint mode */
+static void HyperDbgAccount(PBP_STATS stats, Bit64u start)
+{
+  Bit64u now;
+
+  RegRdtsc(&now);
+  stats->cycles += now - start;
+}
+
+/* Account for a breakpoint hit and enter the command loop. The clock is
+   restarted when the user lets the guest go */
+static void HyperDbgBreakpointHit(PBP_STATS stats, Bit64u *pstart)
+{
+  HyperDbgAccount(stats, *pstart);
+  stats->hits++;
+
+  HyperDbgEnter();
+
+  RegRdtsc(pstart);
 }
 
 static void HyperDbgCommandLoop(void)
@@ -154,14 +255,14 @@ static void HyperDbgCommandLoop(void)
   if (VideoEnabled()) {
     /* Backup video memory */
 
-    if (!hyperdbg_state.singlestepping)
+    if (!hyperdbg_cpu.singlestepping)
       VideoSave();
 
     VideoInitShell();
   }
   
   /* We are not currently single-stepping */
-  hyperdbg_state.singlestepping = FALSE;  
+  hyperdbg_cpu.singlestepping = FALSE;  
 
   /* Initialize kbd buffer */
   vmm_memset(keyboard_buffer, 0, sizeof(keyboard_buffer));
@@ -248,7 +349,12 @@ static void HyperDbgCommandLoop(void)
       break;
 
     case '\t':
-      /* Replace tabs with spaces */
+      /* Complete symbol names ("$name") */
+      if (HyperDbgCompleteSymbol(keyboard_buffer, &i, sizeof(keyboard_buffer))) {
+	break;
+      }
+
+      /* Otherwise, replace tabs with spaces */
       c = ' ';
       /* "break" intentionally omitted! */
 
@@ -271,7 +377,7 @@ static void HyperDbgCommandLoop(void)
     }
   }
 
-  if(VideoEnabled() && !hyperdbg_state.singlestepping) {
+  if(VideoEnabled() && !hyperdbg_cpu.singlestepping) {
     /* Restore video memory */
     VideoRestore();
   }
@@ -280,6 +386,33 @@ static void HyperDbgCommandLoop(void)
   /* RegSetFlags(flags); */
 }
 
+/* If the last word in the command buffer is a symbol reference ("$prefix"),
+   extend it with the longest completion shared by all the matching symbols */
+static hvm_bool HyperDbgCompleteSymbol(Bit8u* buffer, Bit32s* plen, Bit32u size)
+{
+  Bit8u completion[128];
+  Bit32s start;
+  Bit32u n, len;
+
+  for (start = *plen; start > 0 && buffer[start-1] != ' '; start--)
+    ;
+
+  if (buffer[start] != '$')
+    return FALSE;
+
+  n = SymbolCompleteName(&buffer[start+1], completion, sizeof(completion));
+  if (n == 0)
+    return FALSE;
+
+  /* Leave room for the terminator */
+  len = MIN(vmm_strlen(completion), size - (start+1) - 1);
+  vmm_memcpy(&buffer[start+1], completion, len);
+  buffer[start+1+len] = 0;
+  *plen = start + 1 + len;
+
+  return TRUE;
+}
+
 /* Invoked for write operations to the keyboard I/O port */
 static EVENT_PUBLISH_STATUS HyperDbgIOHandler(PEVENT_ARGUMENTS args)
 {
@@ -319,12 +452,15 @@ static EVENT_PUBLISH_STATUS HyperDbgSwBpHandler(PEVENT_ARGUMENTS args)
 {
   hvm_bool isCr3Dipendent, isPerm, useless;
   hvm_address ours_cr3, flags, uselesss;
+  Bit64u t0;
 
 #ifdef GUEST_WIN_7
   hvm_status r;
   Bit8u success = 0;
 #endif
 
+  RegRdtsc(&t0);
+
   if(hyperdbg_state.console_mode) {
 
     if(context.GuestContext.rip == hyperdbg_state.unlink_bp_addr) {
@@ -371,6 +507,8 @@ static EVENT_PUBLISH_STATUS HyperDbgSwBpHandler(PEVENT_ARGUMENTS args)
       if(SwBreakpointGetBPInfo(context.GuestContext.cr3, context.GuestContext.rip, &isCr3Dipendent, &isPerm, &ours_cr3)) {
 
 	Log("[HyperDbg] bp is ours, %s %s", isPerm?"permanent":"", isCr3Dipendent?"and cr3dipendent":"");	
+	hyperdbg_state.int3_stats.exits++;
+
 	/* Update guest RIP to re-execute the faulty instruction */
 	context.GuestContext.resumerip = context.GuestContext.rip;
 
@@ -384,20 +522,20 @@ static EVENT_PUBLISH_STATUS HyperDbgSwBpHandler(PEVENT_ARGUMENTS args)
 
 	  SwBreakpointDelete(context.GuestContext.cr3, context.GuestContext.rip);
 
-	  HyperDbgEnter();
+	  HyperDbgBreakpointHit(&hyperdbg_state.int3_stats, &t0);
 	}
 	else {
 PermBP:
 	  if(!isCr3Dipendent || (isCr3Dipendent && context.GuestContext.cr3 == ours_cr3)) {
 	    SwBreakpointDeletePerm(context.GuestContext.cr3, context.GuestContext.rip);
-	    HyperDbgEnter();
+	    HyperDbgBreakpointHit(&hyperdbg_state.int3_stats, &t0);
 	  }
 
 	  if(SwBreakpointGetBPInfo(context.GuestContext.cr3, context.GuestContext.rip, &useless, &useless, &uselesss)) {
 	  
 	    SwBreakpointDelete(ours_cr3, context.GuestContext.rip);
 
-	    if(!hyperdbg_state.singlestepping) {
+	    if(!hyperdbg_cpu.singlestepping) {
 	      /* Fetch guest EFLAGS */
 	      flags = context.GuestContext.rflags;
 	  
@@ -407,27 +545,28 @@ PermBP:
 	      /* Temporarly disable interrupts in the guest so that the single-stepping instruction isn't interrupted */
 	      flags &= ~FLAGS_IF_MASK;
 	      /* Store info on old flags */
-	      hyperdbg_state.TF_on = (context.GuestContext.rflags & FLAGS_TF_MASK) != 0 ? TRUE : FALSE;
-	      hyperdbg_state.IF_on = (context.GuestContext.rflags & FLAGS_IF_MASK) != 0 ? TRUE : FALSE;
+	      hyperdbg_cpu.TF_on = (context.GuestContext.rflags & FLAGS_TF_MASK) != 0 ? TRUE : FALSE;
+	      hyperdbg_cpu.IF_on = (context.GuestContext.rflags & FLAGS_IF_MASK) != 0 ? TRUE : FALSE;
 
 	      context.GuestContext.rflags = flags;	    
 	    }
 
 	    /* When catch #DB, we have to check if we are in this case */
-	    hyperdbg_state.hasPermBP = TRUE;
-	    hyperdbg_state.previous_codeaddr = context.GuestContext.rip;
-	    hyperdbg_state.isPermBPCr3Dipendent = isCr3Dipendent;
-	    hyperdbg_state.bp_cr3 = ours_cr3;
+	    hyperdbg_cpu.hasPermBP = TRUE;
+	    hyperdbg_cpu.previous_codeaddr = context.GuestContext.rip;
+	    hyperdbg_cpu.isPermBPCr3Dipendent = isCr3Dipendent;
+	    hyperdbg_cpu.bp_cr3 = ours_cr3;
 	  }
 	  else {
 
-	    hyperdbg_state.hasPermBP = FALSE;
+	    hyperdbg_cpu.hasPermBP = FALSE;
 	  }
 	}
       }
       else return EventPublishPass;
 
       Log("[HyperDbg] Done!");
+      HyperDbgAccount(&hyperdbg_state.int3_stats, t0);
     }
   }
   else { 
@@ -442,20 +581,50 @@ static EVENT_PUBLISH_STATUS HyperDbgDebugHandler(PEVENT_ARGUMENTS args)
 {
   hvm_address flags;
   Bit32u bp_index;
+  Bit64u t0;
+  hvm_bool isHw, isHwHit, isHwExec;
+
+  isHw = HwBreakpointCheck(args->EventException.qualification, context.GuestContext.cr3, &isHwHit, &isHwExec);
 
   /* Check if we are single-stepping or not. This is needed because #DB
      exceptions are also generated by the core mechanisms that handles I/O
      instructions */
-  if (!hyperdbg_state.singlestepping && !hyperdbg_state.hasPermBP)
+  if (!isHw && !hyperdbg_cpu.singlestepping && !hyperdbg_cpu.hasPermBP)
     return EventPublishPass;
 
+  RegRdtsc(&t0);
+
+  if(isHw) {
+    hyperdbg_state.hw_stats.exits++;
+
+    /* Data breakpoints are traps, instruction breakpoints are faults: in both
+       cases RIP is where the guest has to resume */
+    context.GuestContext.resumerip = context.GuestContext.rip;
+
+    /* Don't fault again on the same instruction breakpoint */
+    if(isHwExec)
+      context.GuestContext.rflags |= FLAGS_RF_MASK;
+
+    if(isHwHit && !hyperdbg_cpu.singlestepping)
+      HyperDbgBreakpointHit(&hyperdbg_state.hw_stats, &t0);
+    else if(isHwHit)
+      hyperdbg_state.hw_stats.hits++;
+
+    HyperDbgAccount(&hyperdbg_state.hw_stats, t0);
+
+    if(!hyperdbg_cpu.singlestepping && !hyperdbg_cpu.hasPermBP)
+      return EventPublishHandled;
+
+    RegRdtsc(&t0);
+  }
+
   /* Restore EFLAGS and hide it to the guest */
   flags = context.GuestContext.rflags;
   
-  if(hyperdbg_state.IF_on) {
+  if(hyperdbg_cpu.IF_on) {
     flags |= FLAGS_IF_MASK;
   }
-  if(hyperdbg_state.TF_on) {
+  if(hyperdbg_cpu.TF_on) {
     flags |= FLAGS_TF_MASK;
   }
   else {
@@ -466,24 +635,144 @@ static EVENT_PUBLISH_STATUS HyperDbgDebugHandler(PEVENT_ARGUMENTS args)
   /* Update guest RIP to re-execute the faulty instruction */
   context.GuestContext.resumerip = context.GuestContext.rip;
 
-  if(hyperdbg_state.singlestepping) {
+  if(hyperdbg_cpu.singlestepping) {
     HyperDbgEnter();
 
     /* Let's set RF to 1 so that we won't trap when really executing the instruction */
     flags = context.GuestContext.rflags;
     flags |= FLAGS_RF_MASK;
     context.GuestContext.rflags = flags;
+
+    RegRdtsc(&t0);
   }
 
-  if(hyperdbg_state.hasPermBP) {
-    bp_index = SwBreakpointSet(hyperdbg_state.bp_cr3, hyperdbg_state.previous_codeaddr, TRUE, hyperdbg_state.isPermBPCr3Dipendent);
-    hyperdbg_state.hasPermBP = FALSE;
+  if(hyperdbg_cpu.hasPermBP) {
+    bp_index = SwBreakpointSet(hyperdbg_cpu.bp_cr3, hyperdbg_cpu.previous_codeaddr, TRUE, hyperdbg_cpu.isPermBPCr3Dipendent);
+    hyperdbg_cpu.hasPermBP = FALSE;
     /* Enable this if you have problem with permanent BPs */
-    /* Log("[HyperDbg] Set again breakpoint (cr3 0x%08x, addr 0x%08hx) at index %d", hyperdbg_state.bp_cr3, hyperdbg_state.previous_codeaddr, bp_index); */
+    /* Log("[HyperDbg] Set again breakpoint (cr3 0x%08x, addr 0x%08hx) at index %d", hyperdbg_cpu.bp_cr3, hyperdbg_cpu.previous_codeaddr, bp_index); */
+
+    hyperdbg_state.int3_stats.exits++;
+    HyperDbgAccount(&hyperdbg_state.int3_stats, t0);
+  }
+
+  return EventPublishHandled;
+}
+
+#ifdef ENABLE_EPT
+/* Instruction fetch from a page protected by an EPT breakpoint */
+static EVENT_PUBLISH_STATUS HyperDbgEptBpHandler(PEVENT_ARGUMENTS args)
+{
+  hvm_address phy;
+  Bit32u i;
+  Bit64u t0;
+
+  phy = args->EventEPTViolation.guestPhysicalAddress & 0xfffff000;
+
+  if((args->EventEPTViolation.attemptType & EXEC) == 0 || !EptBreakpointIsPageProtected(phy))
+    return EventPublishPass;
+
+  RegRdtsc(&t0);
+  hyperdbg_state.ept_stats.exits++;
+
+  /* Update guest RIP to re-execute the faulty instruction */
+  context.GuestContext.resumerip = context.GuestContext.rip;
+
+  if(args->EventEPTViolation.is_linear_valid &&
+     args->EventEPTViolation.guestLinearAddress == context.GuestContext.rip &&
+     hyperdbg_cpu.ept_step_npages == 0 &&
+     EptBreakpointIsHit(context.GuestContext.cr3, args->EventEPTViolation.guestLinearAddress)) {
+    HyperDbgBreakpointHit(&hyperdbg_state.ept_stats, &t0);
+  }
+
+  /* The page may be in our step already, if it was protected again before
+     our instruction was fetched. It is not another processor's doing: they
+     are frozen for the whole step (see below) */
+  for(i = 0; i < hyperdbg_cpu.ept_step_npages; i++) {
+    if(hyperdbg_cpu.ept_step_phy[i] == phy)
+      break;
+  }
+
+  if(i == 2) {
+    /* Can't happen, an instruction spans two pages at most. Leave the page
+       protected rather than lose track of it */
+    Log("[HyperDbg] Cannot step over EPT breakpoint page %.8x, already stepping over %.8x and %.8x",
+	phy, hyperdbg_cpu.ept_step_phy[0], hyperdbg_cpu.ept_step_phy[1]);
+    HyperDbgAccount(&hyperdbg_state.ept_stats, t0);
+    return EventPublishHandled;
+  }
+
+  /* While the page is executable, the other processors would run past its
+     breakpoints: they are stopped before it becomes executable, and resumed
+     by the MTF exit */
+  if(hyperdbg_cpu.ept_step_npages == 0)
+    SmpFreezeOthers();
+
+  /* Execute a single instruction with the page executable, the MTF exit
+     will protect it again */
+  if(!HVM_SUCCESS(EptBreakpointProtectPage(phy, FALSE))) {
+    Log("[HyperDbg] Cannot make EPT breakpoint page %.8x executable", phy);
+    if(hyperdbg_cpu.ept_step_npages == 0)
+      SmpThawOthers();
+    HyperDbgAccount(&hyperdbg_state.ept_stats, t0);
+    return EventPublishHandled;
+  }
+
+  if(hyperdbg_cpu.ept_step_npages == 0) {
+    if(!HVM_SUCCESS(hvm_x86_ops.vt_trap_mtf(TRUE))) {
+      /* Can't happen, MTF support is checked when setting breakpoints. We
+	 can only leave the page executable */
+      Log("[HyperDbg] Cannot step over EPT breakpoint page %.8x", phy);
+      SmpThawOthers();
+      return EventPublishHandled;
+    }
+
+    /* Temporarly disable interrupts in the guest so that the single-stepping
+       instruction isn't interrupted */
+    hyperdbg_cpu.ept_IF_on = (context.GuestContext.rflags & FLAGS_IF_MASK) != 0 ? TRUE : FALSE;
+    context.GuestContext.rflags &= ~FLAGS_IF_MASK;
+  }
+
+  if(i == hyperdbg_cpu.ept_step_npages)
+    hyperdbg_cpu.ept_step_phy[hyperdbg_cpu.ept_step_npages++] = phy;
+
+  HyperDbgAccount(&hyperdbg_state.ept_stats, t0);
+
+  return EventPublishHandled;
+}
+
+/* End of the step over an instruction on an EPT breakpoint page */
+static EVENT_PUBLISH_STATUS HyperDbgMTFHandler(PEVENT_ARGUMENTS args)
+{
+  Bit32u i;
+  Bit64u t0;
+
+  if(hyperdbg_cpu.ept_step_npages == 0)
+    return EventPublishPass;
+
+  RegRdtsc(&t0);
+  hyperdbg_state.ept_stats.exits++;
+
+  hvm_x86_ops.vt_trap_mtf(FALSE);
+
+  if(hyperdbg_cpu.ept_IF_on)
+    context.GuestContext.rflags |= FLAGS_IF_MASK;
+
+  /* Breakpoints may have been deleted in the meanwhile */
+  for(i = 0; i < hyperdbg_cpu.ept_step_npages; i++) {
+    if(EptBreakpointIsPageProtected(hyperdbg_cpu.ept_step_phy[i]) &&
+       !HVM_SUCCESS(EptBreakpointProtectPage(hyperdbg_cpu.ept_step_phy[i], TRUE)))
+      Log("[HyperDbg] Cannot protect EPT breakpoint page %.8x again", hyperdbg_cpu.ept_step_phy[i]);
   }
+  hyperdbg_cpu.ept_step_npages = 0;
+
+  SmpThawOthers();
+
+  HyperDbgAccount(&hyperdbg_state.ept_stats, t0);
 
   return EventPublishHandled;
 }
+#endif
 
 EVENT_PUBLISH_STATUS HyperDbgIO(void)
 {
@@ -495,6 +784,10 @@ hvm_status HyperDbgHostInit(void)
   EVENT_CONDITION_EXCEPTION exception;
   EVENT_CONDITION_IO io;
   EVENT_CONDITION_HYPERCALL hypercall;
+#ifdef ENABLE_EPT
+  EVENT_CONDITION_EPT_VIOLATION ept;
+  EVENT_CONDITION_NONE none;
+#endif
   hvm_status r;
 
   /* Init keyboard module */
@@ -514,6 +807,20 @@ hvm_status HyperDbgHostInit(void)
     return HVM_STATUS_UNSUCCESSFUL;
   }
 
+#ifdef ENABLE_EPT
+  /* Register the EPT breakpoints handlers */
+  vmm_memset(&ept, 0, sizeof(ept));
+  ept.exec = TRUE;
+  if(!EventSubscribe(EventEPTViolation, &ept, sizeof(ept), HyperDbgEptBpHandler)) {
+    return HVM_STATUS_UNSUCCESSFUL;
+  }
+
+  none = 0;
+  if(!EventSubscribe(EventMonitorTrap, &none, sizeof(none), HyperDbgMTFHandler)) {
+    return HVM_STATUS_UNSUCCESSFUL;
+  }
+#endif
+
   /* JOY: I commented this as for now we are not using it and we do not want
      random userspace process to mess up with our resolution :) */
 #if 0
@@ -531,10 +838,18 @@ hvm_status HyperDbgHostInit(void)
     GuestLog("ERROR: Unable to register non-root -> root hypercall handler");
     return HVM_STATUS_UNSUCCESSFUL;
   }
+
+  /* Register a hypercall to drive the sampling profiler */
+  hypercall.hypernum = HYPERDBG_HYPERCALL_PROFILE;
+  if(!EventSubscribe(EventHypercall, &hypercall, sizeof(hypercall), HyperDbgHypercallProfile)) {
+    GuestLog("ERROR: Unable to register profiler hypercall handler");
+    return HVM_STATUS_UNSUCCESSFUL;
+  }
   
   /* Trap keyboard-related I/O instructions */
   io.direction = EventIODirectionIn;
   io.portnum = (Bit32u) KEYB_REGISTER_OUTPUT;
+  io.portcount = 1;
   if(!EventSubscribe(EventIO, &io, sizeof(io), HyperDbgIOHandler)) {
     return HVM_STATUS_UNSUCCESSFUL;
   }
@@ -545,6 +860,18 @@ hvm_status HyperDbgHostInit(void)
 hvm_status HyperDbgHostFini(void)
 {
   EVENT_CONDITION_EXCEPTION exception;
+#ifdef ENABLE_EPT
+  EVENT_CONDITION_EPT_VIOLATION ept;
+  EVENT_CONDITION_NONE none;
+
+  /* Remove EPT breakpoints handlers */
+  vmm_memset(&ept, 0, sizeof(ept));
+  ept.exec = TRUE;
+  EventUnsubscribe(EventEPTViolation, &ept, sizeof(ept));
+  none = 0;
+  EventUnsubscribe(EventMonitorTrap, &none, sizeof(none));
+#endif
+
   /* Remove DEBUG handler */
   exception.exceptionnum = TRAP_DEBUG;
   EventUnsubscribe(EventException, &exception, sizeof(exception));
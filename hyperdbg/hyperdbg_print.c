@@ -28,6 +28,13 @@
 #include "video.h"
 #include "gui.h"
 #include "pager.h"
+#include "mmu.h"
+#include "common.h"
+#include "hw_bp.h"
+#include "exitstats.h"
+#include "trace.h"
+#include "sampler.h"
+#include "vmx.h"
 
 void PrintHelp()
 {
@@ -47,7 +54,13 @@ void PrintHelp()
   vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "%c addr|$symbol [cr3] - set sw breakpoint @ address addr or at address of $symbol", HYPERDBG_CMD_CHAR_SW_BP);
   vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "%c addr|$symbol [cr3] - set permanent sw breakpoint @ address addr or at address of $symbol", HYPERDBG_CMD_CHAR_SW_PERM_BP);
   vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "%c id - delete sw breakpoint #id (always check id with BP listing)", HYPERDBG_CMD_CHAR_DELETE_SW_BP);
-  vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "%c - list sw breakpoints", HYPERDBG_CMD_CHAR_LIST_BP);
+#ifdef ENABLE_EPT
+  vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "%c addr|$symbol [cr3] - set permanent EPT breakpoint (no code patching) @ address addr or at address of $symbol", HYPERDBG_CMD_CHAR_EPT_BP);
+  vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "%c id - delete EPT breakpoint #id (always check id with BP listing)", HYPERDBG_CMD_CHAR_DELETE_EPT_BP);
+#endif
+  vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "%c addr|$symbol [x|w|rw] [1|2|4] [cr3] - set hw breakpoint (x) or watchpoint (w, rw) of 1, 2 or 4 bytes @ address addr or at address of $symbol", HYPERDBG_CMD_CHAR_HW_BP);
+  vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "%c id - delete hw breakpoint #id (always check id with BP listing)", HYPERDBG_CMD_CHAR_DELETE_HW_BP);
+  vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "%c - list breakpoints", HYPERDBG_CMD_CHAR_LIST_BP);
   vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "%c - single step", HYPERDBG_CMD_CHAR_SINGLESTEP);
   vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "%c [addr] [cr3] - disassemble starting from addr (default rip)", HYPERDBG_CMD_CHAR_DISAS);
   vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "%c - continue execution", HYPERDBG_CMD_CHAR_CONTINUE);
@@ -55,6 +68,9 @@ void PrintHelp()
   vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "%c addr - lookup symbol associated with address addr", HYPERDBG_CMD_CHAR_SYMBOL);
   vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "%c addr - lookup nearest symbol to address addr", HYPERDBG_CMD_CHAR_SYMBOL_NEAREST);
   vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "%c - show info on HyperDbg", HYPERDBG_CMD_CHAR_INFO);
+  vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "%c [reset] - show VM exit counts and handler latencies (then reset them)", HYPERDBG_CMD_CHAR_EXITSTATS);
+  vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "%c [n] - show the last n records of the VMM trace log", HYPERDBG_CMD_CHAR_TRACE);
+  vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "%c [proc|start [cycles]|stop] - show sampled guest time by function or process, start sampling every n TSC cycles, stop", HYPERDBG_CMD_CHAR_PROFILE);
   vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "");
   vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "ONLY FOR WINDOWS 7");
   vmm_snprintf(out_matrix[i++], OUT_SIZE_X, "%c cr3 - freeze process with specified cr3", HYPERDBG_CMD_CHAR_UNLINK_PROC);
@@ -264,21 +280,54 @@ void PrintSockets(PCMD_RESULT buffer, Bit32s size)
   PagerLoop(LIGHT_GREEN);
 }
 
+static char *PrintBPKind(BREAKPOINT_KIND kind)
+{
+  switch(kind) {
+  case BreakpointEpt:      return "EPT ";
+  case BreakpointHardware: return "hw ";
+  default:                 return "";
+  }
+}
+
+static char *PrintHwBPType(Bit8u type)
+{
+  switch(type) {
+  case HwBreakpointExec:      return "x";
+  case HwBreakpointWrite:     return "w";
+  case HwBreakpointReadWrite: return "rw";
+  default:                    return "?";
+  }
+}
+
 void PrintBPList(PCMD_RESULT buffer)
 {
-  Bit32u i;
-  char tmp[OUT_SIZE_X];
+  Bit32u i, id;
+  char tmp[OUT_SIZE_X], c;
 
   VideoResetOutMatrix();
 
-  vmm_snprintf(tmp, sizeof(tmp),  "ID        Cr3             Address             Perm?             Cr3Dependent?");
+  vmm_snprintf(tmp, sizeof(tmp),  "ID        Cr3             Address             Perm?             Cr3Dependent?     Type");
 
-  for (i=0; i<MAXSWBPS; i++) {
+  for (i=0; i<MAXSWBPS+MAXEPTBPS+MAXHWBPS; i++) {
 
     if(buffer->bplist[i].Addr != 0) {
       PagerAddLine(tmp);
+
+      /* EPT and hw breakpoints are numbered on their own */
+      switch(buffer->bplist[i].kind) {
+      case BreakpointEpt:      id = i-MAXSWBPS;           c = 'e'; break;
+      case BreakpointHardware: id = i-MAXSWBPS-MAXEPTBPS; c = 'h'; break;
+      default:                 id = i;                    c = '.'; break;
+      }
+
       /* Print data */
-      vmm_snprintf(tmp, sizeof(tmp),  "%.3d.      0x%08hx      0x%08hx          %5s             %5s", i, buffer->bplist[i].cr3, buffer->bplist[i].Addr, buffer->bplist[i].isPerm?"TRUE":"FALSE", buffer->bplist[i].isCr3Dipendent?"TRUE":"FALSE");
+      vmm_snprintf(tmp, sizeof(tmp),  "%.3d%c      0x%08hx      0x%08hx          %5s             %5s", id, c,
+		   buffer->bplist[i].cr3, buffer->bplist[i].Addr, buffer->bplist[i].isPerm?"TRUE":"FALSE", buffer->bplist[i].isCr3Dipendent?"TRUE":"FALSE");
+
+      if(buffer->bplist[i].kind == BreakpointHardware) {
+	vmm_snprintf(tmp + vmm_strlen((Bit8u*) tmp), sizeof(tmp) - vmm_strlen((Bit8u*) tmp), "             %s/%d",
+		     PrintHwBPType(buffer->bplist[i].hwtype), buffer->bplist[i].hwlen);
+      }
     }
   }
 
@@ -465,7 +514,7 @@ void PrintSwBreakpoint(PCMD_RESULT buffer)
     return;
   }
 
-  vmm_snprintf(out_matrix[0], OUT_SIZE_X, "Set bp #%d @ 0x%08hx", buffer->bpinfo.bp_index, buffer->bpinfo.addr);
+  vmm_snprintf(out_matrix[0], OUT_SIZE_X, "Set %sbp #%d @ 0x%08hx", PrintBPKind(buffer->bpinfo.kind), buffer->bpinfo.bp_index, buffer->bpinfo.addr);
 
   VideoRefreshOutArea(LIGHT_GREEN);
 }
@@ -486,7 +535,7 @@ void PrintDeleteSwBreakpoint(PCMD_RESULT buffer)
       return;
   }
 
-  vmm_snprintf(out_matrix[0], OUT_SIZE_X, "Deleted bp #%d!", buffer->bpinfo.bp_index);   
+  vmm_snprintf(out_matrix[0], OUT_SIZE_X, "Deleted %sbp #%d!", PrintBPKind(buffer->bpinfo.kind), buffer->bpinfo.bp_index);   
 
   VideoRefreshOutArea(LIGHT_GREEN);
 }
@@ -524,9 +573,24 @@ void PrintDisassembled(PCMD_RESULT buffer, Bit32s size)
   VideoRefreshOutArea(LIGHT_GREEN);
 }
 
+static void PrintBPStats(char *line, char *mode, PBP_STATS stats)
+{
+  Bit32u exits100;
+
+  if(stats->hits == 0) {
+    vmm_snprintf(line, OUT_SIZE_X, "%s breakpoints: no hits, %d exits", mode, stats->exits);
+    return;
+  }
+
+  exits100 = (stats->exits * 100) / stats->hits;
+  vmm_snprintf(line, OUT_SIZE_X, "%s breakpoints: %d hits, %d.%.2d exits/hit, %d cycles/hit",
+	       mode, stats->hits, exits100 / 100, exits100 % 100, CmDiv64(stats->cycles, stats->hits));
+}
+
 void PrintInfo()
 {
   Bit32u start;
+  MMU_STATS mmustats;
 
   VideoResetOutMatrix();
 
@@ -541,9 +605,184 @@ void PrintInfo()
   vmm_snprintf(out_matrix[start++], OUT_SIZE_X, "                    *           {joystick,pago}@security.di.unimi.it          *                   ");
   vmm_snprintf(out_matrix[start++], OUT_SIZE_X, "                    *                                                         *                   ");
   vmm_snprintf(out_matrix[start++], OUT_SIZE_X, "                    ***********************************************************                   ");
+
+  MmuGetStats(&mmustats);
+  start++;
+  vmm_snprintf(out_matrix[start++], OUT_SIZE_X, "MMU: %d maps, %d TLB flushes, %d page invalidations, %d PTE search iterations",
+	       mmustats.maps, mmustats.tlb_flushes, mmustats.tlb_page_flushes, mmustats.search_iterations);
+  vmm_snprintf(out_matrix[start++], OUT_SIZE_X, "Guest TLB cache: %d hits (%d large), %d misses",
+	       mmustats.gtlb_hits, mmustats.gtlb_large_hits, mmustats.gtlb_misses);
+  vmm_snprintf(out_matrix[start++], OUT_SIZE_X, "Contiguous runs: %d (%d pages)",
+	       mmustats.runs, mmustats.run_pages);
+  start++;
+  PrintBPStats(out_matrix[start++], "int3", &hyperdbg_state.int3_stats);
+  PrintBPStats(out_matrix[start++], "hw  ", &hyperdbg_state.hw_stats);
+#ifdef ENABLE_EPT
+  PrintBPStats(out_matrix[start++], "EPT ", &hyperdbg_state.ept_stats);
+#endif
   VideoRefreshOutArea(LIGHT_GREEN);
 }
 
+/* Cycle counts are printed as 32-bit values, saturating */
+static Bit32u PrintCycles(Bit64u cycles)
+{
+  return (cycles >> 32) ? 0xffffffff : (Bit32u) cycles;
+}
+
+void PrintExitStats()
+{
+  PEXIT_STATS stats;
+  PEXIT_REASON_STATS r;
+  Bit32u i;
+  char tmp[OUT_SIZE_X];
+
+  VideoResetOutMatrix();
+
+  stats = ExitStatsGet();
+
+  vmm_snprintf(tmp, sizeof(tmp), "%d VM exits (cycles from VMM lock to entry, percentiles are upper bounds)", PrintCycles(stats->exits));
+  PagerAddLine(tmp);
+  if(stats->exits != 0) {
+    vmm_snprintf(tmp, sizeof(tmp), "Waiting for the VMM lock: %u cycles avg, %u max",
+		 PrintCycles(CmDiv64(stats->lock_cycles, PrintCycles(stats->exits))), PrintCycles(stats->lock_max));
+    PagerAddLine(tmp);
+  }
+  vmm_snprintf(tmp, sizeof(tmp), "Reason    Count         Avg         p50         p90         p99         Max");
+  PagerAddLine(tmp);
+
+  for(i = 0; i < EXIT_STATS_REASONS; i++) {
+    r = &stats->reasons[i];
+    if(r->count == 0)
+      continue;
+
+    vmm_snprintf(tmp, sizeof(tmp), "%6d %8d  %10u  %10u  %10u  %10u  %10u", i, r->count,
+		 CmDiv64(r->cycles, r->count),
+		 PrintCycles(ExitStatsPercentile(r, 50)),
+		 PrintCycles(ExitStatsPercentile(r, 90)),
+		 PrintCycles(ExitStatsPercentile(r, 99)),
+		 PrintCycles(r->max));
+    PagerAddLine(tmp);
+  }
+
+  PagerAddLine("");
+  PagerAddLine("Exception   Count");
+  for(i = 0; i < EXIT_STATS_VECTORS; i++) {
+    if(stats->vectors[i] == 0)
+      continue;
+
+    vmm_snprintf(tmp, sizeof(tmp), "%9d %7d", i, stats->vectors[i]);
+    PagerAddLine(tmp);
+  }
+
+  PagerAddLine("");
+  PagerAddLine("I/O port    Count");
+  for(i = 0; i < EXIT_STATS_PORTS; i++) {
+    if(stats->ports[i].count == 0)
+      continue;
+
+    vmm_snprintf(tmp, sizeof(tmp), "   0x%04x %7d", stats->ports[i].port, stats->ports[i].count);
+    PagerAddLine(tmp);
+  }
+  if(stats->ports_dropped != 0) {
+    vmm_snprintf(tmp, sizeof(tmp), "    other %7d", stats->ports_dropped);
+    PagerAddLine(tmp);
+  }
+
+  PagerLoop(LIGHT_GREEN);
+}
+
+void PrintTrace(Bit32u n)
+{
+  TRACE_RECORD record;
+  Bit32u cursor, lost, len;
+  Bit64u first;
+  char line[TRACE_LINE_SIZE], tmp[OUT_SIZE_X];
+
+  VideoResetOutMatrix();
+
+  cursor = TraceGetCursor();
+  cursor = (cursor < n) ? 0 : cursor - n;
+
+  vmm_snprintf(tmp, sizeof(tmp), "    Cycles  Message");
+  PagerAddLine(tmp);
+
+  first = 0;
+  lost = 0;
+  while(TraceRead(&cursor, &record, &lost)) {
+    if(first == 0)
+      first = record.tsc;
+
+    len = TraceFormat(&record, line, sizeof(line));
+    if(len > 0 && line[len-1] == '\n')
+      line[len-1] = 0;
+
+    vmm_snprintf(tmp, sizeof(tmp), "%10u  %s", PrintCycles(record.tsc - first), line);
+    PagerAddLine(tmp);
+  }
+
+  if(lost != 0) {
+    vmm_snprintf(tmp, sizeof(tmp), "(%d records lost)", lost);
+    PagerAddLine(tmp);
+  }
+
+  PagerLoop(LIGHT_GREEN);
+}
+
+void PrintProfile(PROFILE_MODE mode)
+{
+  PPROFILE_ENTRY entries;
+  PEXIT_REASON_STATS r;
+  Bit64u period;
+  Bit32u i, n, total, cost, permille;
+  char tmp[OUT_SIZE_X];
+
+  VideoResetOutMatrix();
+
+  n = ProfileBuild(mode, &entries, &total);
+  period = SamplerGetPeriod();
+
+  if(period != 0)
+    vmm_snprintf(tmp, sizeof(tmp), "%d samples, one every %u cycles", total, PrintCycles(period));
+  else
+    vmm_snprintf(tmp, sizeof(tmp), "%d samples, sampling stopped", total);
+  PagerAddLine(tmp);
+
+  /* What each sample costs the guest, from the exit stats */
+  r = &ExitStatsGet()->reasons[EXIT_REASON_PREEMPTION_TIMER];
+  if(period != 0 && r->count != 0) {
+    cost = CmDiv64(r->cycles, r->count);
+    permille = CmDiv64((Bit64u) cost * 1000, PrintCycles(period));
+    vmm_snprintf(tmp, sizeof(tmp), "Overhead: %u cycles per sample, %d.%d%% of guest time", cost, permille / 10, permille % 10);
+    PagerAddLine(tmp);
+  }
+
+  PagerAddLine("");
+  PagerAddLine(mode == ProfileByFunction ? " Samples       %  Function" : " Samples       %  Process");
+
+  for(i = 0; i < n; i++) {
+    ProfileFormatEntry(&entries[i], total, tmp, sizeof(tmp));
+    PagerAddLine(tmp);
+  }
+
+  PagerLoop(LIGHT_GREEN);
+}
+
+void PrintProfileStatus(hvm_status r)
+{
+  VideoResetOutMatrix();
+
+  if(r == HVM_STATUS_SUCCESS) {
+    if(SamplerGetPeriod() != 0)
+      vmm_snprintf(out_matrix[0], OUT_SIZE_X, "Sampling every %u cycles", PrintCycles(SamplerGetPeriod()));
+    else
+      vmm_snprintf(out_matrix[0], OUT_SIZE_X, "Sampling stopped");
+    VideoRefreshOutArea(LIGHT_GREEN);
+  } else {
+    vmm_snprintf(out_matrix[0], OUT_SIZE_X, "Cannot start sampling (no VMX preemption timer, or invalid period)");
+    VideoRefreshOutArea(RED);
+  }
+}
+
 void PrintUnknown()
 {
   VideoResetOutMatrix();
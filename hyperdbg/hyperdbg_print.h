@@ -31,6 +31,7 @@
 #include "syms.h"
 #include "vt.h" /* context */
 #include "hyperdbg_common.h"
+#include "profile.h"
 
 /* ################ */
 /* #### MACROS #### */
@@ -77,6 +78,12 @@ typedef struct {
   Bit32u data[512];
 } MEMORYDUMP, *PMEMORYDUMP;
 
+typedef enum {
+  BreakpointSoftware = 0,
+  BreakpointEpt,
+  BreakpointHardware,
+} BREAKPOINT_KIND;
+
 typedef struct {
   PSYMBOL symbol;
   Bit32u bp_index;
@@ -84,6 +91,7 @@ typedef struct {
   Bit32s error_code;
   hvm_bool isPerm;
   hvm_bool isCr3Dipendent;
+  BREAKPOINT_KIND kind;
 } BPINFO, *PBINFO;
 
 typedef struct {
@@ -99,6 +107,9 @@ typedef struct {
   hvm_address cr3;
   hvm_bool isPerm;
   hvm_bool isCr3Dipendent;
+  BREAKPOINT_KIND kind;
+  Bit8u hwtype;			/* Hardware breakpoints only: DR7 R/W and */
+  Bit8u hwlen;			/* length in bytes */
 } BPLIST, *PBLIST;
 
 typedef struct {
@@ -109,7 +120,7 @@ typedef struct {
     SOCKET sockets[128];
     MEMORYDUMP memory_dump;
     BPINFO bpinfo;
-    BPLIST bplist[MAXSWBPS];
+    BPLIST bplist[MAXSWBPS+MAXEPTBPS+MAXHWBPS]; /* sw, EPT and hw breakpoints */
     INSTRUCTION_DATA instructions[128];
   };
 } CMD_RESULT, *PCMD_RESULT;
@@ -129,6 +140,10 @@ void PrintDeleteSwBreakpoint(PCMD_RESULT buffer);
 void PrintBPList(PCMD_RESULT buffer);
 void PrintDisassembled(PCMD_RESULT buffer, Bit32s size);
 void PrintInfo(void);
+void PrintExitStats(void);
+void PrintTrace(Bit32u n);
+void PrintProfile(PROFILE_MODE mode);
+void PrintProfileStatus(hvm_status r);
 void PrintUnlinkProc(Bit32s error_code);
 void PrintRelinkProc(Bit32s error_code);
 void PrintUnknown(void);
@@ -0,0 +1,199 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+#include "profile.h"
+#include "symsearch.h"
+#include "process.h"
+#include "sampler.h"
+#include "smp.h"
+#include "vt.h"
+#include "vmmstring.h"
+#include "common.h"
+
+/* ############### */
+/* #### TYPES #### */
+/* ############### */
+
+/* Samples of one function (or address space) */
+typedef struct {
+  hvm_address key;
+  Bit32u      count;
+} PROFILE_GROUP, *PPROFILE_GROUP;
+
+/* ################# */
+/* #### GLOBALS #### */
+/* ################# */
+
+/* Too big for the VMM stack */
+static hvm_address   profile_keys[VT_MAX_CPUS * SAMPLER_SAMPLES];
+static PROFILE_GROUP profile_groups[VT_MAX_CPUS * SAMPLER_SAMPLES];
+static PROFILE_ENTRY profile_entries[PROFILE_MAX_ENTRIES + 1];
+
+/* ########################## */
+/* #### LOCAL PROTOTYPES #### */
+/* ########################## */
+
+static void ProfileSortKeys(hvm_address *v, Bit32u n);
+static void ProfileSortGroups(PPROFILE_GROUP v, Bit32u n);
+static void ProfileNameProcesses(PPROFILE_ENTRY v, Bit32u n);
+
+/* ################ */
+/* #### BODIES #### */
+/* ################ */
+
+Bit32u ProfileBuild(PROFILE_MODE mode, PPROFILE_ENTRY *pentries, Bit32u *ptotal)
+{
+  PSAMPLER_SAMPLE samples;
+  PPROFILE_ENTRY e, other;
+  PSYMBOL psym;
+  Bit32u cpu, i, j, n, nkeys, ngroups, nentries, taken;
+
+  /* The rings of processors that are running are still being written: a
+     few samples may be torn, which does not matter for a histogram */
+  nkeys = 0;
+  for(cpu = 0; cpu < SmpCpuCount(); cpu++) {
+    n = SamplerGetSamples(cpu, &samples, &taken);
+    for(i = 0; i < n; i++)
+      profile_keys[nkeys++] = (mode == ProfileByFunction) ? samples[i].rip : (samples[i].cr3 & 0xfffff000);
+  }
+  *ptotal = nkeys;
+
+  /* Samples in the same function (or address space) become adjacent */
+  ProfileSortKeys(profile_keys, nkeys);
+
+  ngroups = 0;
+  for(i = 0; i < nkeys; i = j) {
+    if(mode == ProfileByFunction) {
+      psym = SymbolGetNearest(profile_keys[i]);
+      for(j = i + 1; j < nkeys && (profile_keys[j] == profile_keys[j-1] || SymbolGetNearest(profile_keys[j]) == psym); j++)
+	;
+    } else {
+      for(j = i + 1; j < nkeys && profile_keys[j] == profile_keys[i]; j++)
+	;
+    }
+
+    profile_groups[ngroups].key   = profile_keys[i];
+    profile_groups[ngroups].count = j - i;
+    ngroups++;
+  }
+
+  /* The hottest groups get an entry, whatever their address */
+  ProfileSortGroups(profile_groups, ngroups);
+
+  other = &profile_entries[PROFILE_MAX_ENTRIES];
+  vmm_memset(other, 0, sizeof(PROFILE_ENTRY));
+  vmm_snprintf(other->name, PROFILE_NAME_SIZE, "(other)");
+
+  nentries = MIN(ngroups, PROFILE_MAX_ENTRIES);
+  for(i = 0; i < nentries; i++) {
+    e = &profile_entries[i];
+    e->key   = profile_groups[i].key;
+    e->count = profile_groups[i].count;
+    e->name[0] = 0;
+    if(mode == ProfileByFunction) {
+      psym = SymbolGetNearest(e->key);
+      vmm_snprintf(e->name, PROFILE_NAME_SIZE, "%s", psym ? (char *) psym->name : "(no symbol)");
+    }
+  }
+
+  for(; i < ngroups; i++)
+    other->count += profile_groups[i].count;
+
+  if(mode == ProfileByProcess)
+    ProfileNameProcesses(profile_entries, nentries);
+
+  if(other->count > 0) {
+    profile_entries[nentries++] = *other;
+  }
+
+  *pentries = profile_entries;
+
+  return nentries;
+}
+
+void ProfileFormatEntry(PPROFILE_ENTRY entry, Bit32u total, char *buffer, Bit32u size)
+{
+  Bit32u permille;
+
+  permille = total ? (Bit32u) CmDiv64((Bit64u) entry->count * 1000, total) : 0;
+
+  vmm_snprintf(buffer, size, "%8d %3d.%d%%  %s", entry->count, permille / 10, permille % 10, entry->name);
+}
+
+/* Name each address space after the first process that uses it */
+static void ProfileNameProcesses(PPROFILE_ENTRY v, Bit32u n)
+{
+  PROCESS_DATA proc[2];
+  hvm_status r;
+  Bit32u i, cur;
+
+  cur = 0;
+  r = ProcessGetNextProcess(context.GuestContext.cr3, NULL, &proc[cur]);
+  while(r == HVM_STATUS_SUCCESS) {
+    for(i = 0; i < n; i++) {
+      if(v[i].name[0] == 0 && v[i].key == (proc[cur].cr3 & 0xfffff000))
+	vmm_snprintf(v[i].name, PROFILE_NAME_SIZE, "%s", proc[cur].name);
+    }
+
+    r = ProcessGetNextProcess(context.GuestContext.cr3, &proc[cur], &proc[cur ^ 1]);
+    cur ^= 1;
+  }
+
+  for(i = 0; i < n; i++) {
+    if(v[i].name[0] == 0)
+      vmm_snprintf(v[i].name, PROFILE_NAME_SIZE, "cr3 %.8x", v[i].key);
+  }
+}
+
+/* Shell sort: a few thousand keys at most, and no memory to allocate */
+static void ProfileSortKeys(hvm_address *v, Bit32u n)
+{
+  Bit32u gap, i, j;
+  hvm_address t;
+
+  for(gap = n / 2; gap > 0; gap /= 2) {
+    for(i = gap; i < n; i++) {
+      t = v[i];
+      for(j = i; j >= gap && v[j-gap] > t; j -= gap)
+	v[j] = v[j-gap];
+      v[j] = t;
+    }
+  }
+}
+
+/* By decreasing count */
+static void ProfileSortGroups(PPROFILE_GROUP v, Bit32u n)
+{
+  Bit32u gap, i, j;
+  PROFILE_GROUP t;
+
+  for(gap = n / 2; gap > 0; gap /= 2) {
+    for(i = gap; i < n; i++) {
+      t = v[i];
+      for(j = i; j >= gap && v[j-gap].count < t.count; j -= gap)
+	v[j] = v[j-gap];
+      v[j] = t;
+    }
+  }
+}
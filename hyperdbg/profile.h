@@ -0,0 +1,62 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include "hyperdbg.h"
+
+/* Histograms of the guest samples taken by the VMM sampler (see
+   core/sampler.h), by kernel function (resolved with SymbolGetNearest()) or
+   by process (address space) */
+
+#define PROFILE_MAX_ENTRIES 256	/* The less sampled functions or processes are counted together */
+#define PROFILE_NAME_SIZE   64
+
+/* Operations of the HYPERDBG_HYPERCALL_PROFILE hypercall (in RBX) */
+#define PROFILE_STOP           0
+#define PROFILE_START          1
+#define PROFILE_READ_FUNCTIONS 2
+#define PROFILE_READ_PROCESSES 3
+
+typedef enum {
+  ProfileByFunction,
+  ProfileByProcess,
+} PROFILE_MODE;
+
+typedef struct {
+  hvm_address key;		/* Lowest sampled RIP in the function, or CR3 */
+  Bit32u      count;
+  char        name[PROFILE_NAME_SIZE];
+} PROFILE_ENTRY, *PPROFILE_ENTRY;
+
+/* Aggregate the samples of all the processors. Entries are sorted by
+   decreasing count, and are valid until the next call. Returns their number,
+   and sets 'ptotal' to the number of samples */
+Bit32u ProfileBuild(PROFILE_MODE mode, PPROFILE_ENTRY *pentries, Bit32u *ptotal);
+
+/* A histogram line for 'entry', without newline */
+void   ProfileFormatEntry(PPROFILE_ENTRY entry, Bit32u total, char *buffer, Bit32u size);
+
+#endif	/* _PROFILE_H */
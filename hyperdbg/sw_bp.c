@@ -28,12 +28,20 @@
 
 #define INT3_OPCODE 0xcc
 
+/* Breakpoints are indexed by an open-addressing (linear probing) hash table,
+   hashed on the address only: entries for the same address in different
+   address spaces end up in the same cluster */
+#define SW_BP_HASH_BITS 13
+#define SW_BP_HASH_SIZE (1 << SW_BP_HASH_BITS)
+#define SW_BP_HASH(addr) ((Bit32u)((addr)*0x9e3779b1) >> (32 - SW_BP_HASH_BITS))
+
 typedef struct _SW_BP {
-  hvm_address Addr;
+  hvm_address Addr;		/* 0 if the entry is free */
   hvm_address cr3;
   Bit8u OldOpcode;
   hvm_bool isPerm;
   hvm_bool isCr3Dipendent;
+  Bit32u NextFree;		/* Next entry in the free list */
 } SW_BP, *PSW_BP;
 
 /* ################# */
@@ -42,11 +50,21 @@ typedef struct _SW_BP {
 
 static SW_BP sw_bps[MAXSWBPS];
 
+/* Hash table slots hold the index of a breakpoint plus one (0: empty slot) */
+static Bit16u sw_bps_hash[SW_BP_HASH_SIZE];
+
+/* Free entries are the ones in the free list, plus all the entries from
+   sw_bps_top on (never used so far) */
+static Bit32u sw_bps_free = MAXSWBPS;
+static Bit32u sw_bps_top  = 0;
+
 /* ########################## */
 /* #### LOCAL PROTOTYPES #### */
 /* ########################## */
 
-Bit32u GetFirstFree(void);
+static Bit32u SwBreakpointAlloc(void);
+static void   SwBreakpointFree(Bit32u index);
+static Bit32u SwBreakpointFind(hvm_address cr3, hvm_address address, hvm_bool independentOnly);
 
 /* ################ */
 /* #### BODIES #### */
@@ -55,7 +73,7 @@ Bit32u GetFirstFree(void);
 /* If it returns MAXSWBPS, we have a full-error */
 Bit32u SwBreakpointSet(hvm_address cr3, hvm_address address, hvm_bool isPerm, hvm_bool isCr3Dipendent)
 {
-  Bit32u index;
+  Bit32u index, slot;
   PSW_BP ptr;
   Bit8u  op;
   hvm_status r;
@@ -65,23 +83,33 @@ Bit32u SwBreakpointSet(hvm_address cr3, hvm_address address, hvm_bool isPerm, hv
   if(SwBreakpointGetBPInfo(cr3, address, &useless, &useless, &found_cr3) && cr3 == found_cr3)
     return -1;
 
-  index = GetFirstFree();
+  index = SwBreakpointAlloc();
   if(index == MAXSWBPS) return MAXSWBPS;
 
   ptr = &sw_bps[index];
-  ptr->Addr = address;
-  ptr->cr3 = cr3;
-  ptr->isPerm = isPerm;
-  ptr->isCr3Dipendent = isCr3Dipendent;
 
   r = MmuReadVirtualRegion(cr3, address, &(ptr->OldOpcode), sizeof(ptr->OldOpcode));
-  if (r != HVM_STATUS_SUCCESS)
+  if (r != HVM_STATUS_SUCCESS) {
+    SwBreakpointFree(index);
     return MAXSWBPS;
+  }
 
   op = INT3_OPCODE;
   r = MmuWriteVirtualRegion(cr3, address, &op, sizeof(op));
-  if (r != HVM_STATUS_SUCCESS)
+  if (r != HVM_STATUS_SUCCESS) {
+    SwBreakpointFree(index);
     return MAXSWBPS;
+  }
+
+  ptr->Addr = address;
+  ptr->cr3 = cr3;
+  ptr->isPerm = isPerm;
+  ptr->isCr3Dipendent = isCr3Dipendent;
+
+  /* Insert into the hash table */
+  slot = SW_BP_HASH(address);
+  while(sw_bps_hash[slot] != 0) slot = (slot + 1) & (SW_BP_HASH_SIZE - 1);
+  sw_bps_hash[slot] = index + 1;
 
   return index;
 }
@@ -90,8 +118,7 @@ hvm_bool SwBreakpointGetBPInfo(hvm_address cr3, hvm_address address, hvm_bool *i
 {
   Bit32u i;
 
-  i = 0;
-  while(i < MAXSWBPS && sw_bps[i].Addr != address) i++;
+  i = SwBreakpointFind(cr3, address, FALSE);
 
   if(i == MAXSWBPS) {
     /* No breakpoint at this address */
@@ -110,8 +137,11 @@ hvm_bool SwBreakpointDeletePerm(hvm_address cr3, hvm_address address)
   PSW_BP ptr;
   hvm_status r;
 
-  i = 0;
-  while(i < MAXSWBPS && (sw_bps[i].Addr != address || (sw_bps[i].isCr3Dipendent && sw_bps[i].cr3 != cr3))) i++;
+  i = SwBreakpointFind(cr3, address, TRUE);
+
+  if(i == MAXSWBPS) {
+    return FALSE;
+  }
 
   /* Restore the old code */
   ptr = &sw_bps[i];
@@ -130,8 +160,7 @@ hvm_bool SwBreakpointDelete(hvm_address cr3, hvm_address address)
 
   Log("[HyperDbg] Delete BP (cr3 0x%08hx, addr 0x%08hx)", cr3, address);
 
-  i = 0;
-  while(i < MAXSWBPS && (sw_bps[i].Addr != address)) i++;
+  i = SwBreakpointFind(cr3, address, FALSE);
 
   if(i == MAXSWBPS) {
     return FALSE;
@@ -143,16 +172,12 @@ hvm_bool SwBreakpointDelete(hvm_address cr3, hvm_address address)
   if (r != HVM_STATUS_SUCCESS)
     return FALSE;
 
-  ptr->Addr = 0;
-  ptr->OldOpcode = 0;
-  ptr->cr3 = 0;
-  ptr->isCr3Dipendent = FALSE;
-  ptr->isPerm = FALSE;
+  SwBreakpointFree(i);
 
   return TRUE;
 }
 
-hvm_bool SwBreakpointDeleteById(hvm_address id)
+hvm_bool SwBreakpointDeleteById(Bit32u id)
 {
   PSW_BP ptr;
   hvm_status r;
@@ -165,23 +190,11 @@ hvm_bool SwBreakpointDeleteById(hvm_address id)
   if (r != HVM_STATUS_SUCCESS)
     return FALSE;
 
-  ptr->Addr = 0;
-  ptr->OldOpcode = 0;
-  ptr->cr3 = 0;
-  ptr->isCr3Dipendent = FALSE;
-  ptr->isPerm = FALSE;
+  SwBreakpointFree(id);
 
   return TRUE;
 }
 
-Bit32u GetFirstFree(void)
-{
-  Bit32u i;
-  i = 0;
-  while(i < MAXSWBPS && sw_bps[i].Addr != 0) i++;
-  return i;
-}
-
 void SwBreakpointGetBPList(PCMD_RESULT result)
 {
   int i;
@@ -194,3 +207,82 @@ void SwBreakpointGetBPList(PCMD_RESULT result)
     (*result).bplist[i].isCr3Dipendent = sw_bps[i].isCr3Dipendent;
   }
 }
+
+/* Look for the breakpoint at 'address' in address space 'cr3'. If there is
+   none, return any other breakpoint at 'address' (only those that are not
+   cr3-dependent, if 'independentOnly' is TRUE). Returns MAXSWBPS if no
+   breakpoint is found */
+static Bit32u SwBreakpointFind(hvm_address cr3, hvm_address address, hvm_bool independentOnly)
+{
+  Bit32u slot, i, found;
+
+  found = MAXSWBPS;
+
+  for(slot = SW_BP_HASH(address); sw_bps_hash[slot] != 0; slot = (slot + 1) & (SW_BP_HASH_SIZE - 1)) {
+    i = sw_bps_hash[slot] - 1;
+
+    if(sw_bps[i].Addr != address)
+      continue;
+
+    if(sw_bps[i].cr3 == cr3)
+      return i;
+
+    if(found == MAXSWBPS && (!independentOnly || !sw_bps[i].isCr3Dipendent))
+      found = i;
+  }
+
+  return found;
+}
+
+static Bit32u SwBreakpointAlloc(void)
+{
+  Bit32u i;
+
+  if(sw_bps_free != MAXSWBPS) {
+    i = sw_bps_free;
+    sw_bps_free = sw_bps[i].NextFree;
+    return i;
+  }
+
+  if(sw_bps_top < MAXSWBPS)
+    return sw_bps_top++;
+
+  return MAXSWBPS;
+}
+
+/* Remove a breakpoint from the hash table (if it is there) and put it back
+   into the free list */
+static void SwBreakpointFree(Bit32u index)
+{
+  Bit32u i, j, home;
+
+  if(sw_bps[index].Addr != 0) {
+    /* Find the slot of the breakpoint */
+    for(i = SW_BP_HASH(sw_bps[index].Addr); sw_bps_hash[i] != index + 1; i = (i + 1) & (SW_BP_HASH_SIZE - 1))
+      ;
+
+    /* Backward-shift deletion: move back the following entries of the
+       cluster that would not be reachable anymore */
+    for(j = (i + 1) & (SW_BP_HASH_SIZE - 1); sw_bps_hash[j] != 0; j = (j + 1) & (SW_BP_HASH_SIZE - 1)) {
+      home = SW_BP_HASH(sw_bps[sw_bps_hash[j] - 1].Addr);
+
+      /* Is 'home' cyclically in (i, j]? Then the entry can stay where it is */
+      if((i <= j) ? (i < home && home <= j) : (i < home || home <= j))
+	continue;
+
+      sw_bps_hash[i] = sw_bps_hash[j];
+      i = j;
+    }
+
+    sw_bps_hash[i] = 0;
+  }
+
+  sw_bps[index].Addr = 0;
+  sw_bps[index].OldOpcode = 0;
+  sw_bps[index].cr3 = 0;
+  sw_bps[index].isCr3Dipendent = FALSE;
+  sw_bps[index].isPerm = FALSE;
+
+  sw_bps[index].NextFree = sw_bps_free;
+  sw_bps_free = index;
+}
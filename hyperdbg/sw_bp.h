@@ -29,7 +29,7 @@
 #include "hyperdbg_print.h"
 #include "hyperdbg_common.h"
 
-hvm_address SwBreakpointSet(hvm_address cr3, hvm_address address, hvm_bool isPerm, hvm_bool isCr3Dipendent);
+Bit32u      SwBreakpointSet(hvm_address cr3, hvm_address address, hvm_bool isPerm, hvm_bool isCr3Dipendent);
 hvm_bool    SwBreakpointGetBPInfo(hvm_address cr3, hvm_address address, hvm_bool *isCr3Dipendent, hvm_bool *isPerm, hvm_address *ours_cr3);
 hvm_bool    SwBreakpointDelete(hvm_address cr3, hvm_address address);
 hvm_bool    SwBreakpointDeletePerm(hvm_address cr3, hvm_address address);
@@ -22,18 +22,73 @@
   
 */
 
+#ifdef GUEST_WINDOWS
+#include <ddk/ntddk.h>
+#elif defined GUEST_LINUX
+#include <linux/kernel.h>
+#include <linux/vmalloc.h>
+#endif
+
 #include "symsearch.h"
 #include "syms.h"
 #include "debug.h"
 #include "vmmstring.h"
 
+/* ################ */
+/* #### MACROS #### */
+/* ################ */
+
 #define MAX(p,q) (((p) >= (q)) ? (p) : (q))
 
+/* FNV-1a, over lowercased names */
+#define SYMBOL_HASH_SEED  0x811c9dc5
+#define SYMBOL_HASH_PRIME 0x01000193
+
+/* ############### */
+/* #### TYPES #### */
+/* ############### */
+
+/* A slot of the open-addressing name hash table. 'index' is the index of the
+   symbol in symtab[] plus one, so that zero marks an empty slot */
+typedef struct {
+  Bit32u hash;
+  Bit32u index;
+} SYMBOL_HASH_SLOT, *PSYMBOL_HASH_SLOT;
+
+/* ################# */
+/* #### GLOBALS #### */
+/* ################# */
+
+/* The symbol table in use: either the compiled-in one, or the one loaded by
+   SymbolLoadPack(). NOS is not a constant expression here, so the size of
+   the compiled-in table is taken when needed: lookups work even before
+   SymbolInit() */
+static PSYMBOL           symtab = syms;
+static Bit32u            packsyms = 0;   /* Symbols in the pack */
+#define nsyms ((symtab == syms) ? NOS : packsyms)
+static Bit32u*           packhash = NULL; /* Name hashes, from the pack */
+static Bit8u*            packpool = NULL; /* String pool, from the pack */
+
+static PSYMBOL_HASH_SLOT symhash = NULL; /* Name hash table */
+static Bit32u            symhash_mask;	 /* Number of slots, minus one */
+static Bit32u*           symbyname = NULL; /* symtab[] indexes, sorted by name */
+static hvm_address*      symaddr = NULL;   /* Relocated symbol addresses */
+
 /* ########################## */
 /* #### LOCAL PROTOTYPES #### */
 /* ########################## */
 
-static hvm_bool DicotomicSymbolSearch(hvm_address addr, Bit32s start, Bit32s end, Bit32u* index);
+static Bit32u   SymbolUpperBound(hvm_address addr, Bit32u from);
+static hvm_address SymbolAddress(Bit32u i);
+static Bit32u   SymbolHashName(Bit8u* name, Bit32u* plen);
+static Bit32s   SymbolNameCompare(Bit8u* name, Bit8u* pattern, hvm_bool prefix);
+static void     SymbolSortByName(Bit32u* v, Bit32u n);
+static Bit32u   SymbolPrefixRange(Bit8u* prefix, Bit32u* pfirst);
+static hvm_bool SymbolNameContains(Bit8u* name, Bit8u* pattern, Bit32u len);
+static void     SymbolFreeIndexes(void);
+static void     SymbolUnloadPack(void);
+static void*    SymbolAlloc(Bit32u size);
+static void     SymbolFree(void* p);
 
 /* ################ */
 /* #### BODIES #### */
@@ -41,44 +96,240 @@ static hvm_bool DicotomicSymbolSearch(hvm_address addr, Bit32s start, Bit32s end
 
 PSYMBOL SymbolGetFromAddress(hvm_address addr)
 {
-  PSYMBOL SearchedSym;
-  Bit32u index;
-  if(NOS == 0) {
-    return  NULL;
+  Bit32u n;
+
+  n = SymbolUpperBound(addr, 0);
+  if (n == 0 || SymbolAddress(n-1) != addr)
+    return NULL;
+
+  return &symtab[n-1];
+}
+
+/* Get the symbol with the highest address that is not greater than 'addr' */
+PSYMBOL SymbolGetNearest(hvm_address addr)
+{
+  Bit32u n;
+
+  n = SymbolUpperBound(addr, 0);
+  if (n == 0)
+    return NULL;
+
+  return &symtab[n-1];
+}
+
+/* Resolve 'n' addresses at once. results[i] is set as SymbolGetFromAddress()
+   (when 'exact' is TRUE) or SymbolGetNearest() would do for addrs[i]. When
+   addresses come in ascending order, each search starts from the position
+   of the previous one */
+void SymbolResolveMany(hvm_address* addrs, PSYMBOL* results, Bit32u n, hvm_bool exact)
+{
+  Bit32u i, pos;
+
+  pos = 0;
+  for (i = 0; i < n; i++) {
+    if (i > 0 && addrs[i] < addrs[i-1])
+      pos = 0;
+
+    pos = SymbolUpperBound(addrs[i], pos);
+
+    if (pos == 0 || (exact && SymbolAddress(pos-1) != addrs[i]))
+      results[i] = NULL;
+    else
+      results[i] = &symtab[pos-1];
   }
-  
-  if(!DicotomicSymbolSearch(addr, 0, NOS-1, &index)) {
-    SearchedSym = NULL;
-  } else {
-    SearchedSym = &syms[index];
+}
+
+/* Build the symbol indexes. Invoked at initialization time, when VMX is still
+   off and the kernel base is already known. If memory cannot be allocated,
+   name lookups fall back to a linear scan of symtab[], and address lookups
+   relocate each probed entry */
+hvm_status SymbolInit(void)
+{
+  Bit32u i, n, h, len, slot;
+
+  if (nsyms == 0)
+    return HVM_STATUS_SUCCESS;
+
+  /* Keep the load factor of the hash table below 1/2 */
+  for (n = 1; n < 2*nsyms; n <<= 1)
+    ;
+
+  symhash   = SymbolAlloc(n * sizeof(SYMBOL_HASH_SLOT));
+  symbyname = SymbolAlloc(nsyms * sizeof(Bit32u));
+  symaddr   = SymbolAlloc(nsyms * sizeof(hvm_address));
+
+  if (!symhash || !symbyname || !symaddr) {
+    GuestLog("[HyperDbg] Cannot allocate symbol indexes");
+    SymbolFreeIndexes();
+    return HVM_STATUS_UNSUCCESSFUL;
   }
 
-  return SearchedSym;
+  vmm_memset(symhash, 0, n * sizeof(SYMBOL_HASH_SLOT));
+  symhash_mask = n - 1;
+
+  for (i = 0; i < nsyms; i++) {
+    h = packhash ? packhash[i] : SymbolHashName(symtab[i].name, &len);
+
+    /* Linear probing. On duplicate names, keep the first symbol, as the
+       linear scan did */
+    for (slot = h & symhash_mask; symhash[slot].index != 0; slot = (slot + 1) & symhash_mask) {
+      if (symhash[slot].hash == h && 
+	  SymbolNameCompare(symtab[symhash[slot].index-1].name, symtab[i].name, FALSE) == 0)
+	break;
+    }
+
+    if (symhash[slot].index == 0) {
+      symhash[slot].hash  = h;
+      symhash[slot].index = i + 1;
+    }
+
+    symbyname[i] = i;
+
+    /* symtab[] is sorted by address, so the relocated column is too */
+    symaddr[i] = symtab[i].addr + hyperdbg_state.win_state.kernel_base;
+  }
+
+  SymbolSortByName(symbyname, nsyms);
+
+  return HVM_STATUS_SUCCESS;
 }
 
-PSYMBOL SymbolGetNearest(hvm_address addr)
+void SymbolFini(void)
 {
-  PSYMBOL SearchedSym;
-  Bit32u index;
-  if(NOS == 0) {
-    return  NULL;
+  SymbolFreeIndexes();
+  SymbolUnloadPack();
+}
+
+static void SymbolFreeIndexes(void)
+{
+  if (symhash) {
+    SymbolFree(symhash);
+    symhash = NULL;
+  }
+
+  if (symbyname) {
+    SymbolFree(symbyname);
+    symbyname = NULL;
+  }
+
+  if (symaddr) {
+    SymbolFree(symaddr);
+    symaddr = NULL;
+  }
+}
+
+/* Replace the compiled-in symbol table with a symbol pack (see symsearch.h),
+   read through 'read'. Must be invoked before SymbolInit() */
+hvm_status SymbolLoadPack(SYMBOL_PACK_READ read, void* handle)
+{
+  SYMBOL_PACK_HEADER hdr;
+  PSYMBOL tab;
+  Bit32u *addrs, i, off, len;
+
+  addrs = NULL;
+  tab   = NULL;
+
+  if (read(handle, &hdr, sizeof(hdr)) != HVM_STATUS_SUCCESS)
+    return HVM_STATUS_UNSUCCESSFUL;
+
+  if (hdr.magic != SYMBOL_PACK_MAGIC || hdr.version != SYMBOL_PACK_VERSION ||
+      hdr.count == 0 || hdr.count > SYMBOL_PACK_MAX_SYMBOLS || 
+      hdr.poolsize < hdr.count || hdr.poolsize > hdr.count*SYMBOL_PACK_MAX_NAME) {
+    GuestLog("[HyperDbg] Invalid symbol pack header");
+    return HVM_STATUS_UNSUCCESSFUL;
+  }
+
+  SymbolUnloadPack();
+
+  addrs    = SymbolAlloc(hdr.count * sizeof(Bit32u));
+  packhash = SymbolAlloc(hdr.count * sizeof(Bit32u));
+  packpool = SymbolAlloc(hdr.poolsize);
+  tab      = SymbolAlloc(hdr.count * sizeof(SYMBOL));
+
+  if (!addrs || !packhash || !packpool || !tab) {
+    GuestLog("[HyperDbg] Cannot allocate memory for %d symbols", hdr.count);
+    goto error;
+  }
+
+  if (read(handle, addrs, hdr.count * sizeof(Bit32u)) != HVM_STATUS_SUCCESS ||
+      read(handle, packhash, hdr.count * sizeof(Bit32u)) != HVM_STATUS_SUCCESS ||
+      read(handle, packpool, hdr.poolsize) != HVM_STATUS_SUCCESS) {
+    GuestLog("[HyperDbg] Truncated symbol pack");
+    goto error;
+  }
+
+  /* Names are stored one after the other, in the same order as addresses */
+  off = 0;
+  for (i = 0; i < hdr.count; i++) {
+    for (len = 0; off + len < hdr.poolsize && packpool[off+len] != 0; len++)
+      ;
+
+    if (off + len >= hdr.poolsize || (i > 0 && addrs[i] < addrs[i-1])) {
+      GuestLog("[HyperDbg] Malformed symbol pack (symbol #%d)", i);
+      goto error;
+    }
+
+    tab[i].name = &packpool[off];
+    tab[i].addr = addrs[i];
+    off += len + 1;
+  }
+
+  SymbolFree(addrs);
+
+  symtab   = tab;
+  packsyms = hdr.count;
+
+  GuestLog("[HyperDbg] Loaded %d symbols", nsyms);
+
+  return HVM_STATUS_SUCCESS;
+
+ error:
+  if (addrs) SymbolFree(addrs);
+  if (tab) SymbolFree(tab);
+  SymbolUnloadPack();
+  return HVM_STATUS_UNSUCCESSFUL;
+}
+
+/* Release the symbol pack, if any, and go back to the compiled-in table */
+static void SymbolUnloadPack(void)
+{
+  if (symtab != syms) {
+    SymbolFree(symtab);
+    symtab = syms;
+  }
+
+  if (packhash) {
+    SymbolFree(packhash);
+    packhash = NULL;
   }
-  
-  DicotomicSymbolSearch(addr, 0, NOS-1, &index);
-  SearchedSym = &syms[index];
 
-  return SearchedSym;
+  if (packpool) {
+    SymbolFree(packpool);
+    packpool = NULL;
+  }
 }
 
-/* Unfortunately, the list is sorted on the address, so we have to use a linear
-   search algotithm */
 PSYMBOL SymbolGetFromName(Bit8u* name)
 {
   PSYMBOL SearchedSym;
-  Bit32u index;
+  Bit32u index, h, len, slot;
+
+  if (symhash) {
+    h = SymbolHashName(name, &len);
 
-  for(index = 0; index < NOS; index++) {
-    SearchedSym = &syms[index];
+    for (slot = h & symhash_mask; symhash[slot].index != 0; slot = (slot + 1) & symhash_mask) {
+      SearchedSym = &symtab[symhash[slot].index-1];
+      if (symhash[slot].hash == h && SymbolNameCompare(SearchedSym->name, name, FALSE) == 0)
+	return SearchedSym;
+    }
+
+    return NULL;
+  }
+
+  /* No index: the list is sorted on the address, so we have to use a linear
+     search algotithm */
+  for(index = 0; index < nsyms; index++) {
+    SearchedSym = &symtab[index];
     /* we use MAX because we have to check with the longer length, otherwise we
        could match, for example, KiFastCallEntry2 when looking for
        KiFastCallEntry */
@@ -88,32 +339,243 @@ PSYMBOL SymbolGetFromName(Bit8u* name)
   return NULL;
 }
 
-/* Returns TRUE and sets Index to the index of the found entries if
-   found. Otherwise, returns FALSE and Index is undefined */
-static hvm_bool DicotomicSymbolSearch(hvm_address addr, Bit32s start, Bit32s end, Bit32u* index)
+/* Look for symbols whose name starts with (SymbolSearchPrefix) or contains
+   (SymbolSearchSubstring) 'pattern', ignoring case. Up to 'max' matches are
+   stored in 'results', in alphabetical order; the return value is the total
+   number of matches */
+Bit32u SymbolSearchName(Bit8u* pattern, SYMBOL_SEARCH_MODE mode, PSYMBOL* results, Bit32u max)
 {
-  Bit32u mid;
-  PSYMBOL CurrentSym;
+  Bit32u i, n, first, len;
 
-  mid = (start+end)/2;
-  CurrentSym = &syms[mid];
+  if (!symbyname)
+    return 0;
 
-  while(end >= start) {
-    if(addr == (CurrentSym->addr + hyperdbg_state.win_state.kernel_base)) {
-      *index = mid;
-      return TRUE;
+  n = 0;
+
+  if (mode == SymbolSearchPrefix) {
+    n = SymbolPrefixRange(pattern, &first);
+    for (i = 0; i < n && i < max; i++)
+      results[i] = &symtab[symbyname[first+i]];
+  } else {
+    len = vmm_strlen(pattern);
+    for (i = 0; i < nsyms; i++) {
+      if (!SymbolNameContains(symtab[symbyname[i]].name, pattern, len))
+	continue;
+      if (n < max)
+	results[n] = &symtab[symbyname[i]];
+      n++;
+    }
+  }
+
+  return n;
+}
+
+/* Complete 'prefix' with the longest prefix shared by all the symbols whose
+   name starts with it. The completion (with the case of the first match) is
+   stored in 'out', and the number of matching symbols is returned */
+Bit32u SymbolCompleteName(Bit8u* prefix, Bit8u* out, Bit32u outsize)
+{
+  Bit8u *a, *b;
+  Bit32u n, first, len;
+
+  if (!symbyname || outsize == 0)
+    return 0;
+
+  n = SymbolPrefixRange(prefix, &first);
+  if (n == 0)
+    return 0;
+
+  /* Names are sorted, so the prefix shared by the first and the last match is
+     shared by all of them */
+  a = symtab[symbyname[first]].name;
+  b = symtab[symbyname[first+n-1]].name;
+
+  for (len = 0; len < outsize-1 && a[len] != 0 && vmm_tolower(a[len]) == vmm_tolower(b[len]); len++)
+    out[len] = a[len];
+
+  out[len] = 0;
+
+  return n;
+}
+
+/* Returns the number of symbols whose address is not greater than 'addr',
+   i.e., the index of the first symbol above 'addr'. Symbols before 'from' are
+   known to be not greater than 'addr' */
+static Bit32u SymbolUpperBound(hvm_address addr, Bit32u from)
+{
+  Bit32u lo, hi, mid;
+
+  lo = from;
+  hi = nsyms;
+
+  if (symaddr) {
+    while (lo < hi) {
+      mid = lo + (hi - lo)/2;
+      if (symaddr[mid] <= addr)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  } else {
+    while (lo < hi) {
+      mid = lo + (hi - lo)/2;
+      if (symtab[mid].addr + hyperdbg_state.win_state.kernel_base <= addr)
+	lo = mid + 1;
+      else
+	hi = mid;
     }
+  }
+
+  return lo;
+}
+
+/* Relocated address of the i-th symbol */
+static hvm_address SymbolAddress(Bit32u i)
+{
+  return symaddr ? symaddr[i] : symtab[i].addr + hyperdbg_state.win_state.kernel_base;
+}
+
+static Bit32u SymbolHashName(Bit8u* name, Bit32u* plen)
+{
+  Bit32u h, i;
+
+  h = SYMBOL_HASH_SEED;
+  for (i = 0; name[i] != 0; i++) {
+    h ^= vmm_tolower(name[i]);
+    h *= SYMBOL_HASH_PRIME;
+  }
 
-    if(addr < (CurrentSym->addr + hyperdbg_state.win_state.kernel_base)) {
-      end = mid - 1;
+  *plen = i;
+
+  return h;
+}
+
+/* Case-insensitive comparison. When 'prefix' is TRUE, only the first
+   strlen(pattern) characters of 'name' are considered */
+static Bit32s SymbolNameCompare(Bit8u* name, Bit8u* pattern, hvm_bool prefix)
+{
+  Bit8u a, b;
+
+  while (1) {
+    b = vmm_tolower(*pattern);
+    if (b == 0 && prefix)
+      return 0;
+
+    a = vmm_tolower(*name);
+    if (a != b)
+      return (a < b) ? -1 : 1;
+
+    if (a == 0)
+      return 0;
+
+    name++;
+    pattern++;
+  }
+}
+
+/* Sort symtab[] indexes by name (heapsort, no recursion and no extra memory).
+   Ties are broken on the index, so that the order is deterministic */
+static void SymbolSortByName(Bit32u* v, Bit32u n)
+{
+  Bit32u start, end, root, child, tmp;
+  Bit32s c;
+
+#define SYMBOL_LESS(x, y)						  ((c = SymbolNameCompare(symtab[(x)].name, symtab[(y)].name, FALSE)) < 0 || (c == 0 && (x) < (y)))
+
+  if (n < 2)
+    return;
+
+  start = n/2;
+  end   = n;
+
+  while (end > 1) {
+    if (start > 0) {
+      /* Building the heap */
+      start--;
     } else {
-      start = mid + 1;
+      /* Move the largest element to the end */
+      end--;
+      tmp = v[end]; v[end] = v[0]; v[0] = tmp;
     }
 
-    return DicotomicSymbolSearch(addr, start, end, index);
+    /* Sift down v[start] */
+    root = start;
+    while ((child = 2*root + 1) < end) {
+      if (child + 1 < end && SYMBOL_LESS(v[child], v[child+1]))
+	child++;
+
+      if (!SYMBOL_LESS(v[root], v[child]))
+	break;
+
+      tmp = v[root]; v[root] = v[child]; v[child] = tmp;
+      root = child;
+    }
   }
 
-  /* Not found! */
-  *index = mid;
-  return FALSE; 
+#undef SYMBOL_LESS
+}
+
+/* Find the range of symbols (in the name index) whose name starts with
+   'prefix'. Returns the number of such symbols */
+static Bit32u SymbolPrefixRange(Bit8u* prefix, Bit32u* pfirst)
+{
+  Bit32u lo, hi, mid, first;
+
+  /* First name >= prefix */
+  lo = 0; hi = nsyms;
+  while (lo < hi) {
+    mid = lo + (hi - lo)/2;
+    if (SymbolNameCompare(symtab[symbyname[mid]].name, prefix, TRUE) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  first = lo;
+
+  /* First name > prefix */
+  hi = nsyms;
+  while (lo < hi) {
+    mid = lo + (hi - lo)/2;
+    if (SymbolNameCompare(symtab[symbyname[mid]].name, prefix, TRUE) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  *pfirst = first;
+
+  return lo - first;
+}
+
+static hvm_bool SymbolNameContains(Bit8u* name, Bit8u* pattern, Bit32u len)
+{
+  Bit32u i;
+
+  for (i = 0; name[i] != 0; i++) {
+    if (vmm_strncmpi(&name[i], pattern, len) == 0)
+      return TRUE;
+  }
+
+  return (len == 0);
+}
+
+/* Symbol packs and their indexes take up to tens of MB: on Linux they are
+   allocated with vmalloc(), in the same area as the module itself, so that
+   the VMM can reach them like its own code and data */
+static void* SymbolAlloc(Bit32u size)
+{
+#ifdef GUEST_WINDOWS
+  return ExAllocatePoolWithTag(NonPagedPool, size, 'gbdh');
+#elif defined GUEST_LINUX
+  return vmalloc(size);
+#endif
+}
+
+static void SymbolFree(void* p)
+{
+#ifdef GUEST_WINDOWS
+  ExFreePoolWithTag(p, 'gbdh');
+#elif defined GUEST_LINUX
+  vfree(p);
+#endif
 }
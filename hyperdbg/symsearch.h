@@ -28,8 +28,46 @@
 #include "hyperdbg.h"
 #include "syms.h"
 
+/* Symbol packs are a binary alternative to the compiled-in symbol table,
+   loaded at initialization time (see tools/sympack.py). Layout, all integers
+   little-endian:
+
+     SYMBOL_PACK_HEADER
+     Bit32u addr[count]     symbol addresses, in ascending order
+     Bit32u hash[count]     FNV-1a hash of each lowercased name
+     char   pool[poolsize]  'count' NUL-terminated names, same order as addr[]
+*/
+#define SYMBOL_PACK_MAGIC       0x4d595348 /* "HSYM" */
+#define SYMBOL_PACK_VERSION     1
+#define SYMBOL_PACK_MAX_SYMBOLS 0x40000
+#define SYMBOL_PACK_MAX_NAME    256
+
+typedef struct {
+  Bit32u magic;
+  Bit32u version;
+  Bit32u count;			/* Number of symbols */
+  Bit32u poolsize;		/* Size of the string pool, in bytes */
+} SYMBOL_PACK_HEADER, *PSYMBOL_PACK_HEADER;
+
+/* Reads exactly 'size' bytes of the symbol pack into 'buffer' */
+typedef hvm_status (*SYMBOL_PACK_READ)(void* handle, void* buffer, Bit32u size);
+
+/* Name search modes */
+typedef enum {
+  SymbolSearchPrefix,
+  SymbolSearchSubstring
+} SYMBOL_SEARCH_MODE;
+
+hvm_status SymbolLoadPack(SYMBOL_PACK_READ read, void* handle);
+hvm_status SymbolInit(void);
+void    SymbolFini(void);
+
 PSYMBOL SymbolGetFromAddress(hvm_address);
 PSYMBOL SymbolGetNearest(hvm_address);
 PSYMBOL SymbolGetFromName(Bit8u*);
+void    SymbolResolveMany(hvm_address* addrs, PSYMBOL* results, Bit32u n, hvm_bool exact);
+
+Bit32u  SymbolSearchName(Bit8u* pattern, SYMBOL_SEARCH_MODE mode, PSYMBOL* results, Bit32u max);
+Bit32u  SymbolCompleteName(Bit8u* prefix, Bit8u* out, Bit32u outsize);
 
 #endif	/* _SYMSEARCH_H */
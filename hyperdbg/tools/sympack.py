@@ -0,0 +1,97 @@
+"""
+  Copyright notice
+  ================
+
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+
+"""
+
+# Build a HyperDbg symbol pack (see hyperdbg/symsearch.h) from /proc/kallsyms
+# or from a System.map file. The pack is loaded at module init time with:
+#
+#   insmod hcore.ko symbols=/path/to/pack
+
+import struct
+import sys
+
+SYMBOL_PACK_MAGIC       = 0x4d595348
+SYMBOL_PACK_VERSION     = 1
+SYMBOL_PACK_MAX_SYMBOLS = 0x40000
+SYMBOL_PACK_MAX_NAME    = 256
+
+# Symbol types to keep: code and data (see nm(1))
+TYPES = "TtWwDdBbRr"
+
+def namehash(name):
+    # FNV-1a over the lowercased name, as SymbolHashName() in symsearch.c
+    h = 0x811c9dc5
+    for c in name.lower():
+        h ^= c
+        h = (h * 0x01000193) & 0xffffffff
+    return h
+
+def parse(f):
+    syms = set()
+    for line in f:
+        # "<addr> <type> <name> [<module>]"
+        fields = line.split()
+        if len(fields) < 3 or fields[1] not in TYPES:
+            continue
+
+        addr = int(fields[0], 16)
+        name = fields[2].encode("ascii", "replace")
+
+        if addr == 0 or addr > 0xffffffff:
+            # Hidden by kptr_restrict, or not a 32-bit kernel
+            continue
+        if len(name) >= SYMBOL_PACK_MAX_NAME:
+            continue
+
+        syms.add((addr, name))
+
+    return sorted(syms)
+
+def write(syms, out):
+    pool = b"".join([name + b"\0" for (addr, name) in syms])
+
+    out.write(struct.pack("<4I", SYMBOL_PACK_MAGIC, SYMBOL_PACK_VERSION, len(syms), len(pool)))
+    out.write(struct.pack("<%dI" % len(syms), *[addr for (addr, name) in syms]))
+    out.write(struct.pack("<%dI" % len(syms), *[namehash(name) for (addr, name) in syms]))
+    out.write(pool)
+
+if __name__ == "__main__":
+    if len(sys.argv) < 3:
+        print("Usage: sympack.py {/proc/kallsyms|System.map} out")
+        sys.exit(1)
+
+    with open(sys.argv[1]) as f:
+        syms = parse(f)
+
+    if len(syms) == 0:
+        print("No symbols found (is kptr_restrict set?)")
+        sys.exit(1)
+
+    if len(syms) > SYMBOL_PACK_MAX_SYMBOLS:
+        print("Too many symbols: %d (max %d)" % (len(syms), SYMBOL_PACK_MAX_SYMBOLS))
+        sys.exit(1)
+
+    with open(sys.argv[2], "wb") as out:
+        write(syms, out)
+
+    print("%d symbols written to %s" % (len(syms), sys.argv[2]))
@@ -0,0 +1,278 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+/* EventPublish() against a full events[] table, compared with the linear
+   scan of all the slots it replaced: both must invoke the same handlers, and
+   the time per published event of each is reported */
+
+#include "test.h"
+#include "bench.h"
+#include "events.c"
+
+#define N_SAMPLES   65536	/* Distinct synthetic events, published in turn */
+#define N_PUBLISHES (1 << 24)
+
+/* #### STUBS #### */
+
+void CmSetBit32(Bit32u* dword, Bit32u bit)
+{
+  *dword |= 1 << bit;
+}
+
+/* #### SUBSCRIBERS #### */
+
+static Bit32u hits;
+
+static EVENT_PUBLISH_STATUS HandledCallback(PEVENT_ARGUMENTS args)
+{
+  hits++;
+  return EventPublishHandled;
+}
+
+static EVENT_PUBLISH_STATUS PassCallback(PEVENT_ARGUMENTS args)
+{
+  hits++;
+  return EventPublishPass;
+}
+
+typedef struct {
+  HVM_EVENT_TYPE type;
+  union {
+    EVENT_CONDITION_HYPERCALL hypercall;
+    EVENT_CONDITION_EXCEPTION exception;
+    EVENT_CONDITION_IO io;
+    EVENT_CONDITION_CR cr;
+    EVENT_CONDITION_MSR msr;
+  } condition;
+  int size;
+} SAMPLE;
+
+static SAMPLE samples[N_SAMPLES];
+static Bit32u ports[400];	/* Single ports with a subscriber */
+static Bit32u msrs[40];
+static Bit32u seed = 12345;
+
+static Bit32u Random(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+static EVENT_CALLBACK Callback(void)
+{
+  return (Random() & 3) ? HandledCallback : PassCallback;
+}
+
+/* Fill all the N_EVENTS slots: mostly single ports, as the debugger does
+   for the serial and keyboard ports, and a few of every other keyed type */
+static void FillTable(void)
+{
+  EVENT_CONDITION_HYPERCALL h;
+  EVENT_CONDITION_EXCEPTION e;
+  EVENT_CONDITION_IO io;
+  EVENT_CONDITION_CR cr;
+  EVENT_CONDITION_MSR m;
+  Bit32u i, n;
+
+  EventInit();
+  n = 0;
+
+  for (i = 0; i < 400; i++) {
+    io.direction = Random() % 3;
+    io.portnum   = ports[i] = Random() & 0xffff;
+    io.portcount = 1;
+    n += EventSubscribe(EventIO, &io, sizeof(io), Callback());
+  }
+
+  for (i = 0; i < 8; i++) {
+    io.direction = EventIODirectionBoth;
+    io.portnum   = Random() & 0xfff0;
+    io.portcount = 16;
+    n += EventSubscribe(EventIO, &io, sizeof(io), Callback());
+  }
+
+  for (i = 0; i < 16; i++) {
+    e.exceptionnum = i;
+    n += EventSubscribe(EventException, &e, sizeof(e), Callback());
+  }
+
+  for (i = 0; i < 32; i++) {
+    h.hypernum = 0xdead0000 + i;
+    n += EventSubscribe(EventHypercall, &h, sizeof(h), Callback());
+  }
+
+  for (i = 0; i < 16; i++) {
+    cr.crno    = i / 2;
+    cr.iswrite = i & 1;
+    n += EventSubscribe(EventControlRegister, &cr, sizeof(cr), Callback());
+  }
+
+  for (i = 0; i < 40; i++) {
+    m.access = Random() % 3;
+    m.msrnum = msrs[i] = (i & 1) ? 0xc0000080 + i : 0x170 + i;
+    n += EventSubscribe(EventMSR, &m, sizeof(m), Callback());
+  }
+
+  CHECK(n == N_EVENTS && events_free == NULL, "%d subscriptions out of %d", n, N_EVENTS);
+}
+
+/* I/O exits first, then the other exits the debugger subscribes to. Half of
+   the accesses hit a port or MSR with a subscriber */
+static void FillSamples(void)
+{
+  SAMPLE *s;
+  Bit32u i, r;
+
+  for (i = 0; i < N_SAMPLES; i++) {
+    s = &samples[i];
+    r = Random();
+
+    switch (r % 10) {
+    case 0: case 1: case 2: case 3: case 4: case 5:
+      s->type = EventIO;
+      s->condition.io.direction = (r & 0x100) ? EventIODirectionIn : EventIODirectionOut;
+      s->condition.io.portnum   = (r & 0x200) ? ports[Random() % 400] : Random() & 0xffff;
+      s->condition.io.portcount = 1;
+      s->size = sizeof(EVENT_CONDITION_IO);
+      break;
+
+    case 6:
+      s->type = EventException;
+      s->condition.exception.exceptionnum = Random() % N_EXCEPTIONS;
+      s->size = sizeof(EVENT_CONDITION_EXCEPTION);
+      break;
+
+    case 7:
+      s->type = EventControlRegister;
+      s->condition.cr.crno    = Random() % 9;
+      s->condition.cr.iswrite = Random() & 1;
+      s->size = sizeof(EVENT_CONDITION_CR);
+      break;
+
+    case 8:
+      s->type = EventMSR;
+      s->condition.msr.access = (r & 0x100) ? EventMSRAccessRead : EventMSRAccessWrite;
+      s->condition.msr.msrnum = (r & 0x200) ? msrs[Random() % 40] : Random() & 0x1fff;
+      s->size = sizeof(EVENT_CONDITION_MSR);
+      break;
+
+    default:
+      s->type = EventHypercall;
+      s->condition.hypercall.hypernum = 0xdead0000 + Random() % 64;
+      s->size = sizeof(EVENT_CONDITION_HYPERCALL);
+      break;
+    }
+  }
+}
+
+/* #### REFERENCE #### */
+
+/* The dispatch before subscribers were indexed: every slot of events[] is
+   checked. Slots are taken in order and never freed here, so this is also
+   subscription order */
+static EVENT_PUBLISH_STATUS LinearPublish(HVM_EVENT_TYPE type, PEVENT_ARGUMENTS args, void* pcondition, int condition_size)
+{
+  EVENT_PUBLISH_STATUS s;
+  Bit32u i;
+
+  s = EventPublishNone;
+  for (i = 0; i < N_EVENTS; i++) {
+    if (events[i].type != type)
+      continue;
+
+    if (!EventCheckCondition(type, pcondition, &(events[i].condition)))
+      continue;
+
+    s = events[i].callback(args);
+    if (s == EventPublishHandled)
+      break;
+  }
+
+  return s;
+}
+
+/* #### BENCHMARK #### */
+
+static void Compare(void)
+{
+  EVENT_ARGUMENTS args;
+  EVENT_PUBLISH_STATUS s1, s2;
+  Bit32u i, h1, h2;
+
+  vmm_memset(&args, 0, sizeof(args));
+  for (i = 0; i < N_SAMPLES; i++) {
+    hits = 0;
+    s1 = EventPublish(samples[i].type, &args, &samples[i].condition, samples[i].size);
+    h1 = hits;
+
+    hits = 0;
+    s2 = LinearPublish(samples[i].type, &args, &samples[i].condition, samples[i].size);
+    h2 = hits;
+
+    CHECK(s1 == s2 && h1 == h2, "sample %d (type %d): status %d/%d, %d/%d handlers",
+	  i, samples[i].type, s1, s2, h1, h2);
+    if (test_failures > 16)
+      return;
+  }
+}
+
+static double Measure(hvm_bool linear)
+{
+  EVENT_ARGUMENTS args;
+  unsigned long long t;
+  volatile Bit32u sink;
+  SAMPLE *s;
+  Bit32u i;
+
+  vmm_memset(&args, 0, sizeof(args));
+  sink = 0;
+
+  t = BenchNow();
+  for (i = 0; i < N_PUBLISHES; i++) {
+    s = &samples[i & (N_SAMPLES - 1)];
+    if (linear)
+      sink += LinearPublish(s->type, &args, &s->condition, s->size);
+    else
+      sink += EventPublish(s->type, &args, &s->condition, s->size);
+  }
+  t = BenchNow() - t;
+
+  return (double) t / N_PUBLISHES;
+}
+
+int main(void)
+{
+  double linear, indexed;
+
+  FillTable();
+  FillSamples();
+  Compare();
+
+  linear  = Measure(TRUE);
+  indexed = Measure(FALSE);
+  printf("bench_events: %d subscribers, %d events: linear scan %.1f ns/event, indexed %.1f ns/event\n",
+	 N_EVENTS, N_PUBLISHES, linear, indexed);
+
+  TEST_RESULT("bench_events");
+}
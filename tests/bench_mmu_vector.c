@@ -0,0 +1,136 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+/* Memory dumps of 4KB, 64KB and 1MB, read with MmuReadVirtualRegion() (i.e.,
+   physically contiguous pages copied as runs through the mapping window)
+   and one page at a time through the slots, as dumps were read before.
+   Reports pages/second, then copies (i.e., separate mappings: a run is one
+   copy), page mappings and TLB invalidations per page. On the simulated MMU
+   an invalidation is a system call, which dominates the times */
+
+#include "test.h"
+#include "bench.h"
+#include "mmu.c"
+#include "mmu_sim.h"
+
+#define CONTIG   0x10000000	/* 1MB, physically contiguous */
+#define SCATTER  0x20000000	/* 1MB, no two pages adjacent */
+#define DATA     0x00200000
+
+#define DUMP_BYTES (32 << 20)	/* Read by each measurement */
+
+static hvm_address cr3;
+static Bit8u buffer[1 << 20];
+
+static void SetupGuest(void)
+{
+  Bit32u i, frame;
+
+  cr3 = SimNewPD();
+
+  frame = PHY_TO_FRAME((hvm_phy_address) DATA);
+  for (i = 0; i < 256; i++)
+    SimMap(cr3, CONTIG + i*MMU_PAGE_SIZE, frame + i);
+
+  frame = PHY_TO_FRAME((hvm_phy_address) DATA + (1 << 20));
+  for (i = 0; i < 256; i++)
+    SimMap(cr3, SCATTER + i*MMU_PAGE_SIZE, frame + 2*(255 - i));
+
+  for (i = DATA / 4; i < SIM_PHYS_SIZE / 4; i++)
+    ((Bit32u*) phys)[i] = i * 0x9e3779b1;
+}
+
+/* The dump loop before vectored reads */
+static hvm_status ReadByPage(hvm_address va, Bit8u* p, Bit32u size)
+{
+  hvm_phy_address phy;
+  Bit32u n;
+
+  while (size > 0) {
+    n = MIN(size, MMU_PAGE_SIZE - MMU_PAGE_OFFSET(va));
+    if (MmuGetPhysicalAddress(cr3, va, &phy) != HVM_STATUS_SUCCESS ||
+	MmuReadPhysicalRegion(phy, p, n) != HVM_STATUS_SUCCESS)
+      return HVM_STATUS_UNSUCCESSFUL;
+    va += n;
+    p += n;
+    size -= n;
+  }
+
+  return HVM_STATUS_SUCCESS;
+}
+
+static void Measure(const char *layout, hvm_address base, Bit32u size, hvm_bool bypage)
+{
+  unsigned long long t;
+  MMU_STATS s0, s1;
+  hvm_phy_address phy;
+  hvm_status r;
+  Bit32u i, n, pages;
+
+  n = DUMP_BYTES / size;
+  pages = n * (size / MMU_PAGE_SIZE);
+
+  MmuGuestTLBSetEnabled(TRUE);
+  MmuGetStats(&s0);
+  t = BenchNow();
+  for (i = 0; i < n; i++) {
+    r = bypage ? ReadByPage(base, buffer, size) : MmuReadVirtualRegion(cr3, base, buffer, size);
+    CHECK(r == HVM_STATUS_SUCCESS, "%s %d bytes: read failed", layout, size);
+  }
+  t = BenchNow() - t;
+  MmuGetStats(&s1);
+  MmuGuestTLBSetEnabled(FALSE);
+
+  for (i = 0; i < size; i += MMU_PAGE_SIZE) {
+    phy = 0;
+    SimTranslate(cr3, base + i, &phy);
+    CHECK(vmm_memcmp(buffer + i, phys + phy, MMU_PAGE_SIZE) == 0, "%s %d bytes: page %d differs",
+	  layout, size, i / MMU_PAGE_SIZE);
+  }
+
+  printf("  %-10s %5dKB %-8s %8.0f pages/s %5.2f copies/page %5.2f maps/page %5.2f invlpg/page\n",
+	 layout, size >> 10, bypage ? "by page" : "vector", pages / (t / 1e9),
+	 (double) (s1.runs - s0.runs + (s1.maps - s0.maps) - (s1.run_pages - s0.run_pages)) / pages,
+	 (double) (s1.maps - s0.maps) / pages,
+	 (double) (s1.tlb_page_flushes - s0.tlb_page_flushes) / pages);
+}
+
+int main(void)
+{
+  static const Bit32u sizes[] = { 4 << 10, 64 << 10, 1 << 20 };
+  Bit32u i;
+
+  SimInit();
+  SetupGuest();
+
+  printf("bench_mmu_vector:\n");
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    Measure("contiguous", CONTIG, sizes[i], TRUE);
+    Measure("contiguous", CONTIG, sizes[i], FALSE);
+    Measure("scattered", SCATTER, sizes[i], TRUE);
+    Measure("scattered", SCATTER, sizes[i], FALSE);
+  }
+
+  TEST_RESULT("bench_mmu_vector");
+}
@@ -0,0 +1,199 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+/* Simulated processor for the tests that #include ept.c: the identity map is
+   built in host memory, with WB memory and 1GB and 2MB EPT pages. The first
+   2MB region has a UC hole (so it is mapped by a PT from the start) and the
+   last 1GB region has a UC top (so it is mapped by a PD of 2MB pages).
+   Guest physical memory is a host mapping, filled on demand, and
+   SimGuestWrite() writes to it as the guest would, through the EPT
+   permissions */
+
+#ifndef _TESTS_EPT_SIM_H
+#define _TESTS_EPT_SIM_H
+
+#include <sys/mman.h>
+
+#define SIM_PHYS_SIZE ((Bit64u) HOST_GB << 30)
+
+static Bit8u* simphys;			/* Guest physical memory */
+static Bit32u invept_count;
+static Bit32u freeze_count, thaw_count;
+static Bit32u violations;		/* Write EPT violations */
+static Bit32u next_phys = 0x100000;
+
+/* #### STUBS #### */
+
+void USESTACK EptInvept(Bit32u eptp_high, Bit32u eptp_low, Bit32u rsvd_high, Bit32u rsvd_low)
+{
+  invept_count++;
+}
+
+/* Freezes may nest, but must be balanced */
+void SmpFreezeOthers(void)
+{
+  freeze_count++;
+}
+
+void SmpThawOthers(void)
+{
+  CHECK(thaw_count < freeze_count, "SmpThawOthers() without SmpFreezeOthers()");
+  thaw_count++;
+}
+
+/* Tables are only reached through VIRT_PD_BASES and VIRT_PT_BASES, so any
+   distinct page-aligned value will do as their physical address */
+hvm_status MmuGetPhysicalAddress(hvm_address cr3, hvm_address va, hvm_phy_address* pphy)
+{
+  *pphy = next_phys;
+  next_phys += 4096;
+  return HVM_STATUS_SUCCESS;
+}
+
+/* Identity-mapped guest */
+hvm_status MmuWalkVirtualRange(hvm_address cr3, hvm_address va, Bit32u size, MMU_PAGE_CALLBACK callback, void* arg)
+{
+  hvm_address end;
+
+  end = va + size;
+  for (va &= ~0xfff; va < end; va += 4096)
+    callback(va, va, arg);
+
+  return HVM_STATUS_SUCCESS;
+}
+
+hvm_status MmuReadWritePhysicalRegion(hvm_phy_address phy, void* buffer, Bit32u size, hvm_bool isWrite)
+{
+  if (!simphys || phy + size > SIM_PHYS_SIZE)
+    abort();
+
+  if (isWrite)
+    vmm_memcpy(simphys + phy, buffer, size);
+  else
+    vmm_memcpy(buffer, simphys + phy, size);
+
+  return HVM_STATUS_SUCCESS;
+}
+
+Bit32u RegGetCr3(void) { return 0; }
+Bit32u SmpCpuCount(void) { return 1; }
+void TraceRecord(PTRACE_SITE site, ...) { }
+
+void USESTACK ReadMSR(Bit32u reg, PMSR msr)
+{
+  msr->Hi = 0;
+  switch (reg) {
+  case MSR_IA32_MTRRCAP:         msr->Lo = 2; break;
+  case MSR_IA32_MTRR_DEF_TYPE:   msr->Lo = IA32_MTRR_DEF_TYPE_E | MEM_TYPE_WRITEBACK; break;
+  case IA32_VMX_EPT_VPID_CAP:    msr->Lo = EPT_CAP_2MB_PAGES | EPT_CAP_1GB_PAGES; break;
+  case MSR_IA32_MTRR_PHYSBASE(0): msr->Lo = 0x000a0000 | MEM_TYPE_UNCACHEABLE; break;
+  case MSR_IA32_MTRR_PHYSMASK(0): msr->Lo = 0xfffe0000 | IA32_MTRR_PHYMASK_VALID; msr->Hi = 0xfffff; break;
+  case MSR_IA32_MTRR_PHYSBASE(1): msr->Lo = 0xfe000000 | MEM_TYPE_UNCACHEABLE; break;
+  case MSR_IA32_MTRR_PHYSMASK(1): msr->Lo = 0xfe000000 | IA32_MTRR_PHYMASK_VALID; msr->Hi = 0xfffff; break;
+  default:                       msr->Lo = 0; break;
+  }
+}
+
+/* #### SIMULATION #### */
+
+#define PAGE(n) ((hvm_address) (n) << 12)
+
+/* Build the identity map, with the EPT dirty flags if 'ad' */
+static void SimInit(hvm_bool ad)
+{
+  EPTInit();
+  EPTAccessDirty = ad;
+  if (!HVM_SUCCESS(EPTBuildIdentityMap())) {
+    printf("cannot build the identity map\n");
+    exit(1);
+  }
+
+  simphys = mmap(NULL, SIM_PHYS_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (simphys == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+}
+
+/* A guest write of 'value' at 'phy'. Without write permission, the EPT
+   violation goes to EPTHandleWrite() and the write is retried: FALSE if the
+   violation is not handled there. With the dirty flags, the processor sets
+   the one of the leaf entry */
+static hvm_bool SimGuestWrite(hvm_address phy, Bit8u value)
+{
+  Bit32u *entry;
+
+  entry = (Bit32u *) EPTGetEntry(phy);
+  if (!(*entry & WRITE)) {
+    violations++;
+    if (!EPTHandleWrite(phy))
+      return FALSE;
+    entry = (Bit32u *) EPTGetEntry(phy);
+    if (!(*entry & WRITE))
+      return FALSE;
+  }
+
+  if (EPTAccessDirty)
+    *entry |= EPT_ACCESSED | EPT_DIRTY;
+
+  simphys[phy] = value;
+
+  return TRUE;
+}
+
+/* TRUE if 'phy' is mapped by a 2MB page */
+static hvm_bool SimIsLarge(hvm_address phy)
+{
+  hvm_address entry;
+
+  entry = EPTGetEntry(phy);
+  return (*(Bit32u *) entry & EPT_LARGE_PAGE) && !(entry >= VIRT_PDPT && entry < VIRT_PDPT + 4096);
+}
+
+/* Call f on each leaf entry of the map, with the first page it maps and
+   their number */
+static void SimForEachLeaf(void (*f)(Bit32u *entry, Bit32u page, Bit32u npages))
+{
+  Bit32u i, j, k, n, *pdpte, *pde;
+
+  for (i = 0; i < HOST_GB; i++) {
+    pdpte = (Bit32u *) (VIRT_PDPT + i*8);
+    if (*pdpte & EPT_LARGE_PAGE) {
+      f(pdpte, i << 18, 1 << 18);
+      continue;
+    }
+    for (j = 0; j < 512; j++) {
+      n = i*512 + j;
+      pde = (Bit32u *) (VIRT_PD_BASES[i] + j*8);
+      if (*pde & EPT_LARGE_PAGE) {
+	f(pde, n << 9, 512);
+	continue;
+      }
+      for (k = 0; k < 512; k++)
+	f((Bit32u *) (VIRT_PT_BASES[n] + k*8), (n << 9) + k, 1);
+    }
+  }
+}
+
+#endif	/* _TESTS_EPT_SIM_H */
@@ -0,0 +1,53 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+/* Included first (see Makefile) by the tests in this directory, which are
+   built as ordinary host programs: the source file under test is #included
+   by the test itself, so that its static functions can be reached, and the
+   kernel facilities it uses are mapped to libc */
+
+#ifndef _TESTS_HOST_H
+#define _TESTS_HOST_H
+
+#define _GNU_SOURCE		/* memfd_create(), see mmu_sim.h */
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define KERN_DEBUG ""
+#define printk printf
+
+#define GFP_KERNEL 0
+#define kmalloc(size, flags) aligned_alloc(4096, (size))
+#define kfree(p) free(p)
+#define vmalloc(size) aligned_alloc(4096, (size))
+#define vfree(p) free(p)
+
+/* The kernel headers the sources include are empty files under include/ */
+#define PAGE_OFFSET 0xc0000000UL
+#define phys_to_virt(phy) ((void*) (uintptr_t) (phy))
+
+#endif	/* _TESTS_HOST_H */
@@ -0,0 +1 @@
+/* Empty: see tests/host.h */
@@ -0,0 +1,220 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+/* Simulated MMU for the tests that #include mmu.c. Guest physical memory is
+   a memfd, also mapped flat at 'phys' to build page tables. The mapping
+   slots and window of mmu.c are real host pages: their PTEs live in
+   simptes[], and the TLB flush of one of them maps the frame the PTE points
+   to (or nothing) at its address, as the processor would */
+
+#ifndef _TESTS_MMU_SIM_H
+#define _TESTS_MMU_SIM_H
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SIM_PHYS_SIZE (64 << 20)
+#define SIM_PAGES     MMU_MAP_SET_PAGES
+
+static int    simfd = -1;
+static Bit8u* phys;			/* Flat view of guest physical memory */
+static Bit8u* simarea;			/* Host pages of the slots and window */
+static PTE    simptes[SIM_PAGES];
+static Bit32u simflushes;
+static Bit32u simframes;		/* Next free frame */
+
+/* #### STUBS #### */
+
+struct HVM_X86_OPS hvm_x86_ops;
+VT_CPU vt_cpus[VT_MAX_CPUS];
+
+Bit32u RegGetCr0(void) { return 0; }
+Bit32u RegGetCr3(void) { return 0; }
+Bit32u SmpCpuCount(void) { return 1; }
+
+/* The guest set of slots is the only one */
+PVT_CPU VtCurrentRootCpu(void)
+{
+  return NULL;
+}
+
+static void SimFlushPage(hvm_address va)
+{
+  Bit32u n;
+  void *p;
+
+  simflushes++;
+
+  if (va < (hvm_address) simarea || va >= (hvm_address) simarea + SIM_PAGES*MMU_PAGE_SIZE)
+    return;
+
+  n = (va - (hvm_address) simarea) / MMU_PAGE_SIZE;
+  if (simptes[n].Present && FRAME_TO_PHY((hvm_phy_address) simptes[n].PageBaseAddr) < SIM_PHYS_SIZE)
+    p = mmap((void*) va, MMU_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+	     simfd, FRAME_TO_PHY((off_t) simptes[n].PageBaseAddr));
+  else
+    p = mmap((void*) va, MMU_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+}
+
+static void SimFlush(void)
+{
+  Bit32u i;
+
+  for (i = 0; i < SIM_PAGES; i++)
+    SimFlushPage((hvm_address) simarea + i*MMU_PAGE_SIZE);
+}
+
+/* Set up physical memory and the guest set of slots of mmu.c */
+static void SimInit(void)
+{
+  PMMU_MAP_SET set;
+  Bit32u i;
+
+  simfd = memfd_create("phys", 0);
+  if (simfd < 0 || ftruncate(simfd, SIM_PHYS_SIZE) != 0) {
+    perror("memfd");
+    exit(1);
+  }
+
+  phys    = mmap(NULL, SIM_PHYS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, simfd, 0);
+  /* Below 4GB, like any address of the (32-bit) VMM: MMU_PAGE_ALIGN()
+     truncates to 32 bits */
+  simarea = mmap(NULL, SIM_PAGES*MMU_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+  if (phys == MAP_FAILED || simarea == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+
+  hvm_x86_ops.mmu_tlb_flush_page = SimFlushPage;
+  hvm_x86_ops.mmu_tlb_flush      = SimFlush;
+
+  set = &mapsets[MMU_MAP_GUEST_SET];
+  for (i = 0; i < MMU_MAP_SLOTS; i++) {
+    set->slots[i].va   = (hvm_address) simarea + i*MMU_PAGE_SIZE;
+    set->slots[i].pte  = (hvm_address) &simptes[i];
+    set->slots[i].busy = FALSE;
+  }
+
+  set->window_va   = (hvm_address) simarea + MMU_MAP_SLOTS*MMU_PAGE_SIZE;
+  set->window_busy = FALSE;
+  for (i = 0; i < MMU_MAP_WINDOW_PAGES; i++)
+    set->window_pte[i] = (hvm_address) &simptes[MMU_MAP_SLOTS + i];
+
+  mapsets_ready = TRUE;
+  simframes = 1;		/* Frame 0 stays unused */
+}
+
+/* #### GUEST PAGE TABLES #### */
+
+static PTE* SimEntry(hvm_phy_address addr)
+{
+  return (PTE*) (phys + addr);
+}
+
+static Bit32u SimAllocFrame(void)
+{
+  Bit32u frame;
+
+  frame = simframes++;
+  if (FRAME_TO_PHY((hvm_phy_address) simframes) > SIM_PHYS_SIZE) {
+    printf("out of simulated physical memory\n");
+    exit(1);
+  }
+
+  vmm_memset(phys + FRAME_TO_PHY((hvm_phy_address) frame), 0, MMU_PAGE_SIZE);
+  return frame;
+}
+
+/* A new, empty page directory: returns its cr3 */
+static hvm_address SimNewPD(void)
+{
+  return FRAME_TO_PHY((hvm_address) SimAllocFrame());
+}
+
+static void SimSetEntry(PTE* p, Bit32u frame, hvm_bool isLarge)
+{
+  vmm_memset(p, 0, sizeof(PTE));
+  p->Present      = 1;
+  p->Writable     = 1;
+  p->LargePage    = isLarge;
+  p->PageBaseAddr = frame;
+}
+
+/* Map the 4KB page at va to 'frame' */
+static void SimMap(hvm_address cr3, hvm_address va, Bit32u frame)
+{
+  PTE *pde;
+
+  pde = SimEntry(CR3_ALIGN(cr3) + VA_TO_PDE(va)*sizeof(PTE));
+  if (!pde->Present || pde->LargePage)
+    SimSetEntry(pde, SimAllocFrame(), FALSE);
+
+  SimSetEntry(SimEntry(FRAME_TO_PHY((hvm_phy_address) pde->PageBaseAddr) + VA_TO_PTE(va)*sizeof(PTE)), frame, FALSE);
+}
+
+/* Map the large page at va to the large page at 'phy' */
+static void SimMapLarge(hvm_address cr3, hvm_address va, hvm_phy_address phy)
+{
+  SimSetEntry(SimEntry(CR3_ALIGN(cr3) + VA_TO_PDE(va)*sizeof(PTE)), PHY_TO_FRAME(phy), TRUE);
+}
+
+static void SimUnmap(hvm_address cr3, hvm_address va)
+{
+  PTE *pde;
+
+  pde = SimEntry(CR3_ALIGN(cr3) + VA_TO_PDE(va)*sizeof(PTE));
+  if (pde->Present && !pde->LargePage)
+    SimEntry(FRAME_TO_PHY((hvm_phy_address) pde->PageBaseAddr) + VA_TO_PTE(va)*sizeof(PTE))->Present = 0;
+  else
+    pde->Present = 0;
+}
+
+/* Reference translation, straight from the page tables */
+static hvm_bool SimTranslate(hvm_address cr3, hvm_address va, hvm_phy_address* pphy)
+{
+  PTE pde, pte;
+
+  pde = *SimEntry(CR3_ALIGN(cr3) + VA_TO_PDE(va)*sizeof(PTE));
+  if (!pde.Present)
+    return FALSE;
+
+  if (pde.LargePage) {
+    *pphy = LARGEFRAME_TO_PHY((hvm_phy_address) pde.PageBaseAddr) + LARGEPAGE_OFFSET(va);
+    return TRUE;
+  }
+
+  pte = *SimEntry(FRAME_TO_PHY((hvm_phy_address) pde.PageBaseAddr) + VA_TO_PTE(va)*sizeof(PTE));
+  if (!pte.Present)
+    return FALSE;
+
+  *pphy = FRAME_TO_PHY((hvm_phy_address) pte.PageBaseAddr) + MMU_PAGE_OFFSET(va);
+  return TRUE;
+}
+
+#endif	/* _TESTS_MMU_SIM_H */
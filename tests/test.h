@@ -0,0 +1,47 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+/* Checks shared by the tests: a failed CHECK() is reported and counted, and
+   TEST_RESULT() makes the test exit with 1 if any failed */
+
+#ifndef _TESTS_TEST_H
+#define _TESTS_TEST_H
+
+static int test_failures = 0;
+
+#define CHECK(cond, fmt, ...)						\
+  do {									\
+    if (!(cond)) {							\
+      printf("%s:%d: " fmt "\n", __FILE__, __LINE__, ## __VA_ARGS__);	\
+      test_failures++;							\
+    }									\
+  } while(0)
+
+#define TEST_RESULT(name)						\
+  do {									\
+    printf("%s: %s\n", (name), test_failures ? "FAILED" : "ok");	\
+    return test_failures ? 1 : 0;					\
+  } while(0)
+
+#endif	/* _TESTS_TEST_H */
@@ -0,0 +1,461 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+/* Serial output of comio.c through an emulated 16550A (and 8250) UART. Each
+   port access costs IO_NS of emulated time and the line shifts out one byte
+   every 10 bit times, so that the emulator can tell how many bytes were
+   written per transmitter-empty poll, whether any was written into a full
+   FIFO, and how well the line is used. The asynchronous queue is checked for
+   wrap-around of its indexes and for the bytes it drops when full */
+
+#include "test.h"
+#include "comio.c"
+
+#define IO_NS     1000		/* A trapped port access */
+#define WIRE_SIZE (4 * COM_TX_QUEUE_SIZE)
+
+/* #### 16550 EMULATOR #### */
+
+static struct {
+  hvm_bool has_fifo;		/* 16550A; 8250 otherwise */
+  Bit8u    ier, lcr, mcr, fcr, dll, dlm;
+
+  Bit64u   now;			/* Emulated time (ns) */
+  Bit64u   shift_end;		/* When the byte being shifted out is done */
+  hvm_bool shifting;
+  Bit8u    fifo[COM_FIFO_SIZE];
+  Bit32u   fifo_head, fifo_count;
+
+  Bit8u    wire[WIRE_SIZE];	/* Bytes that left the UART */
+  Bit32u   nwire;
+  Bit8u   *rx;			/* Bytes to receive */
+  Bit32u   nrx;
+
+  Bit32u   ios, lsr_reads, thr_writes;
+  Bit32u   overruns;		/* Bytes written into a full FIFO */
+  Bit32u   bursts, burst_len, max_burst;
+  hvm_bool last_was_lsr;
+} uart;
+
+static Bit32u UartFifoSize(void)
+{
+  return (uart.has_fifo && (uart.fcr & 1)) ? COM_FIFO_SIZE : 1;
+}
+
+static Bit64u UartByteNs(void)
+{
+  Bit32u divisor;
+
+  divisor = uart.dll | (uart.dlm << 8);
+  return 10ULL * 1000000000ULL * (divisor ? divisor : 0x10000) / COM_UART_CLOCK;
+}
+
+/* Shift out the bytes whose time has come */
+static void UartAdvance(void)
+{
+  while (uart.shifting && uart.now >= uart.shift_end) {
+    uart.shifting = FALSE;
+    if (uart.fifo_count > 0) {
+      if (uart.nwire < WIRE_SIZE)
+	uart.wire[uart.nwire] = uart.fifo[uart.fifo_head];
+      uart.nwire++;
+      uart.fifo_head = (uart.fifo_head + 1) % COM_FIFO_SIZE;
+      uart.fifo_count--;
+      uart.shift_end += UartByteNs();
+      uart.shifting = TRUE;
+    }
+  }
+}
+
+static void UartReset(hvm_bool has_fifo)
+{
+  vmm_memset(&uart, 0, sizeof(uart));
+  uart.has_fifo = has_fifo;
+}
+
+/* Let the line go idle, without touching the ports */
+static void UartFinish(void)
+{
+  while (uart.shifting) {
+    uart.now = uart.shift_end;
+    UartAdvance();
+  }
+}
+
+Bit8u USESTACK IoReadPortByte(Bit16u portno)
+{
+  Bit8u r;
+
+  uart.now += IO_NS;
+  uart.ios++;
+  UartAdvance();
+
+  switch (portno - COM_PORT_ADDRESS) {
+  case RECEIVER_BUFFER_REGISTER:
+    if (uart.lcr & 0x80)
+      return uart.dll;
+    r = 0;
+    if (uart.nrx > 0) {
+      r = *uart.rx++;
+      uart.nrx--;
+    }
+    return r;
+
+  case INTERRUPT_IDENTIFICATION_REGISTER:
+    return (uart.has_fifo && (uart.fcr & 1)) ? (IIR_FIFO_ENABLED | 1) : 1;
+
+  case LINE_STATUS_REGISTER:
+    uart.lsr_reads++;
+    uart.last_was_lsr = TRUE;
+    r = 0;
+    if (uart.nrx > 0)
+      r |= LSR_DATA_AVAILABLE;
+    if (uart.fifo_count == 0)
+      r |= LSR_THR_EMPTY;
+    if (uart.fifo_count == 0 && !uart.shifting)
+      r |= LSR_THR_EMPTY_AND_IDLE;
+    return r;
+
+  default:
+    abort();
+  }
+}
+
+void USESTACK IoWritePortByte(Bit16u portno, Bit8u value)
+{
+  uart.now += IO_NS;
+  uart.ios++;
+  UartAdvance();
+
+  switch (portno - COM_PORT_ADDRESS) {
+  case TRANSMIT_HOLDING_REGISTER:
+    if (uart.lcr & 0x80) {
+      uart.dll = value;
+      break;
+    }
+
+    uart.thr_writes++;
+    if (uart.last_was_lsr) {
+      uart.bursts++;
+      uart.burst_len = 0;
+    }
+    uart.burst_len++;
+    if (uart.burst_len > uart.max_burst)
+      uart.max_burst = uart.burst_len;
+    uart.last_was_lsr = FALSE;
+
+    if (uart.fifo_count >= UartFifoSize()) {
+      uart.overruns++;
+      break;
+    }
+    uart.fifo[(uart.fifo_head + uart.fifo_count) % COM_FIFO_SIZE] = value;
+    uart.fifo_count++;
+    if (!uart.shifting) {
+      uart.shift_end = uart.now;
+      uart.shifting  = TRUE;
+      UartAdvance();
+    }
+    break;
+
+  case INTERRUPT_ENABLE_REGISTER:
+    if (uart.lcr & 0x80)
+      uart.dlm = value;
+    else
+      uart.ier = value;
+    break;
+
+  case INTERRUPT_IDENTIFICATION_REGISTER:
+    uart.fcr = value;
+    break;
+
+  case 3:
+    uart.lcr = value;
+    break;
+
+  case 4:
+    uart.mcr = value;
+    break;
+
+  default:
+    abort();
+  }
+}
+
+/* #### STUBS #### */
+
+void USESTACK CmInitSpinLock(Bit32u *plock) { *plock = 0; }
+void USESTACK CmAcquireSpinLock(Bit32u *plock) { CHECK(*plock == 0, "ComSpinLock taken twice"); *plock = 1; }
+void USESTACK CmReleaseSpinLock(Bit32u *plock) { *plock = 0; }
+
+/* #### HELPERS #### */
+
+static Bit8u  data[WIRE_SIZE];
+static Bit32u seed = 12345;
+
+static void MakeData(void)
+{
+  Bit32u i;
+
+  for (i = 0; i < WIRE_SIZE; i++) {
+    seed = seed * 1103515245 + 12345;
+    data[i] = 'a' + (seed >> 16) % 26;
+  }
+}
+
+/* A new UART, initialized by ComInit() */
+static void Init(hvm_bool has_fifo, Bit32u baud)
+{
+  UartReset(has_fifo);
+  PortInit();
+  ComFifoSize = 1;
+  ComAsync = FALSE;
+  ComTxHead = ComTxTail = 0;
+  ComInit(baud);
+  uart.ios = 0;
+  uart.now = 0;
+}
+
+/* ComPrint() 'n' bytes of data[], starting at 'from', in chunks that fit its
+   buffer */
+static void Print(Bit32u from, Bit32u n)
+{
+  char chunk[512];
+  Bit32u m;
+
+  while (n > 0) {
+    m = MIN(n, sizeof(chunk) - 1);
+    vmm_memcpy(chunk, &data[from], m);
+    chunk[m] = 0;
+    ComPrint("%s", chunk);
+    from += m;
+    n -= m;
+  }
+}
+
+/* The wire carries exactly data[0, n) */
+static void CheckWire(const char *name, Bit32u n)
+{
+  Bit32u i;
+
+  CHECK(uart.nwire == n, "%s: %d bytes on the wire, %d expected", name, uart.nwire, n);
+  for (i = 0; i < MIN(n, uart.nwire); i++) {
+    if (uart.wire[i] != data[i]) {
+      CHECK(FALSE, "%s: byte %d is '%c', '%c' expected", name, i, uart.wire[i], data[i]);
+      break;
+    }
+  }
+  CHECK(uart.overruns == 0, "%s: %d bytes written into a full FIFO", name, uart.overruns);
+}
+
+/* #### TESTS #### */
+
+static void TestInit(void)
+{
+  static const struct { Bit32u baud, divisor; } rates[] = {
+    { 115200, 1 }, { 38400, 3 }, { 9600, 12 }, { 0, 1 }, { 1000000, 1 }, { 1, 0xffff },
+  };
+  Bit32u i;
+
+  for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+    Init(TRUE, rates[i].baud);
+    CHECK((uart.dll | (uart.dlm << 8)) == rates[i].divisor, "init: baud %d: divisor %d, %d expected",
+	  rates[i].baud, uart.dll | (uart.dlm << 8), rates[i].divisor);
+    CHECK(uart.lcr == 0x03, "init: baud %d: DLAB left set", rates[i].baud);
+  }
+
+  Init(TRUE, 115200);
+  CHECK(ComFifoSize == COM_FIFO_SIZE, "init: 16550A: FIFO size %d", ComFifoSize);
+  Init(FALSE, 115200);
+  CHECK(ComFifoSize == 1, "init: 8250: FIFO size %d", ComFifoSize);
+}
+
+/* Synchronous output: one burst of at most ComFifoSize bytes per
+   transmitter-empty poll, and nothing lost */
+static void TestBurst(const char *name, hvm_bool has_fifo, hvm_bool old, Bit32u n)
+{
+  double line;
+
+  Init(has_fifo, 115200);
+  if (old)
+    ComFifoSize = 1;		/* One byte per poll, as before bursts */
+
+  PortSendBurst(data, n);
+  UartFinish();
+
+  CheckWire(name, n);
+  CHECK(uart.max_burst <= ComFifoSize, "%s: burst of %d bytes", name, uart.max_burst);
+  CHECK(uart.bursts == (n + ComFifoSize - 1) / ComFifoSize, "%s: %d bursts, %d expected",
+	name, uart.bursts, (n + ComFifoSize - 1) / ComFifoSize);
+
+  line = (double) n * UartByteNs() / uart.now;
+  printf("test_comio: sync,  %-22s %5.3f waits per byte, line %5.1f%% busy\n",
+	 name, (double) uart.bursts / n, 100 * line);
+}
+
+/* Asynchronous output: ComPrint() only queues, ComDrain() writes at most a
+   FIFO of data and never waits */
+static void TestDrain(void)
+{
+  Bit32u lsr, ios;
+
+  Init(TRUE, 115200);
+  ComSetAsync(TRUE);
+
+  Print(0, 100);
+  CHECK(uart.thr_writes == 0, "drain: %d bytes written by ComPrint()", uart.thr_writes);
+
+  ComDrain();
+  CHECK(uart.thr_writes == COM_FIFO_SIZE, "drain: %d bytes written, %d expected", uart.thr_writes, COM_FIFO_SIZE);
+
+  /* The FIFO is still busy: one poll, nothing written */
+  lsr = uart.lsr_reads;
+  ios = uart.ios;
+  ComDrain();
+  CHECK(uart.lsr_reads == lsr + 1 && uart.ios == ios + 1, "drain: %d port accesses with a busy FIFO", uart.ios - ios);
+
+  ComSetAsync(FALSE);
+  CHECK(ComTxHead == ComTxTail, "drain: queue not flushed by ComSetAsync(FALSE)");
+  UartFinish();
+  CheckWire("drain", 100);
+
+  /* Nothing to do, no port access */
+  ios = uart.ios;
+  ComDrain();
+  CHECK(uart.ios == ios, "drain: %d port accesses with an empty queue", uart.ios - ios);
+}
+
+/* Queued output drained only on VM exits, one every EXIT_NS: with a FIFO
+   each drain moves up to COM_FIFO_SIZE bytes instead of one */
+#define EXIT_NS 200000
+
+static void TestDrainRate(const char *name, hvm_bool old)
+{
+  Bit32u n;
+
+  Init(TRUE, 115200);
+  if (old)
+    ComFifoSize = 1;
+  ComSetAsync(TRUE);
+
+  n = COM_TX_QUEUE_SIZE;
+  Print(0, n);
+  while (ComTxHead != ComTxTail) {
+    ComDrain();
+    uart.now += EXIT_NS;
+  }
+  UartFinish();
+
+  CheckWire(name, n);
+  printf("test_comio: async, %-22s %5.0f bytes/s with a VM exit every %d us (line: %d bytes/s)\n",
+	 name, n * 1e9 / uart.now, EXIT_NS / 1000, (Bit32u) (1000000000ULL / UartByteNs()));
+  ComAsync = FALSE;
+}
+
+/* Indexes wrapping around 2^32, and the queue around its end, with producer
+   and consumer interleaved */
+static void TestWrap(void)
+{
+  Bit32u sent, n;
+
+  Init(TRUE, 115200);
+  ComTxHead = ComTxTail = 0xffffffff - COM_TX_QUEUE_SIZE / 2;
+  ComSetAsync(TRUE);
+
+  for (sent = 0; sent < 3 * COM_TX_QUEUE_SIZE; sent += n) {
+    seed = seed * 1103515245 + 12345;
+    n = MIN((seed >> 16) % 700, 3 * COM_TX_QUEUE_SIZE - sent);
+    Print(sent, n);
+
+    do {
+      UartAdvance();
+      ComDrain();
+      uart.now += (seed >> 8) % 50000;
+    } while (ComTxHead - ComTxTail > COM_TX_QUEUE_SIZE / 2);
+  }
+
+  ComFlush();
+  UartFinish();
+  CheckWire("wrap", 3 * COM_TX_QUEUE_SIZE);
+  CHECK(ComTxHead == ComTxTail && ComTxHead < COM_TX_QUEUE_SIZE * 3, "wrap: head %08x, tail %08x", ComTxHead, ComTxTail);
+}
+
+/* With nobody draining, the queue keeps the oldest COM_TX_QUEUE_SIZE bytes
+   and drops the rest; it works again once drained */
+static void TestDrops(void)
+{
+  Bit32u n;
+
+  Init(TRUE, 115200);
+  ComTxHead = ComTxTail = COM_TX_QUEUE_SIZE - 10;
+  ComSetAsync(TRUE);
+
+  n = COM_TX_QUEUE_SIZE + 1000;
+  Print(0, n);
+  CHECK(ComTxHead - ComTxTail == COM_TX_QUEUE_SIZE, "drops: %d bytes queued", ComTxHead - ComTxTail);
+  CHECK(uart.thr_writes == 0, "drops: %d bytes written while queueing", uart.thr_writes);
+
+  ComFlush();
+  UartFinish();
+  CheckWire("drops", COM_TX_QUEUE_SIZE);
+
+  /* The queue accepts data again */
+  uart.nwire = 0;
+  Print(0, 100);
+  ComSetAsync(FALSE);
+  UartFinish();
+  CheckWire("drops (after flush)", 100);
+}
+
+static void TestRecv(void)
+{
+  Bit8u c;
+
+  Init(TRUE, 115200);
+  uart.rx  = (Bit8u*) "hd";
+  uart.nrx = 2;
+
+  c = PortRecvByte();
+  CHECK(c == 'h', "recv: '%c'", c);
+  c = PortRecvByte();
+  CHECK(c == 'd', "recv: '%c'", c);
+}
+
+int main(void)
+{
+  MakeData();
+
+  TestInit();
+  TestBurst("16550A, bursts", TRUE, FALSE, 10000);
+  TestBurst("16550A, byte per poll", TRUE, TRUE, 10000);
+  TestBurst("8250", FALSE, FALSE, 10000);
+  TestBurst("16550A, short", TRUE, FALSE, 17);
+  TestDrain();
+  TestDrainRate("16550A, bursts", FALSE);
+  TestDrainRate("16550A, byte per drain", TRUE);
+  TestWrap();
+  TestDrops();
+  TestRecv();
+
+  TEST_RESULT("test_comio");
+}
@@ -0,0 +1,267 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+/* Dirty-page logging of ept.c, on the simulated identity map of ept_sim.h,
+   both with write protection and with the EPT dirty flags. Guest writes go
+   through the EPT permissions, and the harvested bitmaps are compared with
+   the pages written: exactly, where the map has 4KB pages, and a whole
+   granule for each write to a 2MB page */
+
+#include "test.h"
+#include "ept.c"
+#include "ept_sim.h"
+
+#define BITMAP_WORDS (EPT_DIRTY_LOG_PAGES / 32)
+
+static Bit32u expected[BITMAP_WORDS];	/* Pages written since the last harvest */
+static Bit32u harvested[BITMAP_WORDS];
+static Bit32u seed = 12345;
+
+static Bit32u Random(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+#define IS_SET(bitmap, page) (((bitmap)[(page) >> 5] >> ((page) & 31)) & 1)
+
+/* A guest write, recorded in expected[] */
+static void Write(const char *name, hvm_address phy)
+{
+  hvm_bool large;
+  Bit32u page;
+
+  page  = phy >> 12;
+  large = SimIsLarge(phy);
+
+  CHECK(SimGuestWrite(phy, 0x5a), "%s: write to %08lx not handled", name, (unsigned long) phy);
+
+  if (large)
+    vmm_memset(&expected[(page & ~511) >> 5], 0xff, 512 / 8);
+  else
+    expected[page >> 5] |= 1 << (page & 31);
+}
+
+/* #### CHECKS #### */
+
+static Bit32u leaf_mask, leaf_value, leaf_errors, leaf_huge;
+static Bit32u initial_huge;		/* 1GB pages before logging */
+
+static void CheckLeaf(Bit32u *entry, Bit32u page, Bit32u npages)
+{
+  if (npages == 1 << 18)
+    leaf_huge++;
+  if ((*entry & READ) && (*entry & leaf_mask) != leaf_value)
+    leaf_errors++;
+}
+
+/* All the readable leaves of the map have (entry & mask) == value, and
+   there are no 1GB pages if !huge, or as many as before logging if huge */
+static void CheckLeaves(const char *name, Bit32u mask, Bit32u value, hvm_bool huge)
+{
+  leaf_mask   = mask;
+  leaf_value  = value;
+  leaf_errors = leaf_huge = 0;
+  SimForEachLeaf(CheckLeaf);
+
+  CHECK(leaf_errors == 0, "%s: %d leaves with flags & %03x != %03x", name, leaf_errors, mask, value);
+  CHECK(leaf_huge == (huge ? initial_huge : 0), "%s: %d 1GB pages", name, leaf_huge);
+}
+
+/* Harvest pages [first, first + npages) and compare with expected[], which
+   is then cleared there. Returns the INVEPTs issued */
+static Bit32u Harvest(const char *name, Bit32u first, Bit32u npages)
+{
+  Bit32u i, n, bad;
+
+  n = invept_count;
+  CHECK(HVM_SUCCESS(EPTDirtyLogHarvest((Bit8u *) &harvested[first / 32], first, npages)), "%s: harvest failed", name);
+  n = invept_count - n;
+
+  bad = 0;
+  for (i = first / 32; i < (first + npages) / 32; i++) {
+    if (harvested[i] != expected[i] && bad++ == 0)
+      CHECK(FALSE, "%s: pages %05x-%05x harvested as %08x, written %08x", name, i*32, i*32 + 31, harvested[i], expected[i]);
+    expected[i] = 0;
+  }
+
+  return n;
+}
+
+/* #### TESTS #### */
+
+/* Start protects all the pages (or clears all the dirty flags), splitting
+   the 1GB pages; stop makes them writable again */
+static void TestStartStop(hvm_bool ad)
+{
+  Bit32u f;
+
+  f = freeze_count;
+  CHECK(HVM_SUCCESS(EPTDirtyLogStart()), "start failed");
+  CHECK(!HVM_SUCCESS(EPTDirtyLogStart()), "started twice");
+  if (ad)
+    CheckLeaves("start", WRITE | EPT_DIRTY, WRITE, FALSE);
+  else
+    CheckLeaves("start", WRITE, 0, FALSE);
+
+  EPTDirtyLogStop();
+  CheckLeaves("stop", WRITE, WRITE, TRUE);
+  CHECK(freeze_count - f == 2 && freeze_count == thaw_count, "start/stop: %d freezes", freeze_count - f);
+}
+
+/* The first write to a page is trapped and recorded, the next ones are
+   not; a write to a 2MB page makes all of it writable */
+static void TestFirstWrite(void)
+{
+  Bit32u v;
+
+  EPTDirtyLogStart();
+
+  v = violations;
+  Write("first write", 0x5123);
+  Write("first write", 0x5456);
+  CHECK(violations - v == 1, "first write: %d violations on a 4KB page", violations - v);
+  CHECK(!(*(Bit32u *) EPTGetEntry(0x6000) & WRITE), "first write: next page made writable");
+
+  v = violations;
+  Write("first write", 0x40123456);
+  Write("first write", 0x401ff000);
+  CHECK(violations - v == 1, "first write: %d violations on a 2MB page", violations - v);
+  CHECK(!(*(Bit32u *) EPTGetEntry(0x40200000) & WRITE), "first write: next 2MB page made writable");
+
+  Harvest("first write", 0, EPT_DIRTY_LOG_PAGES);
+  CHECK(harvested[0] == 1 << 5, "first write: first 2MB region harvested as %08x", harvested[0]);
+  CHECK(harvested[(0x40000000 >> 12) / 32] == 0xffffffff && harvested[(0x401ff000 >> 12) / 32] == 0xffffffff,
+	"first write: 2MB page not harvested whole");
+
+  EPTDirtyLogStop();
+}
+
+/* Random writes, to 2MB pages and to regions split into 4KB pages, then
+   harvested in pieces. Each harvest issues one INVEPT if something was
+   written in its range, and protects its range again (or clears its dirty
+   flags), and only that range */
+static void TestHarvest(const char *name, hvm_bool ad)
+{
+  static const Bit32u split[] = { 0x00000, 0x00400, 0x3fe00, 0x40000, 0xbfe00, 0xfe000 };
+  Bit32u round, i, n, half;
+  hvm_address phy;
+
+  EPTDirtyLogStart();
+
+  /* Regions with 4KB pages: the first one, and a few split by a breakpoint
+     somewhere. EXEC is not touched by the logging */
+  for (i = 0; i < sizeof(split) / sizeof(split[0]); i++)
+    EPTAlterPT(PAGE(split[i] + 7), EXEC, TRUE);
+
+  half = EPT_DIRTY_LOG_PAGES / 2;
+  for (round = 0; round < 8; round++) {
+    for (i = 0; i < 2000; i++) {
+      if (Random() % 2)
+	phy = PAGE(split[Random() % 6] + Random() % 512) + Random() % 4096;
+      else
+	phy = (hvm_address) (Random() % EPT_DIRTY_LOG_PAGES) << 12 | Random() % 4096;
+      Write(name, phy);
+    }
+
+    /* The upper half first: the lower one keeps its bits and permissions */
+    n = Harvest(name, half, half);
+    CHECK(n == 1, "%s: %d INVEPTs for the upper half", name, n);
+
+    for (i = 0; i < 64; i++) {
+      phy = (hvm_address) (Random() % half) << 12;
+      if (IS_SET(expected, phy >> 12)) {
+	CHECK(*(Bit32u *) EPTGetEntry(phy) & (ad ? EPT_DIRTY : WRITE), "%s: page %08lx written but protected by the other half",
+	      name, (unsigned long) phy);
+	break;
+      }
+    }
+
+    n = Harvest(name, 0, half);
+    CHECK(n == 1, "%s: %d INVEPTs for the lower half", name, n);
+
+    if (ad)
+      CheckLeaves(name, WRITE | EPT_DIRTY, WRITE, FALSE);
+    else
+      CheckLeaves(name, WRITE, 0, FALSE);
+
+    /* Nothing written since */
+    n = Harvest(name, 0, EPT_DIRTY_LOG_PAGES);
+    CHECK(n == 0, "%s: %d INVEPTs for an empty harvest", name, n);
+  }
+
+  /* While logging, a page becomes writable only after its first write */
+  if (!ad) {
+    EPTAlterPT(PAGE(0x400), READ | WRITE | EXEC, FALSE);
+    CHECK(!(*(Bit32u *) EPTGetEntry(PAGE(0x400)) & WRITE), "%s: page made writable before its first write", name);
+    Write(name, PAGE(0x401));
+    EPTAlterPT(PAGE(0x401), READ | WRITE, FALSE);
+    CHECK(*(Bit32u *) EPTGetEntry(PAGE(0x401)) & WRITE, "%s: written page not made writable", name);
+    Harvest(name, 0, EPT_DIRTY_LOG_PAGES);
+  }
+
+  for (i = 0; i < sizeof(split) / sizeof(split[0]); i++)
+    EPTAlterPT(PAGE(split[i] + 7), READ | WRITE | EXEC, FALSE);
+
+  EPTDirtyLogStop();
+  CheckLeaves(name, WRITE, WRITE, TRUE);
+}
+
+static void TestArguments(void)
+{
+  Bit8u bitmap[EPT_DIRTY_LOG_GRANULE / 8];
+
+  CHECK(!HVM_SUCCESS(EPTDirtyLogHarvest(bitmap, 0, EPT_DIRTY_LOG_GRANULE)), "harvest while stopped");
+
+  EPTDirtyLogStart();
+  CHECK(!HVM_SUCCESS(EPTDirtyLogHarvest(bitmap, 1, EPT_DIRTY_LOG_GRANULE)), "unaligned first page");
+  CHECK(!HVM_SUCCESS(EPTDirtyLogHarvest(bitmap, 0, 1)), "unaligned page count");
+  CHECK(!HVM_SUCCESS(EPTDirtyLogHarvest(bitmap, EPT_DIRTY_LOG_PAGES, EPT_DIRTY_LOG_GRANULE)), "range past the end");
+  CHECK(!HVM_SUCCESS(EPTDirtyLogHarvest(bitmap, EPT_DIRTY_LOG_GRANULE, 0xfffffe00)), "range wrapping around");
+  CHECK(HVM_SUCCESS(EPTDirtyLogHarvest(bitmap, EPT_DIRTY_LOG_PAGES - EPT_DIRTY_LOG_GRANULE, EPT_DIRTY_LOG_GRANULE)), "last granule");
+  EPTDirtyLogStop();
+}
+
+int main(void)
+{
+  SimInit(FALSE);
+  SimForEachLeaf(CheckLeaf);
+  initial_huge = leaf_huge;
+  CHECK(initial_huge > 0, "no 1GB pages in the map");
+
+  /* Write protection */
+  TestStartStop(FALSE);
+  TestFirstWrite();
+  TestHarvest("write protection", FALSE);
+  TestArguments();
+
+  /* Dirty flags */
+  EPTAccessDirty = TRUE;
+  TestStartStop(TRUE);
+  TestHarvest("dirty flags", TRUE);
+
+  CHECK(freeze_count == thaw_count, "%d SmpFreezeOthers(), %d SmpThawOthers()", freeze_count, thaw_count);
+
+  TEST_RESULT("test_dirtylog");
+}
@@ -0,0 +1,217 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+/* INVEPTs issued by the EPT batch API, counted over an identity map built in
+   host memory: every batch, however nested and however many pages it
+   changes, must end with exactly one INVEPT, and only if something
+   changed */
+
+#include "test.h"
+#include "ept.c"
+#include "ept_sim.h"
+
+/* #### CHECKS #### */
+
+/* INVEPTs issued by the statement, besides the ones that reclaimed retired
+   tables (see EPTReclaimTables()) */
+#define INVEPTS(stmt)							\
+  ({									\
+    Bit32u __i = invept_count, __f = freeze_count;			\
+    stmt;								\
+    (invept_count - __i) - (freeze_count - __f);			\
+  })
+
+static void CheckPerms(const char *name, hvm_address first, Bit32u npages, Bit8u perms)
+{
+  Bit32u i, pte;
+
+  for (i = 0; i < npages; i++) {
+    pte = *(Bit32u *) EPTGetEntry(first + PAGE(i));
+    CHECK((pte & EPT_PERMS) == perms, "%s: page %08llx has perms %x, expected %x",
+	  name, (Bit64u) first + PAGE(i), pte & EPT_PERMS, perms);
+    if ((pte & EPT_PERMS) != perms)
+      return;
+  }
+}
+
+static void CheckGeneration(const char *name, Bit32u generation, Bit32u n)
+{
+  CHECK(EPTGeneration - generation == n, "%s: EPTGeneration moved by %d, expected %d",
+	name, EPTGeneration - generation, n);
+}
+
+/* #### TESTS #### */
+
+static void TestSingleChange(void)
+{
+  Bit32u n, g;
+
+  g = EPTGeneration;
+  n = INVEPTS(EPTAlterPT(PAGE(0x1234), WRITE, TRUE));
+  CHECK(n == 1, "single page: %d INVEPTs", n);
+  CheckPerms("single page", PAGE(0x1234), 1, READ | EXEC);
+  CheckGeneration("single page", g, 1);
+
+  n = INVEPTS(EPTAlterPT(PAGE(0x1234), WRITE, TRUE));
+  CHECK(n == 0, "unchanged page: %d INVEPTs", n);
+
+  n = INVEPTS(EPTAlterPT(PAGE(0x1234), READ | WRITE | EXEC, FALSE));
+  CHECK(n == 1, "page restored: %d INVEPTs", n);
+  CheckPerms("page restored", PAGE(0x1234), 1, READ | WRITE | EXEC);
+}
+
+/* Ranges across 2MB and 1GB boundaries, and through the UC hole */
+static void TestRanges(void)
+{
+  static const struct {
+    hvm_address base;
+    Bit32u size;
+  } r[] = {
+    { 0x00000000, 0x00400000 },
+    { 0x001ff800, 0x00001000 },	/* Two pages, across 2MB */
+    { 0x3ff00000, 0x00200000 },	/* Across 1GB */
+    { 0xbfe00000, 0x00400000 },
+    { 0xfdfff000, 0x00002000 },	/* Into the UC top */
+    { 0xfffff000, 0x00001000 },
+  };
+  Bit32u i, n, g;
+
+  for (i = 0; i < sizeof(r)/sizeof(r[0]); i++) {
+    g = EPTGeneration;
+    n = INVEPTS(CHECK(HVM_SUCCESS(EPTAlterPhysicalRange(r[i].base, r[i].size, WRITE | EXEC, TRUE)),
+		      "range %d not changed", i));
+    CHECK(n == 1, "range %d: %d INVEPTs", i, n);
+    CheckGeneration("range", g, 1);
+    CheckPerms("range", r[i].base & ~0xfff, (r[i].size + (r[i].base & 0xfff) + 0xfff) >> 12, READ);
+
+    n = INVEPTS(EPTAlterPhysicalRange(r[i].base, r[i].size, WRITE | EXEC, TRUE));
+    CHECK(n == 0, "range %d unchanged: %d INVEPTs", i, n);
+
+    n = INVEPTS(EPTAlterPhysicalRange(r[i].base, r[i].size, READ | WRITE | EXEC, FALSE));
+    CHECK(n == 1, "range %d restored: %d INVEPTs", i, n);
+    CheckPerms("range restored", r[i].base & ~0xfff, (r[i].size + (r[i].base & 0xfff) + 0xfff) >> 12, READ | WRITE | EXEC);
+  }
+
+  n = INVEPTS(EPTAlterPhysicalRange(0x1000, 0, WRITE, TRUE));
+  CHECK(n == 0, "empty range: %d INVEPTs", n);
+}
+
+/* Nested batches flush once, when the outermost one is committed */
+static void TestNestedBatches(void)
+{
+  Bit32u n, before, g;
+
+  g = EPTGeneration;
+  before = invept_count - freeze_count;
+
+  EPTBeginBatch();
+  EPTAlterPhysicalRange(0x10000000, 0x10000, WRITE, TRUE);
+  EPTBeginBatch();
+  EPTAlterPhysicalRange(0x20000000, 0x10000, WRITE, TRUE);
+  EPTAlterPT(0x30000000, EXEC, TRUE);
+  EPTCommitBatch();
+  EPTAlterVirtualRange(0, 0x40000000, 0x3000, WRITE, TRUE);
+
+  n = invept_count - freeze_count - before;
+  CHECK(n == 0, "nested batches: %d INVEPTs before the outer commit", n);
+  CheckGeneration("nested batches", g, 0);
+
+  EPTCommitBatch();
+  n = invept_count - freeze_count - before;
+  CHECK(n == 1, "nested batches: %d INVEPTs", n);
+  CheckGeneration("nested batches", g, 1);
+
+  /* Unbalanced commit */
+  n = INVEPTS(EPTCommitBatch());
+  CHECK(n == 0, "unbalanced commit: %d INVEPTs", n);
+
+  n = INVEPTS(EPTBeginBatch(); EPTCommitBatch());
+  CHECK(n == 0, "empty batch: %d INVEPTs", n);
+
+  n = INVEPTS(EPTAlterVirtualRange(0, 0x40000000, 0x3000, READ | WRITE | EXEC, FALSE));
+  CHECK(n == 1, "virtual range: %d INVEPTs", n);
+  CheckPerms("virtual range", 0x40000000, 3, READ | WRITE | EXEC);
+
+  EPTBeginBatch();
+  EPTAlterPhysicalRange(0x10000000, 0x10000, READ | WRITE | EXEC, FALSE);
+  EPTAlterPhysicalRange(0x20000000, 0x10000, READ | WRITE | EXEC, FALSE);
+  EPTAlterPT(0x30000000, READ | WRITE | EXEC, FALSE);
+  EPTCommitBatch();
+}
+
+/* A page in every 2MB region, until the pool runs out: the batch fails,
+   but still flushes the changes made before the failure. Restoring the
+   pages merges the regions back, and the tables can be used again */
+static void TestPoolExhaustion(void)
+{
+  Bit32u i, n, done, cycle;
+  hvm_status r;
+
+  for (cycle = 0; cycle < 3; cycle++) {
+    n = invept_count - freeze_count;
+    r = HVM_STATUS_SUCCESS;
+    EPTBeginBatch();
+    for (done = 0; done < HOST_GB*512 && HVM_SUCCESS(r); done++)
+      r = EPTAlterPT((hvm_address) done << 21, WRITE, TRUE);
+    EPTCommitBatch();
+    n = invept_count - freeze_count - n;
+
+    CHECK(!HVM_SUCCESS(r), "cycle %d: pool not exhausted", cycle);
+    CHECK(done > EPT_TABLE_POOL, "cycle %d: only %d regions split", cycle, done);
+    CHECK(n == 1, "cycle %d: %d INVEPTs", cycle, n);
+
+    n = invept_count - freeze_count;
+    EPTBeginBatch();
+    for (i = 0; i < done; i++)
+      EPTAlterPT((hvm_address) i << 21, READ | WRITE | EXEC, FALSE);
+    EPTCommitBatch();
+    n = invept_count - freeze_count - n;
+    CHECK(n == 1, "cycle %d restored: %d INVEPTs", cycle, n);
+
+    for (i = 0; i < HOST_GB; i++) {
+      if (huge_types[i] != EPT_TYPE_MIXED)
+	CHECK(!VIRT_PD_BASES[i] && (*(Bit32u *) (VIRT_PDPT + i*8) & EPT_LARGE_PAGE),
+	      "cycle %d: 1GB region %d not merged", cycle, i);
+    }
+  }
+
+  CHECK(freeze_count == thaw_count, "%d SmpFreezeOthers(), %d SmpThawOthers()", freeze_count, thaw_count);
+  CHECK(freeze_count > 0, "retired tables never reclaimed");
+}
+
+int main(void)
+{
+  SimInit(FALSE);
+
+  CHECK(!(*(Bit32u *) (VIRT_PDPT + 3*8) & EPT_LARGE_PAGE), "last 1GB region not split");
+  CHECK(!(*(Bit32u *) VIRT_PD_BASES[0] & EPT_LARGE_PAGE), "first 2MB region not split");
+  CHECK(invept_count == 0, "%d INVEPTs while building the map", invept_count);
+
+  TestSingleChange();
+  TestRanges();
+  TestNestedBatches();
+  TestPoolExhaustion();
+
+  TEST_RESULT("test_ept_batch");
+}
@@ -0,0 +1,270 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+/* Guest translation cache of mmu.c: hits, large pages, separate address
+   spaces, eviction, flushes and the wrap-around of the generation counter,
+   checked against a walk of synthetic page tables */
+
+#include "test.h"
+#include "mmu.c"
+#include "mmu_sim.h"
+
+#define VA(n) ((hvm_address) 0x08000000 + (n)*MMU_PAGE_SIZE)
+
+static Bit32u seed = 12345;
+
+static Bit32u Random(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+/* Translate va through the cache and compare with the page tables */
+static void CheckTranslation(const char *name, hvm_address cr3, hvm_address va)
+{
+  hvm_phy_address phy, expected;
+  hvm_bool valid;
+  hvm_status r;
+
+  valid = SimTranslate(cr3, va, &expected);
+  r = MmuGetPhysicalAddress(cr3, va, &phy);
+
+  CHECK((r == HVM_STATUS_SUCCESS) == valid, "%s: cr3 %08lx va %08lx: valid %d, expected %d",
+	name, (unsigned long) cr3, (unsigned long) va, r == HVM_STATUS_SUCCESS, valid);
+  if (r == HVM_STATUS_SUCCESS && valid)
+    CHECK(phy == expected, "%s: cr3 %08lx va %08lx: phy %08llx, expected %08llx",
+	  name, (unsigned long) cr3, (unsigned long) va, (unsigned long long) phy, (unsigned long long) expected);
+}
+
+static MMU_STATS Stats(void)
+{
+  MMU_STATS s;
+
+  MmuGetStats(&s);
+  return s;
+}
+
+/* #### TESTS #### */
+
+/* The second translation of a page is a hit, and reads no page table */
+static void TestHits(void)
+{
+  MMU_STATS s0, s1;
+  hvm_address cr3;
+  Bit32u i;
+
+  cr3 = SimNewPD();
+  for (i = 0; i < 32; i++)
+    SimMap(cr3, VA(i), SimAllocFrame());
+
+  MmuGuestTLBSetEnabled(TRUE);
+
+  s0 = Stats();
+  for (i = 0; i < 32; i++)
+    CheckTranslation("first", cr3, VA(i) + i);
+  s1 = Stats();
+  CHECK(s1.gtlb_misses - s0.gtlb_misses == 32 && s1.gtlb_hits == s0.gtlb_hits,
+	"first: %d misses, %d hits", s1.gtlb_misses - s0.gtlb_misses, s1.gtlb_hits - s0.gtlb_hits);
+
+  s0 = Stats();
+  for (i = 0; i < 32; i++)
+    CheckTranslation("second", cr3, VA(i) + 0xfff - i);
+  s1 = Stats();
+  CHECK(s1.gtlb_hits - s0.gtlb_hits == 32 && s1.gtlb_misses == s0.gtlb_misses && s1.maps == s0.maps,
+	"second: %d hits, %d misses, %d maps", s1.gtlb_hits - s0.gtlb_hits,
+	s1.gtlb_misses - s0.gtlb_misses, s1.maps - s0.maps);
+
+  /* Unmapped pages are not cached */
+  s0 = Stats();
+  CheckTranslation("not present", cr3, VA(100));
+  CheckTranslation("not present", cr3, VA(100));
+  s1 = Stats();
+  CHECK(s1.gtlb_misses - s0.gtlb_misses == 2, "not present: %d misses", s1.gtlb_misses - s0.gtlb_misses);
+
+  MmuGuestTLBSetEnabled(FALSE);
+}
+
+/* Any page of a large page hits the entry of the large page */
+static void TestLargePages(void)
+{
+  MMU_STATS s0, s1;
+  hvm_address cr3, va;
+  Bit32u i;
+
+  cr3 = SimNewPD();
+  SimMapLarge(cr3, 0x40000000, 0x00800000);
+  SimMap(cr3, 0x40400000, SimAllocFrame());
+
+  MmuGuestTLBSetEnabled(TRUE);
+
+  CheckTranslation("large", cr3, 0x40000000);
+  s0 = Stats();
+  for (i = 0; i < 64; i++) {
+    va = 0x40000000 + (Random() & (LARGEPAGE_SIZE - 1));
+    CheckTranslation("large", cr3, va);
+  }
+  s1 = Stats();
+  CHECK(s1.gtlb_large_hits - s0.gtlb_large_hits == 64 && s1.gtlb_misses == s0.gtlb_misses,
+	"large: %d large hits, %d misses", s1.gtlb_large_hits - s0.gtlb_large_hits, s1.gtlb_misses - s0.gtlb_misses);
+
+  /* The next 4MB are small pages */
+  CheckTranslation("small after large", cr3, 0x40400000);
+  CheckTranslation("small after large", cr3, 0x40401000);
+
+  MmuGuestTLBSetEnabled(FALSE);
+}
+
+/* The same address in two address spaces, whose entries fall in the same
+   sets */
+static void TestAddressSpaces(void)
+{
+  hvm_address cr3[2];
+  Bit32u i;
+
+  cr3[0] = SimNewPD();
+  while (simframes % MMU_GTLB_SETS != PHY_TO_FRAME(cr3[0]) % MMU_GTLB_SETS)
+    SimAllocFrame();
+  cr3[1] = SimNewPD();
+  CHECK(MMU_GTLB_SET(cr3[0], VA(0)) == MMU_GTLB_SET(cr3[1], VA(0)), "address spaces: different sets");
+
+  for (i = 0; i < 16; i++) {
+    SimMap(cr3[0], VA(i), SimAllocFrame());
+    SimMap(cr3[1], VA(i), SimAllocFrame());
+  }
+  SimMapLarge(cr3[0], 0x80000000, 0x01000000);
+  SimMap(cr3[1], 0x80000000, SimAllocFrame());
+
+  MmuGuestTLBSetEnabled(TRUE);
+  for (i = 0; i < 64; i++) {
+    CheckTranslation("address spaces", cr3[i & 1], VA(i % 16));
+    CheckTranslation("address spaces", cr3[i & 1], 0x80000000);
+  }
+  MmuGuestTLBSetEnabled(FALSE);
+}
+
+/* Many more pages than entries: evicted entries are walked again */
+static void TestEviction(void)
+{
+  MMU_STATS s0, s1;
+  hvm_address cr3;
+  Bit32u i, n;
+
+  n = 4 * MMU_GTLB_SETS * MMU_GTLB_WAYS;
+  cr3 = SimNewPD();
+  for (i = 0; i < n; i++)
+    SimMap(cr3, VA(i), (i % 7) ? SimAllocFrame() : 1);
+
+  MmuGuestTLBSetEnabled(TRUE);
+  for (i = 0; i < 8*n; i++)
+    CheckTranslation("eviction", cr3, VA(Random() % n));
+
+  /* Pages of the same set, one more than the ways: round-robin eviction */
+  s0 = Stats();
+  for (i = 0; i < 4*(MMU_GTLB_WAYS + 1); i++)
+    CheckTranslation("same set", cr3, VA((i % (MMU_GTLB_WAYS + 1)) * MMU_GTLB_SETS));
+  s1 = Stats();
+  CHECK(s1.gtlb_misses > s0.gtlb_misses, "same set: no evictions");
+  MmuGuestTLBSetEnabled(FALSE);
+}
+
+/* Changed page tables are seen once the cache is flushed (resuming the
+   guest flushes it too) */
+static void TestFlush(void)
+{
+  hvm_address cr3;
+  hvm_phy_address phy;
+  Bit32u frame;
+
+  cr3 = SimNewPD();
+  SimMap(cr3, VA(0), SimAllocFrame());
+
+  MmuGuestTLBSetEnabled(TRUE);
+  CheckTranslation("flush", cr3, VA(0));
+
+  frame = SimAllocFrame();
+  SimMap(cr3, VA(0), frame);
+  MmuGetPhysicalAddress(cr3, VA(0), &phy);
+  CHECK(phy != FRAME_TO_PHY((hvm_phy_address) frame), "flush: new PTE seen before the flush");
+
+  MmuGuestTLBFlush();
+  CheckTranslation("flush", cr3, VA(0));
+
+  SimUnmap(cr3, VA(0));
+  MmuGuestTLBSetEnabled(FALSE);
+  MmuGuestTLBSetEnabled(TRUE);
+  CheckTranslation("resume", cr3, VA(0));
+  MmuGuestTLBSetEnabled(FALSE);
+
+  /* Disabled: every translation walks the page tables */
+  SimMap(cr3, VA(0), frame);
+  CheckTranslation("disabled", cr3, VA(0));
+  SimMap(cr3, VA(0), SimAllocFrame());
+  CheckTranslation("disabled", cr3, VA(0));
+}
+
+/* After 2^32 flushes the generation wraps: entries inserted 2^32 flushes
+   earlier must not become valid again */
+static void TestGenerationWrap(void)
+{
+  hvm_address cr3;
+  Bit32u i;
+
+  cr3 = SimNewPD();
+  for (i = 0; i < 16; i++)
+    SimMap(cr3, VA(i), SimAllocFrame());
+
+  MmuGuestTLBSetEnabled(TRUE);
+
+  gtlb_generation = 1;
+  for (i = 0; i < 16; i++)
+    CheckTranslation("before wrap", cr3, VA(i));
+
+  gtlb_generation = 0xfffffffe;
+  MmuGuestTLBFlush();
+  MmuGuestTLBFlush();
+  CHECK(gtlb_generation == 1, "generation %u after the wrap", gtlb_generation);
+
+  for (i = 0; i < 16; i++)
+    SimMap(cr3, VA(i), SimAllocFrame());
+  for (i = 0; i < 16; i++)
+    CheckTranslation("after wrap", cr3, VA(i));
+  for (i = 0; i < 16; i++)
+    CheckTranslation("after wrap, cached", cr3, VA(i));
+
+  MmuGuestTLBSetEnabled(FALSE);
+}
+
+int main(void)
+{
+  SimInit();
+
+  TestHits();
+  TestLargePages();
+  TestAddressSpaces();
+  TestEviction();
+  TestFlush();
+  TestGenerationWrap();
+
+  TEST_RESULT("test_gtlb");
+}
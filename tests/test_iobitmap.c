@@ -0,0 +1,228 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+/* I/O bitmaps filled by EventUpdateIOBitmaps() from port range
+   subscriptions, compared with the bitmaps built one port at a time */
+
+#include "test.h"
+#include "events.c"
+
+/* #### STUBS #### */
+
+void CmSetBit32(Bit32u* dword, Bit32u bit)
+{
+  *dword |= 1 << bit;
+}
+
+static EVENT_PUBLISH_STATUS IoCallback(PEVENT_ARGUMENTS args)
+{
+  return EventPublishPass;
+}
+
+/* #### REFERENCE #### */
+
+#define BITMAP_SIZE (IO_BITMAP_PORTS / 8)
+#define GUARD       64		/* Bytes checked around each bitmap */
+#define GUARD_BYTE  0x5a
+
+static Bit8u  bitmaps[2][GUARD + BITMAP_SIZE + GUARD];
+static Bit8u  expected[N_IO_PORTS / 8];
+static Bit32u subscribed[N_IO_PORTS];	/* Subscriptions covering each port */
+
+#define IS_SET(bitmap, n) (((bitmap)[(n) / 8] >> ((n) & 7)) & 1)
+
+static void ResetBitmaps(void)
+{
+  vmm_memset(bitmaps, GUARD_BYTE, sizeof(bitmaps));
+  vmm_memset(&bitmaps[0][GUARD], 0, BITMAP_SIZE);
+  vmm_memset(&bitmaps[1][GUARD], 0, BITMAP_SIZE);
+}
+
+/* Compare the bitmaps with the reference: one bit for each port with at
+   least one subscriber, and the guard bytes untouched */
+static void CheckBitmaps(const char *name)
+{
+  Bit32u port, i;
+  Bit8u *a, *b;
+
+  a = &bitmaps[0][GUARD];
+  b = &bitmaps[1][GUARD];
+  for (port = 0; port < N_IO_PORTS; port++) {
+    if (port < IO_BITMAP_PORTS) {
+      CHECK(IS_SET(a, port) == (subscribed[port] != 0), "%s: port %04x in bitmap A", name, port);
+    } else {
+      CHECK(IS_SET(b, port - IO_BITMAP_PORTS) == (subscribed[port] != 0), "%s: port %04x in bitmap B", name, port);
+    }
+
+    if (test_failures > 16)
+      return;
+  }
+
+  for (i = 0; i < GUARD; i++) {
+    CHECK(bitmaps[0][i] == GUARD_BYTE && bitmaps[0][GUARD + BITMAP_SIZE + i] == GUARD_BYTE,
+	  "%s: write out of bitmap A", name);
+    CHECK(bitmaps[1][i] == GUARD_BYTE && bitmaps[1][GUARD + BITMAP_SIZE + i] == GUARD_BYTE,
+	  "%s: write out of bitmap B", name);
+  }
+}
+
+static void Update(const char *name)
+{
+  ResetBitmaps();
+  EventUpdateIOBitmaps(&bitmaps[0][GUARD], &bitmaps[1][GUARD]);
+  CheckBitmaps(name);
+}
+
+static hvm_bool Subscribe(Bit32u portnum, Bit32u portcount)
+{
+  EVENT_CONDITION_IO io;
+  Bit32u i, n;
+
+  io.direction = EventIODirectionBoth;
+  io.portnum   = portnum;
+  io.portcount = portcount;
+  if (!EventSubscribe(EventIO, &io, sizeof(io), IoCallback))
+    return FALSE;
+
+  n = portcount ? portcount : 1;
+  for (i = 0; i < n; i++)
+    subscribed[portnum + i]++;
+
+  return TRUE;
+}
+
+static void Unsubscribe(Bit32u portnum, Bit32u portcount)
+{
+  EVENT_CONDITION_IO io;
+  Bit32u i, n;
+
+  io.direction = EventIODirectionBoth;
+  io.portnum   = portnum;
+  io.portcount = portcount;
+  CHECK(EventUnsubscribe(EventIO, &io, sizeof(io)), "unsubscribe %04x+%d", portnum, portcount);
+
+  n = portcount ? portcount : 1;
+  for (i = 0; i < n; i++)
+    subscribed[portnum + i]--;
+}
+
+static void Reset(void)
+{
+  EventInit();
+  vmm_memset(subscribed, 0, sizeof(subscribed));
+}
+
+/* #### TESTS #### */
+
+/* Every alignment of the first and last bit of a short range */
+static void TestSetBitRange(void)
+{
+  Bit32u first, count, i;
+  Bit8u *b;
+
+  b = &bitmaps[0][GUARD];
+  for (first = 0; first < 40; first++) {
+    for (count = 0; count < 80; count++) {
+      ResetBitmaps();
+      EventSetBitRange(b, first, count);
+
+      vmm_memset(expected, 0, 32);
+      for (i = first; i < first + count; i++)
+	expected[i / 8] |= 1 << (i & 7);
+
+      CHECK(vmm_memcmp(b, expected, 32) == 0 && b[32] == 0, "bits %d+%d", first, count);
+      for (i = 0; i < GUARD; i++)
+	CHECK(bitmaps[0][i] == GUARD_BYTE, "bits %d+%d: write before the bitmap", first, count);
+    }
+  }
+}
+
+static void TestBoundaries(void)
+{
+  Reset();
+  Update("no subscribers");
+
+  Subscribe(0x0000, 0);		/* portcount 0 is a single port */
+  Subscribe(0x0060, 1);
+  Subscribe(0x7fff, 1);
+  Subscribe(0x8000, 1);
+  Subscribe(0xffff, 0);
+  Update("single ports");
+
+  Reset();
+  Subscribe(0x7ff9, 16);	/* Across the two bitmaps */
+  Subscribe(0x0001, 0x7fff);	/* Up to the end of bitmap A */
+  Subscribe(0x8000, 0x8000);	/* The whole bitmap B */
+  Update("bitmap edges");
+
+  Reset();
+  Subscribe(0x0000, N_IO_PORTS);
+  Update("all ports");
+
+  Reset();
+  CHECK(!Subscribe(0xfff0, 0x20), "range past port 0xffff accepted");
+  CHECK(!Subscribe(0x10000, 1), "port 0x10000 accepted");
+  Update("rejected ranges");
+}
+
+/* Random overlapping ranges, then half of them removed */
+static void TestRandomRanges(void)
+{
+  Bit32u seed, i, n, portnum[256], portcount[256];
+
+  Reset();
+  seed = 12345;
+  n = 0;
+  for (i = 0; i < 256; i++) {
+    seed = seed * 1103515245 + 12345;
+    portnum[n] = (seed >> 8) & 0xffff;
+    seed = seed * 1103515245 + 12345;
+    switch ((seed >> 16) & 3) {
+    case 0:  portcount[n] = 0; break;
+    case 1:  portcount[n] = (seed >> 20) & 0xf; break;
+    case 2:  portcount[n] = (seed >> 20) & 0x3ff; break;
+    default: portcount[n] = (seed >> 12) & 0xffff; break;
+    }
+
+    if (portcount[n] > N_IO_PORTS - portnum[n])
+      portcount[n] = N_IO_PORTS - portnum[n];
+
+    if (Subscribe(portnum[n], portcount[n]))
+      n++;
+  }
+  Update("random ranges");
+
+  for (i = 0; i < n; i += 2)
+    Unsubscribe(portnum[i], portcount[i]);
+  Update("random ranges, half removed");
+}
+
+int main(void)
+{
+  TestSetBitRange();
+  TestBoundaries();
+  TestRandomRanges();
+
+  TEST_RESULT("test_iobitmap");
+}
@@ -0,0 +1,287 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+/* Vectored virtual memory accesses of mmu.c: chunks are merged into
+   physically contiguous runs only when their buffers are contiguous too,
+   runs never overflow the mapping window, and a busy window falls back to
+   page-sized copies */
+
+#include "test.h"
+#include "mmu.c"
+#include "mmu_sim.h"
+
+#define CONTIG   0x10000000	/* 64 pages, physically contiguous */
+#define SCATTER  0x20000000	/* 64 pages, no two of them adjacent */
+#define LARGE    0x40000000	/* A large page */
+#define HOLE     0x30000000	/* 2 pages, the second one not present */
+
+#define DATA     0x00200000	/* Guest data; page tables are below */
+
+static hvm_address cr3;
+static Bit8u buffer[2 << 20], expected[2 << 20];
+
+/* Fill guest data with a pattern that tells pages and offsets apart */
+static void FillPhys(void)
+{
+  Bit32u i;
+
+  for (i = DATA / 4; i < SIM_PHYS_SIZE / 4; i++)
+    ((Bit32u*) phys)[i] = i * 0x9e3779b1;
+}
+
+static void Reference(hvm_address va, Bit8u* p, Bit32u size)
+{
+  hvm_phy_address phy;
+  Bit32u n;
+
+  while (size > 0) {
+    n = MIN(size, MMU_PAGE_SIZE - MMU_PAGE_OFFSET(va));
+    if (!SimTranslate(cr3, va, &phy)) {
+      printf("reference: %08lx not mapped\n", (unsigned long) va);
+      exit(1);
+    }
+    vmm_memcpy(p, phys + phy, n);
+    va += n;
+    p += n;
+    size -= n;
+  }
+}
+
+static void SetupGuest(void)
+{
+  Bit32u i, frame;
+
+  cr3 = SimNewPD();
+
+  frame = PHY_TO_FRAME((hvm_phy_address) DATA);
+  for (i = 0; i < 64; i++)
+    SimMap(cr3, CONTIG + i*MMU_PAGE_SIZE, frame + i);
+
+  frame = PHY_TO_FRAME((hvm_phy_address) 0x00400000);
+  for (i = 0; i < 64; i++)
+    SimMap(cr3, SCATTER + i*MMU_PAGE_SIZE, frame + 2*(63 - i));
+
+  SimMapLarge(cr3, LARGE, 0x00800000);
+
+  SimMap(cr3, HOLE, PHY_TO_FRAME((hvm_phy_address) 0x00c00000));
+  SimMap(cr3, HOLE + MMU_PAGE_SIZE, PHY_TO_FRAME((hvm_phy_address) 0x00c01000));
+  SimUnmap(cr3, HOLE + MMU_PAGE_SIZE);
+
+  FillPhys();
+}
+
+static MMU_STATS Stats(void)
+{
+  MMU_STATS s;
+
+  MmuGetStats(&s);
+  return s;
+}
+
+/* Every slot and window PTE is back to its original value */
+static void CheckRestored(const char *name)
+{
+  Bit32u i;
+
+  for (i = 0; i < SIM_PAGES; i++)
+    CHECK(!simptes[i].Present, "%s: PTE %d left mapped", name, i);
+  CHECK(!mapsets[MMU_MAP_GUEST_SET].window_busy, "%s: window left busy", name);
+  for (i = 0; i < MMU_MAP_SLOTS; i++)
+    CHECK(!mapsets[MMU_MAP_GUEST_SET].slots[i].busy, "%s: slot %d left busy", name, i);
+}
+
+/* Read a vector, compare each element with the page tables, and return the
+   number of runs */
+static Bit32u ReadVector(const char *name, PMMU_IOVEC iov, Bit32u n)
+{
+  MMU_STATS s0, s1;
+  hvm_status r;
+  Bit32u i;
+
+  for (i = 0; i < n; i++)
+    vmm_memset(iov[i].buffer, 0xcc, iov[i].size);
+
+  s0 = Stats();
+  r = MmuReadVirtualVector(cr3, iov, n);
+  s1 = Stats();
+
+  CHECK(r == HVM_STATUS_SUCCESS, "%s: read failed", name);
+  for (i = 0; i < n; i++) {
+    Reference(iov[i].va, expected, iov[i].size);
+    CHECK(vmm_memcmp(iov[i].buffer, expected, iov[i].size) == 0, "%s: element %d differs", name, i);
+  }
+  CheckRestored(name);
+
+  CHECK(s1.run_pages - s0.run_pages <= (s1.runs - s0.runs) * MMU_MAP_WINDOW_PAGES,
+	"%s: %d pages in %d runs", name, s1.run_pages - s0.run_pages, s1.runs - s0.runs);
+
+  return s1.runs - s0.runs;
+}
+
+/* #### TESTS #### */
+
+static void TestContiguous(void)
+{
+  MMU_IOVEC iov[4];
+  Bit32u runs;
+
+  /* Two pages: one run */
+  iov[0].va = CONTIG + 0x100; iov[0].buffer = buffer; iov[0].size = 2*MMU_PAGE_SIZE - 0x200;
+  runs = ReadVector("two pages", iov, 1);
+  CHECK(runs == 1, "two pages: %d runs", runs);
+
+  /* Adjacent fields read into adjacent buffers: merged */
+  iov[0].va = CONTIG + 0x0ff0; iov[0].buffer = buffer;        iov[0].size = 0x10;
+  iov[1].va = CONTIG + 0x1000; iov[1].buffer = buffer + 0x10; iov[1].size = 0x20;
+  runs = ReadVector("adjacent fields", iov, 2);
+  CHECK(runs == 1, "adjacent fields: %d runs", runs);
+
+  /* A single page is copied through a slot */
+  iov[0].va = CONTIG + 0x3000; iov[0].buffer = buffer; iov[0].size = 0x800;
+  runs = ReadVector("single page", iov, 1);
+  CHECK(runs == 0, "single page: %d runs", runs);
+
+  /* Inside a large page */
+  iov[0].va = LARGE + 0x1234; iov[0].buffer = buffer; iov[0].size = 8*MMU_PAGE_SIZE;
+  runs = ReadVector("large page", iov, 1);
+  CHECK(runs == 1, "large page: %d runs", runs);
+}
+
+/* Physically contiguous chunks, whose buffers are not */
+static void TestBufferDiscontiguity(void)
+{
+  MMU_IOVEC iov[2];
+  Bit32u runs;
+
+  iov[0].va = CONTIG;                 iov[0].buffer = buffer;            iov[0].size = 2*MMU_PAGE_SIZE;
+  iov[1].va = CONTIG + 2*MMU_PAGE_SIZE; iov[1].buffer = buffer + 0x10000; iov[1].size = 2*MMU_PAGE_SIZE;
+  runs = ReadVector("buffer gap", iov, 2);
+  CHECK(runs == 2, "buffer gap: %d runs", runs);
+
+  /* Backwards in the buffer */
+  iov[0].buffer = buffer + 2*MMU_PAGE_SIZE;
+  iov[1].buffer = buffer;
+  runs = ReadVector("buffer backwards", iov, 2);
+  CHECK(runs == 2, "buffer backwards: %d runs", runs);
+
+  /* Contiguous buffer, scattered frames: nothing to merge */
+  iov[0].va = SCATTER; iov[0].buffer = buffer; iov[0].size = 16*MMU_PAGE_SIZE;
+  runs = ReadVector("scattered frames", iov, 1);
+  CHECK(runs == 0, "scattered frames: %d runs", runs);
+}
+
+/* Runs longer than the window are split */
+static void TestWindowOverflow(void)
+{
+  MMU_IOVEC iov[1];
+  Bit32u runs;
+
+  iov[0].va = CONTIG; iov[0].buffer = buffer; iov[0].size = MMU_MAP_WINDOW_PAGES*MMU_PAGE_SIZE;
+  runs = ReadVector("full window", iov, 1);
+  CHECK(runs == 1, "full window: %d runs", runs);
+
+  /* One byte more, at the end or at the beginning */
+  iov[0].size++;
+  runs = ReadVector("window + 1", iov, 1);
+  CHECK(runs == 1, "window + 1: %d runs", runs);
+
+  iov[0].va = CONTIG + MMU_PAGE_SIZE - 1;
+  runs = ReadVector("offset window", iov, 1);
+  CHECK(runs == 1, "offset window: %d runs", runs);
+
+  iov[0].va = CONTIG + 0x123; iov[0].size = 64*MMU_PAGE_SIZE - 0x200;
+  runs = ReadVector("64 pages", iov, 1);
+  CHECK(runs == 4, "64 pages: %d runs", runs);
+}
+
+/* A busy window: page-sized copies through the slots */
+static void TestWindowBusy(void)
+{
+  MMU_IOVEC iov[1];
+  MMU_STATS s0, s1;
+  hvm_status r;
+
+  mapsets[MMU_MAP_GUEST_SET].window_busy = TRUE;
+
+  s0 = Stats();
+  iov[0].va = CONTIG + 0x80; iov[0].buffer = buffer; iov[0].size = 8*MMU_PAGE_SIZE;
+  r = MmuReadVirtualVector(cr3, iov, 1);
+  s1 = Stats();
+
+  Reference(iov[0].va, expected, iov[0].size);
+  CHECK(r == HVM_STATUS_SUCCESS && vmm_memcmp(buffer, expected, iov[0].size) == 0, "busy window: wrong data");
+  /* 9 pages, each copied and translated (PDE and PTE) on its own */
+  CHECK(s1.runs == s0.runs && s1.maps - s0.maps == 3*9, "busy window: %d runs, %d maps",
+	s1.runs - s0.runs, s1.maps - s0.maps);
+  CHECK(mapsets[MMU_MAP_GUEST_SET].window_busy, "busy window: released by someone else");
+
+  mapsets[MMU_MAP_GUEST_SET].window_busy = FALSE;
+  CheckRestored("busy window");
+}
+
+static void TestWrite(void)
+{
+  MMU_IOVEC iov[2];
+  Bit32u i;
+
+  for (i = 0; i < 8*MMU_PAGE_SIZE; i++)
+    buffer[i] = i * 7;
+
+  iov[0].va = CONTIG + 0x5800; iov[0].buffer = buffer;                 iov[0].size = 4*MMU_PAGE_SIZE;
+  iov[1].va = SCATTER + 0x10;  iov[1].buffer = buffer + 4*MMU_PAGE_SIZE; iov[1].size = 4*MMU_PAGE_SIZE;
+  CHECK(MmuWriteVirtualVector(cr3, iov, 2) == HVM_STATUS_SUCCESS, "write failed");
+  CheckRestored("write");
+
+  for (i = 0; i < 2; i++) {
+    Reference(iov[i].va, expected, iov[i].size);
+    CHECK(vmm_memcmp(iov[i].buffer, expected, iov[i].size) == 0, "write: element %d differs", i);
+  }
+
+  FillPhys();
+}
+
+/* A page that is not present fails the whole access */
+static void TestNotPresent(void)
+{
+  MMU_IOVEC iov[1];
+
+  iov[0].va = HOLE + 0x800; iov[0].buffer = buffer; iov[0].size = MMU_PAGE_SIZE;
+  CHECK(MmuReadVirtualVector(cr3, iov, 1) != HVM_STATUS_SUCCESS, "not present: read succeeded");
+  CheckRestored("not present");
+}
+
+int main(void)
+{
+  SimInit();
+  SetupGuest();
+
+  TestContiguous();
+  TestBufferDiscontiguity();
+  TestWindowOverflow();
+  TestWindowBusy();
+  TestWrite();
+  TestNotPresent();
+
+  TEST_RESULT("test_mmu_vector");
+}
@@ -0,0 +1,377 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+/* Memory types computed by EPTInit() from a set of MTRRs, compared with the
+   type of each address computed straight from the MSRs */
+
+#include "test.h"
+#include "ept.c"
+
+/* #### FAKE MSRS #### */
+
+typedef struct {
+  Bit32u reg;
+  Bit64u value;
+} FAKE_MSR;
+
+static FAKE_MSR fake_msrs[128];
+static Bit32u   fake_msrs_count;
+
+static void MsrSet(Bit32u reg, Bit64u value)
+{
+  Bit32u i;
+
+  for (i = 0; i < fake_msrs_count; i++) {
+    if (fake_msrs[i].reg == reg)
+      break;
+  }
+  if (i == fake_msrs_count)
+    fake_msrs_count++;
+
+  fake_msrs[i].reg   = reg;
+  fake_msrs[i].value = value;
+}
+
+static Bit64u MsrGet(Bit32u reg)
+{
+  Bit32u i;
+
+  for (i = 0; i < fake_msrs_count; i++) {
+    if (fake_msrs[i].reg == reg)
+      return fake_msrs[i].value;
+  }
+
+  return 0;
+}
+
+void USESTACK ReadMSR(Bit32u reg, PMSR msr)
+{
+  Bit64u value;
+
+  value = MsrGet(reg);
+  msr->Lo = GET32L(value);
+  msr->Hi = GET32H(value);
+}
+
+/* #### STUBS #### */
+
+/* Not reached by EPTInit() and EPTGetMemoryType() */
+void USESTACK EptInvept(Bit32u eptp_high, Bit32u eptp_low, Bit32u rsvd_high, Bit32u rsvd_low) { abort(); }
+hvm_status MmuGetPhysicalAddress(hvm_address cr3, hvm_address va, hvm_phy_address* pphy) { abort(); }
+hvm_status MmuReadWritePhysicalRegion(hvm_phy_address phy, void* buffer, Bit32u size, hvm_bool isWrite) { abort(); }
+hvm_status MmuWalkVirtualRange(hvm_address cr3, hvm_address va, Bit32u size, MMU_PAGE_CALLBACK callback, void* arg) { abort(); }
+Bit32u RegGetCr3(void) { abort(); }
+Bit32u SmpCpuCount(void) { abort(); }
+void SmpFreezeOthers(void) { abort(); }
+void SmpThawOthers(void) { abort(); }
+void TraceRecord(PTRACE_SITE site, ...) { }
+
+/* #### MTRR CONFIGURATIONS #### */
+
+#define VCNT 32
+
+static void MtrrReset(Bit8u deftype, hvm_bool enabled, hvm_bool fixed)
+{
+  fake_msrs_count = 0;
+  MsrSet(MSR_IA32_MTRRCAP, IA32_MTRRCAP_FIX | IA32_MTRRCAP_WC | VCNT);
+  MsrSet(MSR_IA32_MTRR_DEF_TYPE, deftype |
+	 (enabled ? IA32_MTRR_DEF_TYPE_E : 0) |
+	 (fixed ? IA32_MTRR_DEF_TYPE_FE : 0));
+}
+
+/* size must be a power of 2, and base a multiple of it */
+static void MtrrVariable(Bit32u n, Bit64u base, Bit64u size, Bit8u type)
+{
+  MsrSet(MSR_IA32_MTRR_PHYSBASE(n), base | type);
+  MsrSet(MSR_IA32_MTRR_PHYSMASK(n), (~(size - 1) & 0x000ffffffffff000ULL) | IA32_MTRR_PHYMASK_VALID);
+}
+
+/* The 8 ranges of a fixed-range MTRR get types[0], ..., types[7] */
+static void MtrrFixed(Bit32u reg, const Bit8u types[8])
+{
+  Bit64u value;
+  int i;
+
+  value = 0;
+  for (i = 7; i >= 0; i--)
+    value = (value << 8) | types[i];
+
+  MsrSet(reg, value);
+}
+
+/* #### REFERENCE #### */
+
+/* First address, size of each of the 8 ranges and MSR of the fixed-range
+   MTRRs */
+static const struct {
+  Bit32u base;
+  Bit32u unit;
+  Bit32u reg;
+} fixed_msrs[] = {
+  { 0x00000, 0x10000, MSR_IA32_MTRR_FIX64K_00000 },
+  { 0x80000, 0x04000, MSR_IA32_MTRR_FIX16K_80000 },
+  { 0xa0000, 0x04000, MSR_IA32_MTRR_FIX16K_A0000 },
+  { 0xc0000, 0x01000, MSR_IA32_MTRR_FIX4K_C0000 },
+  { 0xc8000, 0x01000, MSR_IA32_MTRR_FIX4K_C8000 },
+  { 0xd0000, 0x01000, MSR_IA32_MTRR_FIX4K_D0000 },
+  { 0xd8000, 0x01000, MSR_IA32_MTRR_FIX4K_D8000 },
+  { 0xe0000, 0x01000, MSR_IA32_MTRR_FIX4K_E0000 },
+  { 0xe8000, 0x01000, MSR_IA32_MTRR_FIX4K_E8000 },
+  { 0xf0000, 0x01000, MSR_IA32_MTRR_FIX4K_F0000 },
+  { 0xf8000, 0x01000, MSR_IA32_MTRR_FIX4K_F8000 },
+};
+
+/* Memory type of address, decoded from the MSRs one range at a time */
+static Bit8u RefMemoryType(Bit64u address)
+{
+  Bit64u deftype, base, mask;
+  hvm_bool uc, wt, wb, other;
+  Bit8u type;
+  Bit32u i, n;
+
+  deftype = MsrGet(MSR_IA32_MTRR_DEF_TYPE);
+  if (!(deftype & IA32_MTRR_DEF_TYPE_E))
+    return MEM_TYPE_UNCACHEABLE;
+
+  if ((deftype & IA32_MTRR_DEF_TYPE_FE) && address < 0x100000) {
+    for (i = sizeof(fixed_msrs)/sizeof(fixed_msrs[0]) - 1; fixed_msrs[i].base > address; i--)
+      ;
+    n = (address - fixed_msrs[i].base) / fixed_msrs[i].unit;
+    return (Bit8u) (MsrGet(fixed_msrs[i].reg) >> (n * 8));
+  }
+
+  uc = wt = wb = other = FALSE;
+  type = MEM_TYPE_UNCACHEABLE;
+  n = 0;
+  for (i = 0; i < VCNT; i++) {
+    base = MsrGet(MSR_IA32_MTRR_PHYSBASE(i));
+    mask = MsrGet(MSR_IA32_MTRR_PHYSMASK(i));
+    if (!(mask & IA32_MTRR_PHYMASK_VALID))
+      continue;
+
+    mask &= ~0xfffULL;
+    if ((address & mask) != (base & mask))
+      continue;
+
+    type = base & 0xff;
+    uc    |= type == MEM_TYPE_UNCACHEABLE;
+    wt    |= type == MEM_TYPE_WRITETHROUGH;
+    wb    |= type == MEM_TYPE_WRITEBACK;
+    other |= type != MEM_TYPE_UNCACHEABLE && type != MEM_TYPE_WRITETHROUGH &&
+             type != MEM_TYPE_WRITEBACK;
+    n++;
+  }
+
+  if (n == 0)
+    return deftype & IA32_MTRR_DEF_TYPE_TYPE;
+  if (uc + wt + wb + other == 1)
+    return type;
+  if (wt && wb && !uc && !other)
+    return MEM_TYPE_WRITETHROUGH;
+
+  /* UC wins, any other mix is undefined */
+  return MEM_TYPE_UNCACHEABLE;
+}
+
+/* #### CHECKS #### */
+
+static void CheckAddress(const char *name, Bit64u address)
+{
+  Bit8u got, expected;
+
+  if (address >= MTRR_ADDRESS_LIMIT)
+    return;
+
+  got = EPTGetMemoryType((hvm_address) address);
+  expected = RefMemoryType(address);
+  CHECK(got == expected, "%s: %08llx has type %d, expected %d",
+	name, address, got, expected);
+}
+
+/* Rebuild the interval map from the fake MSRs, then compare every range
+   boundary (and its neighbours), every page below 1MB and every 1MB above */
+static void CheckConfiguration(const char *name)
+{
+  Bit64u address, base, size;
+  Bit32u i;
+
+  EPTInit();
+
+  for (i = 1; i < interval_count; i++) {
+    CHECK(intervals[i-1].base < intervals[i].base, "%s: interval %d not sorted", name, i);
+    CHECK(intervals[i-1].type != intervals[i].type, "%s: interval %d not merged", name, i);
+  }
+
+  for (address = 0; address < 0x100000; address += 0x1000)
+    CheckAddress(name, address);
+  for (address = 0; address < MTRR_ADDRESS_LIMIT; address += 0x100000)
+    CheckAddress(name, address);
+
+  for (i = 0; i < VCNT; i++) {
+    if (!(MsrGet(MSR_IA32_MTRR_PHYSMASK(i)) & IA32_MTRR_PHYMASK_VALID))
+      continue;
+
+    base = MsrGet(MSR_IA32_MTRR_PHYSBASE(i)) & ~0xfffULL;
+    size = MASK_TO_LEN(MsrGet(MSR_IA32_MTRR_PHYSMASK(i)));
+    if (base > 0)
+      CheckAddress(name, base - 1);
+    CheckAddress(name, base);
+    CheckAddress(name, base + size - 1);
+    CheckAddress(name, base + size);
+  }
+}
+
+static void TestCombineTypes(void)
+{
+  static const Bit8u types[] = { MEM_TYPE_UNCACHEABLE, MEM_TYPE_WRITECOMBINE,
+				 MEM_TYPE_WRITETHROUGH, MEM_TYPE_WRITEPROTECT,
+				 MEM_TYPE_WRITEBACK };
+  Bit8u a, b, expected;
+  Bit32u i, j;
+
+  for (i = 0; i < sizeof(types); i++) {
+    for (j = 0; j < sizeof(types); j++) {
+      a = types[i];
+      b = types[j];
+      if (a == b)
+	expected = a;
+      else if ((a == MEM_TYPE_WRITETHROUGH && b == MEM_TYPE_WRITEBACK) ||
+	       (a == MEM_TYPE_WRITEBACK && b == MEM_TYPE_WRITETHROUGH))
+	expected = MEM_TYPE_WRITETHROUGH;
+      else
+	expected = MEM_TYPE_UNCACHEABLE;
+
+      CHECK(EPTCombineTypes(a, b) == expected, "combine %d %d gives %d, expected %d",
+	    a, b, EPTCombineTypes(a, b), expected);
+    }
+  }
+}
+
+static void TestDisabled(void)
+{
+  MtrrReset(MEM_TYPE_WRITEBACK, FALSE, TRUE);
+  MtrrVariable(0, 0, 0x80000000ULL, MEM_TYPE_WRITEBACK);
+  CheckConfiguration("disabled");
+
+  CHECK(interval_count == 1, "disabled: %d intervals", interval_count);
+  CHECK(EPTGetMemoryType(0) == MEM_TYPE_UNCACHEABLE, "disabled: fixed range used");
+}
+
+static void TestDefaultType(void)
+{
+  MtrrReset(MEM_TYPE_WRITEBACK, TRUE, FALSE);
+  CheckConfiguration("default WB");
+  CHECK(interval_count == 1, "default WB: %d intervals", interval_count);
+
+  MtrrReset(MEM_TYPE_UNCACHEABLE, TRUE, FALSE);
+  MtrrVariable(0, 0x40000000ULL, 0x40000000ULL, MEM_TYPE_WRITEBACK);
+  CheckConfiguration("default UC");
+  CHECK(EPTGetMemoryType(0x3fffffff) == MEM_TYPE_UNCACHEABLE, "default UC: below range");
+  CHECK(EPTGetMemoryType(0x40000000) == MEM_TYPE_WRITEBACK, "default UC: in range");
+  CHECK(EPTGetMemoryType(0x80000000) == MEM_TYPE_UNCACHEABLE, "default UC: above range");
+}
+
+/* Fixed ranges enabled and disabled over the same variable ranges */
+static void TestFixedRanges(void)
+{
+  static const Bit8u low[8]  = { 6, 6, 6, 6, 6, 6, 6, 6 };
+  static const Bit8u f80[8]  = { 6, 6, 6, 6, 6, 6, 6, 0 };
+  static const Bit8u fa0[8]  = { 0, 0, 0, 0, 1, 1, 1, 1 };
+  static const Bit8u fc0[8]  = { 5, 5, 5, 5, 0, 0, 0, 0 };
+  static const Bit8u mix[8]  = { 0, 1, 4, 5, 6, 0, 1, 4 };
+  static const Bit8u rom[8]  = { 5, 5, 5, 5, 5, 5, 5, 5 };
+  Bit32u reg;
+  int fe;
+
+  for (fe = 0; fe < 2; fe++) {
+    MtrrReset(MEM_TYPE_UNCACHEABLE, TRUE, fe);
+    MtrrFixed(MSR_IA32_MTRR_FIX64K_00000, low);
+    MtrrFixed(MSR_IA32_MTRR_FIX16K_80000, f80);
+    MtrrFixed(MSR_IA32_MTRR_FIX16K_A0000, fa0);
+    MtrrFixed(MSR_IA32_MTRR_FIX4K_C0000, fc0);
+    for (reg = MSR_IA32_MTRR_FIX4K_C8000; reg <= MSR_IA32_MTRR_FIX4K_E8000; reg++)
+      MtrrFixed(reg, mix);
+    MtrrFixed(MSR_IA32_MTRR_FIX4K_F0000, rom);
+    MtrrFixed(MSR_IA32_MTRR_FIX4K_F8000, rom);
+    MtrrVariable(0, 0, 0x40000000ULL, MEM_TYPE_WRITEBACK);
+    CheckConfiguration(fe ? "fixed enabled" : "fixed disabled");
+  }
+
+  CHECK(EPTGetMemoryType(0x9c000) == MEM_TYPE_UNCACHEABLE, "fixed: 16K range 7");
+  CHECK(EPTGetMemoryType(0xb0000) == MEM_TYPE_WRITECOMBINE, "fixed: VGA range");
+  CHECK(EPTGetMemoryType(0xfffff) == MEM_TYPE_WRITEPROTECT, "fixed: last page");
+  CHECK(EPTGetMemoryType(0x100000) == MEM_TYPE_WRITEBACK, "fixed: first page above 1MB");
+}
+
+/* Overlapping variable ranges: UC over anything, WT over WB, identical
+   types, and undefined mixes */
+static void TestOverlaps(void)
+{
+  MtrrReset(MEM_TYPE_UNCACHEABLE, TRUE, FALSE);
+  MtrrVariable(0, 0x00000000ULL, 0x80000000ULL, MEM_TYPE_WRITEBACK);
+  MtrrVariable(1, 0x80000000ULL, 0x40000000ULL, MEM_TYPE_WRITEBACK);
+  MtrrVariable(2, 0x7f000000ULL, 0x01000000ULL, MEM_TYPE_UNCACHEABLE);
+  MtrrVariable(3, 0x01000000ULL, 0x01000000ULL, MEM_TYPE_WRITETHROUGH);
+  MtrrVariable(4, 0x20000000ULL, 0x10000000ULL, MEM_TYPE_WRITECOMBINE);
+  MtrrVariable(5, 0x40000000ULL, 0x40000000ULL, MEM_TYPE_WRITEBACK);
+  MtrrVariable(6, 0xe0000000ULL, 0x04000000ULL, MEM_TYPE_WRITEPROTECT);
+  MtrrVariable(7, 0x00000000ULL, 0x00080000ULL, MEM_TYPE_UNCACHEABLE);
+  MtrrVariable(8, 0x01800000ULL, 0x00100000ULL, MEM_TYPE_UNCACHEABLE);
+  CheckConfiguration("overlaps");
+
+  CHECK(EPTGetMemoryType(0x7f800000) == MEM_TYPE_UNCACHEABLE, "overlaps: UC over WB");
+  CHECK(EPTGetMemoryType(0x01000000) == MEM_TYPE_WRITETHROUGH, "overlaps: WT over WB");
+  CHECK(EPTGetMemoryType(0x01800000) == MEM_TYPE_UNCACHEABLE, "overlaps: UC over WT and WB");
+  CHECK(EPTGetMemoryType(0x20000000) == MEM_TYPE_UNCACHEABLE, "overlaps: WC over WB");
+  CHECK(EPTGetMemoryType(0x50000000) == MEM_TYPE_WRITEBACK, "overlaps: WB over WB");
+  CHECK(EPTGetMemoryType(0xe0000000) == MEM_TYPE_WRITEPROTECT, "overlaps: WP alone");
+  CHECK(EPTGetMemoryType(0x00000000) == MEM_TYPE_UNCACHEABLE, "overlaps: UC at 0");
+}
+
+/* Every variable range in use, none adjacent: the most intervals there can
+   be */
+static void TestManyRanges(void)
+{
+  Bit32u i;
+
+  MtrrReset(MEM_TYPE_WRITEBACK, TRUE, FALSE);
+  for (i = 0; i < VCNT; i++)
+    MtrrVariable(i, 0x04000000ULL * (2*i + 1), 0x04000000ULL,
+		 (i & 1) ? MEM_TYPE_UNCACHEABLE : MEM_TYPE_WRITETHROUGH);
+  CheckConfiguration("many ranges");
+
+  CHECK(interval_count == 2*VCNT, "many ranges: %d intervals", interval_count);
+}
+
+int main(void)
+{
+  TestCombineTypes();
+  TestDisabled();
+  TestDefaultType();
+  TestFixedRanges();
+  TestOverlaps();
+  TestManyRanges();
+
+  TEST_RESULT("test_mtrr");
+}
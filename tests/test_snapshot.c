@@ -0,0 +1,250 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+/* Copy-on-write snapshots of ept.c, on the simulated identity map and guest
+   memory of ept_sim.h. Pages are given known contents before the snapshot,
+   written by the guest through the EPT permissions, and must read back
+   unchanged after each restore, which must leave them write-protected
+   again. The pool of saved pages and the tables reserved to split 2MB
+   pages are exhausted on purpose, and dropping the snapshot must give back
+   the map it started from */
+
+#include "test.h"
+#include "ept.c"
+#include "ept_sim.h"
+
+#define N_TARGETS 600		/* Pages written in each round */
+
+static Bit32u targets[EPT_SNAPSHOT_POOL + 1];
+static Bit32u seed = 12345;
+
+static Bit32u Random(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+static Bit8u Original(Bit32u page, Bit32u offset)
+{
+  return (Bit8u) (page * 13 + offset);
+}
+
+/* Give the pages their original contents, as the guest would before the
+   snapshot */
+static void Prepare(Bit32u n)
+{
+  Bit32u i, j;
+
+  for (i = 0; i < n; i++)
+    for (j = 0; j < 4096; j++)
+      simphys[PAGE(targets[i]) + j] = Original(targets[i], j);
+}
+
+/* n distinct pages, in 'regions' 2MB regions starting from the one of 'first'
+   (through the UC hole, the first 1GB boundary and so on) */
+static void PickTargets(Bit32u n, Bit32u first, Bit32u regions)
+{
+  Bit32u i, j, page;
+
+  for (i = 0; i < n; i++) {
+  again:
+    page = (first & ~511) + (i % regions) * 512 * 37 % EPT_DIRTY_LOG_PAGES + Random() % 512;
+    page %= EPT_DIRTY_LOG_PAGES;
+    for (j = 0; j < i; j++)
+      if (targets[j] == page)
+	goto again;
+    targets[i] = page;
+  }
+}
+
+/* A few guest writes to each page. Returns the violations */
+static Bit32u Scribble(const char *name, Bit32u n)
+{
+  Bit32u i, v;
+
+  v = violations;
+  for (i = 0; i < 3 * n; i++)
+    CHECK(SimGuestWrite(PAGE(targets[i % n]) + Random() % 4096, Random()), "%s: write to page %05x not handled",
+	  name, targets[i % n]);
+
+  return violations - v;
+}
+
+/* #### CHECKS #### */
+
+static Bit32u leaf_writable, leaf_counts[3];
+
+static void CountLeaf(Bit32u *entry, Bit32u page, Bit32u npages)
+{
+  if ((*entry & READ) && (*entry & WRITE))
+    leaf_writable++;
+  leaf_counts[npages == 1 ? 0 : npages == 512 ? 1 : 2]++;
+}
+
+static void CountLeaves(void)
+{
+  leaf_writable = 0;
+  vmm_memset(leaf_counts, 0, sizeof(leaf_counts));
+  SimForEachLeaf(CountLeaf);
+}
+
+/* The pages have their original contents and are write-protected */
+static void CheckRestored(const char *name, Bit32u n)
+{
+  Bit32u i, j;
+
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < 4096 && simphys[PAGE(targets[i]) + j] == Original(targets[i], j); j++)
+      ;
+    CHECK(j == 4096, "%s: page %05x differs at %03x", name, targets[i], j);
+    CHECK(!(*(Bit32u *) EPTGetEntry(PAGE(targets[i])) & WRITE), "%s: page %05x left writable", name, targets[i]);
+  }
+
+  CountLeaves();
+  CHECK(leaf_writable == 0, "%s: %d writable leaves", name, leaf_writable);
+}
+
+/* #### TESTS #### */
+
+/* Each round writes to new pages, in new 2MB regions: only the pages
+   written are saved, each one split off its 2MB page with a reserved
+   table, and restored */
+static void TestRestore(void)
+{
+  Bit32u round, n, v, reserved, inv;
+
+  CHECK(HVM_SUCCESS(EPTSnapshotTake()), "take failed");
+  CHECK(!HVM_SUCCESS(EPTSnapshotTake()), "taken twice");
+  CHECK(!HVM_SUCCESS(EPTDirtyLogStart()), "dirty logging started during a snapshot");
+
+  CountLeaves();
+  CHECK(leaf_writable == 0 && leaf_counts[2] == 0, "take: %d writable leaves, %d 1GB pages", leaf_writable, leaf_counts[2]);
+
+  for (round = 0; round < 4; round++) {
+    PickTargets(N_TARGETS, round * 0x1000 * 512, 20);
+    Prepare(N_TARGETS);
+
+    reserved = table_reserved;
+    v = Scribble("restore", N_TARGETS);
+    CHECK(v == N_TARGETS, "round %d: %d violations for %d pages", round, v, N_TARGETS);
+    CHECK(snapshot_count == N_TARGETS, "round %d: %d pages saved", round, snapshot_count);
+    CHECK(reserved - table_reserved <= 20, "round %d: %d tables used for 20 regions", round, reserved - table_reserved);
+
+    inv = invept_count;
+    CHECK(HVM_SUCCESS(EPTSnapshotRestore(&n)), "round %d: restore failed", round);
+    CHECK(n == N_TARGETS, "round %d: %d pages restored", round, n);
+    CHECK(invept_count - inv == 1, "round %d: %d INVEPTs", round, invept_count - inv);
+    CheckRestored("restore", N_TARGETS);
+
+    /* Written again after the restore: saved again */
+    v = Scribble("restore", N_TARGETS);
+    CHECK(v == N_TARGETS, "round %d: %d violations after the restore", round, v);
+    CHECK(HVM_SUCCESS(EPTSnapshotRestore(&n)) && n == N_TARGETS, "round %d: second restore", round);
+    CheckRestored("second restore", N_TARGETS);
+  }
+
+  inv = invept_count;
+  CHECK(HVM_SUCCESS(EPTSnapshotRestore(&n)) && n == 0, "empty restore: %d pages", n);
+  CHECK(invept_count == inv, "empty restore: %d INVEPTs", invept_count - inv);
+}
+
+/* One page more than the pool can save */
+static void TestPoolOverflow(void)
+{
+  Bit32u n;
+
+  CHECK(HVM_SUCCESS(EPTSnapshotTake()), "pool overflow: take failed");
+  PickTargets(EPT_SNAPSHOT_POOL + 1, 0, 64);
+  Scribble("pool overflow", EPT_SNAPSHOT_POOL + 1);
+  CHECK(snapshot_overflow, "pool overflow: not detected");
+  CHECK(!HVM_SUCCESS(EPTSnapshotRestore(&n)), "pool overflow: restored");
+}
+
+/* One 2MB region more than the reserved tables can split: the last one is
+   made writable whole, and the snapshot cannot be restored */
+static void TestTableOverflow(void)
+{
+  Bit32u i, n, v;
+
+  CHECK(HVM_SUCCESS(EPTSnapshotTake()), "table overflow: take failed");
+  for (i = 0; i <= EPT_SNAPSHOT_TABLES; i++)
+    targets[i] = (0x1000 + i * 512 * 3) % EPT_DIRTY_LOG_PAGES;
+
+  Scribble("table overflow", EPT_SNAPSHOT_TABLES);
+  CHECK(!snapshot_overflow && table_reserved == 0, "table overflow: %d tables left", table_reserved);
+
+  targets[0] = targets[EPT_SNAPSHOT_TABLES];
+  v = Scribble("table overflow", 1);
+  CHECK(snapshot_overflow && v == 1, "table overflow: not detected");
+  v = violations;
+  SimGuestWrite(PAGE(targets[0] ^ 511), 0);
+  CHECK(violations == v, "table overflow: rest of the 2MB page still protected");
+  CHECK(!HVM_SUCCESS(EPTSnapshotRestore(&n)), "table overflow: restored");
+}
+
+/* The map is back to the one before the snapshot, and all the tables are
+   in the pool */
+static void CheckDropped(const char *name, Bit32u *counts)
+{
+  CountLeaves();
+  CHECK(leaf_counts[0] == counts[0] && leaf_counts[1] == counts[1] && leaf_counts[2] == counts[2],
+	"%s: %d/%d/%d 4KB/2MB/1GB pages, %d/%d/%d before", name,
+	leaf_counts[0], leaf_counts[1], leaf_counts[2], counts[0], counts[1], counts[2]);
+  CHECK(leaf_writable == leaf_counts[0] + leaf_counts[1] + leaf_counts[2],
+	"%s: %d writable leaves", name, leaf_writable);
+
+  EPTReclaimTables();
+  CHECK(table_pool_count == EPT_TABLES && table_reserved == 0, "%s: %d tables in the pool, %d reserved", name,
+	table_pool_count, table_reserved);
+}
+
+int main(void)
+{
+  Bit32u counts[3];
+
+  SimInit(FALSE);
+
+  CountLeaves();
+  vmm_memcpy(counts, leaf_counts, sizeof(counts));
+
+  TestRestore();
+  EPTSnapshotDrop();
+  CheckDropped("drop", counts);
+
+  TestPoolOverflow();
+  EPTSnapshotDrop();
+  CheckDropped("drop after pool overflow", counts);
+
+  TestTableOverflow();
+  EPTSnapshotDrop();
+  CheckDropped("drop after table overflow", counts);
+
+  CHECK(EPTDirtyLogStart() == HVM_STATUS_SUCCESS, "dirty logging after the snapshots");
+  CHECK(!HVM_SUCCESS(EPTSnapshotTake()), "snapshot taken during dirty logging");
+  EPTDirtyLogStop();
+
+  CHECK(freeze_count == thaw_count, "%d SmpFreezeOthers(), %d SmpThawOthers()", freeze_count, thaw_count);
+
+  TEST_RESULT("test_snapshot");
+}
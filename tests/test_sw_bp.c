@@ -0,0 +1,365 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+/* Software breakpoints of sw_bp.c: 10k breakpoints set, hit and deleted in
+   random order, in a few address spaces, at addresses chosen so that they
+   form long clusters in the hash table, wrapping around its end. After every
+   change, all the entries of the table must be reachable from their home
+   slot (i.e., backward-shift deletion must have kept the clusters whole) */
+
+#include "test.h"
+#include "bench.h"
+#include "sw_bp.c"
+#include "vmmstring.h"
+
+#define N_BPS     10000
+#define N_CR3     4
+#define MEM_BASE  0x00400000
+#define MEM_SIZE  0x00400000
+#define BAD_WRITE (MEM_BASE + MEM_SIZE - 0x2000) /* Read-only page */
+#define BAD_READ  (MEM_BASE + MEM_SIZE - 0x1000) /* Not present page */
+
+#define CR3(k)    ((hvm_address) 0x1000 * ((k) + 1))
+
+/* #### STUBS #### */
+
+static Bit8u  memory[N_CR3][MEM_SIZE];	/* Guest memory of each address space */
+static Bit32u reads, writes;
+
+hvm_status MmuReadWriteVirtualRegion(hvm_address cr3, hvm_address va, void* buffer, Bit32u size, hvm_bool isWrite)
+{
+  Bit32u k;
+
+  k = cr3 / 0x1000 - 1;
+  if (k >= N_CR3 || va < MEM_BASE || va + size > BAD_READ || (isWrite && va + size > BAD_WRITE))
+    return HVM_STATUS_UNSUCCESSFUL;
+
+  if (isWrite) {
+    vmm_memcpy(&memory[k][va - MEM_BASE], buffer, size);
+    writes++;
+  } else {
+    vmm_memcpy(buffer, &memory[k][va - MEM_BASE], size);
+    reads++;
+  }
+
+  return HVM_STATUS_SUCCESS;
+}
+
+void TraceRecord(PTRACE_SITE site, ...) { }
+
+/* #### REFERENCE #### */
+
+typedef struct {
+  hvm_address addr;
+  Bit32u      k;		/* Address space */
+  hvm_bool    isPerm;
+  hvm_bool    isCr3Dipendent;
+  Bit32u      index;		/* MAXSWBPS if not set */
+  Bit8u       opcode;		/* Original byte */
+  Bit32u      same;		/* Next entry with the same address (a ring) */
+} BP;
+
+static BP     bps[N_BPS];
+static Bit32u live;
+static Bit32u seed = 12345;
+
+static Bit32u Random(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+static Bit8u Original(Bit32u k, hvm_address addr)
+{
+  return (Bit8u) ((addr * 7 + k) | 1);	/* Never 0xcc */
+}
+
+/* Breakpoint addresses whose home slot is in the last or first 'window'
+   slots of the table, so that clusters wrap around its end. Some addresses
+   are used in several address spaces, and a few fall on the pages where
+   reads or writes fail */
+static void MakeBreakpoints(Bit32u window)
+{
+  hvm_address addr;
+  Bit32u i, j, home, k;
+
+  for (i = 0; i < N_BPS; i++) {
+    if (i > 0 && Random() % 4 == 0) {
+      addr = bps[Random() % i].addr;
+    } else if (Random() % 200 == 0) {
+      addr = ((Random() & 1) ? BAD_WRITE : BAD_READ) + Random() % 0x1000;
+    } else {
+      do {
+	addr = MEM_BASE + Random() % (MEM_SIZE - 0x2000);
+	home = SW_BP_HASH(addr);
+      } while (home >= window && home < SW_BP_HASH_SIZE - window);
+    }
+
+    bps[i].addr           = addr;
+    bps[i].k              = Random() % N_CR3;
+    bps[i].isPerm         = Random() & 1;
+    bps[i].isCr3Dipendent = Random() & 1;
+    bps[i].index          = MAXSWBPS;
+    bps[i].same           = i;
+
+    for (j = 0; j < i; j++) {
+      if (bps[j].addr == addr) {
+	bps[i].same = bps[j].same;
+	bps[j].same = i;
+	break;
+      }
+    }
+  }
+
+  for (k = 0; k < N_CR3; k++)
+    for (i = 0; i < MEM_SIZE; i++)
+      memory[k][i] = Original(k, MEM_BASE + i);
+}
+
+/* The live breakpoint in address space 'k' at the address of 'bp' */
+static BP* FindLive(Bit32u k, BP* bp)
+{
+  Bit32u i, j;
+
+  i = j = bp - bps;
+  do {
+    if (bps[j].index != MAXSWBPS && bps[j].k == k)
+      return &bps[j];
+    j = bps[j].same;
+  } while (j != i);
+
+  return NULL;
+}
+
+/* Every slot of the hash table holds a live breakpoint, reachable from its
+   home slot without crossing an empty one, and every live breakpoint has a
+   slot */
+static void CheckTable(const char *name)
+{
+  Bit32u i, empty, slot, run, j, n, home;
+
+  /* Walk the table starting after an empty slot, so that 'run' is always the
+     number of slots of the current cluster, even when it wraps around */
+  for (empty = 0; sw_bps_hash[empty] != 0; empty++)
+    ;
+
+  n = run = 0;
+  for (i = 1; i <= SW_BP_HASH_SIZE; i++) {
+    slot = (empty + i) & (SW_BP_HASH_SIZE - 1);
+    if (sw_bps_hash[slot] == 0) {
+      run = 0;
+      continue;
+    }
+
+    n++;
+    run++;
+    j = sw_bps_hash[slot] - 1;
+    CHECK(j < MAXSWBPS && sw_bps[j].Addr != 0, "%s: slot %d holds free entry %d", name, slot, j);
+
+    home = SW_BP_HASH(sw_bps[j].Addr);
+    CHECK(((slot - home) & (SW_BP_HASH_SIZE - 1)) < run,
+	  "%s: slot %d (entry %d) not reachable from its home slot %d", name, slot, j, home);
+  }
+
+  CHECK(n == live, "%s: %d slots used, %d breakpoints", name, n, live);
+}
+
+/* #### OPERATIONS #### */
+
+static void Set(const char *name, BP* bp)
+{
+  Bit32u index;
+  hvm_bool failing, present;
+
+  present = FindLive(bp->k, bp) != NULL;
+  failing = bp->addr >= BAD_WRITE;
+
+  index = SwBreakpointSet(CR3(bp->k), bp->addr, bp->isPerm, bp->isCr3Dipendent);
+
+  if (present) {
+    CHECK(index == (Bit32u) -1, "%s: %08lx set twice: %d", name, (unsigned long) bp->addr, index);
+    return;
+  }
+
+  if (failing) {
+    CHECK(index == MAXSWBPS, "%s: %08lx on a bad page: %d", name, (unsigned long) bp->addr, index);
+    CHECK(memory[bp->k][bp->addr - MEM_BASE] != INT3_OPCODE || bp->addr >= BAD_READ,
+	  "%s: %08lx: int3 left on a failed set", name, (unsigned long) bp->addr);
+    return;
+  }
+
+  if (live == MAXSWBPS) {
+    CHECK(index == MAXSWBPS, "%s: set with a full table: %d", name, index);
+    return;
+  }
+
+  CHECK(index < MAXSWBPS, "%s: %08lx not set", name, (unsigned long) bp->addr);
+  if (index >= MAXSWBPS)
+    return;
+
+  bp->index  = index;
+  bp->opcode = Original(bp->k, bp->addr);
+  live++;
+  CHECK(memory[bp->k][bp->addr - MEM_BASE] == INT3_OPCODE, "%s: %08lx: no int3", name, (unsigned long) bp->addr);
+}
+
+/* An int3 exit at the address of the breakpoint */
+static void Hit(const char *name, BP* bp)
+{
+  hvm_bool isCr3Dipendent, isPerm, found;
+  hvm_address cr3;
+  BP *other;
+
+  found = SwBreakpointGetBPInfo(CR3(bp->k), bp->addr, &isCr3Dipendent, &isPerm, &cr3);
+
+  if (bp->index != MAXSWBPS) {
+    CHECK(found && cr3 == CR3(bp->k) && isPerm == bp->isPerm && isCr3Dipendent == bp->isCr3Dipendent,
+	  "%s: %08lx in cr3 %lx: found %d, cr3 %lx", name, (unsigned long) bp->addr,
+	  (unsigned long) CR3(bp->k), found, (unsigned long) cr3);
+    return;
+  }
+
+  /* Not set (or set by another entry with the same address and address
+     space): any live breakpoint at the same address */
+  other = found ? FindLive(cr3 / 0x1000 - 1, bp) : NULL;
+  CHECK(!found || other, "%s: %08lx: found a breakpoint that is not set", name, (unsigned long) bp->addr);
+}
+
+static void Delete(const char *name, BP* bp, hvm_bool byId)
+{
+  hvm_bool r;
+
+  if (bp->index == MAXSWBPS)
+    return;
+
+  r = byId ? SwBreakpointDeleteById(bp->index) : SwBreakpointDelete(CR3(bp->k), bp->addr);
+  CHECK(r, "%s: %08lx not deleted", name, (unsigned long) bp->addr);
+  CHECK(memory[bp->k][bp->addr - MEM_BASE] == bp->opcode, "%s: %08lx: code not restored", name, (unsigned long) bp->addr);
+
+  bp->index = MAXSWBPS;
+  live--;
+}
+
+/* #### TESTS #### */
+
+/* All the breakpoints, in batches that fill the table */
+static void TestBatches(void)
+{
+  Bit32u i, first, last;
+
+  for (first = 0; first < N_BPS; first = last) {
+    last = MIN(first + MAXSWBPS + 64, N_BPS);
+
+    for (i = first; i < last; i++)
+      Set("batch set", &bps[i]);
+    CheckTable("batch set");
+
+    for (i = first; i < last; i++)
+      Hit("batch hit", &bps[Random() % (last - first) + first]);
+
+    for (i = first; i < last; i++)
+      Delete("batch delete", &bps[i], i & 1);
+    CheckTable("batch delete");
+    CHECK(live == 0, "batch: %d breakpoints left", live);
+  }
+}
+
+/* Random operations, checking the table after each deletion */
+static void TestRandom(Bit32u n)
+{
+  Bit32u i;
+  BP *bp;
+
+  for (i = 0; i < n && test_failures < 16; i++) {
+    bp = &bps[Random() % N_BPS];
+
+    switch (Random() % 8) {
+    case 0: case 1: case 2:
+      Set("random set", bp);
+      break;
+
+    case 3: case 4:
+      Hit("random hit", bp);
+      break;
+
+    default:
+      Delete("random delete", bp, Random() & 1);
+      if (i % 16 == 0)
+	CheckTable("random delete");
+      break;
+    }
+  }
+
+  for (i = 0; i < N_BPS; i++)
+    Delete("cleanup", &bps[i], FALSE);
+  CheckTable("cleanup");
+}
+
+/* #### BENCHMARK #### */
+
+/* Time per hit with 'n' breakpoints set */
+static double MeasureHits(Bit32u n)
+{
+  hvm_bool isCr3Dipendent, isPerm;
+  unsigned long long t;
+  hvm_address cr3;
+  volatile Bit32u sink;
+  Bit32u i, m;
+
+  for (i = 0, m = 0; i < N_BPS && m < n; i++) {
+    if (bps[i].addr < BAD_WRITE && !FindLive(bps[i].k, &bps[i])) {
+      Set("measure", &bps[i]);
+      m++;
+    }
+  }
+
+  sink = 0;
+  t = BenchNow();
+  for (i = 0; i < 1000000; i++)
+    sink += SwBreakpointGetBPInfo(CR3(bps[i % m].k), bps[i % m].addr, &isCr3Dipendent, &isPerm, &cr3);
+  t = BenchNow() - t;
+
+  for (i = 0; i < N_BPS; i++)
+    Delete("measure", &bps[i], FALSE);
+
+  return t / 1e6;
+}
+
+int main(void)
+{
+  /* Clusters around the end of the table */
+  MakeBreakpoints(64);
+  TestBatches();
+  TestRandom(200000);
+
+  /* Addresses anywhere */
+  MakeBreakpoints(SW_BP_HASH_SIZE / 2);
+  TestBatches();
+  TestRandom(200000);
+
+  printf("test_sw_bp: hit with 16 breakpoints %.1f ns, 1024 %.1f ns, %d %.1f ns\n",
+	 MeasureHits(16), MeasureHits(1024), MAXSWBPS, MeasureHits(MAXSWBPS));
+
+  TEST_RESULT("test_sw_bp");
+}
@@ -0,0 +1,272 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+/* Address lookups of symsearch.c, compared with DicotomicSymbolSearch(), the
+   recursive search they replaced, on 100k symbols. SymbolResolveMany() is
+   checked on ascending and non-ascending batches, with and without the
+   relocated address column built by SymbolInit() */
+
+#include "test.h"
+#include "bench.h"
+#include "symsearch.c"
+
+#define N_SYMS    100000
+#define N_QUERIES 65536
+#define N_SINGLE  4096		/* Checked against a linear scan */
+#define BASE      0x80000000	/* Kernel base */
+
+/* #### STUBS #### */
+
+HYPERDBG_STATE hyperdbg_state;
+
+SYMBOL syms[N_SYMS];
+const Bit32u NOS = N_SYMS;
+
+static char names[N_SYMS][8];
+static hvm_address queries[N_QUERIES];
+static PSYMBOL results[N_QUERIES];
+static Bit32u seed = 12345;
+
+static Bit32u Random(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+/* #### REFERENCE #### */
+
+/* The lookup before SymbolUpperBound(), from the baseline tree. Returns TRUE
+   and sets Index to the index of the found entries if found. Otherwise,
+   returns FALSE and Index is undefined */
+static hvm_bool DicotomicSymbolSearch(hvm_address addr, Bit32s start, Bit32s end, Bit32u* index)
+{
+  Bit32u mid;
+  PSYMBOL CurrentSym;
+
+  mid = (start+end)/2;
+  CurrentSym = &syms[mid];
+
+  while(end >= start) {
+    if(addr == (CurrentSym->addr + hyperdbg_state.win_state.kernel_base)) {
+      *index = mid;
+      return TRUE;
+    }
+
+    if(addr < (CurrentSym->addr + hyperdbg_state.win_state.kernel_base)) {
+      end = mid - 1;
+    } else {
+      start = mid + 1;
+    }
+
+    return DicotomicSymbolSearch(addr, start, end, index);
+  }
+
+  /* Not found! */
+  *index = mid;
+  return FALSE; 
+}
+
+/* The last symbol not above addr */
+static PSYMBOL Nearest(hvm_address addr)
+{
+  Bit32s i;
+
+  for (i = N_SYMS - 1; i >= 0 && syms[i].addr + BASE > addr; i--)
+    ;
+  return i >= 0 ? &syms[i] : NULL;
+}
+
+/* Symbols every 0-3 paragraphs, so that some share an address */
+static void MakeSymbols(void)
+{
+  Bit32u i, addr;
+
+  addr = 0x1000;
+  for (i = 0; i < N_SYMS; i++) {
+    addr += (Random() % 4) * 0x10;
+    sprintf(names[i], "s%d", i);
+    syms[i].name = (unsigned char*) names[i];
+    syms[i].addr = addr;
+  }
+
+  hyperdbg_state.win_state.kernel_base = BASE;
+}
+
+/* Symbol addresses, addresses in between, and addresses out of the table */
+static hvm_address RandomAddress(void)
+{
+  switch (Random() % 8) {
+  case 0:  return BASE + Random() % 0x1000;
+  case 1:  return BASE + syms[N_SYMS-1].addr + Random() % 0x1000;
+  case 2:  return Random() % BASE;
+  case 3:
+  case 4:  return BASE + syms[Random() % N_SYMS].addr;
+  default: return BASE + syms[0].addr + Random() % (syms[N_SYMS-1].addr - syms[0].addr);
+  }
+}
+
+static int CompareAddresses(const void *x, const void *y)
+{
+  hvm_address a = *(const hvm_address*) x, b = *(const hvm_address*) y;
+
+  return (a > b) - (a < b);
+}
+
+/* #### TESTS #### */
+
+/* Single lookups. The old search found any of the symbols sharing an
+   address; its nearest lookup returned the last probed symbol, which is
+   wrong whenever that is above the address (counted, not checked) */
+static void TestSingle(const char *name)
+{
+  PSYMBOL s, n, expected;
+  hvm_address a;
+  Bit32u i, index, oldwrong;
+  hvm_bool found;
+
+  oldwrong = 0;
+  for (i = 0; i < N_SINGLE; i++) {
+    a = RandomAddress();
+    s = SymbolGetFromAddress(a);
+    n = SymbolGetNearest(a);
+    found = DicotomicSymbolSearch(a, 0, NOS-1, &index);
+    expected = Nearest(a);
+
+    CHECK((s != NULL) == found, "%s: %08lx: found %d, old search %d", name, (unsigned long) a, s != NULL, found);
+    if (s && found)
+      CHECK(s->addr == syms[index].addr && s == expected, "%s: %08lx: symbol %ld, old search %d",
+	    name, (unsigned long) a, (long) (s - syms), index);
+
+    CHECK(n == expected, "%s: nearest %08lx: symbol %ld, expected %ld", name, (unsigned long) a,
+	  n ? (long) (n - syms) : -1L, expected ? (long) (expected - syms) : -1L);
+    if (!found && &syms[index] != expected)
+      oldwrong++;
+
+    if (test_failures > 16)
+      return;
+  }
+
+  printf("  %s: old nearest lookup wrong for %d addresses out of %d\n", name, oldwrong, N_SINGLE);
+}
+
+/* A batch gives the same results as one lookup at a time */
+static void CheckBatch(const char *name, Bit32u n)
+{
+  Bit32u i;
+
+  SymbolResolveMany(queries, results, n, TRUE);
+  for (i = 0; i < n; i++)
+    CHECK(results[i] == SymbolGetFromAddress(queries[i]), "%s: exact %d (%08lx)", name, i, (unsigned long) queries[i]);
+
+  SymbolResolveMany(queries, results, n, FALSE);
+  for (i = 0; i < n; i++)
+    CHECK(results[i] == SymbolGetNearest(queries[i]), "%s: nearest %d (%08lx)", name, i, (unsigned long) queries[i]);
+}
+
+static void TestBatches(const char *name)
+{
+  char label[64];
+  hvm_address t;
+  Bit32u i;
+
+  for (i = 0; i < N_QUERIES; i++)
+    queries[i] = RandomAddress();
+
+  snprintf(label, sizeof(label), "%s, random", name);
+  CheckBatch(label, N_QUERIES);
+
+  qsort(queries, N_QUERIES, sizeof(hvm_address), CompareAddresses);
+  snprintf(label, sizeof(label), "%s, ascending", name);
+  CheckBatch(label, N_QUERIES);
+
+  /* Ascending with a step back every few addresses, as a backtrace that
+     goes through a callback */
+  for (i = 7; i < N_QUERIES; i += 8) {
+    t = queries[i]; queries[i] = queries[i-3]; queries[i-3] = t;
+  }
+  snprintf(label, sizeof(label), "%s, steps back", name);
+  CheckBatch(label, N_QUERIES);
+
+  for (i = 0; i < N_QUERIES / 2; i++) {
+    t = queries[i]; queries[i] = queries[N_QUERIES-1-i]; queries[N_QUERIES-1-i] = t;
+  }
+  snprintf(label, sizeof(label), "%s, descending", name);
+  CheckBatch(label, N_QUERIES);
+
+  snprintf(label, sizeof(label), "%s, empty and single", name);
+  CheckBatch(label, 0);
+  CheckBatch(label, 1);
+}
+
+/* #### BENCHMARK #### */
+
+static void Measure(void)
+{
+  unsigned long long t;
+  volatile Bit32u sink;
+  Bit32u i, index, rounds;
+  double old, single, batch;
+
+  rounds = 16;
+  for (i = 0; i < N_QUERIES; i++)
+    queries[i] = RandomAddress();
+  qsort(queries, N_QUERIES, sizeof(hvm_address), CompareAddresses);
+
+  sink = 0;
+  t = BenchNow();
+  for (i = 0; i < rounds*N_QUERIES; i++)
+    sink += DicotomicSymbolSearch(queries[i % N_QUERIES], 0, NOS-1, &index);
+  old = (BenchNow() - t) / (double) (rounds*N_QUERIES);
+
+  t = BenchNow();
+  for (i = 0; i < rounds*N_QUERIES; i++)
+    sink += (SymbolGetNearest(queries[i % N_QUERIES]) != NULL);
+  single = (BenchNow() - t) / (double) (rounds*N_QUERIES);
+
+  t = BenchNow();
+  for (i = 0; i < rounds; i++)
+    SymbolResolveMany(queries, results, N_QUERIES, FALSE);
+  batch = (BenchNow() - t) / (double) (rounds*N_QUERIES);
+
+  printf("test_symaddr: %d symbols: old search %.1f ns, nearest %.1f ns, ascending batch %.1f ns per address\n",
+	 N_SYMS, old, single, batch);
+}
+
+int main(void)
+{
+  MakeSymbols();
+
+  /* Before SymbolInit(): no address column */
+  TestSingle("no index");
+  TestBatches("no index");
+
+  CHECK(SymbolInit() == HVM_STATUS_SUCCESS && symaddr, "indexes not built");
+  TestSingle("index");
+  TestBatches("index");
+
+  Measure();
+  SymbolFini();
+
+  TEST_RESULT("test_symaddr");
+}
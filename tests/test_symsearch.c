@@ -0,0 +1,355 @@
+/*
+  Copyright notice
+  ================
+  
+  Copyright (C) 2010 - 2013
+      Lorenzo  Martignoni <martignlo@gmail.com>
+      Roberto  Paleari    <roberto.paleari@gmail.com>
+      Aristide Fattori    <joystick@security.di.unimi.it>
+      Mattia   Pagnozzi   <pago@security.di.unimi.it>
+  
+  This program is free software: you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+  
+  HyperDbg is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+  
+*/
+
+/* Name lookups of symsearch.c on a synthetic 100k-symbol pack: exact names
+   (hash table), prefixes and substrings are compared with a scan of the
+   whole table, then the lookups per second of each kind are reported */
+
+#include "test.h"
+#include "bench.h"
+#include "symsearch.c"
+
+#define N_SYMS    100000
+#define N_QUERIES 2000		/* Checked against the scan */
+#define N_TIMED   200000	/* Timed hash lookups */
+#define MAX_RESULTS 64
+
+/* #### STUBS #### */
+
+HYPERDBG_STATE hyperdbg_state;
+
+/* A small compiled-in table, replaced by the pack */
+SYMBOL syms[] = {
+  { (unsigned char*) "KiFastCallEntry", 0x1000 },
+  { (unsigned char*) "NtCreateFile",    0x2000 },
+};
+const Bit32u NOS = sizeof(syms) / sizeof(syms[0]);
+
+/* #### SYMBOL PACK #### */
+
+static const char *stems[] = {
+  "Nt", "Zw", "Ke", "Ki", "Ex", "Io", "Mm", "Ob", "Ps", "Rtl", "Se", "Cm", "Hal", "Fs", "Wmi",
+};
+
+static Bit8u  pack[N_SYMS * (8 + 40) + sizeof(SYMBOL_PACK_HEADER)];
+static Bit32u packoff, packsize;
+static char   names[N_SYMS][40];
+static Bit32u seed = 12345;
+
+static Bit32u Random(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+/* FNV-1a of the lowercased name, as tools/sympack.py computes it */
+static Bit32u Hash(const char *s)
+{
+  Bit32u h;
+
+  for (h = 0x811c9dc5; *s; s++) {
+    h ^= (Bit8u) ((*s >= 'A' && *s <= 'Z') ? *s - 'A' + 'a' : *s);
+    h *= 0x01000193;
+  }
+  return h;
+}
+
+/* Names like NtAbcDef_12: common prefixes, some names differing only in
+   case, and some exact duplicates */
+static void MakeNames(void)
+{
+  Bit32u i, j, n;
+  char *p;
+
+  for (i = 0; i < N_SYMS; i++) {
+    p = names[i];
+    if (i > 0 && Random() % 100 == 0) {
+      /* Same name as an earlier symbol, maybe with another case */
+      sprintf(p, "%s", names[Random() % i]);
+      if (Random() & 1)
+	p[0] ^= 0x20;
+      continue;
+    }
+
+    p += sprintf(p, "%s", stems[Random() % (sizeof(stems) / sizeof(stems[0]))]);
+    n = 2 + Random() % 3;
+    for (j = 0; j < n; j++) {
+      *p++ = 'A' + Random() % 26;
+      *p++ = 'a' + Random() % 26;
+      *p++ = 'a' + Random() % 26;
+    }
+    sprintf(p, "_%d", Random() % 100);
+  }
+}
+
+static void BuildPack(void)
+{
+  PSYMBOL_PACK_HEADER hdr;
+  Bit32u *addr, *hash, i, addrnow;
+  char *pool;
+
+  hdr  = (PSYMBOL_PACK_HEADER) pack;
+  addr = (Bit32u*) (hdr + 1);
+  hash = addr + N_SYMS;
+  pool = (char*) (hash + N_SYMS);
+
+  addrnow = 0x00400000;
+  for (i = 0; i < N_SYMS; i++) {
+    addrnow += (Random() % 4) * 0x10;	/* Some symbols share an address */
+    addr[i] = addrnow;
+    hash[i] = Hash(names[i]);
+    sprintf(pool, "%s", names[i]);
+    pool += vmm_strlen((Bit8u*) names[i]) + 1;
+  }
+
+  hdr->magic    = SYMBOL_PACK_MAGIC;
+  hdr->version  = SYMBOL_PACK_VERSION;
+  hdr->count    = N_SYMS;
+  hdr->poolsize = pool - (char*) (hash + N_SYMS);
+  packsize = (Bit8u*) pool - pack;
+}
+
+static hvm_status ReadPack(void* handle, void* buffer, Bit32u size)
+{
+  if (size > packsize - packoff)
+    return HVM_STATUS_UNSUCCESSFUL;
+
+  vmm_memcpy(buffer, pack + packoff, size);
+  packoff += size;
+  return HVM_STATUS_SUCCESS;
+}
+
+/* #### REFERENCE #### */
+
+static int Lower(int c)
+{
+  return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+static int CompareNames(const char *a, const char *b)
+{
+  while (Lower(*a) == Lower(*b) && *a)
+    a++, b++;
+  return Lower((Bit8u) *a) - Lower((Bit8u) *b);
+}
+
+/* Name order of the index: case-insensitive, then by position */
+static int CompareIndexes(const void *x, const void *y)
+{
+  Bit32u a = *(const Bit32u*) x, b = *(const Bit32u*) y;
+  int c;
+
+  c = CompareNames(names[a], names[b]);
+  return c ? c : (a < b ? -1 : a > b);
+}
+
+static hvm_bool StartsWith(const char *name, const char *prefix)
+{
+  for (; *prefix; name++, prefix++)
+    if (Lower(*name) != Lower(*prefix))
+      return FALSE;
+  return TRUE;
+}
+
+static hvm_bool Contains(const char *name, const char *pattern)
+{
+  for (; *name; name++)
+    if (StartsWith(name, pattern))
+      return TRUE;
+  return *pattern == 0;
+}
+
+static Bit32u matches[N_SYMS];
+
+/* Indexes of all the matching symbols, in name order */
+static Bit32u Scan(const char *pattern, SYMBOL_SEARCH_MODE mode)
+{
+  Bit32u i, n;
+
+  for (i = 0, n = 0; i < N_SYMS; i++) {
+    if (mode == SymbolSearchPrefix ? StartsWith(names[i], pattern) : Contains(names[i], pattern))
+      matches[n++] = i;
+  }
+
+  qsort(matches, n, sizeof(Bit32u), CompareIndexes);
+  return n;
+}
+
+/* A query: an existing name with random case changes, or a name that is not
+   in the table */
+static void Query(char *q)
+{
+  Bit32u i;
+
+  sprintf(q, "%s", names[Random() % N_SYMS]);
+  for (i = 0; q[i]; i++)
+    if (Random() % 4 == 0 && ((q[i] | 0x20) >= 'a' && (q[i] | 0x20) <= 'z'))
+      q[i] ^= 0x20;
+
+  switch (Random() % 4) {
+  case 0: q[i-1] = 'x'; break;		/* Not a symbol (most likely) */
+  case 1: sprintf(q + i, "x"); break;	/* A symbol name is a prefix */
+  default: break;
+  }
+}
+
+/* #### TESTS #### */
+
+static void TestLoad(void)
+{
+  packoff = 0;
+  CHECK(SymbolLoadPack(ReadPack, NULL) == HVM_STATUS_SUCCESS, "pack not loaded");
+  CHECK(SymbolInit() == HVM_STATUS_SUCCESS, "indexes not built");
+  CHECK(nsyms == N_SYMS && symhash && symbyname, "%d symbols", nsyms);
+}
+
+static void TestExact(void)
+{
+  char q[64];
+  PSYMBOL s;
+  Bit32u i, j;
+
+  for (i = 0; i < N_QUERIES; i++) {
+    Query(q);
+    s = SymbolGetFromName((Bit8u*) q);
+
+    /* The first symbol with that name */
+    for (j = 0; j < N_SYMS && CompareNames(names[j], q) != 0; j++)
+      ;
+
+    CHECK(j < N_SYMS ? s == &symtab[j] : s == NULL, "exact %s: symbol %ld, expected %d",
+	  q, s ? (long) (s - symtab) : -1L, j < N_SYMS ? (int) j : -1);
+  }
+}
+
+static void CheckSearch(const char *pattern, SYMBOL_SEARCH_MODE mode)
+{
+  PSYMBOL results[MAX_RESULTS];
+  Bit32u i, n, expected;
+
+  n = SymbolSearchName((Bit8u*) pattern, mode, results, MAX_RESULTS);
+  expected = Scan(pattern, mode);
+
+  CHECK(n == expected, "%s '%s': %d matches, expected %d",
+	mode == SymbolSearchPrefix ? "prefix" : "substring", pattern, n, expected);
+  for (i = 0; i < n && i < expected && i < MAX_RESULTS; i++) {
+    CHECK(results[i] == &symtab[matches[i]], "%s '%s': match %d is %s, expected %s",
+	  mode == SymbolSearchPrefix ? "prefix" : "substring", pattern, i,
+	  results[i]->name, names[matches[i]]);
+  }
+}
+
+static void TestPrefix(void)
+{
+  char q[64], out[64];
+  Bit32u i, n, len;
+
+  CheckSearch("", SymbolSearchPrefix);
+  CheckSearch("zzz", SymbolSearchPrefix);
+
+  for (i = 0; i < 200 && test_failures < 16; i++) {
+    Query(q);
+    q[1 + Random() % 8] = 0;
+    CheckSearch(q, SymbolSearchPrefix);
+
+    /* The completion is the longest prefix shared by all the matches */
+    n = SymbolCompleteName((Bit8u*) q, (Bit8u*) out, sizeof(out));
+    if (n == 0)
+      continue;
+    Scan(q, SymbolSearchPrefix);
+    for (len = 0; out[len] && Lower(names[matches[0]][len]) == Lower(names[matches[n-1]][len]); len++)
+      ;
+    CHECK(out[len] == 0 && len >= vmm_strlen((Bit8u*) q) && StartsWith(names[matches[0]], out),
+	  "complete '%s': '%s'", q, out);
+  }
+}
+
+static void TestSubstring(void)
+{
+  static const char *patterns[] = { "", "_9", "create", "AbC", "Ntq", "xyzzy", "_1" };
+  char q[64];
+  Bit32u i;
+
+  for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++)
+    CheckSearch(patterns[i], SymbolSearchSubstring);
+
+  for (i = 0; i < 20 && test_failures < 16; i++) {
+    Query(q);
+    q[3 + Random() % 3] = 0;
+    CheckSearch(q + 2, SymbolSearchSubstring);
+  }
+}
+
+/* #### BENCHMARK #### */
+
+static void Measure(void)
+{
+  static char q[1024][64];
+  PSYMBOL results[MAX_RESULTS];
+  unsigned long long t;
+  volatile Bit32u sink;
+  double exact, prefix, substring;
+  Bit32u i;
+
+  for (i = 0; i < 1024; i++)
+    Query(q[i]);
+
+  sink = 0;
+  t = BenchNow();
+  for (i = 0; i < N_TIMED; i++)
+    sink += (SymbolGetFromName((Bit8u*) q[i & 1023]) != NULL);
+  exact = N_TIMED / ((BenchNow() - t) / 1e9);
+
+  t = BenchNow();
+  for (i = 0; i < N_TIMED; i++) {
+    q[i & 1023][0] = 'N'; q[i & 1023][1] = 't';
+    sink += SymbolSearchName((Bit8u*) q[i & 1023] + (i & 1), SymbolSearchPrefix, results, MAX_RESULTS);
+  }
+  prefix = N_TIMED / ((BenchNow() - t) / 1e9);
+
+  t = BenchNow();
+  for (i = 0; i < 20; i++)
+    sink += SymbolSearchName((Bit8u*) "_42", SymbolSearchSubstring, results, MAX_RESULTS);
+  substring = 20 / ((BenchNow() - t) / 1e9);
+
+  printf("test_symsearch: %d symbols: %.0f exact/s, %.0f prefix/s, %.0f substring/s\n",
+	 N_SYMS, exact, prefix, substring);
+}
+
+int main(void)
+{
+  MakeNames();
+  BuildPack();
+
+  TestLoad();
+  TestExact();
+  TestPrefix();
+  TestSubstring();
+  Measure();
+
+  SymbolFini();
+  CHECK(symtab == syms && nsyms == NOS, "compiled-in table not restored");
+
+  TEST_RESULT("test_symsearch");
+}